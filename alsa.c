@@ -24,6 +24,15 @@
 #include <alsa/asoundlib.h>
 
 #include "alsa.h"
+#include "perf.h"
+
+/* Auto-tune mode ('-m auto'): begin with an aggressively small
+ * buffer, and back off only if an xrun occurs soon after the last
+ * change of size */
+
+#define AUTO_BEGIN 2 /* milliseconds */
+#define AUTO_MAX 64 /* milliseconds */
+#define AUTO_PROBATION 60 /* seconds */
 
 
 /* This structure doesn't have corresponding functions to be an
@@ -36,14 +45,20 @@ struct alsa_pcm {
     struct pollfd *pe;
     size_t pe_count; /* number of pollfd entries */
 
-    signed short *buf;
-    snd_pcm_uframes_t period;
+    signed short *buf; /* NULL in mmap mode */
+    snd_pcm_uframes_t period, buffer;
     int rate;
+    bool mmap; /* audio is transferred in-place in the device ring */
 };
 
 
 struct alsa {
     struct alsa_pcm capture, playback;
+
+    bool autotune,
+        retuned; /* at least one re-tune has taken place */
+    int buffer_time; /* milliseconds, as currently configured */
+    unsigned int tuned_at; /* perf_time() of the last (re)tune */
 };
 
 
@@ -64,17 +79,16 @@ static bool chk(const char *s, int r)
 }
 
 
-static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
-                    snd_pcm_stream_t stream, int rate, int buffer_time)
+/* Negotiate the hardware parameters of an open handle. Also used to
+ * re-tune an already-running stream; the poll descriptors of the
+ * handle are stable across re-configuration */
+
+static int pcm_configure(struct alsa_pcm *alsa, int rate, int buffer_time)
 {
     int r, dir;
     unsigned int p;
     size_t bytes;
     snd_pcm_hw_params_t *hw_params;
-    
-    r = snd_pcm_open(&alsa->pcm, device_name, stream, SND_PCM_NONBLOCK);
-    if (!chk("open", r))
-        return -1;
 
     snd_pcm_hw_params_alloca(&hw_params);
 
@@ -82,11 +96,26 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
     if (!chk("hw_params_any", r))
         return -1;
     
+    /* Prefer mmap access: the timecoder then decodes straight out
+     * of the capture ring, and playback is built straight into the
+     * playback ring, without a copy either way */
+
     r = snd_pcm_hw_params_set_access(alsa->pcm, hw_params,
-                                     SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (!chk("hw_params_set_access", r))
-        return -1;
-    
+                                     SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (r < 0) {
+        fprintf(stderr, "ALSA: mmap access not available; "
+                "using read/write transfers\n");
+
+        r = snd_pcm_hw_params_set_access(alsa->pcm, hw_params,
+                                         SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (!chk("hw_params_set_access", r))
+            return -1;
+
+        alsa->mmap = false;
+    } else {
+        alsa->mmap = true;
+    }
+
     r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params, SND_PCM_FORMAT_S16);
     if (!chk("hw_params_set_format", r)) {
         fprintf(stderr, "16-bit signed format is not available. "
@@ -135,6 +164,15 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
     if (!chk("get_period_size", r))
         return -1;
 
+    r = snd_pcm_hw_params_get_buffer_size(hw_params, &alsa->buffer);
+    if (!chk("get_buffer_size", r))
+        return -1;
+
+    if (alsa->mmap) {
+        alsa->buf = NULL;
+        return 0;
+    }
+
     bytes = alsa->period * DEVICE_CHANNELS * sizeof(signed short);
     alsa->buf = malloc(bytes);
     if (!alsa->buf) {
@@ -151,6 +189,98 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 }
 
 
+static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
+                    snd_pcm_stream_t stream, int rate, int buffer_time)
+{
+    int r;
+
+    r = snd_pcm_open(&alsa->pcm, device_name, stream, SND_PCM_NONBLOCK);
+    if (!chk("open", r))
+        return -1;
+
+    return pcm_configure(alsa, rate, buffer_time);
+}
+
+/*
+ * Re-negotiate a running stream with a new buffer time
+ *
+ * Used by auto-tune, in response to an xrun; this path is not
+ * realtime-safe, but neither is an xrun.
+ */
+
+static int pcm_retune(struct alsa_pcm *alsa, int buffer_time)
+{
+    int r;
+
+    r = snd_pcm_drop(alsa->pcm);
+    if (!chk("drop", r))
+        return -1;
+
+    free(alsa->buf);
+    alsa->buf = NULL;
+
+    return pcm_configure(alsa, alsa->rate, buffer_time);
+}
+
+/*
+ * Map the next period (or what is available of it) of the device
+ * ring into our address space
+ *
+ * Post: on success, *pcm is *frames of audio to read or fill,
+ * which must then be passed to pcm_mmap_done()
+ * Return: negative error from ALSA, otherwise zero
+ */
+
+static int pcm_mmap_frames(struct alsa_pcm *alsa, signed short **pcm,
+                           const snd_pcm_channel_area_t **area,
+                           snd_pcm_uframes_t *offset,
+                           snd_pcm_uframes_t *frames)
+{
+    int r;
+    snd_pcm_sframes_t avail;
+
+    avail = snd_pcm_avail_update(alsa->pcm);
+    if (avail < 0)
+        return avail;
+
+    *frames = alsa->period;
+    if ((snd_pcm_uframes_t)avail < *frames)
+        *frames = avail;
+
+    r = snd_pcm_mmap_begin(alsa->pcm, area, offset, frames);
+    if (r < 0)
+        return r;
+
+    /* Interleaved access: both channels share one area */
+
+    *pcm = (signed short*)((char*)(*area)->addr + (*area)->first / 8
+                           + *offset * (*area)->step / 8);
+
+    return 0;
+}
+
+/*
+ * Hand the frames mapped by pcm_mmap_frames() back to the device
+ *
+ * Return: negative error from ALSA, otherwise zero
+ */
+
+static int pcm_mmap_done(struct alsa_pcm *alsa, snd_pcm_uframes_t offset,
+                         snd_pcm_uframes_t frames)
+{
+    snd_pcm_sframes_t w;
+
+    w = snd_pcm_mmap_commit(alsa->pcm, offset, frames);
+    if (w < 0)
+        return w;
+
+    if ((snd_pcm_uframes_t)w != frames)
+        return -EPIPE;
+
+    return 0;
+}
+
+
 static void pcm_close(struct alsa_pcm *alsa)
 {
     if (snd_pcm_close(alsa->pcm) < 0)
@@ -244,15 +374,43 @@ static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
 static int playback(struct device *dv)
 {
     int r;
+    snd_pcm_sframes_t avail;
     struct alsa *alsa = (struct alsa*)dv->local;
 
+    /* Record how close we came to an underrun: the frames still
+     * queued at the moment we refill */
+
+    avail = snd_pcm_avail_update(alsa->playback.pcm);
+    if (avail >= 0 && (snd_pcm_uframes_t)avail <= alsa->playback.buffer) {
+        unsigned int queued;
+
+        queued = alsa->playback.buffer - avail;
+        if (queued < dv->headroom)
+            dv->headroom = queued;
+    }
+
+    if (alsa->playback.mmap) {
+        signed short *pcm = NULL;
+        const snd_pcm_channel_area_t *area;
+        snd_pcm_uframes_t offset, frames;
+
+        r = pcm_mmap_frames(&alsa->playback, &pcm, &area,
+                            &offset, &frames);
+        if (r < 0)
+            return r;
+
+        device_collect(dv, pcm, frames);
+
+        return pcm_mmap_done(&alsa->playback, offset, frames);
+    }
+
     device_collect(dv, alsa->playback.buf, alsa->playback.period);
 
     r = snd_pcm_writei(alsa->playback.pcm, alsa->playback.buf,
                        alsa->playback.period);
     if (r < 0)
         return r;
-        
+
     if (r < alsa->playback.period) {
         fprintf(stderr, "alsa: playback underrun %d/%ld.\n", r,
                 alsa->playback.period);
@@ -270,11 +428,26 @@ static int capture(struct device *dv)
     int r;
     struct alsa *alsa = (struct alsa*)dv->local;
 
+    if (alsa->capture.mmap) {
+        signed short *pcm = NULL;
+        const snd_pcm_channel_area_t *area;
+        snd_pcm_uframes_t offset, frames;
+
+        r = pcm_mmap_frames(&alsa->capture, &pcm, &area,
+                            &offset, &frames);
+        if (r < 0)
+            return r;
+
+        device_submit(dv, pcm, frames);
+
+        return pcm_mmap_done(&alsa->capture, offset, frames);
+    }
+
     r = snd_pcm_readi(alsa->capture.pcm, alsa->capture.buf,
                       alsa->capture.period);
     if (r < 0)
         return r;
-    
+
     if (r < alsa->capture.period) {
         fprintf(stderr, "alsa: capture underrun %d/%ld.\n",
                 r, alsa->capture.period);
@@ -286,6 +459,59 @@ static int capture(struct device *dv)
 }
 
 
+/* An xrun happened. If auto-tune is enabled and the current buffer
+ * size is still on probation, back off to a larger one; otherwise
+ * treat it as a one-off glitch and leave the size alone.
+ *
+ * Return: true if both streams were re-tuned and restarted, and no
+ * further recovery is needed */
+
+static bool retune(struct device *dv)
+{
+    unsigned int now;
+    struct alsa *alsa = (struct alsa*)dv->local;
+
+    if (!alsa->autotune)
+        return false;
+
+    now = perf_time();
+
+    /* Back-to-back xruns (eg. capture and playback in the same
+     * poll) are one event; don't escalate twice */
+
+    if (alsa->retuned && now - alsa->tuned_at < 1000000)
+        return true;
+
+    if (now - alsa->tuned_at > AUTO_PROBATION * 1000000)
+        return false;
+
+    if (alsa->buffer_time >= AUTO_MAX)
+        return false;
+
+    alsa->buffer_time *= 2;
+
+    fprintf(stderr, "ALSA: xrun during probation; "
+            "re-tuning to a %dms buffer\n", alsa->buffer_time);
+
+    if (pcm_retune(&alsa->capture, alsa->buffer_time) < 0
+        || pcm_retune(&alsa->playback, alsa->buffer_time) < 0)
+    {
+        fputs("ALSA: failed to re-tune\n", stderr);
+        return false;
+    }
+
+    if (snd_pcm_start(alsa->capture.pcm) < 0)
+        abort();
+
+    /* Playback restarts when data is next written */
+
+    alsa->tuned_at = now;
+    alsa->retuned = true;
+
+    return true;
+}
+
+
 /* After poll() has returned, instruct a device to do all it can at
  * the present time. Return zero if success, otherwise -1 */
 
@@ -307,6 +533,10 @@ static int handle(struct device *dv)
         if (r < 0) {
             if (r == -EPIPE) {
                 fputs("ALSA: capture xrun.\n", stderr);
+                device_xrun(dv);
+
+                if (retune(dv))
+                    return 0;
 
                 r = snd_pcm_prepare(alsa->capture.pcm);
                 if (r < 0) {
@@ -339,7 +569,11 @@ static int handle(struct device *dv)
         if (r < 0) {
             if (r == -EPIPE) {
                 fputs("ALSA: playback xrun.\n", stderr);
-                
+                device_xrun(dv);
+
+                if (retune(dv))
+                    return 0;
+
                 r = snd_pcm_prepare(alsa->playback.pcm);
                 if (r < 0) {
                     alsa_error("prepare", r);
@@ -402,6 +636,13 @@ int alsa_init(struct device *dv, const char *device_name,
         return -1;
     }
 
+    alsa->autotune = (buffer_time == 0);
+    if (alsa->autotune)
+        buffer_time = AUTO_BEGIN;
+    alsa->buffer_time = buffer_time;
+    alsa->tuned_at = perf_time();
+    alsa->retuned = false;
+
     if (pcm_open(&alsa->capture, device_name, SND_PCM_STREAM_CAPTURE,
                 rate, buffer_time) < 0)
     {
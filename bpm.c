@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Beat detection over the PCM already resident in track blocks
+ *
+ * Tempo is estimated from an onset-energy envelope (around 100
+ * frames/sec) by autocorrelation over the lags which correspond to
+ * 60--200 BPM. Analysis runs in a pool of low-priority worker
+ * threads, one job per deck load; results are delivered back on the
+ * rig, which is the only thread allowed to modify the record.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bpm.h"
+#include "debug.h"
+#include "rig.h"
+
+#define MAX_WORKERS 8
+
+#define ENVELOPE_FPS 100 /* nominal; exact rate follows the hop size */
+#define BPM_MIN 60.0
+#define BPM_MAX 200.0
+
+struct event analysis_done = EVENT_INIT(analysis_done);
+
+static struct list analyses = LIST_INIT(analyses),
+    pending = LIST_INIT(pending);
+
+static pthread_t pool[MAX_WORKERS];
+static unsigned int nworkers = 0;
+static pthread_mutex_t mx;
+static pthread_cond_t cv;
+static bool stopping;
+
+/*
+ * Estimate the tempo of a fully-imported track
+ *
+ * Return: beats-per-minute, or 0.0 if it could not be determined
+ */
+
+static double analyse(struct track *tr)
+{
+    unsigned int hop, nf, lo, hi, lag, best, k;
+    double fps, best_r, refine, *acf;
+    float *onset, prev;
+
+    hop = tr->rate / ENVELOPE_FPS;
+    if (hop == 0)
+        return 0.0;
+
+    nf = tr->length / hop;
+    fps = (double)tr->rate / hop;
+
+    lo = 60.0 * fps / BPM_MAX;
+    hi = 60.0 * fps / BPM_MIN;
+
+    if (nf < hi * 4) /* too short to correlate with confidence */
+        return 0.0;
+
+    onset = malloc(nf * sizeof *onset);
+    if (onset == NULL) {
+        perror("malloc");
+        return 0.0;
+    }
+
+    /* Positive difference of the energy envelope; a rise in level
+     * marks an onset, decays are ignored */
+
+    prev = 0.0;
+
+    for (k = 0; k < nf; k++) {
+        unsigned int s, base;
+        float sum;
+
+        sum = 0.0;
+        base = k * hop;
+
+        for (s = 0; s < hop; s++) {
+            const signed short *q;
+
+            q = track_get_sample(tr, base + s);
+            sum += abs(q[0]) + abs(q[1]);
+        }
+
+        onset[k] = (k > 0 && sum > prev) ? sum - prev : 0.0;
+        prev = sum;
+    }
+
+    acf = malloc((hi + 2) * sizeof *acf);
+    if (acf == NULL) {
+        perror("malloc");
+        free(onset);
+        return 0.0;
+    }
+
+    best = 0;
+    best_r = 0.0;
+
+    for (lag = lo; lag <= hi; lag++) {
+        double sum;
+
+        sum = 0.0;
+        for (k = 0; k < nf - lag; k++)
+            sum += (double)onset[k] * onset[k + lag];
+
+        acf[lag] = sum / (nf - lag);
+
+        if (acf[lag] > best_r) {
+            best_r = acf[lag];
+            best = lag;
+        }
+    }
+
+    free(onset);
+
+    if (best == 0 || best_r <= 0.0) { /* silence, or no beat */
+        free(acf);
+        return 0.0;
+    }
+
+    /* Parabolic interpolation between the neighbouring lags, for
+     * finer resolution than the envelope rate gives directly */
+
+    refine = 0.0;
+
+    if (best > lo && best < hi) {
+        double denom;
+
+        denom = acf[best - 1] - 2 * acf[best] + acf[best + 1];
+        if (denom < 0.0)
+            refine = 0.5 * (acf[best - 1] - acf[best + 1]) / denom;
+        if (refine < -0.5)
+            refine = -0.5;
+        if (refine > 0.5)
+            refine = 0.5;
+    }
+
+    free(acf);
+
+    return 60.0 * fps / (best + refine);
+}
+
+/*
+ * Worker thread: take jobs from the queue until asked to stop
+ */
+
+static void* worker_main(void *p)
+{
+    for (;;) {
+        struct analysis *a;
+
+        if (pthread_mutex_lock(&mx) != 0)
+            abort();
+
+        while (list_empty(&pending) && !stopping) {
+            if (pthread_cond_wait(&cv, &mx) != 0)
+                abort();
+        }
+
+        if (list_empty(&pending)) { /* stopping */
+            if (pthread_mutex_unlock(&mx) != 0)
+                abort();
+            return NULL;
+        }
+
+        a = list_entry(pending.next, struct analysis, jobs);
+        list_del(&a->jobs);
+
+        if (pthread_mutex_unlock(&mx) != 0)
+            abort();
+
+        a->bpm = analyse(a->track);
+
+        /* Notify the rig; the byte is the handover of 'a' */
+
+        if (write(a->pipe[1], "", 1) == -1)
+            perror("write");
+    }
+}
+
+/*
+ * Start the pool of analysis workers, one per CPU
+ *
+ * The workers take the lowest scheduling priority the system offers;
+ * analysis is strictly background work.
+ */
+
+int bpm_init(void)
+{
+    long n;
+    unsigned int i;
+
+    if (pthread_mutex_init(&mx, NULL) != 0)
+        abort();
+    if (pthread_cond_init(&cv, NULL) != 0)
+        abort();
+    stopping = false;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&pool[i], NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            break;
+        }
+
+#ifdef SCHED_IDLE
+        {
+            struct sched_param sp = { .sched_priority = 0 };
+
+            /* Best effort only; not all systems permit it */
+
+            (void)pthread_setschedparam(pool[i], SCHED_IDLE, &sp);
+        }
+#endif
+    }
+
+    nworkers = i;
+    if (nworkers == 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Stop the workers; jobs still in flight are abandoned
+ *
+ * Pre: the rig has exited
+ */
+
+void bpm_clear(void)
+{
+    unsigned int i;
+
+    if (pthread_mutex_lock(&mx) != 0)
+        abort();
+    stopping = true;
+    if (pthread_cond_broadcast(&cv) != 0)
+        abort();
+    if (pthread_mutex_unlock(&mx) != 0)
+        abort();
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_join(pool[i], NULL) != 0)
+            abort();
+    }
+    nworkers = 0;
+
+    if (pthread_mutex_destroy(&mx) != 0)
+        abort();
+    if (pthread_cond_destroy(&cv) != 0)
+        abort();
+}
+
+/*
+ * Request analysis of the given record, using the PCM of the given
+ * track; no second decode of the file takes place
+ *
+ * The track need not have finished importing; the job is held back
+ * until it has. The caller does not get a handle on the job -- the
+ * result arrives via the record and the analysis_done event.
+ */
+
+void bpm_analyse(struct record *r, struct track *t)
+{
+    struct analysis *a;
+
+    if (r->bpm != 0.0) /* tempo is already known */
+        return;
+
+    list_for_each(a, &analyses, analyses) {
+        if (a->record == r) /* already being analysed */
+            return;
+    }
+
+    a = malloc(sizeof *a);
+    if (a == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    if (pipe(a->pipe) == -1) {
+        perror("pipe");
+        free(a);
+        return;
+    }
+
+    /* Keep the pipe out of child processes; the rig's registration
+     * of the read side must end when we close it */
+
+    if (fcntl(a->pipe[0], F_SETFD, FD_CLOEXEC) == -1
+        || fcntl(a->pipe[1], F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        abort();
+    }
+
+    a->record = r;
+    a->track = t;
+    track_acquire(t);
+    a->pe.fd = -1;
+    a->pe.revents = 0;
+    a->dispatched = false;
+    a->bpm = 0.0;
+
+    list_add(&a->analyses, &analyses);
+    rig_post_analysis(a);
+
+    debug("analysing %s", r->pathname);
+}
+
+/*
+ * Get persistent entry for use by the rig
+ *
+ * Return: poll entry, valid until the analysis completes
+ */
+
+struct pollfd* analysis_pollfd(struct analysis *a)
+{
+    a->pe.fd = a->pipe[0];
+    a->pe.events = POLLIN;
+    a->pe.revents = 0;
+
+    return &a->pe;
+}
+
+/*
+ * Handle any activity on this analysis, called from the rig
+ *
+ * Dispatch to a worker once the track import has finished, and
+ * deliver the result when the worker has one.
+ */
+
+void analysis_handle(struct analysis *a)
+{
+    char e;
+
+    if (!a->dispatched) {
+        if (track_is_importing(a->track))
+            return;
+
+        if (pthread_mutex_lock(&mx) != 0)
+            abort();
+        list_add(&a->jobs, &pending);
+        if (pthread_cond_signal(&cv) != 0)
+            abort();
+        if (pthread_mutex_unlock(&mx) != 0)
+            abort();
+
+        a->dispatched = true;
+        return;
+    }
+
+    if (a->pe.fd == -1)
+        return;
+
+    if (a->pe.revents == 0)
+        return;
+
+    a->pe.revents = 0;
+
+    if (read(a->pipe[0], &e, 1) == -1)
+        abort();
+
+    debug("%s: %0.1f BPM", a->record->pathname, a->bpm);
+
+    if (a->bpm != 0.0) {
+        a->record->bpm = a->bpm;
+        fire(&analysis_done, a->record);
+    }
+
+    if (close(a->pipe[0]) == -1)
+        abort();
+    if (close(a->pipe[1]) == -1)
+        abort();
+
+    track_release(a->track);
+    list_del(&a->rig);
+    list_del(&a->analyses);
+    free(a);
+}
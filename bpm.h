@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * In-process BPM analysis of imported tracks
+ */
+
+#ifndef BPM_H
+#define BPM_H
+
+#include <stdbool.h>
+#include <sys/poll.h>
+
+#include "index.h"
+#include "list.h"
+#include "observer.h"
+#include "track.h"
+
+struct analysis {
+    struct list analyses;
+    struct record *record;
+    struct track *track;
+
+    /* Handled by the rig until the result has been delivered */
+
+    struct list rig;
+    int pipe[2]; /* written by the worker on completion */
+    struct pollfd pe;
+    bool dispatched;
+
+    /* On the queue of work, between dispatch and pickup */
+
+    struct list jobs;
+
+    /* Result, written by the worker before notifying */
+
+    double bpm; /* or 0.0 if it could not be determined */
+};
+
+/* Fired (on the rig thread) with the record, when its BPM changes */
+
+extern struct event analysis_done;
+
+int bpm_init(void);
+void bpm_clear(void);
+
+void bpm_analyse(struct record *r, struct track *t);
+
+/* Used by the rig and main thread */
+
+struct pollfd* analysis_pollfd(struct analysis *a);
+void analysis_handle(struct analysis *a);
+
+#endif
@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "console.h"
+#include "deck.h"
+#include "library.h"
+#include "perf.h"
+#include "rig.h"
+#include "xwax.h"
+
+/*
+ * Console: a line-based command surface on a UNIX socket
+ *
+ * Intended for headless operation (--no-interface), where it stands
+ * in for the keyboard: a handful of deck commands, executed under
+ * the rig lock exactly as a keypress would be. One client at a time;
+ * the protocol is a command per line, and a reply per command.
+ */
+
+#define POLL_MS 250 /* tick to notice shutdown and SIGUSR1 */
+#define BUFFER 1024
+
+static pthread_t ph;
+static int listener = -1, client = -1;
+static const char *address;
+static char buffer[BUFFER];
+static size_t fill;
+static volatile bool finished;
+
+/*
+ * Parse a deck number given by the client
+ *
+ * Return: the deck, or NULL if there is no such deck
+ */
+
+static struct deck* parse_deck(const char *s)
+{
+    char *endptr;
+    unsigned long n;
+
+    n = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || n >= ndeck)
+        return NULL;
+
+    return &deck[n];
+}
+
+/*
+ * Load the given pathname onto a deck
+ *
+ * The record goes via get_record(), as a scan result would, so it
+ * lives in the library arena for the rest of the session.
+ */
+
+static int load(struct deck *d, const char *pathname)
+{
+    char *line;
+    struct record *r;
+
+    if (asprintf(&line, "%s\t\t%s", pathname, pathname) == -1)
+        return -1;
+
+    r = get_record(line); /* frees line */
+    if (r == NULL)
+        return -1;
+
+    deck_load(d, r);
+
+    return 0;
+}
+
+/*
+ * Handle one command from the client
+ *
+ * Pre: rig lock is held
+ * Post: a single-line reply has been written to out
+ */
+
+static void command(char *line, int out)
+{
+    char *verb, *arg, *rest;
+
+    verb = strtok_r(line, " \t", &rest);
+    if (verb == NULL) {
+        dprintf(out, "error: empty command\n");
+        return;
+    }
+
+    if (!strcmp(verb, "quit")) {
+        if (rig_quit() == -1)
+            dprintf(out, "error: unable to quit\n");
+        else
+            dprintf(out, "ok\n");
+        return;
+    }
+
+    /* The remaining commands name a deck as their first argument */
+
+    arg = strtok_r(NULL, " \t", &rest);
+    if (arg == NULL) {
+        dprintf(out, "error: %s requires a deck number\n", verb);
+        return;
+    }
+
+    if (!strcmp(verb, "load")) {
+        struct deck *d;
+        const char *pathname;
+
+        d = parse_deck(arg);
+        pathname = rest + strspn(rest, " \t");
+
+        if (d == NULL || *pathname == '\0')
+            dprintf(out, "error: usage: load <deck> <pathname>\n");
+        else if (load(d, pathname) == -1)
+            dprintf(out, "error: unable to load record\n");
+        else
+            dprintf(out, "ok\n");
+
+    } else if (!strcmp(verb, "recue")) {
+        struct deck *d;
+
+        d = parse_deck(arg);
+        if (d == NULL) {
+            dprintf(out, "error: no such deck\n");
+        } else {
+            deck_recue(d);
+            dprintf(out, "ok\n");
+        }
+
+    } else if (!strcmp(verb, "loop")) {
+        struct deck *d;
+        char *beats, *endptr;
+        double b;
+
+        d = parse_deck(arg);
+        beats = strtok_r(NULL, " \t", &rest);
+        b = (beats != NULL) ? strtod(beats, &endptr) : 0.0;
+
+        if (d == NULL || beats == NULL || *endptr != '\0' || b <= 0.0) {
+            dprintf(out, "error: usage: loop <deck> <beats>\n");
+        } else {
+            deck_loop(d, b);
+            dprintf(out, "ok\n");
+        }
+
+    } else if (!strcmp(verb, "unloop")) {
+        struct deck *d;
+
+        d = parse_deck(arg);
+        if (d == NULL) {
+            dprintf(out, "error: no such deck\n");
+        } else {
+            deck_unloop(d);
+            dprintf(out, "ok\n");
+        }
+
+    } else {
+        dprintf(out, "error: commands are load, recue, loop, unloop, quit\n");
+    }
+}
+
+/*
+ * Take a read from the client and act on any completed lines
+ */
+
+static void service_client(void)
+{
+    ssize_t z;
+
+    z = read(client, buffer + fill, sizeof buffer - fill);
+    if (z <= 0) {
+        if (z == -1)
+            perror("read");
+        if (close(client) == -1)
+            abort();
+        client = -1;
+        return;
+    }
+
+    fill += z;
+
+    for (;;) {
+        char *nl;
+        size_t len;
+
+        nl = memchr(buffer, '\n', fill);
+        if (nl == NULL)
+            break;
+
+        *nl = '\0';
+
+        rig_lock();
+        command(buffer, client);
+        rig_unlock();
+
+        len = nl + 1 - buffer;
+        memmove(buffer, nl + 1, fill - len);
+        fill -= len;
+    }
+
+    if (fill == sizeof buffer) {
+        dprintf(client, "error: line too long\n");
+        fill = 0;
+    }
+}
+
+static void* launch(void *arg)
+{
+    for (;;) {
+        int r;
+        nfds_t n;
+        struct pollfd pe[2];
+
+        if (finished)
+            return NULL;
+
+        /* When there is no interface thread, this is where the
+         * performance dump requested by SIGUSR1 gets printed */
+
+        if (perf_dump_pending) {
+            size_t d;
+
+            perf_dump_pending = 0;
+            perf_dump(stderr);
+
+            for (d = 0; d < ndeck; d++)
+                deck_dump(stderr, d, &deck[d]);
+        }
+
+        pe[0].fd = listener;
+        pe[0].events = POLLIN;
+        n = 1;
+
+        if (client != -1) {
+            pe[1].fd = client;
+            pe[1].events = POLLIN;
+            n = 2;
+        }
+
+        r = poll(pe, n, POLL_MS);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            abort();
+        }
+
+        if (pe[0].revents != 0) {
+            int fd;
+
+            fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd == -1) {
+                perror("accept");
+                continue;
+            }
+
+            /* A new connection displaces the old; on a headless
+             * box the newcomer is the one who wants control */
+
+            if (client != -1 && close(client) == -1)
+                abort();
+
+            client = fd;
+            fill = 0;
+            continue; /* poll again before reading */
+        }
+
+        if (n == 2 && pe[1].revents != 0)
+            service_client();
+    }
+}
+
+/*
+ * Begin listening for commands on the given socket pathname
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int console_start(const char *path)
+{
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof sa.sun_path) {
+        fprintf(stderr, "%s: pathname is too long.\n", path);
+        return -1;
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    (void)unlink(path); /* stale socket from a previous session */
+
+    if (bind(listener, (struct sockaddr*)&sa, sizeof sa) == -1) {
+        perror("bind");
+        goto fail;
+    }
+
+    if (listen(listener, 1) == -1) {
+        perror("listen");
+        goto fail;
+    }
+
+    finished = false;
+    fill = 0;
+
+    if (pthread_create(&ph, NULL, launch, NULL) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+
+    address = path;
+    fprintf(stderr, "Listening for commands on %s\n", path);
+
+    return 0;
+
+fail:
+    if (close(listener) == -1)
+        abort();
+    listener = -1;
+    return -1;
+}
+
+/*
+ * Synchronise with the console thread and exit
+ */
+
+void console_stop(void)
+{
+    finished = true;
+
+    if (pthread_join(ph, NULL) != 0)
+        abort();
+
+    if (client != -1 && close(client) == -1)
+        abort();
+    if (close(listener) == -1)
+        abort();
+    if (unlink(address) == -1)
+        perror("unlink");
+}
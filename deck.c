@@ -18,10 +18,13 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 
+#include "bpm.h"
 #include "controller.h"
 #include "cues.h"
 #include "deck.h"
+#include "recorder.h"
 #include "status.h"
 #include "rig.h"
 
@@ -35,6 +38,32 @@ static const struct record no_record = {
     .title = ""
 };
 
+/* Width of the window of PCM kept warm around each cue point,
+ * in seconds, so that punching a cue never faults in cold pages
+ * from the realtime thread */
+
+#define CUE_PREFETCH 4.0
+
+/*
+ * Re-warm the PCM around every set cue point
+ *
+ * Cheap and asynchronous, so it is repeated whenever the cue points
+ * or the track change; regions not yet imported are skipped.
+ */
+
+static void prefetch_cues(struct deck *d)
+{
+    unsigned int n;
+
+    for (n = 0; n < MAX_CUES; n++) {
+        double p;
+
+        p = cues_get(&d->cues, n);
+        if (p != CUE_UNSET)
+            track_prefetch(d->player.track, p, CUE_PREFETCH);
+    }
+}
+
 /*
  * Initialise a deck
  *
@@ -106,6 +135,12 @@ void deck_load(struct deck *d, struct record *record)
 
     d->record = record;
     player_set_track(&d->player, t); /* passes reference */
+    prefetch_cues(d);
+
+    /* The scanner gave no tempo; get one from the decoded audio */
+
+    if (record->bpm == 0.0)
+        bpm_analyse(record, t);
 }
 
 void deck_recue(struct deck *d)
@@ -147,6 +182,8 @@ void deck_cue(struct deck *d, unsigned int label)
         cues_set(&d->cues, label, player_get_elapsed(&d->player));
     else
         player_seek_to(&d->player, p);
+
+    prefetch_cues(d);
 }
 
 /*
@@ -162,6 +199,7 @@ void deck_punch_in(struct deck *d, unsigned int label)
     p = cues_get(&d->cues, label);
     if (p == CUE_UNSET) {
         cues_set(&d->cues, label, e);
+        prefetch_cues(d);
         return;
     }
 
@@ -187,3 +225,80 @@ void deck_punch_out(struct deck *d)
     player_seek_to(&d->player, e - d->punch);
     d->punch = NO_PUNCH;
 }
+
+/*
+ * Continuous controller input: a 14-bit pitch fader, and relative
+ * movement of a jog wheel. Both are safe from the controller
+ * threads; the player filters them into playback.
+ */
+
+void deck_set_fader(struct deck *d, unsigned int value)
+{
+    player_set_fader(&d->player, value);
+}
+
+void deck_nudge(struct deck *d, int ticks)
+{
+    player_nudge(&d->player, ticks);
+}
+
+/*
+ * Engage a beat loop from the current playback position
+ *
+ * The player does the sample-accurate wrapping; here we size the
+ * loop from the record's tempo, and keep the PCM warm so the jump
+ * back never faults in cold pages.
+ */
+
+void deck_loop(struct deck *d, double beats)
+{
+    double seconds;
+
+    if (d->record->bpm == 0.0) {
+        status_printf(STATUS_WARN, "Loop needs a BPM; analysis pending?");
+        return;
+    }
+
+    seconds = beats * 60.0 / d->record->bpm;
+
+    track_prefetch(d->player.track, player_get_elapsed(&d->player),
+                   seconds + CUE_PREFETCH);
+    player_loop(&d->player, seconds);
+}
+
+void deck_unloop(struct deck *d)
+{
+    player_loop_off(&d->player);
+}
+
+/*
+ * Print this deck's contribution to the performance dump
+ *
+ * Called by whichever service thread notices the SIGUSR1 flag;
+ * see perf_dump_pending.
+ */
+
+void deck_dump(FILE *fd, size_t n, const struct deck *d)
+{
+    const struct device *dv = &d->device;
+    struct timecoder_quality q;
+
+    fprintf(fd, "Deck %zu: %u xrun%s", n, dv->xruns,
+            dv->xruns != 1 ? "s" : "");
+    if (dv->headroom != UINT_MAX)
+        fprintf(fd, ", headroom %u frames", dv->headroom);
+    if (dv->recorder != NULL) {
+        fprintf(fd, ", recorded %lluMb (%u dropped)",
+                dv->recorder->written >> 20,
+                dv->recorder->overruns);
+    }
+    fputc('\n', fd);
+
+    timecoder_get_quality(&d->timecoder, &q);
+    fprintf(fd, "  signal: %.0f%% bit errors, %.1fx level, %.1f%% jitter\n",
+            q.err * 100, q.level, q.jitter * 100);
+
+    perf_dump_counter(fd, "handle", &dv->handle);
+    perf_dump_counter(fd, "timecoder", &dv->submit);
+    perf_dump_counter(fd, "player", &dv->collect);
+}
@@ -48,7 +48,7 @@ struct deck {
     /* A controller adds itself here */
 
     size_t ncontrol;
-    struct controller *control[4];
+    struct controller *control[8]; /* enough for one per deck */
 };
 
 int deck_init(struct deck *deck, struct rt *rt,
@@ -66,5 +66,11 @@ void deck_unset_cue(struct deck *deck, unsigned int label);
 void deck_cue(struct deck *deck, unsigned int label);
 void deck_punch_in(struct deck *d, unsigned int label);
 void deck_punch_out(struct deck *d);
+void deck_set_fader(struct deck *d, unsigned int value);
+void deck_nudge(struct deck *d, int ticks);
+void deck_loop(struct deck *d, double beats);
+void deck_unloop(struct deck *d);
+
+void deck_dump(FILE *fd, size_t n, const struct deck *d);
 
 #endif
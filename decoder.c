@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdio.h>
+
+#include "decoder.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/* The registry of loaded plugins, in the order they were given */
+
+static size_t nplugin = 0;
+static struct {
+    void *handle;
+    const struct decoder_plugin *plugin;
+} plugin[8];
+
+/*
+ * Load a decoder plugin from the given shared library
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+int decoder_load(const char *path)
+{
+    void *handle;
+    const struct decoder_plugin *p;
+
+    if (nplugin == ARRAY_SIZE(plugin)) {
+        fprintf(stderr, "Too many decoder plugins; aborting.\n");
+        return -1;
+    }
+
+    handle = dlopen(path, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    p = dlsym(handle, DECODER_SYMBOL);
+    if (p == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        if (dlclose(handle) != 0)
+            abort();
+        return -1;
+    }
+
+    assert(p->name != NULL);
+    assert(p->claims != NULL);
+    assert(p->decode != NULL);
+
+    plugin[nplugin].handle = handle;
+    plugin[nplugin].plugin = p;
+    nplugin++;
+
+    fprintf(stderr, "Loaded decoder '%s' (%s)\n", p->name, path);
+
+    return 0;
+}
+
+/*
+ * Unload all decoder plugins
+ *
+ * Pre: no decode operations are in progress
+ */
+
+void decoder_global_clear(void)
+{
+    size_t n;
+
+    for (n = 0; n < nplugin; n++) {
+        if (dlclose(plugin[n].handle) != 0)
+            abort();
+    }
+
+    nplugin = 0;
+}
+
+/*
+ * Find a plugin which claims the given file
+ *
+ * Return: the plugin, or NULL if no plugin claims the file
+ */
+
+const struct decoder_plugin* decoder_match(const char *path)
+{
+    size_t n;
+
+    for (n = 0; n < nplugin; n++) {
+        if (plugin[n].plugin->claims(path))
+            return plugin[n].plugin;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * In-process decoder plugins
+ *
+ * A plugin is a shared library which decodes audio files directly
+ * into track memory, avoiding the process spawn and pipe of the
+ * import program. The import program remains the fallback for any
+ * file no plugin claims.
+ *
+ * The library exports one symbol, DECODER_SYMBOL, of type
+ * struct decoder_plugin. The decode function runs on a worker
+ * thread owned by us, and must restrict itself to the sink given --
+ * request a buffer, fill it with interleaved signed 16-bit PCM at
+ * the given sample rate, and notify how many bytes were written.
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define DECODER_SYMBOL "xwax_decoder"
+
+struct decoder_sink {
+    void *local;
+
+    /* Get a buffer to decode into; NULL means stop decoding
+     * and return from the decode function promptly */
+
+    void* (*pcm)(void *local, size_t *len);
+
+    /* Declare that the given number of bytes have been written */
+
+    void (*commit)(void *local, size_t bytes);
+};
+
+struct decoder_plugin {
+    const char *name;
+
+    /* Return true if this plugin can decode the given file */
+
+    bool (*claims)(const char *path);
+
+    /* Decode the whole file into the sink
+     *
+     * Return: -1 on error, otherwise 0
+     */
+
+    int (*decode)(const char *path, unsigned int rate,
+                  const struct decoder_sink *sink);
+};
+
+int decoder_load(const char *path);
+void decoder_global_clear(void);
+
+const struct decoder_plugin* decoder_match(const char *path);
+
+#endif
@@ -18,11 +18,15 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "debug.h"
 #include "device.h"
+#include "perf.h"
 #include "player.h"
+#include "recorder.h"
 #include "timecoder.h"
 
 void device_init(struct device *dv, struct device_ops *ops)
@@ -30,6 +34,12 @@ void device_init(struct device *dv, struct device_ops *ops)
     debug("%p", dv);
     dv->fault = false;
     dv->ops = ops;
+    dv->xruns = 0;
+    dv->headroom = UINT_MAX;
+    dv->recorder = NULL;
+    memset(&dv->handle, 0, sizeof dv->handle);
+    memset(&dv->submit, 0, sizeof dv->submit);
+    memset(&dv->collect, 0, sizeof dv->collect);
 }
 
 /*
@@ -53,6 +63,11 @@ void device_connect_player(struct device *dv, struct player *pl)
     dv->player = pl;
 }
 
+void device_connect_recorder(struct device *dv, struct recorder *re)
+{
+    dv->recorder = re;
+}
+
 /*
  * Return: the sample rate of the device in Hz
  */
@@ -109,38 +124,84 @@ ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z)
 
 void device_handle(struct device *dv)
 {
+    unsigned int t;
+
     if (dv->fault)
         return;
 
     if (dv->ops->handle == NULL)
         return;
 
+    t = perf_time();
+
     if (dv->ops->handle(dv) != 0) {
         dv->fault = true;
         fputs("Error handling audio device; disabling it\n", stderr);
     }
+
+    t = perf_time() - t;
+    perf_sample(&perf_audio, t);
+    perf_sample(&dv->handle, t);
+}
+
+/*
+ * Note an under or over-run on this device
+ *
+ * Called by the backend when the audio system reports one.
+ */
+
+void device_xrun(struct device *dv)
+{
+    dv->xruns++;
+    perf_xrun();
 }
 
 /*
  * Send audio from a device for processing
  *
+ * A tracepoint on the audio path: the time to decode this block of
+ * timecode is recorded per-deck and globally.
+ *
  * Pre: buffer pcm contains n stereo samples
  */
 
 void device_submit(struct device *dv, signed short *pcm, size_t n)
 {
+    unsigned int t;
+
     assert(dv->timecoder != NULL);
+
+    t = perf_time();
     timecoder_submit(dv->timecoder, pcm, n);
+    t = perf_time() - t;
+
+    perf_sample(&perf_timecoder, t);
+    perf_sample(&dv->submit, t);
 }
 
 /*
  * Collect audio from the processing to send to a device
  *
+ * A tracepoint on the audio path, as device_submit()
+ *
  * Post: buffer pcm is filled with n stereo samples
  */
 
 void device_collect(struct device *dv, signed short *pcm, size_t n)
 {
+    unsigned int t;
+
     assert(dv->player != NULL);
+
+    t = perf_time();
     player_collect(dv->player, pcm, n);
+    t = perf_time() - t;
+
+    perf_sample(&perf_player, t);
+    perf_sample(&dv->collect, t);
+
+    /* Tap for session recording: a bounded copy, nothing more */
+
+    if (dv->recorder != NULL)
+        recorder_submit(dv->recorder, pcm, n * DEVICE_CHANNELS);
 }
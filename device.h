@@ -24,6 +24,8 @@
 #include <sys/poll.h>
 #include <sys/types.h>
 
+#include "perf.h"
+
 #define DEVICE_CHANNELS 2
 
 struct device {
@@ -31,8 +33,19 @@ struct device {
     void *local;
     struct device_ops *ops;
 
+    /* Performance counters, maintained by this layer and the
+     * backend, for reporting and tuning */
+
+    unsigned int xruns,
+        headroom; /* least frames queued for playback when refilled,
+                   * or UINT_MAX where the backend has no data */
+    struct perf_counter handle, /* time per call of device_handle() */
+        submit, /* timecode decode; see device_submit() */
+        collect; /* playback render; see device_collect() */
+
     struct timecoder *timecoder;
     struct player *player;
+    struct recorder *recorder; /* or NULL when not recording */
 };
 
 struct device_ops {
@@ -51,6 +64,7 @@ void device_clear(struct device *dv);
 
 void device_connect_timecoder(struct device *dv, struct timecoder *tc);
 void device_connect_player(struct device *dv, struct player *pl);
+void device_connect_recorder(struct device *dv, struct recorder *re);
 
 unsigned int device_sample_rate(struct device *dv);
 
@@ -59,6 +73,7 @@ void device_stop(struct device *dv);
 
 ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z);
 void device_handle(struct device *dv);
+void device_xrun(struct device *dv);
 
 void device_submit(struct device *dv, signed short *pcm, size_t npcm);
 void device_collect(struct device *dv, signed short *pcm, size_t npcm);
@@ -30,6 +30,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "controller.h"
 #include "debug.h"
@@ -67,6 +68,9 @@ struct dicer {
 
     char obuf[180];
     size_t ofill;
+
+    unsigned char ibuf[3]; /* partial message carried between reads */
+    size_t ifill;
 };
 
 /*
@@ -322,6 +326,20 @@ static void event_decoded(struct deck *d, led_t led[NBUTTONS],
             deck_punch_out(d);
         }
     }
+
+    /* Held beat loops, sized per button */
+
+    if (action == ROLL) {
+        static const double beats[NBUTTONS] = { 0.25, 0.5, 1.0, 2.0, 4.0 };
+
+        if (on) {
+            deck_loop(d, beats[button]);
+            set_led(&led[button], ON, 0);
+        } else {
+            deck_unloop(d);
+            set_led(&led[button], 0, ON);
+        }
+    }
 }
 
 /*
@@ -425,19 +443,33 @@ static int realtime(struct controller *c)
 {
     struct dicer *d = c->local;
 
+    /* Drain the device in large reads and act on the events as one
+     * batch, so that a burst of pad hits during a juggle is handled
+     * within a single period, not one event per wakeup. A message
+     * split across reads is carried over to the next. */
+
     for (;;) {
-        unsigned char buf[3];
+        unsigned char buf[128];
         ssize_t z;
+        size_t n;
 
-        z = midi_read(&d->midi, buf, sizeof buf);
+        memcpy(buf, d->ibuf, d->ifill);
+
+        z = midi_read(&d->midi, buf + d->ifill, sizeof(buf) - d->ifill);
         if (z == -1)
             return -1;
         if (z == 0)
             break;
 
-        debug("got event");
+        z += d->ifill;
+
+        debug("batch of %zd bytes", z);
+
+        for (n = 0; n + 3 <= z; n += 3)
+            event(d, buf + n);
 
-        event(d, buf);
+        d->ifill = z - n;
+        memcpy(d->ibuf, buf + n, d->ifill);
     }
 
     sync_all_leds(d);
@@ -491,6 +523,7 @@ int dicer_init(struct controller *c, struct rt *rt, const char *hw)
     d->left = NULL;
     d->right = NULL;
     d->ofill = 0;
+    d->ifill = 0;
 
     for (n = 0; n < NBUTTONS; n++) {
         d->left_led[n] = 0;
@@ -49,12 +49,22 @@ static int excrate_init(struct excrate *e, const char *script,
         return -1;
 
     e->pid = pid;
-    e->pe = NULL;
+    e->pe.fd = -1;
+    e->pe.revents = 0;
     e->terminated = false;
     e->refcount = 0;
     rb_reset(&e->rb);
+    e->sniffed = false;
+    e->binary = false;
     listing_init(&e->listing);
     e->storage = storage;
+
+    /* Many records are about to arrive at once; defer the sorting
+     * until the scan has completed */
+
+    listing_begin_bulk(&e->listing);
+    listing_begin_bulk(storage);
+
     event_init(&e->completion);
     e->search = search;
 
@@ -137,20 +147,21 @@ void excrate_release(struct excrate *e)
 }
 
 /*
- * Get entry for use by poll()
+ * Get persistent entry for use by the rig
  *
  * Pre: scan is running
- * Post: *pe contains poll entry
+ * Return: poll entry, valid until the scan completes
  */
 
-void excrate_pollfd(struct excrate *e, struct pollfd *pe)
+struct pollfd* excrate_pollfd(struct excrate *e)
 {
     assert(e->pid != 0);
 
-    pe->fd = e->fd;
-    pe->events = POLLIN;
+    e->pe.fd = e->fd;
+    e->pe.events = POLLIN;
+    e->pe.revents = 0;
 
-    e->pe = pe;
+    return &e->pe;
 }
 
 static void do_wait(struct excrate *e)
@@ -181,60 +192,137 @@ static void do_wait(struct excrate *e)
 
 /*
  * Return: -1 on completion, otherwise zero
+ *
+ * Drain everything the pipe has to offer, and then announce the new
+ * records in one batch. One event per buffer of data (rather than
+ * one per track) keeps the observers' costs off the scan
  */
 
 static int read_from_pipe(struct excrate *e)
 {
+    int rv;
+    struct index batch, to_storage;
+
+    rv = 0;
+    index_init(&batch);
+    index_init(&to_storage);
+
+    /* The scan chooses a text or binary protocol with its first
+     * bytes of output */
+
+    if (!e->sniffed) {
+        int b;
+
+        b = sniff_magic(e->fd, &e->rb);
+        if (b == -1) {
+            if (errno == EAGAIN)
+                return 0;
+            perror("sniff_magic");
+            return -1;
+        }
+
+        e->binary = (b == 1);
+        e->sniffed = true;
+    }
+
     for (;;) {
         char *line;
         ssize_t z;
+        size_t was;
         struct record *d, *x;
 
-        z = get_line(e->fd, &e->rb, &line);
+        if (e->binary)
+            z = get_frame(e->fd, &e->rb, &line);
+        else
+            z = get_line(e->fd, &e->rb, &line);
         if (z == -1) {
             if (errno == EAGAIN)
-                return 0;
+                break;
             perror("get_line");
-            return -1;
+            rv = -1;
+            break;
         }
 
-        if (z == 0)
-            return -1;
+        if (z == 0) {
+            rv = -1;
+            break;
+        }
 
         debug("got line '%s'", line);
 
-        d = get_record(line);
-        if (d == NULL) {
-            free(line);
+        d = get_record(line); /* takes responsibility for line */
+        if (d == NULL)
             continue; /* ignore malformed entries */
-        }
 
+        was = e->storage->by_order.entries;
         x = listing_add(e->storage, d);
-        if (x == NULL)
-            return -1;
+        if (x == NULL) {
+            rv = -1;
+            break;
+        }
         if (x != d) /* our new record is a duplicate */
-            free(d);
+            record_discard(d);
+
+        if (e->storage->by_order.entries != was) {
+            if (index_reserve(&to_storage, 1) == -1) {
+                rv = -1;
+                break;
+            }
+            index_add(&to_storage, x);
+        }
 
-        x = listing_add(&e->listing, x);
-        if (x == NULL)
-            return -1;
+        was = e->listing.by_order.entries;
+        if (listing_add(&e->listing, x) == NULL) {
+            rv = -1;
+            break;
+        }
+
+        if (e->listing.by_order.entries != was) {
+            if (index_reserve(&batch, 1) == -1) {
+                rv = -1;
+                break;
+            }
+            index_add(&batch, x);
+        }
     }
+
+    /* Bulk-mode listings make no per-record announcements of
+     * their own; deliver the whole batch in a single event */
+
+    if (to_storage.entries > 0)
+        fire(&e->storage->additions, &to_storage);
+    if (batch.entries > 0)
+        fire(&e->listing.additions, &batch);
+
+    index_clear(&to_storage);
+    index_clear(&batch);
+
+    return rv;
 }
 
 void excrate_handle(struct excrate *e)
 {
     assert(e->pid != 0);
 
-    if (e->pe == NULL)
+    if (e->pe.fd == -1)
         return;
 
-    if (e->pe->revents == 0)
+    if (e->pe.revents == 0)
         return;
 
+    e->pe.revents = 0;
+
     if (read_from_pipe(e) != -1)
         return;
 
     do_wait(e);
+
+    /* Restore the sort orders before anyone hears that the scan
+     * is done; completion handlers rely on them */
+
+    listing_end_bulk(&e->listing);
+    listing_end_bulk(e->storage);
+
     fire(&e->completion, NULL);
     list_del(&e->rig);
     excrate_release(e); /* may invalidate e */
@@ -40,12 +40,14 @@ struct excrate {
     struct list rig;
     pid_t pid;
     int fd;
-    struct pollfd *pe;
+    struct pollfd pe;
     bool terminated;
 
     /* State of reader */
 
     struct rb rb;
+    bool sniffed, /* protocol has been determined */
+        binary; /* scan opted in to binary framing */
 };
 
 struct excrate* excrate_acquire_by_scan(const char *script, const char *search,
@@ -56,7 +58,7 @@ void excrate_release(struct excrate *e);
 
 /* Used by the rig and main thread */
 
-void excrate_pollfd(struct excrate *tr, struct pollfd *pe);
+struct pollfd* excrate_pollfd(struct excrate *tr);
 void excrate_handle(struct excrate *tr);
 
 #endif
@@ -32,14 +32,22 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
+/* Well-known descriptor on which any extra file descriptor is
+ * passed to the child; see fork_pipe_nb_fd() */
+
+#define EXTRA_FD 3
+
 /*
  * Fork a child process, attaching stdout to the given pipe
  *
+ * If xfd is not -1, it is additionally passed to the child on
+ * descriptor EXTRA_FD.
+ *
  * Return: -1 on error, or pid on success
  * Post: on success, *fd is file handle for reading
  */
 
-static pid_t do_fork(int pp[2], const char *path, char *argv[])
+static pid_t do_fork(int pp[2], int xfd, const char *path, char *argv[])
 {
     pid_t pid;
 
@@ -61,6 +69,16 @@ static pid_t do_fork(int pp[2], const char *path, char *argv[])
         if (close(pp[1]) != 0)
             abort();
 
+        if (xfd != -1 && xfd != EXTRA_FD) {
+            if (dup2(xfd, EXTRA_FD) == -1) {
+                perror("dup2");
+                _exit(EXIT_FAILURE); /* vfork() was used */
+            }
+
+            if (close(xfd) != 0)
+                abort();
+        }
+
         if (execv(path, argv) == -1) {
             perror(path);
             _exit(EXIT_FAILURE); /* vfork() was used */
@@ -84,7 +102,8 @@ static pid_t do_fork(int pp[2], const char *path, char *argv[])
  * forked.
  */
 
-static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
+static pid_t vext(int pp[2], int xfd, const char *path, char *arg,
+                  va_list ap)
 {
     char *args[16];
     size_t n;
@@ -105,7 +124,7 @@ static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
             break;
     }
 
-    return do_fork(pp, path, args);
+    return do_fork(pp, xfd, path, args);
 }
 
 /*
@@ -128,7 +147,7 @@ pid_t fork_pipe(int *fd, const char *path, char *arg, ...)
     }
 
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vext(pp, -1, path, arg, va);
     va_end(va);
 
     if (r == -1) {
@@ -159,6 +178,47 @@ static int make_non_blocking(int fd)
     return 0;
 }
 
+/*
+ * Keep the given file descriptor out of any future child process
+ *
+ * The rig holds persistent registrations against its descriptors,
+ * which end when the descriptor is closed; that requires ours to be
+ * the only reference, not shared with any child.
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int make_close_on_exec(int fd)
+{
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* How far (in bytes) a child process may run ahead of us */
+
+#define PIPE_CAPACITY (1 << 20)
+
+/*
+ * Enlarge the buffer of the given pipe, where the OS allows
+ *
+ * Scan processes are forked during option parsing, but nobody reads
+ * their output until the rig is up; with the default capacity they
+ * are quickly throttled. Failure is not an error, just the smaller
+ * buffer.
+ */
+
+static void enlarge_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    if (fcntl(fd, F_SETPIPE_SZ, PIPE_CAPACITY) == -1)
+        debug("F_SETPIPE_SZ: %s", strerror(errno));
+#endif
+}
+
 /*
  * Fork a child process with stdout connected to this process
  * via a non-blocking pipe
@@ -178,11 +238,62 @@ pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...)
         return -1;
     }
 
+    enlarge_pipe(pp[1]);
+
+    if (make_non_blocking(pp[0]) == -1)
+        goto fail;
+    if (make_close_on_exec(pp[0]) == -1)
+        goto fail;
+
+    va_start(va, arg);
+    r = vext(pp, -1, path, arg, va);
+    va_end(va);
+
+    assert(r != 0);
+    if (r < 0)
+        goto fail;
+
+    *fd = pp[0];
+    return r;
+
+fail:
+    if (close(pp[0]) != 0)
+        abort();
+    if (close(pp[1]) != 0)
+        abort();
+
+    return -1;
+}
+
+/*
+ * As fork_pipe_nb, but additionally passing the given file
+ * descriptor to the child on a well-known descriptor (3), used for
+ * the shared-memory import transport
+ *
+ * Return: PID on success, otherwise -1
+ * Post: on success, *fd is non-blocking file descriptor for reading
+ */
+
+pid_t fork_pipe_nb_fd(int *fd, int xfd, const char *path, char *arg, ...)
+{
+    int pp[2];
+    pid_t r;
+    va_list va;
+
+    if (pipe(pp) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    enlarge_pipe(pp[1]);
+
     if (make_non_blocking(pp[0]) == -1)
         goto fail;
+    if (make_close_on_exec(pp[0]) == -1)
+        goto fail;
 
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vext(pp, xfd, path, arg, va);
     va_end(va);
 
     assert(r != 0);
@@ -203,12 +314,13 @@ fail:
 
 void rb_reset(struct rb *rb)
 {
+    rb->pos = 0;
     rb->len = 0;
 }
 
 bool rb_is_full(const struct rb *rb)
 {
-    return (rb->len == sizeof rb->buf);
+    return (rb->len - rb->pos == sizeof rb->buf);
 }
 
 /*
@@ -223,6 +335,15 @@ static ssize_t top_up(struct rb *rb, int fd)
     size_t remain;
     ssize_t z;
 
+    /* Consumed bytes pile up at the front; reclaim them with one
+     * bulk copy per read, rather than a copy per record popped */
+
+    if (rb->pos > 0) {
+        memmove(rb->buf, rb->buf + rb->pos, rb->len - rb->pos);
+        rb->len -= rb->pos;
+        rb->pos = 0;
+    }
+
     assert(rb->len < sizeof rb->buf);
     remain = sizeof(rb->buf) - rb->len;
 
@@ -248,28 +369,66 @@ static ssize_t pop(struct rb *rb, char **q)
     char *s;
     size_t len;
 
-    x = memchr(rb->buf, '\n', rb->len);
+    x = memchr(rb->buf + rb->pos, '\n', rb->len - rb->pos);
     if (!x) {
         debug("pop %p exhausted", rb);
         return 0;
     }
 
-    len = x - rb->buf;
+    len = x - (rb->buf + rb->pos);
     debug("pop %p got %u", rb, len);
 
-    s = strndup(rb->buf, len);
+    s = strndup(rb->buf + rb->pos, len);
     if (!s) {
         debug("strndup: %s", strerror(errno));
         return -1;
     }
 
     *q = s;
+    rb->pos += len + 1;
+
+    return len + 1;
+}
+
+/*
+ * Pop a length-prefixed frame from the front of the buffer
+ *
+ * Return: 0 if incomplete, -1 if not enough memory,
+ *    otherwise payload length (incl. terminator)
+ * Post: if return is > 0, q points to alloc'd string
+ */
+
+static ssize_t pop_frame(struct rb *rb, char **q)
+{
+    const unsigned char *p;
+    char *s;
+    size_t avail, len;
+
+    avail = rb->len - rb->pos;
+    if (avail < 2) {
+        debug("pop_frame %p exhausted", rb);
+        return 0;
+    }
+
+    p = (unsigned char*)rb->buf + rb->pos;
+    len = p[0] | (p[1] << 8); /* little-endian */
+
+    if (avail < len + 2)
+        return 0;
+
+    debug("pop_frame %p got %u", rb, len);
 
-    /* Simple compact of the buffer. If this is a bottleneck of any
-     * kind (unlikely) then a circular buffer should be used */
+    s = malloc(len + 1);
+    if (!s) {
+        debug("malloc: %s", strerror(errno));
+        return -1;
+    }
 
-    memmove(rb->buf, x + 1, rb->len - len - 1);
-    rb->len = rb->len - len - 1;
+    memcpy(s, rb->buf + rb->pos + 2, len);
+    s[len] = '\0';
+
+    *q = s;
+    rb->pos += len + 2;
 
     return len + 1;
 }
@@ -307,3 +466,74 @@ ssize_t get_line(int fd, struct rb *rb, char **string)
 
     return -1;
 }
+
+/*
+ * As get_line, but read a length-prefixed binary frame
+ *
+ * No scanning for a terminator, just bulk copies; see SCAN_MAGIC
+ * for the framing.
+ *
+ * Return: 0 on EOF, or -1 on error
+ * Post: if -1 is returned, errno is set accordingly
+ */
+
+ssize_t get_frame(int fd, struct rb *rb, char **string)
+{
+    ssize_t y, z;
+
+    y = top_up(rb, fd);
+    if (y < 0)
+        return y;
+
+    z = pop_frame(rb, string);
+    if (z != 0)
+        return z;
+
+    if (rb_is_full(rb))
+        errno = ENOBUFS; /* frame larger than the buffer */
+    else if (y > 0)
+        errno = EAGAIN;
+    else
+        return 0; /* true EOF: no more data and empty buffer */
+
+    return -1;
+}
+
+/*
+ * Decide if the stream opens with SCAN_MAGIC (and hence speaks the
+ * binary protocol), consuming the magic if so
+ *
+ * The magic contains a NUL byte, which cannot appear in the
+ * line-based protocol.
+ *
+ * Return: 1 if binary, 0 if line-based, or -1 on error
+ * Post: if -1 is returned, errno is set accordingly
+ */
+
+int sniff_magic(int fd, struct rb *rb)
+{
+    ssize_t y;
+    size_t avail;
+
+    y = top_up(rb, fd);
+    if (y < 0)
+        return -1;
+
+    avail = rb->len - rb->pos;
+    if (avail > SCAN_MAGIC_LEN)
+        avail = SCAN_MAGIC_LEN;
+
+    if (memcmp(rb->buf + rb->pos, SCAN_MAGIC, avail) != 0)
+        return 0;
+
+    if (avail == SCAN_MAGIC_LEN) {
+        rb->pos += SCAN_MAGIC_LEN;
+        return 1;
+    }
+
+    if (y == 0)
+        return 0; /* EOF; the partial match is line-based data */
+
+    errno = EAGAIN; /* not enough data to decide yet */
+    return -1;
+}
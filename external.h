@@ -33,14 +33,25 @@
  */
 
 struct rb {
-    char buf[4096];
-    size_t len;
+    char buf[65536];
+    size_t pos, /* bytes consumed from the front */
+        len; /* bytes filled */
 };
 
+/* A scan process may opt in to binary framing by opening its output
+ * with this magic; thereafter each record is a 16-bit little-endian
+ * length followed by that many bytes of payload */
+
+#define SCAN_MAGIC "xwscan\x00\x01"
+#define SCAN_MAGIC_LEN 8
+
 pid_t fork_pipe(int *fd, const char *path, char *arg, ...);
 pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...);
+pid_t fork_pipe_nb_fd(int *fd, int xfd, const char *path, char *arg, ...);
 
 void rb_reset(struct rb *rb);
 ssize_t get_line(int fd, struct rb *rb, char **string);
+ssize_t get_frame(int fd, struct rb *rb, char **string);
+int sniff_magic(int fd, struct rb *rb);
 
 #endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * The shared-memory import transport
+ *
+ * Importers normally write raw PCM to stdout and need know nothing
+ * of this file. An importer which wants to avoid the pipe copies
+ * can instead write frames directly into shared memory, inherited
+ * on the file descriptor below.
+ *
+ * The contract for such an importer is:
+ *
+ * - check the magic and version at offset zero of the file; if they
+ *   do not match, fall back to writing PCM on stdout;
+ *
+ * - declare itself by setting 'active' (before anything is written
+ *   to stdout);
+ *
+ * - grow the file with ftruncate() and place interleaved signed
+ *   16-bit frames in the PCM area of consecutive blocks: block i
+ *   starts at data_offset + i * block_bytes, of which the first
+ *   pcm_bytes are PCM and the remainder belongs to the reader;
+ *
+ * - publish progress by raising 'frames' (a memory barrier first),
+ *   then writing a byte -- any byte -- to stdout to wake the
+ *   reader;
+ *
+ * - close stdout when the audio is complete, and exit.
+ *
+ * An importer which can decode a file out of order -- eg. seekable
+ * formats -- may instead fill blocks in any order, so that the
+ * region the listener has dropped the needle on is audible after
+ * one block, not after a linear decode of everything before it.
+ * Such an importer requires version 2, and:
+ *
+ * - grows the file to cover the entire audio before setting
+ *   'active', and declares the length in 'total' and its ability
+ *   in 'seek';
+ *
+ * - publishes per-block progress by raising 'filled' entries in
+ *   place of 'frames', with the same barrier-then-wakeup sequence;
+ *   each entry may only grow;
+ *
+ * - consults 'want', maintained by the reader, for the block the
+ *   listener is nearest, and decodes there first before
+ *   back-filling the rest.
+ */
+
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stdint.h>
+
+/* The shared memory is passed to the importer on this descriptor */
+
+#define IMPORT_SHM_FD 3
+
+#define IMPORT_SHM_MAGIC "xwsm"
+#define IMPORT_SHM_VERSION 2
+
+struct import_shm_header {
+    char magic[4];
+    uint32_t version;
+
+    /* Geometry, fixed by the parent before the fork */
+
+    uint32_t data_offset, /* first block, bytes into the file */
+        block_bytes, /* stride from one block to the next */
+        pcm_bytes, /* of which PCM, at the start of the block */
+        max_blocks;
+
+    /* Progress, maintained by the importer */
+
+    uint32_t active; /* this importer speaks the protocol */
+    uint32_t frames; /* stereo frames committed to the file */
+
+    /* Out-of-order decode (version 2) */
+
+    uint32_t seek; /* importer fills blocks out of order */
+    uint32_t total; /* frames in the whole file, when seek is set */
+    uint32_t want; /* block the listener is nearest, set by the reader */
+    uint32_t filled[]; /* frames committed per block, when seek is set */
+};
+
+#endif
@@ -161,6 +161,65 @@ static int record_cmp_bpm(const struct record *a, const struct record *b)
     return record_cmp_artist(a, b);
 }
 
+/*
+ * Standard comparison in the given sort order
+ *
+ * Return: -1, 0 or 1 as for strcmp(3)
+ */
+
+int record_cmp(const struct record *a, const struct record *b, int sort)
+{
+    switch (sort) {
+    case SORT_ARTIST:
+        return record_cmp_artist(a, b);
+    case SORT_BPM:
+        return record_cmp_bpm(a, b);
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
+/*
+ * Comparison functions, see qsort(3)
+ */
+
+static int qcmp_artist(const void *a, const void *b)
+{
+    return record_cmp_artist(*(struct record *const *)a,
+                             *(struct record *const *)b);
+}
+
+static int qcmp_bpm(const void *a, const void *b)
+{
+    return record_cmp_bpm(*(struct record *const *)a,
+                          *(struct record *const *)b);
+}
+
+/*
+ * Sort an unordered index into the given sort order
+ *
+ * Cheaper than insertion sort when many records arrive at once; see
+ * listing_begin_bulk() in library.c
+ *
+ * Post: index is sorted
+ */
+
+void index_sort(struct index *ls, int sort)
+{
+    switch (sort) {
+    case SORT_ARTIST:
+        qsort(ls->record, ls->entries, sizeof(struct record*), qcmp_artist);
+        break;
+    case SORT_BPM:
+        qsort(ls->record, ls->entries, sizeof(struct record*), qcmp_bpm);
+        break;
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
 /*
  * Check if a record matches the given string. This function is the
  * definitive code which defines what constitutes a 'match'.
@@ -170,20 +229,11 @@ static int record_cmp_bpm(const struct record *a, const struct record *b)
 
 static bool record_match_word(struct record *re, const char *match)
 {
-    /* Some records provide a dedicated string for matching against,
-     * in the same locale as "match" */
-
-    if (re->match) {
-        if (strcasestr(re->match, match) != NULL)
-            return true;
-    } else {
-        if (strcasestr(re->artist, match) != NULL)
-            return true;
-        if (strcasestr(re->title, match) != NULL)
-            return true;
-    }
+    /* Both sides are folded up-front -- the record at import, the
+     * search words in match_compile() -- so the inner loop is a
+     * plain byte comparison */
 
-    return false;
+    return strstr(re->match, match) != NULL;
 }
 
 /*
@@ -196,6 +246,11 @@ bool record_match(struct record *re, const struct match *h)
 {
     char *const *matches;
 
+    if (h->bpm_hi != 0.0) {
+        if (re->bpm < h->bpm_lo || re->bpm > h->bpm_hi)
+            return false;
+    }
+
     matches = h->words;
 
     while (*matches != NULL) {
@@ -228,6 +283,35 @@ int index_copy(const struct index *src, struct index *dest)
     return 0;
 }
 
+/*
+ * Parse a word of the form "122-128" as a BPM range
+ *
+ * Return: true if the word is a range, otherwise false
+ * Post: if true is returned, lo and hi are set
+ */
+
+static bool parse_bpm_range(const char *s, double *lo, double *hi)
+{
+    char *end;
+    double a, b;
+
+    a = strtod(s, &end);
+    if (end == s || *end != '-')
+        return false;
+
+    s = end + 1;
+    b = strtod(s, &end);
+    if (end == s || *end != '\0')
+        return false;
+
+    if (a <= 0.0 || b <= 0.0)
+        return false;
+
+    *lo = a;
+    *hi = b;
+    return true;
+}
+
 /*
  * Compile a search object from a given string
  *
@@ -237,11 +321,17 @@ int index_copy(const struct index *src, struct index *dest)
 void match_compile(struct match *h, const char *d)
 {
     char *buf;
-    size_t n;
+    size_t n, w;
 
     assert(strlen(d) < sizeof h->buf);
     strcpy(h->buf, d);
 
+    /* Fold the search input once here, to the same case as the
+     * match strings; see record_match_word() */
+
+    for (buf = h->buf; *buf != '\0'; buf++)
+        *buf = tolower((unsigned char)*buf);
+
     buf = h->buf;
     n = 0;
     for (;;) {
@@ -262,6 +352,86 @@ void match_compile(struct match *h, const char *d)
         buf = s + 1; /* skip separator */
     }
     h->words[n] = NULL; /* terminate list */
+
+    /* A word which reads as a BPM range is a constraint on tempo,
+     * not text; if several are given the last one wins */
+
+    h->bpm_lo = 0.0;
+    h->bpm_hi = 0.0;
+
+    w = 0;
+    for (n = 0; h->words[n] != NULL; n++) {
+        double lo, hi;
+
+        if (parse_bpm_range(h->words[n], &lo, &hi)) {
+            h->bpm_lo = lo;
+            h->bpm_hi = hi;
+            continue;
+        }
+
+        h->words[w++] = h->words[n];
+    }
+    h->words[w] = NULL;
+}
+
+/*
+ * Copy search criteria
+ *
+ * A plain struct copy is not enough, as the words point into the
+ * accompanying buffer.
+ */
+
+void match_copy(struct match *dest, const struct match *src)
+{
+    size_t n;
+
+    memcpy(dest->buf, src->buf, sizeof dest->buf);
+
+    for (n = 0; src->words[n] != NULL; n++)
+        dest->words[n] = dest->buf + (src->words[n] - src->buf);
+    dest->words[n] = NULL;
+
+    dest->bpm_lo = src->bpm_lo;
+    dest->bpm_hi = src->bpm_hi;
+}
+
+/*
+ * Check if one search criteria refines another; ie. the set of
+ * records which match 'next' is a subset of those matching 'prev'
+ *
+ * This is so when every word of 'prev' is contained in some word of
+ * 'next', since matching is by substring.
+ *
+ * Return: true if 'next' refines 'prev', otherwise false
+ */
+
+bool match_is_refinement(const struct match *prev, const struct match *next)
+{
+    char *const *p;
+
+    /* A BPM range may appear or narrow, but not widen or lapse */
+
+    if (prev->bpm_hi != 0.0) {
+        if (next->bpm_hi == 0.0)
+            return false;
+        if (next->bpm_lo < prev->bpm_lo || next->bpm_hi > prev->bpm_hi)
+            return false;
+    }
+
+    for (p = prev->words; *p != NULL; p++) {
+        char *const *n;
+
+        for (n = next->words; *n != NULL; n++) {
+            if (strstr(*n, *p) != NULL) /* words are folded */
+                goto covered;
+        }
+
+        return false;
+    covered:
+        continue;
+    }
+
+    return true;
 }
 
 /*
@@ -295,6 +465,136 @@ int index_match(struct index *src, struct index *dest,
     return 0;
 }
 
+/*
+ * Narrow down an index of known matches against refined criteria
+ *
+ * Since every record in the source already matches 'prev', only the
+ * words which changed need testing; a six-character search costs six
+ * substring tests per record in total, not per keystroke.
+ *
+ * Pre: every record in src matches 'prev'
+ * Pre: match_is_refinement(prev, next)
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int index_refine(struct index *src, struct index *dest,
+                 const struct match *prev, const struct match *next)
+{
+    int n;
+    char *const *w;
+    struct match delta;
+    size_t d;
+
+    /* Words which already appear in 'prev' hold for every record
+     * in the source index */
+
+    d = 0;
+
+    for (w = next->words; *w != NULL; w++) {
+        char *const *p;
+
+        for (p = prev->words; *p != NULL; p++) {
+            if (strcasecmp(*p, *w) == 0)
+                goto skip;
+        }
+
+        delta.words[d++] = *w;
+    skip:
+        continue;
+    }
+
+    delta.words[d] = NULL;
+
+    /* The range check is two comparisons; no need to work out
+     * whether it actually changed */
+
+    delta.bpm_lo = next->bpm_lo;
+    delta.bpm_hi = next->bpm_hi;
+
+    index_blank(dest);
+
+    for (n = 0; n < src->entries; n++) {
+        struct record *re;
+
+        re = src->record[n];
+
+        if (record_match(re, &delta)) {
+            if (index_reserve(dest, 1) == -1)
+                return -1;
+            index_add(dest, re);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find records within a BPM range, using the sort order
+ *
+ * The index is ordered fastest to slowest, so the records in range
+ * form a contiguous run which two binary searches delimit; any text
+ * words are then tested against the run only.
+ *
+ * Pre: src is sorted by SORT_BPM
+ * Pre: match has a BPM range
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int index_range_bpm(struct index *src, struct index *dest,
+                    const struct match *match)
+{
+    size_t lo, hi, n;
+
+    assert(match->bpm_hi != 0.0);
+
+    /* First entry no faster than the upper bound */
+
+    lo = 0;
+    n = src->entries;
+    while (lo < n) {
+        size_t mid;
+
+        mid = (lo + n) / 2;
+        if (src->record[mid]->bpm > match->bpm_hi)
+            lo = mid + 1;
+        else
+            n = mid;
+    }
+
+    /* First entry slower than the lower bound; unknown tempo is
+     * zero, sorts last and falls outside any range */
+
+    hi = lo;
+    n = src->entries;
+    while (hi < n) {
+        size_t mid;
+
+        mid = (hi + n) / 2;
+        if (src->record[mid]->bpm >= match->bpm_lo)
+            hi = mid + 1;
+        else
+            n = mid;
+    }
+
+    index_blank(dest);
+
+    for (n = lo; n < hi; n++) {
+        struct record *re;
+
+        re = src->record[n];
+
+        if (record_match(re, match)) {
+            if (index_reserve(dest, 1) == -1)
+                return -1;
+            index_add(dest, re);
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Binary search of sorted index
  *
@@ -325,17 +625,7 @@ static size_t bin_search(struct record **base, size_t n,
     mid = n / 2;
     x = base[mid];
 
-    switch (sort) {
-    case SORT_ARTIST:
-        r = record_cmp_artist(item, x);
-        break;
-    case SORT_BPM:
-        r = record_cmp_bpm(item, x);
-        break;
-    case SORT_PLAYLIST:
-    default:
-        abort();
-    }
+    r = record_cmp(item, x, sort);
 
     if (r < 0)
         return bin_search(base, mid, item, sort, found);
@@ -377,6 +667,39 @@ struct record* index_insert(struct index *ls, struct record *item,
     return item;
 }
 
+/*
+ * Remove an entry from the index
+ *
+ * Pre: item is in the index
+ * Post: index no longer contains item
+ */
+
+void index_remove(struct index *ls, struct record *item, int sort)
+{
+    bool found;
+    size_t z;
+
+    switch (sort) {
+    case SORT_PLAYLIST:
+        /* Linear search; there is no order to exploit */
+
+        for (z = 0; z < ls->entries; z++) {
+            if (ls->record[z] == item)
+                break;
+        }
+        break;
+    default:
+        z = bin_search(ls->record, ls->entries, item, sort, &found);
+        assert(found);
+    }
+
+    assert(z < ls->entries);
+
+    memmove(ls->record + z, ls->record + z + 1,
+            sizeof(struct record*) * (ls->entries - z - 1));
+    ls->entries--;
+}
+
 /*
  * Reserve space in the index for the addition of n new items
  *
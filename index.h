@@ -30,12 +30,15 @@
 /* A single music track in our listings */
 
 struct record {
-    char *pathname, *artist, *title; /* a single malloc */
+    char *pathname, /* allocated together with this struct, from
+                     * the library arena; see library.c */
+        *artist, *title; /* interned, shared between records */
 
-    /* An optional extra string may be used to match against search
-     * input; allows us to handle locale but still type in ASCII */
+    /* The text the search matches against: artist and title,
+     * lower-cased and folded to the ASCII locale used for search
+     * input, built once at import. See matchable() in library.c */
 
-    char *match; /* or NULL */
+    char *match;
 
     double bpm; /* or 0.0 if not known */
 };
@@ -53,19 +56,33 @@ struct index {
 struct match {
     char buf[512];
     char *words[32]; /* NULL-terminated array */
+
+    /* BPM range, inclusive; no constraint when bpm_hi is zero */
+
+    double bpm_lo, bpm_hi;
 };
 
 void index_init(struct index *ls);
 void index_clear(struct index *ls);
 void index_blank(struct index *ls);
 void index_add(struct index *li, struct record *lr);
+void index_sort(struct index *ls, int sort);
+int record_cmp(const struct record *a, const struct record *b, int sort);
 bool record_match(struct record *re, const struct match *h);
 int index_copy(const struct index *src, struct index *dest);
 void match_compile(struct match *h, const char *d);
+void match_copy(struct match *dest, const struct match *src);
+bool match_is_refinement(const struct match *prev,
+                         const struct match *next);
 int index_match(struct index *src, struct index *dest,
                 const struct match *match);
+int index_refine(struct index *src, struct index *dest,
+                 const struct match *prev, const struct match *next);
+int index_range_bpm(struct index *src, struct index *dest,
+                    const struct match *match);
 struct record* index_insert(struct index *ls, struct record *item,
                             int sort);
+void index_remove(struct index *ls, struct record *item, int sort);
 int index_reserve(struct index *i, unsigned int n);
 size_t index_find(struct index *ls, struct record *item, int sort);
 void index_debug(struct index *ls);
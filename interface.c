@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <iconv.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -35,6 +36,8 @@
 
 #include "interface.h"
 #include "layout.h"
+#include "list.h"
+#include "perf.h"
 #include "player.h"
 #include "rig.h"
 #include "selector.h"
@@ -42,9 +45,11 @@
 #include "timecoder.h"
 #include "xwax.h"
 
-/* Screen refresh time in milliseconds */
+/* Target frame rate of the renderer. Events are handled as they
+ * arrive, but drawing happens at most this many times per second */
 
-#define REFRESH 10
+#define FRAME_RATE 60
+#define FRAME (1000 / FRAME_RATE) /* milliseconds */
 
 /* Font definitions */
 
@@ -118,6 +123,7 @@
 #define FUNC_LOAD 0
 #define FUNC_RECUE 1
 #define FUNC_TIMECODE 2
+#define FUNC_KEYLOCK 3
 
 /* Types of SDL_USEREVENT */
 
@@ -133,8 +139,6 @@
 
 #define LOCK(sf) if (SDL_MUSTLOCK(sf)) SDL_LockSurface(sf)
 #define UNLOCK(sf) if (SDL_MUSTLOCK(sf)) SDL_UnlockSurface(sf)
-#define UPDATE(sf, rect) SDL_UpdateRect(sf, (rect)->x, (rect)->y, \
-                                        (rect)->w, (rect)->h)
 
 /* List of directories to use as search path for fonts. */
 
@@ -166,14 +170,28 @@ static SDL_Color background_col = {0, 0, 0, 255},
 
 static unsigned short *spinner_angle, spinner_size;
 
+/* The spinner is pre-rendered into sprites, one per angular step in
+ * each colour, so a frame of rotation is a single blit */
+
+#define SPINNER_STEPS 64
+
+static SDL_Surface *spinner_sprite[2][SPINNER_STEPS]; /* ok, alert */
+
 static int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT,
     meter_scale = DEFAULT_METER_SCALE;
-static Uint32 video_flags = SDL_RESIZABLE;
+static bool hud = false; /* performance HUD is visible */
+static Uint32 video_flags = SDL_RESIZABLE | SDL_HWSURFACE | SDL_ANYFORMAT;
 static float scale = DEFAULT_SCALE;
 static iconv_t utf;
 static pthread_t ph;
 static struct selector selector;
-static struct observer on_status, on_selector;
+static struct observer on_status, on_selector, on_analysis;
+
+/* Events are deferred at the emission site and delivered in a
+ * batch when this thread next wakes, so that a storm of them (eg.
+ * a bulk import) does cheap list work, not SDL calls, per event */
+
+static struct event_queue deferred = EVENT_QUEUE_INIT(deferred);
 
 /*
  * Scale a dimension according to the current zoom level
@@ -259,8 +277,51 @@ static void calculate_angle_lut(unsigned short *lut, int size)
     }
 }
 
+/*
+ * Render one rotation step of the spinner into the given sprite
+ */
+
+static void render_spinner(SDL_Surface *sprite, int rangle, SDL_Color col)
+{
+    int r, c, pangle;
+    Uint8 *rp, *p;
+
+    LOCK(sprite);
+
+    for (r = 0; r < spinner_size; r++) {
+
+        /* Store a pointer to this row of the sprite */
+
+        rp = sprite->pixels + r * sprite->pitch;
+
+        for (c = 0; c < spinner_size; c++) {
+
+            /* Use the lookup table to provide the angle at each
+             * pixel */
+
+            pangle = spinner_angle[r * spinner_size + c];
+
+            p = rp + c * sprite->format->BytesPerPixel;
+
+            if ((rangle - pangle + 1024) % 1024 < 512) {
+                p[0] = col.b >> 2;
+                p[1] = col.g >> 2;
+                p[2] = col.r >> 2;
+            } else {
+                p[0] = col.b;
+                p[1] = col.g;
+                p[2] = col.r;
+            }
+        }
+    }
+
+    UNLOCK(sprite);
+}
+
 static int init_spinner(int size)
 {
+    int n;
+
     spinner_angle = malloc(size * size * (sizeof *spinner_angle));
     if (spinner_angle == NULL) {
         perror("malloc");
@@ -269,11 +330,44 @@ static int init_spinner(int size)
 
     calculate_angle_lut(spinner_angle, size);
     spinner_size = size;
+
+    /* Pre-render every rotation step; the same pixel format as the
+     * back buffer, so the blit is a straight copy */
+
+    for (n = 0; n < SPINNER_STEPS; n++) {
+        SDL_Color col[2] = { ok_col, alert_col };
+        int i, rangle;
+
+        rangle = n * 1024 / SPINNER_STEPS;
+
+        for (i = 0; i < 2; i++) {
+            SDL_Surface *s;
+
+            s = SDL_CreateRGBSurface(SDL_SWSURFACE, size, size, 32,
+                                     0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+            if (s == NULL) {
+                fprintf(stderr, "SDL_CreateRGBSurface: %s\n",
+                        SDL_GetError());
+                return -1;
+            }
+
+            render_spinner(s, rangle, col[i]);
+            spinner_sprite[i][n] = s;
+        }
+    }
+
     return 0;
 }
 
 static void clear_spinner(void)
 {
+    int n, i;
+
+    for (n = 0; n < SPINNER_STEPS; n++) {
+        for (i = 0; i < 2; i++)
+            SDL_FreeSurface(spinner_sprite[i][n]);
+    }
+
     free(spinner_angle);
 }
 
@@ -369,12 +463,16 @@ static int load_fonts(void)
     return 0;
 }
 
+static void text_cache_clear(void); /* see below */
+
 /*
  * Free resources associated with fonts
  */
 
 static void clear_fonts(void)
 {
+    text_cache_clear(); /* renderings may be invalidated with them */
+
     TTF_CloseFont(clock_font);
     TTF_CloseFont(deci_font);
     TTF_CloseFont(font);
@@ -388,6 +486,137 @@ static Uint32 palette(SDL_Surface *sf, SDL_Color *col)
     return SDL_MapRGB(sf->format, col->r, col->g, col->b);
 }
 
+/*
+ * Rasterize the string with the given font and colours
+ *
+ * Return: rendered surface, never NULL
+ */
+
+static SDL_Surface* render_text(const char *buf, TTF_Font *font,
+                                SDL_Color fg, SDL_Color bg, bool locale)
+{
+    SDL_Surface *rendered;
+
+    if (!locale) {
+        rendered = TTF_RenderText_Shaded(font, buf, fg, bg);
+    } else {
+        char ubuf[256], /* fixed buffer is reasonable for rendering */
+            *in, *out;
+        size_t len, fill;
+
+        out = ubuf;
+        fill = sizeof(ubuf) - 1; /* always leave space for \0 */
+
+        if (iconv(utf, NULL, NULL, &out, &fill) == -1)
+            abort();
+
+        in = strdupa(buf);
+        len = strlen(in);
+
+        (void)iconv(utf, &in, &len, &out, &fill);
+        *out = '\0';
+
+        rendered = TTF_RenderUTF8_Shaded(font, ubuf, fg, bg);
+    }
+
+    if (rendered == NULL) {
+        fprintf(stderr, "%s\n", TTF_GetError());
+        abort();
+    }
+
+    return rendered;
+}
+
+/*
+ * Cache of rendered text, in LRU order
+ *
+ * The same strings -- titles, artists, clocks -- are drawn frame
+ * after frame; only genuinely new strings should reach FreeType.
+ */
+
+#define TEXT_CACHE_ENTRIES 512
+
+struct cached_text {
+    struct list lru;
+    char *text;
+    TTF_Font *font;
+    SDL_Color fg, bg;
+    bool locale;
+    SDL_Surface *rendered;
+};
+
+static struct list text_cache = LIST_INIT(text_cache);
+static size_t text_cache_entries = 0;
+
+static bool color_eq(SDL_Color a, SDL_Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static void text_entry_free(struct cached_text *t)
+{
+    list_del(&t->lru);
+    SDL_FreeSurface(t->rendered);
+    free(t->text);
+    free(t);
+    text_cache_entries--;
+}
+
+static void text_cache_clear(void)
+{
+    while (!list_empty(&text_cache))
+        text_entry_free(list_entry(text_cache.next, struct cached_text, lru));
+}
+
+/*
+ * Fetch the rendering of the given string from the cache, or
+ * rasterize (and cache) it on a miss
+ *
+ * Return: rendered surface, owned by the cache, never NULL
+ */
+
+static SDL_Surface* text_lookup(const char *buf, TTF_Font *font,
+                                SDL_Color fg, SDL_Color bg, bool locale)
+{
+    struct cached_text *t;
+
+    list_for_each(t, &text_cache, lru) {
+        if (t->font == font && t->locale == locale
+            && color_eq(t->fg, fg) && color_eq(t->bg, bg)
+            && strcmp(t->text, buf) == 0)
+        {
+            /* Bump to the front of the LRU order */
+
+            list_del(&t->lru);
+            list_add(&t->lru, &text_cache);
+
+            return t->rendered;
+        }
+    }
+
+    if (text_cache_entries == TEXT_CACHE_ENTRIES)
+        text_entry_free(list_entry(text_cache.prev, struct cached_text, lru));
+
+    t = malloc(sizeof *t);
+    if (t == NULL)
+        abort();
+
+    t->text = strdup(buf);
+    if (t->text == NULL)
+        abort();
+
+    t->font = font;
+    t->fg = fg;
+    t->bg = bg;
+    t->locale = locale;
+    t->rendered = render_text(buf, font, fg, bg, locale);
+
+    list_add(&t->lru, &text_cache);
+    text_cache_entries++;
+
+    return t->rendered;
+}
+
 /*
  * Draw text
  *
@@ -413,27 +642,7 @@ static int do_draw_text(SDL_Surface *sf, const struct rect *rect,
         src.h = 0;
 
     } else {
-        if (!locale) {
-            rendered = TTF_RenderText_Shaded(font, buf, fg, bg);
-        } else {
-            char ubuf[256], /* fixed buffer is reasonable for rendering */
-                *in, *out;
-            size_t len, fill;
-
-            out = ubuf;
-            fill = sizeof(ubuf) - 1; /* always leave space for \0 */
-
-            if (iconv(utf, NULL, NULL, &out, &fill) == -1)
-                abort();
-
-            in = strdupa(buf);
-            len = strlen(in);
-
-            (void)iconv(utf, &in, &len, &out, &fill);
-            *out = '\0';
-
-            rendered = TTF_RenderUTF8_Shaded(font, ubuf, fg, bg);
-        }
+        rendered = text_lookup(buf, font, fg, bg, locale);
 
         src.x = 0;
         src.y = 0;
@@ -444,7 +653,6 @@ static int do_draw_text(SDL_Surface *sf, const struct rect *rect,
         dst.y = rect->y;
 
         SDL_BlitSurface(rendered, &src, sf, &dst);
-        SDL_FreeSurface(rendered);
     }
 
     /* Complete the remaining space with a blank rectangle */
@@ -663,11 +871,7 @@ static void draw_record(SDL_Surface *surface, const struct rect *rect,
         split(title, from_left(BPM_WIDTH, 0), &left, &right);
 
         // take note of pitch so we can calculate the avarage later on
-        if (deck->player.currentPitchSample == deck->player.pitchSampleAmount)
-            deck->player.currentPitchSample = 0;
-        deck->player.pitchSamples[ deck->player.currentPitchSample ] = deck->player.pitch ;
-        //printf("index: %f, value: %d\n", pitchSamplesA[currentPitchSampleA], currentPitchSampleA );
-        deck->player.currentPitchSample++;
+        player_sample_pitch(&deck->player);
 
         double nearest = roundf( player_getAveragePitch(&deck->player) * record->bpm * 10) / (record->bpm * 10);
 
@@ -706,30 +910,80 @@ static void draw_clock(SDL_Surface *surface, const struct rect *rect, int t,
  * Draw the visual monitor of the input audio to the timecoder
  */
 
+/* One persistent surface per scope, so that an unchanged monitor
+ * costs a single blit rather than a conversion of every pixel */
+
+static struct {
+    const struct timecoder *tc;
+    SDL_Surface *surface;
+} scope[MAX_DECKS];
+
 static void draw_scope(SDL_Surface *surface, const struct rect *rect,
                        struct timecoder *tc)
 {
-    int r, c, v, mid;
-    Uint8 *p;
+    bool changed;
+    size_t n;
+    SDL_Surface *s;
+    SDL_Rect dst;
 
-    mid = tc->mon_size / 2;
+    changed = timecoder_monitor_render(tc);
 
-    for (r = 0; r < tc->mon_size; r++) {
-        for (c = 0; c < tc->mon_size; c++) {
-            p = surface->pixels
-                + (rect->y + r) * surface->pitch
-                + (rect->x + c) * surface->format->BytesPerPixel;
+    for (n = 0; n < MAX_DECKS; n++) {
+        if (scope[n].tc == tc)
+            break;
+    }
 
-            v = tc->mon[r * tc->mon_size + c];
+    if (n == MAX_DECKS) {
+        for (n = 0; n < MAX_DECKS && scope[n].tc != NULL; n++)
+            ;
+        assert(n < MAX_DECKS);
+
+        scope[n].tc = tc;
+        scope[n].surface = SDL_CreateRGBSurface(SDL_SWSURFACE,
+                                                tc->mon_size, tc->mon_size,
+                                                32, 0x00ff0000, 0x0000ff00,
+                                                0x000000ff, 0);
+        if (scope[n].surface == NULL) {
+            fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+            abort();
+        }
+
+        changed = true;
+    }
 
-            if ((r == mid || c == mid) && v < 64)
-                v = 64;
+    s = scope[n].surface;
 
-            p[0] = v;
-            p[1] = p[0];
-            p[2] = p[1];
+    if (changed) {
+        int r, c, v, mid;
+        Uint8 *p;
+
+        mid = tc->mon_size / 2;
+
+        LOCK(s);
+
+        for (r = 0; r < tc->mon_size; r++) {
+            p = (Uint8*)s->pixels + r * s->pitch;
+
+            for (c = 0; c < tc->mon_size; c++) {
+                v = tc->mon[r * tc->mon_size + c];
+
+                if ((r == mid || c == mid) && v < 64)
+                    v = 64;
+
+                p[0] = v;
+                p[1] = v;
+                p[2] = v;
+                p += s->format->BytesPerPixel;
+            }
         }
+
+        UNLOCK(s);
     }
+
+    dst.x = rect->x;
+    dst.y = rect->y;
+
+    SDL_BlitSurface(s, NULL, surface, &dst);
 }
 
 /*
@@ -742,53 +996,27 @@ static void draw_scope(SDL_Surface *surface, const struct rect *rect,
 static void draw_spinner(SDL_Surface *surface, const struct rect *rect,
                          struct player *pl)
 {
-    int x, y, r, c, rangle, pangle;
+    int rangle;
     double elapsed, remain, rps;
-    Uint8 *rp, *p;
-    SDL_Color col;
-
-    x = rect->x;
-    y = rect->y;
+    SDL_Surface *sprite;
+    SDL_Rect dst;
 
     elapsed = player_get_elapsed(pl);
     remain = player_get_remain(pl);
 
     rps = timecoder_revs_per_sec(pl->timecoder);
-    rangle = (int)(player_get_position(pl) * 1024 * rps) % 1024;
+    rangle = ((int)(player_get_position(pl) * 1024 * rps) % 1024
+              + 1024) % 1024;
 
     if (elapsed < 0 || remain < 0)
-        col = alert_col;
+        sprite = spinner_sprite[1][rangle * SPINNER_STEPS / 1024];
     else
-        col = ok_col;
-
-    for (r = 0; r < spinner_size; r++) {
-
-        /* Store a pointer to this row of the framebuffer */
-
-        rp = surface->pixels + (y + r) * surface->pitch;
+        sprite = spinner_sprite[0][rangle * SPINNER_STEPS / 1024];
 
-        for (c = 0; c < spinner_size; c++) {
-
-            /* Use the lookup table to provide the angle at each
-             * pixel */
-
-            pangle = spinner_angle[r * spinner_size + c];
+    dst.x = rect->x;
+    dst.y = rect->y;
 
-            /* Calculate the final pixel location and set it */
-
-            p = rp + (x + c) * surface->format->BytesPerPixel;
-
-            if ((rangle - pangle + 1024) % 1024 < 512) {
-                p[0] = col.b >> 2;
-                p[1] = col.g >> 2;
-                p[2] = col.r >> 2;
-            } else {
-                p[0] = col.b;
-                p[1] = col.g;
-                p[2] = col.r;
-            }
-        }
-    }
+    SDL_BlitSurface(sprite, NULL, surface, &dst);
 }
 
 /*
@@ -836,7 +1064,7 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
                           struct track *tr, int position)
 {
     int x, y, w, h, r, c, sp, fade, bytes_per_pixel, pitch, height,
-        current_position;
+        current_position, level;
     Uint8 *pixels, *p;
     SDL_Color col;
 
@@ -854,6 +1082,16 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
     else
         current_position = 0;
 
+    /* Read from the mip level whose span is nearest the samples
+     * covered by one column, so no peak goes unseen */
+
+    level = 0;
+    while (w > 0 && level < TRACK_OV_MIPS
+           && (int)(TRACK_OVERVIEW_RES << level) < (int)(tr->length / w))
+    {
+        level++;
+    }
+
     for (c = 0; c < w; c++) {
 
         /* Collect the correct meter value for this column */
@@ -861,7 +1099,7 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
         sp = (long long)tr->length * c / w;
 
         if (sp < tr->length) /* account for rounding */
-            height = track_get_overview(tr, sp) * h / 256;
+            height = track_get_overview_level(tr, sp, level) * h / 256;
         else
             height = 0;
 
@@ -917,7 +1155,7 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
 static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
                          struct track *tr, int position, int scale)
 {
-    int x, y, w, h, c;
+    int x, y, w, h, c, level;
     size_t bytes_per_pixel, pitch;
     Uint8 *pixels;
 
@@ -930,6 +1168,16 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
     bytes_per_pixel = surface->format->BytesPerPixel;
     pitch = surface->pitch;
 
+    /* Columns are aligned to 2^scale samples; the matching mip
+     * level gives the peak of that exact span in one read */
+
+    level = 0;
+    while (level < TRACK_PPM_MIPS
+           && (TRACK_PPM_RES << level) < (1 << scale))
+    {
+        level++;
+    }
+
     /* Draw in columns. This may seem like a performance hit,
      * but oprofile shows it makes no difference */
 
@@ -944,7 +1192,7 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
             + ((c - w / 2) << scale);
 
         if (sp < tr->length && sp > 0)
-            height = track_get_ppm(tr, sp) * h / 256;
+            height = track_get_ppm_level(tr, sp, level) * h / 256;
         else
             height = 0;
 
@@ -1108,22 +1356,89 @@ static void draw_deck(SDL_Surface *surface, const struct rect *rect,
     draw_meters(surface, &meters, t, position, meter_scale);
 }
 
+/*
+ * Damage tracking: the state of each deck as it was last drawn, so
+ * that the steady-state frame repaints only the decks which moved
+ */
+
+struct drawn_deck {
+    const struct record *record;
+    int position;
+    double pitch;
+    size_t length;
+    bool importing;
+};
+
+static struct drawn_deck drawn[MAX_DECKS];
+
+/*
+ * Return: true if the deck looks different to when it was last
+ * drawn, otherwise false
+ */
+
+static bool deck_is_dirty(const struct deck *d, const struct drawn_deck *w,
+                          int position)
+{
+    const struct player *pl = &d->player;
+    const struct track *t = pl->track;
+
+    /* The scope and spinner follow the raw timecode signal, not
+     * just the position; don't try to second-guess them */
+
+    if (pl->timecode_control)
+        return true;
+
+    return w->record != d->record
+        || w->position != position
+        || w->pitch != pl->pitch
+        || w->length != t->length
+        || w->importing != t->importing;
+}
+
 /*
  * Draw all the decks in the system left to right
+ *
+ * If force is not set, only decks which changed since they were
+ * last drawn are painted. Their rectangles are appended to damage
+ * (which has space for one entry per deck) for the caller to flip.
+ *
+ * Return: the number of entries added to damage
  */
 
-static void draw_decks(SDL_Surface *surface, const struct rect *rect,
-                       struct deck deck[], size_t ndecks, int meter_scale)
+static size_t draw_decks(SDL_Surface *surface, const struct rect *rect,
+                         struct deck deck[], size_t ndecks, int meter_scale,
+                         bool force, struct rect damage[])
 {
     int d;
+    size_t n;
     struct rect left, right;
 
     right = *rect;
+    n = 0;
 
     for (d = 0; d < ndecks; d++) {
+        struct player *pl;
+        int position;
+
         split(right, columns(d, ndecks, BORDER), &left, &right);
+
+        pl = &deck[d].player;
+        position = player_get_elapsed(pl) * pl->track->rate;
+
+        if (!force && !deck_is_dirty(&deck[d], &drawn[d], position))
+            continue;
+
         draw_deck(surface, &left, &deck[d], meter_scale);
+        damage[n++] = left;
+
+        drawn[d].record = deck[d].record;
+        drawn[d].position = position;
+        drawn[d].pitch = pl->pitch;
+        drawn[d].length = pl->track->length;
+        drawn[d].importing = pl->track->importing;
     }
+
+    return n;
 }
 
 /*
@@ -1148,6 +1463,55 @@ static void draw_status(SDL_Surface *sf, const struct rect *rect)
     draw_text_in_locale(sf, rect, status(), detail_font, fg, bg);
 }
 
+/*
+ * Draw the performance HUD: a summary of where frame and audio-path
+ * time goes, and a histogram of the frame times to-date
+ */
+
+static void draw_hud(SDL_Surface *surface, const struct rect *rect)
+{
+    char buf[256];
+    unsigned int n, max;
+    struct rect rtext, remain;
+
+    split(*rect, from_right(PERF_BUCKETS * 3, SPACER), &rtext, &remain);
+
+    sprintf(buf, "frame %.1fms (avg %.1f, worst %.1f)  "
+            "decks %.1f  library %.1f  |  "
+            "audio %.1fms (worst %.1f)  xruns %u",
+            perf_frame.last / 1000.0,
+            perf_average(&perf_frame) / 1000.0,
+            perf_frame.worst / 1000.0,
+            perf_average(&perf_decks) / 1000.0,
+            perf_average(&perf_library) / 1000.0,
+            perf_audio.last / 1000.0,
+            perf_audio.worst / 1000.0,
+            perf_xruns);
+
+    draw_text(surface, &rtext, buf, detail_font, detail_col, background_col);
+
+    /* Frame time histogram; one power-of-two bucket per column */
+
+    max = 1;
+    for (n = 0; n < PERF_BUCKETS; n++) {
+        if (perf_frame.bucket[n] > max)
+            max = perf_frame.bucket[n];
+    }
+
+    for (n = 0; n < PERF_BUCKETS; n++) {
+        struct rect bar, col;
+        pix_t h;
+
+        split(remain, columns(n, PERF_BUCKETS, 1), &col, &remain);
+
+        h = col.h * perf_frame.bucket[n] / max;
+        split(col, pixels(from_bottom(h, 0)), &col, &bar);
+
+        draw_rect(surface, &col, background_col);
+        draw_rect(surface, &bar, ok_col);
+    }
+}
+
 /*
  * Draw the search field which the user types into
  */
@@ -1264,6 +1628,64 @@ static void draw_listbox(const struct listbox *lb, SDL_Surface *surface,
     draw_rect(surface, &remain, background_col);
 }
 
+/*
+ * Draw a single row of a listbox
+ *
+ * Repeat the split sequence used by draw_listbox, so that the row
+ * lands at exactly the same position on screen.
+ *
+ * Pre: rect is the row area of the listbox (scrollbar removed)
+ */
+
+static void draw_listbox_row(const struct listbox *lb, SDL_Surface *surface,
+                             const struct rect rect,
+                             const void *context, draw_row_t draw, int row)
+{
+    int r, entry;
+    struct rect line, remain;
+
+    remain = rect;
+
+    for (r = 0; r <= row; r++)
+        split(remain, from_top(FONT_SPACE, 0), &line, &remain);
+
+    entry = listbox_map(lb, row);
+    if (entry == -1)
+        return;
+
+    draw(context, surface, line, entry, entry == listbox_current(lb));
+}
+
+/*
+ * Move the rows of a listbox up or down within the back buffer
+ *
+ * An overlapping blit of a surface onto itself is undefined in SDL,
+ * so move the pixels directly; the caller holds the surface lock.
+ *
+ * Pre: dy is non-zero, and smaller in magnitude than height
+ */
+
+static void shift_rows(SDL_Surface *surface, const struct rect *rect,
+                       int height, int dy)
+{
+    int y, w;
+    size_t pitch;
+    Uint8 *base;
+
+    pitch = surface->pitch;
+    base = (Uint8*)surface->pixels + rect->y * pitch
+        + rect->x * surface->format->BytesPerPixel;
+    w = rect->w * surface->format->BytesPerPixel;
+
+    if (dy > 0) {
+        for (y = 0; y < height - dy; y++)
+            memcpy(base + y * pitch, base + (y + dy) * pitch, w);
+    } else {
+        for (y = height - 1; y >= -dy; y--)
+            memcpy(base + y * pitch, base + (y + dy) * pitch, w);
+    }
+}
+
 static void draw_crate_row(const void *context,
                            SDL_Surface *surface, const struct rect rect,
                            unsigned int entry, bool selected)
@@ -1359,15 +1781,119 @@ static void draw_record_row(const void *context,
     draw_text_in_locale(surface, &right, record->title, font, text_col, col);
 }
 
+/* What the record listbox currently shows in the back buffer, so
+ * that a scroll of the selection repaints only the rows which
+ * changed, not every visible row */
+
+static struct {
+    SDL_Surface *surface; /* NULL if the content is not valid */
+    struct rect rect;
+    unsigned int version;
+    int entries, lines, offset, selected;
+} shown;
+
 /*
  * Display a record library index, with scrollbar and current
  * selection
+ *
+ * If the same view is already in the back buffer at a nearby scroll
+ * offset, blit the surviving rows into place and draw only the
+ * newly-exposed rows, plus the two rows whose selection highlight
+ * changed. Anything else falls back to a full re-draw.
  */
 
 static void draw_index(SDL_Surface *surface, const struct rect rect,
                          const struct selector *x)
 {
+    const struct listbox *lb = &x->records;
+    struct rect scrollbar, remain, line;
+    int d, n, row_h, current;
+
+    current = listbox_current(lb);
+
+    if (shown.surface == surface && shown.version == x->view_version
+        && shown.entries == lb->entries && shown.lines == lb->lines
+        && memcmp(&shown.rect, &rect, sizeof rect) == 0)
+    {
+        split(rect, from_right(SCROLLBAR_SIZE, SPACER), &remain, &scrollbar);
+        split(remain, from_top(FONT_SPACE, 0), &line, NULL);
+        row_h = line.h;
+
+        d = lb->offset - shown.offset;
+
+        if (d == 0) {
+            if (shown.selected != current) {
+                if (shown.selected >= lb->offset
+                    && shown.selected < lb->offset + lb->lines)
+                {
+                    draw_listbox_row(lb, surface, remain, x->view_index,
+                                     draw_record_row,
+                                     shown.selected - lb->offset);
+                }
+                draw_listbox_row(lb, surface, remain, x->view_index,
+                                 draw_record_row, current - lb->offset);
+                shown.selected = current;
+            }
+            return;
+        }
+
+        /* Scrolling by a partial window; both the old and new view
+         * must be a full window of rows for the blit to be valid */
+
+        if (abs(d) < lb->lines
+            && lb->offset + lb->lines <= lb->entries
+            && shown.offset + lb->lines <= shown.entries)
+        {
+            shift_rows(surface, &remain, lb->lines * row_h, d * row_h);
+
+            if (d > 0) {
+                for (n = lb->lines - d; n < lb->lines; n++) {
+                    draw_listbox_row(lb, surface, remain, x->view_index,
+                                     draw_record_row, n);
+                }
+            } else {
+                for (n = 0; n < -d; n++) {
+                    draw_listbox_row(lb, surface, remain, x->view_index,
+                                     draw_record_row, n);
+                }
+            }
+
+            /* The highlight travels with its row in the blit; only
+             * rows whose selected state changed need re-drawing */
+
+            if (shown.selected != current) {
+                if (shown.selected >= lb->offset
+                    && shown.selected < lb->offset + lb->lines)
+                {
+                    draw_listbox_row(lb, surface, remain, x->view_index,
+                                     draw_record_row,
+                                     shown.selected - lb->offset);
+                }
+                if (current >= lb->offset
+                    && current < lb->offset + lb->lines)
+                {
+                    draw_listbox_row(lb, surface, remain, x->view_index,
+                                     draw_record_row, current - lb->offset);
+                }
+            }
+
+            draw_scroll_bar(surface, &scrollbar, lb);
+
+            shown.offset = lb->offset;
+            shown.selected = current;
+            return;
+        }
+    }
+
     draw_listbox(&x->records, surface, rect, x->view_index, draw_record_row);
+
+    shown.surface = surface;
+    shown.rect = rect;
+    shown.version = x->view_version;
+    shown.entries = lb->entries;
+    shown.lines = lb->lines;
+    shown.offset = lb->offset;
+    shown.selected = current;
 }
 
 /*
@@ -1528,7 +2054,14 @@ static bool handle_key(SDLKey key, SDLMod mod)
                 break;
 
             case FUNC_RECUE:
-                deck_recue(de);
+                if (mod & KMOD_CTRL) {
+                    if (player_is_looping(pl))
+                        deck_unloop(de);
+                    else
+                        deck_loop(de, 4.0);
+                } else {
+                    deck_recue(de);
+                }
                 break;
 
             case FUNC_TIMECODE:
@@ -1541,6 +2074,10 @@ static bool handle_key(SDLKey key, SDLMod mod)
                     (void)player_toggle_timecode_control(pl);
                 }
                 break;
+
+            case FUNC_KEYLOCK:
+                (void)player_toggle_key_lock(pl);
+                break;
             }
         }
     }
@@ -1550,23 +2087,70 @@ static bool handle_key(SDLKey key, SDLMod mod)
 
 /*
  * Action on size change event on the main window
+ *
+ * The widgets are rastered in software into a back buffer, and
+ * composited onto the display (which may be a hardware surface)
+ * with blits of only the damaged areas; see flip()
+ *
+ * Post: on success, *screen is the display surface
+ * Return: the back buffer all drawing goes to, or NULL on error
  */
 
-static SDL_Surface* set_size(int w, int h, struct rect *r)
+static SDL_Surface* set_size(int w, int h, struct rect *r,
+                             SDL_Surface **screen)
 {
-    SDL_Surface *surface;
+    SDL_Surface *display, *back;
 
-    surface = SDL_SetVideoMode(w, h, 32, video_flags);
-    if (surface == NULL) {
+    display = SDL_SetVideoMode(w, h, 0, video_flags);
+    if (display == NULL) {
         fprintf(stderr, "%s\n", SDL_GetError());
         return NULL;
     }
 
+    /* Fixed 32bpp BGRX layout; the column renderers write bytes
+     * directly. The blit onto the display converts if it must */
+
+    back = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32,
+                                0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+    if (back == NULL) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return NULL;
+    }
+
+    *screen = display;
     *r = shrink(rect(0, 0, w, h, scale), BORDER);
 
     fprintf(stderr, "New interface size is %dx%d.\n", w, h);
 
-    return surface;
+    return back;
+}
+
+/*
+ * Composite the damaged areas of the back buffer onto the display,
+ * and push them to the screen in a single call
+ */
+
+static void flip(SDL_Surface *screen, SDL_Surface *back,
+                 const struct rect damage[], size_t n)
+{
+    SDL_Rect r[MAX_DECKS + 2];
+    size_t i;
+
+    assert(n <= sizeof(r) / sizeof(*r));
+
+    for (i = 0; i < n; i++) {
+        SDL_Rect src;
+
+        src.x = damage[i].x;
+        src.y = damage[i].y;
+        src.w = damage[i].w;
+        src.h = damage[i].h;
+        r[i] = src; /* blit clips its destination in-place */
+
+        SDL_BlitSurface(back, &src, screen, &r[i]);
+    }
+
+    SDL_UpdateRects(screen, n, r);
 }
 
 static void push_event(int t)
@@ -1610,25 +2194,30 @@ static void defer_selector_redraw(struct observer *o, void *x)
 
 static int interface_main(void)
 {
-    bool library_update, decks_update, status_update;
+    bool library_update, decks_update, decks_tick, status_update, frame;
+    size_t ndamage;
 
     SDL_Event event;
     SDL_TimerID timer;
-    SDL_Surface *surface;
+    SDL_Surface *surface, *screen;
 
-    struct rect rworkspace, rplayers, rlibrary, rstatus, rtmp;
+    struct rect rworkspace, rplayers, rlibrary, rhud, rtmp;
+    struct rect damage[MAX_DECKS + 2];
+    unsigned int t, t0;
 
-    surface = set_size(width, height, &rworkspace);
+    surface = set_size(width, height, &rworkspace, &screen);
     if (!surface)
         return -1;
 
     decks_update = true;
+    decks_tick = false;
     status_update = true;
     library_update = true;
+    ndamage = 0;
 
-    /* The final action is to add the timer which triggers refresh */
+    /* The final action is to add the timer which paces the frames */
 
-    timer = SDL_AddTimer(REFRESH, ticker, NULL);
+    timer = SDL_AddTimer(FRAME, ticker, NULL);
 
     rig_lock();
 
@@ -1641,52 +2230,103 @@ static int interface_main(void)
 
         rig_lock();
 
-        switch(event.type) {
-        case SDL_QUIT: /* user request to quit application; eg. window close */
-            if (rig_quit() == -1)
-                return -1;
-            break;
+        /* Deliver deferred events before anything reads selector
+         * or status state; the frame timer bounds the latency */
 
-        case SDL_VIDEORESIZE:
-            surface = set_size(event.resize.w, event.resize.h, &rworkspace);
-            if (!surface)
-                return -1;
+        event_queue_drain(&deferred);
 
-            library_update = true;
-            decks_update = true;
-            status_update = true;
+        frame = false;
 
-            break;
+        /* Drain the whole event queue before considering a redraw.
+         * Events only mark state as dirty; a burst of them (eg. key
+         * repeat, or a scan delivering records) is handled ahead of
+         * any rendering and coalesces into a single frame */
 
-        case EVENT_TICKER:
-            decks_update = true;
-            break;
+        for (;;) {
 
-        case EVENT_QUIT: /* internal request to finish this thread */
-            goto finish;
+            switch(event.type) {
+            case SDL_QUIT: /* user request to quit application; eg. window close */
+                if (rig_quit() == -1)
+                    return -1;
+                break;
 
-        case EVENT_STATUS:
-            status_update = true;
-            break;
+            case SDL_VIDEORESIZE:
+                SDL_FreeSurface(surface);
+                shown.surface = NULL; /* the new back buffer is blank */
+                surface = set_size(event.resize.w, event.resize.h, &rworkspace,
+                                   &screen);
+                if (!surface)
+                    return -1;
 
-        case EVENT_SELECTOR:
-            library_update = true;
-            break;
+                library_update = true;
+                decks_update = true;
+                status_update = true;
 
-        case SDL_KEYDOWN:
-            if (handle_key(event.key.keysym.sym, event.key.keysym.mod))
-            {
-                struct record *r;
+                break;
 
-                r = selector_current(&selector);
-                if (r != NULL) {
-                    status_set(STATUS_VERBOSE, r->pathname);
-                } else {
-                    status_set(STATUS_VERBOSE, "No search results found");
+            case EVENT_TICKER:
+                decks_tick = true;
+                frame = true;
+                break;
+
+            case EVENT_QUIT: /* internal request to finish this thread */
+                goto finish;
+
+            case EVENT_STATUS:
+                status_update = true;
+                break;
+
+            case EVENT_SELECTOR:
+                library_update = true;
+                break;
+
+            case SDL_KEYDOWN:
+                if (event.key.keysym.sym == SDLK_BACKQUOTE) {
+                    /* Toggle the performance HUD; it takes the
+                     * place of the status line, so re-layout */
+
+                    hud = !hud;
+                    library_update = true;
+                    decks_update = true;
+                    break;
                 }
-            }
 
-        } /* switch(event.type) */
+                if (handle_key(event.key.keysym.sym, event.key.keysym.mod))
+                {
+                    struct record *r;
+
+                    r = selector_current(&selector);
+                    if (r != NULL) {
+                        status_set(STATUS_VERBOSE, r->pathname);
+                    } else {
+                        status_set(STATUS_VERBOSE, "No search results found");
+                    }
+                }
+
+            } /* switch(event.type) */
+
+            if (!SDL_PollEvent(&event))
+                break;
+
+        } /* event drain */
+
+        /* Wait for the frame timer before drawing anything; the
+         * dirty state accumulates until then */
+
+        if (!frame)
+            continue;
+
+        /* A dump of the audio-path trace was requested by signal */
+
+        if (perf_dump_pending) {
+            size_t d;
+
+            perf_dump_pending = 0;
+            perf_dump(stderr);
+
+            for (d = 0; d < ndeck; d++)
+                deck_dump(stderr, d, &deck[d]);
+        }
 
         /* Split the display into the various areas. If an area is too
          * small, abandon any actions to happen in that area. */
@@ -1698,45 +2338,77 @@ static int interface_main(void)
         }*/
         rtmp = rworkspace;
 
+        if (hud)
+            split(rtmp, from_bottom(STATUS_HEIGHT, SPACER), &rtmp, &rhud);
+
         split(rtmp, from_top(PLAYER_HEIGHT, SPACER), &rplayers, &rlibrary);
         if (rlibrary.h < LIBRARY_MIN_HEIGHT || rlibrary.w < LIBRARY_MIN_WIDTH) {
             rplayers = rtmp;
             library_update = false;
         }
 
-        if (rplayers.h < 0 || rplayers.w < 0)
+        if (rplayers.h < 0 || rplayers.w < 0) {
             decks_update = false;
+            decks_tick = false;
+        }
 
-        if (!library_update && !decks_update && !status_update)
+        if (!library_update && !decks_update && !decks_tick
+            && !status_update)
             continue;
 
+        t0 = perf_time();
+
         LOCK(surface);
 
-        if (library_update)
+        if (library_update) {
+            t = perf_time();
             draw_library(surface, &rlibrary, &selector);
+            perf_sample(&perf_library, perf_time() - t);
+        }
 
         /*if (status_update)
             draw_status(surface, &rstatus);*/
 
-        if (decks_update)
-            draw_decks(surface, &rplayers, deck, ndeck, meter_scale);
+        if (decks_update || decks_tick) {
+            t = perf_time();
+            ndamage = draw_decks(surface, &rplayers, deck, ndeck,
+                                 meter_scale, decks_update, damage);
+            perf_sample(&perf_decks, perf_time() - t);
+        }
+
+        if (hud)
+            draw_hud(surface, &rhud);
 
         UNLOCK(surface);
 
+        /* Composite only the damaged areas onto the display; a
+         * full deck redraw (eg. resize) is one whole-area blit */
+
+        if (decks_update) {
+            ndamage = 0;
+            damage[ndamage++] = rplayers;
+        }
+
         if (library_update) {
-            UPDATE(surface, &rlibrary);
+            damage[ndamage++] = rlibrary;
             library_update = false;
         }
 
-        if (status_update) {
-            UPDATE(surface, &rstatus);
-            status_update = false;
-        }
+        /* The status bar is not currently drawn (see above), so a
+         * status change composites nothing */
 
-        if (decks_update) {
-            UPDATE(surface, &rplayers);
-            decks_update = false;
-        }
+        status_update = false;
+
+        if (hud)
+            damage[ndamage++] = rhud;
+
+        flip(screen, surface, damage, ndamage);
+
+        perf_sample(&perf_frame, perf_time() - t0);
+
+        decks_update = false;
+        decks_tick = false;
+        ndamage = 0;
 
     } /* main loop */
 
@@ -1859,13 +2531,19 @@ int interface_start(struct library *lib, const char *geo, bool decor)
     if (init_spinner(zoom(SPINNER_SIZE)) == -1)
         return -1;
 
-    selector_init(&selector, lib);
-    watch(&on_status, &status_changed, defer_status_redraw);
-    watch(&on_selector, &selector.changed, defer_selector_redraw);
+    selector_init(&selector, lib, &deferred);
+    watch_deferred(&on_status, &status_changed, defer_status_redraw,
+                   &deferred);
+    watch_deferred(&on_selector, &selector.changed, defer_selector_redraw,
+                   &deferred);
+    watch_deferred(&on_analysis, &analysis_done, defer_selector_redraw,
+                   &deferred);
     status_set(STATUS_VERBOSE, banner);
 
     fprintf(stderr, "Initialising SDL...\n");
 
+    perf_phase("video");
+
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) == -1) {
         fprintf(stderr, "%s\n", SDL_GetError());
         return -1;
@@ -1880,8 +2558,10 @@ int interface_start(struct library *lib, const char *geo, bool decor)
         return -1;
     }
 
+    perf_phase("fonts"); /* scans the font path list */
     if (load_fonts() == -1)
         return -1;
+    perf_phase("interface");
 
     utf = iconv_open("UTF8", "");
     if (utf == (iconv_t)-1) {
@@ -1915,9 +2595,15 @@ void interface_stop(void)
     for (n = 0; n < ndeck; n++)
         timecoder_monitor_clear(&deck[n].timecoder);
 
+    for (n = 0; n < MAX_DECKS; n++) {
+        if (scope[n].tc != NULL)
+            SDL_FreeSurface(scope[n].surface);
+    }
+
     clear_spinner();
     ignore(&on_status);
     ignore(&on_selector);
+    ignore(&on_analysis);
     selector_clear(&selector);
     clear_fonts();
 
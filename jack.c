@@ -25,6 +25,7 @@
 
 #include "device.h"
 #include "jack.h"
+#include "perf.h"
 
 #define MAX_BLOCK 512 /* samples */
 #define SCALE 32768
@@ -41,35 +42,70 @@ static unsigned rate,
     nstarted = 0;
 static struct device *device[4];
 
-/* Interleave samples from a set of JACK buffers into a local buffer */
+/* Interleave samples from a set of JACK buffers into a local buffer
+ *
+ * This runs on the JACK realtime thread, once per channel of every
+ * deck. The loop is one channel at a time over plain arrays, with no
+ * pointer chasing per sample, so the compiler can vectorise it.
+ * Values beyond full scale are clamped, not wrapped.
+ *
+ * Post: each jbuf[] pointer is advanced past the samples read
+ */
 
 static void interleave(signed short *buf, jack_default_audio_sample_t *jbuf[],
                        jack_nframes_t nframes)
 {
-    while (nframes--) {
-        int n;
+    int n;
+
+    for (n = 0; n < DEVICE_CHANNELS; n++) {
+        jack_nframes_t i;
+        const jack_default_audio_sample_t *in;
+        signed short *out;
+
+        in = jbuf[n];
+        out = buf + n;
+
+        for (i = 0; i < nframes; i++) {
+            float v;
 
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *buf = (signed short)(*jbuf[n] * SCALE);
-            buf++;
-            jbuf[n]++;
+            v = in[i] * SCALE;
+
+            if (v > SCALE - 1)
+                v = SCALE - 1;
+            if (v < -SCALE)
+                v = -SCALE;
+
+            out[i * DEVICE_CHANNELS] = v;
         }
+
+        jbuf[n] += nframes;
     }
 }
 
-/* Uninterleave samples from a local buffer into a set of JACK buffers */
+/* Uninterleave samples from a local buffer into a set of JACK buffers
+ *
+ * Written for vectorisation, in the same way as interleave()
+ *
+ * Post: each jbuf[] pointer is advanced past the samples written
+ */
 
 static void uninterleave(jack_default_audio_sample_t *jbuf[],
                          signed short *buf, jack_nframes_t nframes)
 {
-    while (nframes--) {
-        int n;
+    int n;
 
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *jbuf[n] = (jack_default_audio_sample_t)*buf / SCALE;
-            buf++;
-            jbuf[n]++;
-        }
+    for (n = 0; n < DEVICE_CHANNELS; n++) {
+        jack_nframes_t i;
+        const signed short *in;
+        jack_default_audio_sample_t *out;
+
+        in = buf + n;
+        out = jbuf[n];
+
+        for (i = 0; i < nframes; i++)
+            out[i] = in[i * DEVICE_CHANNELS] * (1.0f / SCALE);
+
+        jbuf[n] += nframes;
     }
 }
 
@@ -127,6 +163,9 @@ static void process_deck(struct device *dv, jack_nframes_t nframes)
 static int process_callback(jack_nframes_t nframes, void *local)
 {
     size_t n;
+    unsigned int t;
+
+    t = perf_time();
 
     for (n = 0; n < ndeck; n++) {
         struct jack *jack;
@@ -136,6 +175,16 @@ static int process_callback(jack_nframes_t nframes, void *local)
             process_deck(device[n], nframes);
     }
 
+    perf_sample(&perf_audio, perf_time() - t);
+
+    return 0;
+}
+
+/* Xrun callback, from the JACK server */
+
+static int xrun_callback(void *local)
+{
+    perf_xrun();
     return 0;
 }
 
@@ -167,6 +216,11 @@ static int start_jack_client(void)
         return -1;
     }
 
+    if (jack_set_xrun_callback(client, xrun_callback, NULL) != 0) {
+        fprintf(stderr, "JACK: Failed to set xrun callback\n");
+        return -1;
+    }
+
     jack_on_shutdown(client, shutdown_callback, NULL);
 
     rate = jack_get_sample_rate(client);
@@ -19,14 +19,20 @@
 
 #define _GNU_SOURCE /* strdupa() */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <iconv.h>
 #include <libgen.h> /*  basename() */
 #include <math.h> /* isfinite() */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "excrate.h"
 #include "external.h"
@@ -39,6 +45,697 @@
 
 static iconv_t ascii = (iconv_t)-1;
 
+/*
+ * Records are carved out of an arena, rather than malloc'd one by
+ * one; a large library is tens of thousands of records, and keeping
+ * them adjacent makes the sequential sweep in index_match() friendly
+ * to the prefetcher. Arena memory is never returned individually,
+ * only all at once on exit; the sole exception is rolling back the
+ * most recent record when it turns out to be a duplicate.
+ */
+
+#define ARENA_CHUNK (256 * 1024) /* bytes */
+#define ARENA_ALIGN sizeof(double)
+
+struct chunk {
+    struct chunk *next;
+    size_t used, size;
+    char mem[];
+};
+
+static struct chunk *arena = NULL;
+static void *last_alloc = NULL;
+static size_t last_len = 0;
+
+/* Artist and title strings repeat heavily across a library, so they
+ * are interned: a hash table of unique strings, stored in the arena */
+
+static char **intern_tab = NULL;
+static size_t intern_size = 0, intern_entries = 0;
+
+/*
+ * A compiled library file is a cache of the parsed scan output: the
+ * record structs (in SORT_ARTIST order, with string pointers held as
+ * file offsets), the other sort orders as permutations, and a string
+ * blob. On startup it is mmap'd private, the offsets are fixed up
+ * in-place, and the crate is browsable without running the scan.
+ *
+ * The format is native-endian and tied to the struct layout, like
+ * the PCM cache; a mismatch is simply a cache miss.
+ */
+
+#define LIB_CACHE_MAGIC "xwlb"
+#define LIB_CACHE_VERSION 2 /* v2: the match string became mandatory */
+
+struct lib_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t records,
+        reclen; /* sizeof(struct record) when written */
+    uint64_t len; /* of the whole file */
+};
+
+static const char *lib_cache_dir = NULL; /* or NULL if disabled */
+
+/* Mappings of cache files, in use by records until exit */
+
+struct lib_map {
+    struct lib_map *next;
+    void *base;
+    size_t len;
+};
+
+static struct lib_map *lib_maps = NULL;
+
+void library_set_cache_dir(const char *dir)
+{
+    lib_cache_dir = dir;
+}
+
+/*
+ * Filename of a cache entry for the given scan and path
+ *
+ * The extension separates the compiled library ("lib") from the
+ * directory timestamps ("dirs") of the same crate.
+ */
+
+static void lib_cache_name(char *buf, size_t len,
+                           const char *scan, const char *path,
+                           const char *ext)
+{
+    uint64_t h;
+    size_t n;
+
+    h = 0xcbf29ce484222325; /* FNV-1a */
+    for (n = 0; scan[n] != '\0'; n++)
+        h = (h ^ (unsigned char)scan[n]) * 0x100000001b3;
+    h = (h ^ '\0') * 0x100000001b3;
+    for (n = 0; path[n] != '\0'; n++)
+        h = (h ^ (unsigned char)path[n]) * 0x100000001b3;
+
+    snprintf(buf, len, "%s/%016llx.%s", lib_cache_dir,
+             (long long unsigned)h, ext);
+}
+
+static int write_whole(int fd, const void *buf, size_t len)
+{
+    size_t done;
+
+    for (done = 0; done < len; ) {
+        ssize_t z;
+
+        z = write(fd, (const char*)buf + done, len - done);
+        if (z == -1) {
+            perror("write");
+            return -1;
+        }
+        done += z;
+    }
+
+    return 0;
+}
+
+/*
+ * Serialize the given listing to the cache, to be picked up by the
+ * next session; best-effort, a failure costs only a re-scan
+ */
+
+static void save_library(struct listing *l, const char *scan,
+                         const char *path)
+{
+    struct lib_cache_header h;
+    struct record *recs;
+    uint32_t *bpm_order, *playlist_order, n, i;
+    const char **mkey;
+    uint64_t *mval, base_off, blob_used, blob_size;
+    char *blob, name[512], tmp[520];
+    size_t msize;
+    int fd;
+
+    if (lib_cache_dir == NULL)
+        return;
+
+    n = l->by_artist.entries;
+    if (n == 0)
+        return;
+
+    /* String offsets are relative to the start of the file, so that
+     * zero can stand in for NULL */
+
+    base_off = sizeof h + n * sizeof *recs + 2 * n * sizeof(uint32_t);
+
+    recs = malloc(n * sizeof *recs);
+    bpm_order = malloc(n * sizeof *bpm_order);
+    playlist_order = malloc(n * sizeof *playlist_order);
+
+    /* Memo of strings already in the blob, keyed on the pointer;
+     * interned strings are shared and so mostly hit */
+
+    msize = 64;
+    while (msize < (size_t)n * 8)
+        msize *= 2;
+    mkey = calloc(msize, sizeof *mkey);
+    mval = malloc(msize * sizeof *mval);
+
+    blob = NULL;
+    blob_used = 0;
+    blob_size = 0;
+
+    if (recs == NULL || bpm_order == NULL || playlist_order == NULL
+        || mkey == NULL || mval == NULL)
+    {
+        perror("malloc");
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct record *r;
+        char **field[4];
+        unsigned int f;
+
+        r = l->by_artist.record[i];
+        recs[i] = *r;
+
+        field[0] = &recs[i].pathname;
+        field[1] = &recs[i].artist;
+        field[2] = &recs[i].title;
+        field[3] = &recs[i].match;
+
+        for (f = 0; f < 4; f++) {
+            const char *s;
+            uint64_t hash, off;
+            size_t len;
+
+            s = *field[f]; /* all four strings are mandatory */
+
+            hash = ((uint64_t)(uintptr_t)s >> 4) % msize;
+            while (mkey[hash] != NULL && mkey[hash] != s)
+                hash = (hash + 1) % msize;
+
+            if (mkey[hash] == s) {
+                off = mval[hash];
+            } else {
+                len = strlen(s) + 1;
+
+                if (blob_used + len > blob_size) {
+                    char *b;
+
+                    blob_size = (blob_size == 0) ? 16384 : blob_size * 2;
+                    if (blob_size < blob_used + len)
+                        blob_size = blob_used + len;
+
+                    b = realloc(blob, blob_size);
+                    if (b == NULL) {
+                        perror("realloc");
+                        goto out;
+                    }
+                    blob = b;
+                }
+
+                memcpy(blob + blob_used, s, len);
+                off = base_off + blob_used;
+                blob_used += len;
+
+                mkey[hash] = s;
+                mval[hash] = off;
+            }
+
+            *field[f] = (char*)(uintptr_t)off;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        bpm_order[i] = index_find(&l->by_artist, l->by_bpm.record[i],
+                                  SORT_ARTIST);
+        playlist_order[i] = index_find(&l->by_artist,
+                                       l->by_order.record[i],
+                                       SORT_ARTIST);
+    }
+
+    memcpy(h.magic, LIB_CACHE_MAGIC, 4);
+    h.version = LIB_CACHE_VERSION;
+    h.records = n;
+    h.reclen = sizeof(struct record);
+    h.len = base_off + blob_used;
+
+    lib_cache_name(name, sizeof name, scan, path, "lib");
+    snprintf(tmp, sizeof tmp, "%s.tmp", name);
+
+    fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd == -1) {
+        perror(tmp);
+        goto out;
+    }
+
+    if (write_whole(fd, &h, sizeof h) == -1
+        || write_whole(fd, recs, n * sizeof *recs) == -1
+        || write_whole(fd, bpm_order, n * sizeof(uint32_t)) == -1
+        || write_whole(fd, playlist_order, n * sizeof(uint32_t)) == -1
+        || write_whole(fd, blob, blob_used) == -1)
+    {
+        if (close(fd) == -1)
+            abort();
+        goto out;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    if (rename(tmp, name) == -1) {
+        perror("rename");
+        goto out;
+    }
+
+    fprintf(stderr, "Compiled %u records to library cache\n", n);
+
+out:
+    free(blob);
+    free(mval);
+    free((void*)mkey);
+    free(playlist_order);
+    free(bpm_order);
+    free(recs);
+}
+
+static int qcmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Record the mtime of every directory the listing draws on
+ *
+ * A directory's mtime changes when entries are added or removed in
+ * it, so these timestamps are enough to tell which parts of the tree
+ * a later rescan actually needs to walk. Written alongside the
+ * compiled library; best-effort, like it.
+ */
+
+static void save_dirs(struct listing *l, const char *scan,
+                      const char *path)
+{
+    struct stat st;
+    char **dirs, *last, name[512], tmp[520];
+    size_t size, ndirs, plen, n;
+    FILE *f;
+
+    if (lib_cache_dir == NULL)
+        return;
+
+    /* The path may be a playlist file rather than a directory
+     * tree; mtime walks do not apply there */
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return;
+
+    size = 64;
+    dirs = malloc(size * sizeof *dirs);
+    if (dirs == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    ndirs = 0;
+    last = NULL;
+    plen = strlen(path);
+
+    dirs[ndirs] = strdup(path);
+    if (dirs[ndirs] == NULL)
+        goto out;
+    ndirs++;
+
+    /* Each record contributes its directory and every ancestor up
+     * to the scan root. Scan output groups files by directory, so
+     * comparing against the previous one skips most records */
+
+    for (n = 0; n < l->by_order.entries; n++) {
+        const char *p;
+        char *s, *x;
+
+        p = l->by_order.record[n]->pathname;
+
+        x = strrchr(p, '/');
+        if (x == NULL || (size_t)(x - p) <= plen)
+            continue;
+
+        s = strndup(p, x - p);
+        if (s == NULL)
+            goto out;
+
+        if (last != NULL && strcmp(s, last) == 0) {
+            free(s);
+            continue;
+        }
+
+        free(last);
+        last = strdup(s);
+        if (last == NULL) {
+            free(s);
+            goto out;
+        }
+
+        while (s != NULL && strlen(s) > plen) {
+            if (ndirs == size) {
+                char **d;
+
+                size *= 2;
+                d = realloc(dirs, size * sizeof *dirs);
+                if (d == NULL) {
+                    perror("realloc");
+                    free(s);
+                    goto out;
+                }
+                dirs = d;
+            }
+
+            dirs[ndirs++] = s;
+
+            x = strrchr(s, '/');
+            if (x == NULL)
+                break;
+            s = strndup(s, x - s); /* parent; NULL ends the walk */
+        }
+
+        if (s != NULL && strlen(s) <= plen)
+            free(s);
+    }
+
+    qsort(dirs, ndirs, sizeof *dirs, qcmp_str);
+
+    lib_cache_name(name, sizeof name, scan, path, "dirs");
+    snprintf(tmp, sizeof tmp, "%s.tmp", name);
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        goto out;
+    }
+
+    fprintf(f, "xwdirs\t1\n");
+
+    for (n = 0; n < ndirs; n++) {
+        if (n > 0 && strcmp(dirs[n], dirs[n - 1]) == 0)
+            continue;
+        if (stat(dirs[n], &st) == -1)
+            continue;
+
+        fprintf(f, "%lld.%09ld\t%s\n", (long long)st.st_mtim.tv_sec,
+                st.st_mtim.tv_nsec, dirs[n]);
+    }
+
+    if (fclose(f) == EOF) {
+        perror("fclose");
+        goto out;
+    }
+
+    if (rename(tmp, name) == -1)
+        perror("rename");
+
+out:
+    for (n = 0; n < ndirs; n++)
+        free(dirs[n]);
+    free(dirs);
+    free(last);
+}
+
+/*
+ * Load a compiled library for the given scan and path
+ *
+ * The records become part of the given library's storage, and the
+ * returned listing carries the pre-sorted orderings.
+ *
+ * Return: a listing with responsibility, or NULL if there is no
+ * usable cache entry
+ */
+
+static struct listing* load_library(struct library *lib, const char *scan,
+                                    const char *path)
+{
+    struct lib_cache_header *h;
+    struct lib_map *m;
+    struct listing *l;
+    struct record *recs, **use;
+    struct stat st;
+    uint32_t n, i, *bpm_order, *playlist_order;
+    char name[512];
+    void *base;
+    int fd;
+
+    if (lib_cache_dir == NULL)
+        return NULL;
+
+    lib_cache_name(name, sizeof name, scan, path, "lib");
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return NULL; /* simply not cached */
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto fail_fd;
+    }
+
+    if (st.st_size < sizeof *h)
+        goto fail_fd;
+
+    /* Private mapping: the string offsets are fixed up to pointers
+     * in our copy of the pages */
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        goto fail_fd;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    h = base;
+
+    if (memcmp(h->magic, LIB_CACHE_MAGIC, 4) != 0
+        || h->version != LIB_CACHE_VERSION
+        || h->reclen != sizeof(struct record)
+        || h->len != (uint64_t)st.st_size)
+    {
+        goto fail_map;
+    }
+
+    n = h->records;
+
+    if (sizeof *h + (uint64_t)n * sizeof(struct record)
+        + 2 * (uint64_t)n * sizeof(uint32_t) > (uint64_t)st.st_size)
+    {
+        goto fail_map;
+    }
+
+    recs = (struct record*)((char*)base + sizeof *h);
+    bpm_order = (uint32_t*)(recs + n);
+    playlist_order = bpm_order + n;
+
+    for (i = 0; i < n; i++) {
+        char **field[] = {
+            &recs[i].pathname,
+            &recs[i].artist,
+            &recs[i].title,
+            &recs[i].match,
+        };
+        unsigned int f;
+
+        for (f = 0; f < 4; f++) {
+            uint64_t off;
+
+            off = (uint64_t)(uintptr_t)*field[f];
+
+            if (off == 0 || off >= (uint64_t)st.st_size)
+                goto fail_map;
+
+            *field[f] = (char*)base + off;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (bpm_order[i] >= n || playlist_order[i] >= n)
+            goto fail_map;
+    }
+
+    l = malloc(sizeof *l);
+    use = malloc(n * sizeof *use);
+    m = malloc(sizeof *m);
+    if (l == NULL || use == NULL || m == NULL) {
+        perror("malloc");
+        free(l);
+        free(use);
+        free(m);
+        goto fail_map;
+    }
+
+    listing_init(l);
+
+    if (index_reserve(&l->by_artist, n) == -1
+        || index_reserve(&l->by_bpm, n) == -1
+        || index_reserve(&l->by_order, n) == -1)
+    {
+        goto fail_listing;
+    }
+
+    /* Past this point the map is retained, even on failure: the
+     * library storage takes pointers into it */
+
+    m->base = base;
+    m->len = st.st_size;
+    m->next = lib_maps;
+    lib_maps = m;
+
+    /* The library storage may already hold some of these records,
+     * from another crate; prefer the existing entry */
+
+    for (i = 0; i < n; i++) {
+        use[i] = listing_add(&lib->storage, &recs[i]);
+        if (use[i] == NULL)
+            goto fail_storage;
+    }
+
+    for (i = 0; i < n; i++) {
+        index_add(&l->by_artist, use[i]); /* stored in artist order */
+        index_add(&l->by_bpm, use[bpm_order[i]]);
+        index_add(&l->by_order, use[playlist_order[i]]);
+    }
+
+    free(use);
+
+    fprintf(stderr, "Loaded %u records from library cache\n", n);
+
+    return l;
+
+fail_storage:
+    free(use);
+    listing_clear(l);
+    free(l);
+    return NULL;
+
+fail_listing:
+    free(use);
+    free(m);
+    listing_clear(l);
+    free(l);
+fail_map:
+    if (munmap(base, st.st_size) == -1)
+        abort();
+    return NULL;
+
+fail_fd:
+    if (close(fd) == -1)
+        abort();
+    return NULL;
+}
+
+/*
+ * Allocate from the arena; the caller cannot free the result
+ *
+ * Return: pointer to zeroed-out memory, or NULL if out of memory
+ */
+
+static void* arena_alloc(size_t len)
+{
+    void *p;
+
+    len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (arena == NULL || arena->used + len > arena->size) {
+        struct chunk *c;
+        size_t size;
+
+        size = (len > ARENA_CHUNK) ? len : ARENA_CHUNK;
+
+        c = malloc(sizeof *c + size);
+        if (c == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+
+        c->used = 0;
+        c->size = size;
+        c->next = arena;
+        arena = c;
+    }
+
+    p = arena->mem + arena->used;
+    arena->used += len;
+
+    last_alloc = p;
+    last_len = len;
+
+    return p;
+}
+
+/*
+ * Return: the interned equivalent of the given string, or NULL if
+ * out of memory
+ */
+
+static char* intern(const char *s)
+{
+    size_t n, h;
+    char *x;
+
+    if (intern_entries * 4 >= intern_size * 3) { /* grow at 75% */
+        char **tab;
+        size_t size, i;
+
+        size = (intern_size == 0) ? 1024 : intern_size * 2;
+
+        tab = calloc(size, sizeof *tab);
+        if (tab == NULL) {
+            perror("calloc");
+            return NULL;
+        }
+
+        for (i = 0; i < intern_size; i++) {
+            char *v;
+
+            v = intern_tab[i];
+            if (v == NULL)
+                continue;
+
+            h = 0xcbf29ce484222325;
+            for (n = 0; v[n] != '\0'; n++)
+                h = (h ^ (unsigned char)v[n]) * 0x100000001b3;
+
+            while (tab[h % size] != NULL)
+                h++;
+            tab[h % size] = v;
+        }
+
+        free(intern_tab);
+        intern_tab = tab;
+        intern_size = size;
+    }
+
+    h = 0xcbf29ce484222325; /* FNV-1a */
+    for (n = 0; s[n] != '\0'; n++)
+        h = (h ^ (unsigned char)s[n]) * 0x100000001b3;
+
+    for (;;) {
+        x = intern_tab[h % intern_size];
+        if (x == NULL)
+            break;
+        if (strcmp(x, s) == 0)
+            return x;
+        h++;
+    }
+
+    x = arena_alloc(n + 1);
+    if (x == NULL)
+        return NULL;
+    memcpy(x, s, n + 1);
+
+    intern_tab[h % intern_size] = x;
+    intern_entries++;
+
+    return x;
+}
+
 int library_global_init(void)
 {
     assert(ascii == (iconv_t)-1);
@@ -58,6 +755,32 @@ void library_global_clear(void)
 
     if (iconv_close(ascii) == -1)
         abort();
+
+    /* All records, everywhere, go away at once */
+
+    while (arena != NULL) {
+        struct chunk *c;
+
+        c = arena;
+        arena = c->next;
+        free(c);
+    }
+
+    free(intern_tab);
+    intern_tab = NULL;
+    intern_size = 0;
+    intern_entries = 0;
+    last_alloc = NULL;
+
+    while (lib_maps != NULL) {
+        struct lib_map *m;
+
+        m = lib_maps;
+        lib_maps = m->next;
+        if (munmap(m->base, m->len) == -1)
+            abort();
+        free(m);
+    }
 }
 
 void listing_init(struct listing *l)
@@ -66,130 +789,934 @@ void listing_init(struct listing *l)
     index_init(&l->by_bpm);
     index_init(&l->by_order);
     event_init(&l->addition);
+    event_init(&l->additions);
+    event_init(&l->refresh);
+    l->grams = NULL;
+    l->version = 0;
+    l->bulk = NULL;
 }
 
+static void gram_free(struct gram_index *g);
+static void bulk_free(struct bulk *b);
+
 void listing_clear(struct listing *l)
 {
     index_clear(&l->by_artist);
     index_clear(&l->by_bpm);
     index_clear(&l->by_order);
     event_clear(&l->addition);
+    event_clear(&l->additions);
+    event_clear(&l->refresh);
+    gram_free(l->grams);
+    bulk_free(l->bulk);
 }
 
 /*
- * Base initialiser for a crate, shared by the other init functions
+ * Inverted n-gram index over a listing
  *
- * Note the deep copy of the crate name
+ * For every record, the strings which record_match() would inspect
+ * are broken into 1, 2 and 3-byte grams (folded at import), each
+ * mapping
+ * to a posting list of records containing it. A search consults the
+ * rarest gram of a query word and runs the real match only on those
+ * candidates, instead of the whole listing.
  *
- * Return: 0 on success or -1 on memory allocation failure
+ * Record ids are positions in by_order; the pos[] tables translate
+ * an id to its position in the other sort orders, so results come
+ * out in the order of whichever index is on display.
  */
 
-static int crate_init(struct crate *c, const char *name)
+struct posting {
+    uint32_t key; /* folded bytes and length, packed */
+    uint32_t *id; /* ascending */
+    uint32_t len, cap;
+};
+
+struct gram_index {
+    unsigned int version; /* of the listing, when built */
+    uint32_t records;
+    uint32_t *pos[SORT_END]; /* indexed by [sort][id]; playlist is NULL */
+    struct posting *tab; /* open addressing on key; len == 0 is empty */
+    size_t tab_size, tab_used;
+};
+
+static void gram_free(struct gram_index *g)
 {
-    c->name = strdup(name);
-    if (c->name == NULL) {
-        perror("strdup");
-        return -1;
+    size_t n;
+
+    if (g == NULL)
+        return;
+
+    for (n = 0; n < g->tab_size; n++)
+        free(g->tab[n].id);
+    free(g->tab);
+    free(g->pos[SORT_ARTIST]);
+    free(g->pos[SORT_BPM]);
+    free(g);
+}
+
+static uint32_t gram_key(const char *s, unsigned int len)
+{
+    uint32_t key;
+    unsigned int n;
+
+    assert(len >= 1 && len <= 3);
+
+    key = (uint32_t)len << 24;
+    for (n = 0; n < len; n++)
+        key |= (uint32_t)(unsigned char)s[n] << (n * 8);
+
+    return key;
+}
+
+/*
+ * Return: posting list for the key, created on demand, or NULL if
+ * out of memory
+ */
+
+static struct posting* gram_get(struct gram_index *g, uint32_t key)
+{
+    size_t h;
+
+    if (g->tab_used * 4 >= g->tab_size * 3) { /* grow at 75% */
+        struct posting *tab;
+        size_t size, n;
+
+        size = (g->tab_size == 0) ? 4096 : g->tab_size * 2;
+
+        tab = calloc(size, sizeof *tab);
+        if (tab == NULL) {
+            perror("calloc");
+            return NULL;
+        }
+
+        for (n = 0; n < g->tab_size; n++) {
+            if (g->tab[n].id == NULL)
+                continue;
+
+            h = (g->tab[n].key * 2654435761u) % size;
+            while (tab[h].id != NULL)
+                h = (h + 1) % size;
+            tab[h] = g->tab[n];
+        }
+
+        free(g->tab);
+        g->tab = tab;
+        g->tab_size = size;
+    }
+
+    h = (key * 2654435761u) % g->tab_size;
+    while (g->tab[h].id != NULL && g->tab[h].key != key)
+        h = (h + 1) % g->tab_size;
+
+    if (g->tab[h].id == NULL) {
+        g->tab[h].key = key;
+        g->tab[h].len = 0;
+        g->tab[h].cap = 4;
+        g->tab[h].id = malloc(4 * sizeof(uint32_t));
+        if (g->tab[h].id == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        g->tab_used++;
+    }
+
+    return &g->tab[h];
+}
+
+static int gram_add_text(struct gram_index *g, const char *s, uint32_t id)
+{
+    size_t n, len;
+
+    len = strlen(s);
+
+    for (n = 0; n < len; n++) {
+        unsigned int z;
+
+        for (z = 1; z <= 3 && n + z <= len; z++) {
+            struct posting *p;
+
+            p = gram_get(g, gram_key(s + n, z));
+            if (p == NULL)
+                return -1;
+
+            if (p->len > 0 && p->id[p->len - 1] == id)
+                continue; /* this record is already listed */
+
+            if (p->len == p->cap) {
+                uint32_t *x;
+
+                x = realloc(p->id, p->cap * 2 * sizeof(uint32_t));
+                if (x == NULL) {
+                    perror("realloc");
+                    return -1;
+                }
+                p->id = x;
+                p->cap *= 2;
+            }
+
+            p->id[p->len++] = id;
+        }
+    }
+
+    return 0;
+}
+
+static struct gram_index* gram_build(struct listing *l)
+{
+    struct gram_index *g;
+    struct record **map_key;
+    uint32_t *map_val, n, i;
+    size_t msize;
+
+    n = l->by_order.entries;
+
+    g = malloc(sizeof *g);
+    if (g == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    g->version = l->version;
+    g->records = n;
+    g->pos[SORT_ARTIST] = malloc(n * sizeof(uint32_t));
+    g->pos[SORT_BPM] = malloc(n * sizeof(uint32_t));
+    g->pos[SORT_PLAYLIST] = NULL; /* the id is the position */
+    g->tab = NULL;
+    g->tab_size = 0;
+    g->tab_used = 0;
+
+    /* Temporary record -> id map, to invert the sort orders */
+
+    msize = 64;
+    while (msize < (size_t)n * 4)
+        msize *= 2;
+    map_key = calloc(msize, sizeof *map_key);
+    map_val = malloc(msize * sizeof *map_val);
+
+    if (g->pos[SORT_ARTIST] == NULL || g->pos[SORT_BPM] == NULL
+        || map_key == NULL || map_val == NULL)
+    {
+        perror("malloc");
+        goto fail;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct record *r;
+        size_t h;
+
+        r = l->by_order.record[i];
+
+        h = ((uintptr_t)r >> 4) % msize;
+        while (map_key[h] != NULL && map_key[h] != r)
+            h = (h + 1) % msize;
+        map_key[h] = r;
+        map_val[h] = i;
+
+        /* Mirror record_match_word(): the match string is the
+         * definitive text for searching */
+
+        if (gram_add_text(g, r->match, i) == -1)
+            goto fail;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct index *x;
+        int sort;
+
+        for (sort = SORT_ARTIST; sort <= SORT_BPM; sort++) {
+            struct record *r;
+            size_t h;
+
+            x = (sort == SORT_ARTIST) ? &l->by_artist : &l->by_bpm;
+            r = x->record[i];
+
+            h = ((uintptr_t)r >> 4) % msize;
+            while (map_key[h] != r) {
+                assert(map_key[h] != NULL);
+                h = (h + 1) % msize;
+            }
+
+            g->pos[sort][map_val[h]] = i;
+        }
+    }
+
+    free(map_val);
+    free(map_key);
+
+    return g;
+
+fail:
+    free(map_val);
+    free(map_key);
+    gram_free(g);
+    return NULL;
+}
+
+/*
+ * Return: the posting list of the rarest gram of the word, or NULL
+ * if the word has no candidates in this listing
+ */
+
+static const struct posting* gram_rarest(struct gram_index *g,
+                                         const char *word)
+{
+    static const struct posting none = { 0, NULL, 0, 0 };
+    const struct posting *best;
+    size_t n, len;
+    unsigned int z;
+
+    len = strlen(word);
+    assert(len > 0);
+
+    z = (len > 3) ? 3 : len;
+    best = NULL;
+
+    for (n = 0; n + z <= len; n++) {
+        uint32_t key;
+        size_t h;
+
+        key = gram_key(word + n, z);
+
+        h = (key * 2654435761u) % g->tab_size;
+        while (g->tab[h].id != NULL && g->tab[h].key != key)
+            h = (h + 1) % g->tab_size;
+
+        if (g->tab[h].id == NULL)
+            return &none; /* gram absent: no record can match */
+
+        if (best == NULL || g->tab[h].len < best->len)
+            best = &g->tab[h];
+    }
+
+    return best;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    if (x < y)
+        return -1;
+    if (x > y)
+        return 1;
+    return 0;
+}
+
+/*
+ * Find entries in the listing which match, using the gram index
+ *
+ * Drop-in for index_match() against one of the listing's own
+ * indexes, but consults posting lists so that only candidate records
+ * get the full match. The gram index is (re)built lazily when the
+ * listing has changed.
+ *
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int listing_match(struct listing *l, int sort, struct index *dest,
+                  const struct match *match)
+{
+    struct index *src;
+    const struct posting *base;
+    uint32_t *pos, i;
+    char *const *w;
+
+    switch (sort) {
+    case SORT_ARTIST:
+        src = &l->by_artist;
+        break;
+    case SORT_BPM:
+        src = &l->by_bpm;
+        break;
+    case SORT_PLAYLIST:
+        src = &l->by_order;
+        break;
+    default:
+        abort();
+    }
+
+    /* Mid bulk-load the sort orders are not yet valid, so neither
+     * binary search nor the gram index positions can be trusted */
+
+    if (l->bulk != NULL)
+        return index_match(src, dest, match);
+
+    /* A BPM range delimits a run of this index; two binary
+     * searches beat any posting list */
+
+    if (sort == SORT_BPM && match->bpm_hi != 0.0)
+        return index_range_bpm(src, dest, match);
+
+    if (l->grams == NULL || l->grams->version != l->version) {
+        gram_free(l->grams);
+        l->grams = gram_build(l);
+    }
+
+    if (l->grams == NULL || l->grams->tab_size == 0)
+        return index_match(src, dest, match); /* the slow way */
+
+    /* The rarest gram of whichever word narrows hardest */
+
+    base = NULL;
+
+    for (w = match->words; *w != NULL; w++) {
+        const struct posting *p;
+
+        if ((*w)[0] == '\0')
+            continue;
+
+        p = gram_rarest(l->grams, *w);
+        if (base == NULL || p->len < base->len)
+            base = p;
+    }
+
+    if (base == NULL) /* no usable words, eg. an empty search */
+        return index_match(src, dest, match);
+
+    if (base->len == 0) {
+        index_blank(dest);
+        return 0;
+    }
+
+    /* Translate ids into positions in the index on display, so
+     * candidates are visited (and added) in its order */
+
+    pos = malloc(base->len * sizeof *pos);
+    if (pos == NULL) {
+        perror("malloc");
+        return index_match(src, dest, match);
+    }
+
+    if (sort == SORT_PLAYLIST) {
+        memcpy(pos, base->id, base->len * sizeof *pos); /* ascending */
+    } else {
+        for (i = 0; i < base->len; i++)
+            pos[i] = l->grams->pos[sort][base->id[i]];
+        qsort(pos, base->len, sizeof *pos, cmp_uint32);
+    }
+
+    index_blank(dest);
+
+    for (i = 0; i < base->len; i++) {
+        struct record *re;
+
+        re = src->record[pos[i]];
+
+        if (record_match(re, match)) {
+            if (index_reserve(dest, 1) == -1) {
+                free(pos);
+                return -1;
+            }
+            index_add(dest, re);
+        }
+    }
+
+    free(pos);
+    return 0;
+}
+
+/*
+ * Base initialiser for a crate, shared by the other init functions
+ *
+ * Note the deep copy of the crate name
+ *
+ * Return: 0 on success or -1 on memory allocation failure
+ */
+
+static int crate_init(struct crate *c, const char *name)
+{
+    c->name = strdup(name);
+    if (c->name == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    c->is_busy = false;
+    c->scan = NULL;
+    c->path = NULL;
+    c->cached = NULL;
+    c->delta = NULL;
+
+    event_init(&c->activity);
+    event_init(&c->refresh);
+    event_init(&c->addition);
+    event_init(&c->additions);
+
+    return 0;
+}
+
+/*
+ * Propagate an addition event on the listing upwards -- as an
+ * addition event on this crate
+ */
+
+static void propagate_addition(struct observer *o, void *x)
+{
+    struct crate *c = container_of(o, struct crate, on_addition);
+    fire(&c->addition, x);
+}
+
+static void propagate_additions(struct observer *o, void *x)
+{
+    struct crate *c = container_of(o, struct crate, on_additions);
+    fire(&c->additions, x);
+}
+
+/*
+ * Propagate a refresh of the listing (eg. at the end of a bulk
+ * load, when its order has changed) upwards to the crate
+ */
+
+static void propagate_refresh(struct observer *o, void *x)
+{
+    struct crate *c = container_of(o, struct crate, on_refresh);
+    fire(&c->refresh, NULL);
+}
+
+/*
+ * Propagate notification that the scan has finished
+ */
+
+static void propagate_completion(struct observer *o, void *x)
+{
+    struct crate *c = container_of(o, struct crate, on_completion);
+    c->is_busy = false;
+    fire(&c->activity, NULL);
+
+    /* The scan is the slow way to get this listing; compile it,
+     * with timestamps, so the next one is cheaper */
+
+    if (c->scan != NULL) {
+        save_library(c->listing, c->scan, c->path);
+        save_dirs(c->listing, c->scan, c->path);
+    }
+}
+
+/*
+ * Initialise the crate which shows the entire library content
+ *
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+static int crate_init_all(struct library *l, struct crate *c, const char *name)
+{
+    if (crate_init(c, name) == -1)
+        return -1;
+
+    c->is_fixed = true;
+    c->listing = &l->storage;
+    watch(&c->on_addition, &c->listing->addition, propagate_addition);
+    watch(&c->on_additions, &c->listing->additions, propagate_additions);
+    watch(&c->on_refresh, &c->listing->refresh, propagate_refresh);
+    c->excrate = NULL;
+
+    return 0;
+}
+
+/*
+ * Wire in the excrate to this crate, including events
+ */
+
+static void hook_up_excrate(struct crate *c, struct excrate *e)
+{
+    if (!c->is_busy) {
+        c->is_busy = true;
+        fire(&c->activity, NULL);
+    }
+
+    c->excrate = e;
+    c->listing = &e->listing;
+    fire(&c->refresh, NULL);
+
+    watch(&c->on_addition, &c->listing->addition, propagate_addition);
+    watch(&c->on_additions, &c->listing->additions, propagate_additions);
+    watch(&c->on_refresh, &c->listing->refresh, propagate_refresh);
+    watch(&c->on_completion, &e->completion, propagate_completion);
+}
+
+/*
+ * Initialise a crate which has a fixed scan as its source
+ *
+ * Not all crates have a source (eg. 'all' crate.) This is also
+ * convenient as in future there may be other sources such as virtual
+ * crates or external searches.
+ *
+ * Return: 0 on success or -1 on error
+ */
+
+static int crate_init_scan(struct library *l, struct crate *c, const char *name,
+                           const char *scan, const char *path)
+{
+    struct excrate *e;
+
+    if (crate_init(c, name) == -1)
+        return -1;
+
+    c->is_fixed = false;
+    c->scan = scan;
+    c->path = path;
+
+    /* A compiled library makes the crate browsable without the
+     * scan; the user can rescan to pick up changes */
+
+    c->cached = load_library(l, scan, path);
+    if (c->cached != NULL) {
+        c->listing = c->cached;
+        c->excrate = NULL;
+        watch(&c->on_addition, &c->listing->addition, propagate_addition);
+        watch(&c->on_additions, &c->listing->additions, propagate_additions);
+        watch(&c->on_refresh, &c->listing->refresh, propagate_refresh);
+        return 0;
+    }
+
+    e = excrate_acquire_by_scan(scan, path, &l->storage);
+    if (e == NULL)
+        return -1;
+
+    hook_up_excrate(c, e);
+
+    return 0;
+}
+
+/*
+ * Delta rescan
+ *
+ * The saved directory timestamps tell us which parts of the tree
+ * changed since the listing was built. Only those directories are
+ * handed to the scan script, one at a time; additions merge into the
+ * existing listing through the usual events, and records whose file
+ * was not reported again are removed. Adding one track mid-set then
+ * costs one directory scan, not the whole library.
+ */
+
+/* Above this many changed directories, a full rescan is cheaper */
+
+#define DELTA_MAX_DIRS 64
+
+struct delta {
+    struct crate *crate;
+    struct library *library;
+
+    char **dirs; /* changed directories awaiting a scan */
+    size_t ndirs, next;
+
+    struct excrate *excrate; /* scan in progress, or NULL */
+    struct observer on_addition, on_completion;
+
+    struct index seen; /* records reported for the current directory */
+    bool seen_ok; /* false if the above is incomplete */
+};
+
+static void delta_free(struct delta *d)
+{
+    size_t n;
+
+    for (n = 0; n < d->ndirs; n++)
+        free(d->dirs[n]);
+    free(d->dirs);
+    index_clear(&d->seen);
+    free(d);
+}
+
+/*
+ * Remove records under the given directory which the scan no longer
+ * reports
+ */
+
+static void delta_sweep(struct delta *d, const char *dir)
+{
+    struct listing *l;
+    struct index victims;
+    size_t len, n;
+
+    l = d->crate->listing;
+    len = strlen(dir);
+
+    /* Collect first; we can't remove while iterating */
+
+    index_init(&victims);
+
+    for (n = 0; n < l->by_order.entries; n++) {
+        struct record *r;
+        size_t i;
+
+        r = l->by_order.record[n];
+
+        if (strncmp(r->pathname, dir, len) != 0 || r->pathname[len] != '/')
+            continue;
+
+        for (i = 0; i < d->seen.entries; i++) {
+            if (d->seen.record[i] == r)
+                goto keep;
+        }
+
+        if (index_reserve(&victims, 1) == -1)
+            break;
+        index_add(&victims, r);
+    keep:
+        continue;
+    }
+
+    for (n = 0; n < victims.entries; n++) {
+        struct record *r;
+
+        r = victims.record[n];
+        fprintf(stderr, "Removing '%s'\n", r->pathname);
+
+        listing_remove(l, r);
+        listing_remove(&d->library->storage, r);
+    }
+
+    index_clear(&victims);
+}
+
+/*
+ * A batch of records arrived from the scan of a changed directory
+ */
+
+static void delta_additions(struct observer *o, void *x)
+{
+    struct delta *d = container_of(o, struct delta, on_addition);
+    struct index *batch = x;
+    size_t n;
+
+    for (n = 0; n < batch->entries; n++) {
+        struct record *r;
+
+        r = batch->record[n];
+
+        /* Note it as present, or the sweep would remove it */
+
+        if (index_reserve(&d->seen, 1) == -1) {
+            d->seen_ok = false;
+        } else {
+            index_add(&d->seen, r);
+        }
+
+        (void)listing_add(d->crate->listing, r); /* no-op if known */
+    }
+}
+
+static void delta_step(struct delta *d);
+
+static void delta_completion(struct observer *o, void *x)
+{
+    struct delta *d = container_of(o, struct delta, on_completion);
+
+    if (d->seen_ok)
+        delta_sweep(d, d->dirs[d->next - 1]);
+
+    ignore(&d->on_addition);
+    ignore(&d->on_completion);
+    excrate_release(d->excrate); /* the rig still holds its reference */
+    d->excrate = NULL;
+
+    delta_step(d);
+}
+
+/*
+ * Scan the next changed directory, or finish up
+ */
+
+static void delta_step(struct delta *d)
+{
+    struct crate *c;
+
+    c = d->crate;
+
+    while (d->next < d->ndirs) {
+        const char *dir;
+        struct excrate *e;
+
+        dir = d->dirs[d->next++];
+
+        index_blank(&d->seen);
+        d->seen_ok = true;
+
+        e = excrate_acquire_by_scan(c->scan, dir, &d->library->storage);
+        if (e == NULL)
+            continue; /* skip this directory */
+
+        d->excrate = e;
+        watch(&d->on_addition, &e->listing.additions, delta_additions);
+        watch(&d->on_completion, &e->completion, delta_completion);
+        return;
     }
 
     c->is_busy = false;
+    fire(&c->activity, NULL);
 
-    event_init(&c->activity);
-    event_init(&c->refresh);
-    event_init(&c->addition);
+    /* Bring the compiled library and the timestamps up to date */
 
-    return 0;
+    save_library(c->listing, c->scan, c->path);
+    save_dirs(c->listing, c->scan, c->path);
+
+    c->delta = NULL;
+    delta_free(d);
 }
 
 /*
- * Propagate an addition event on the listing upwards -- as an
- * addition event on this crate
+ * Drop a delta rescan which is still in flight
  */
 
-static void propagate_addition(struct observer *o, void *x)
+static void delta_abandon(struct crate *c)
 {
-    struct crate *c = container_of(o, struct crate, on_addition);
-    fire(&c->addition, x);
-}
+    struct delta *d;
 
-/*
- * Propagate notification that the scan has finished
- */
+    d = c->delta;
+    if (d == NULL)
+        return;
 
-static void propagate_completion(struct observer *o, void *x)
-{
-    struct crate *c = container_of(o, struct crate, on_completion);
-    c->is_busy = false;
-    fire(&c->activity, NULL);
+    if (d->excrate != NULL) {
+        ignore(&d->on_addition);
+        ignore(&d->on_completion);
+        excrate_release(d->excrate);
+    }
+
+    c->delta = NULL;
+    delta_free(d);
 }
 
 /*
- * Initialise the crate which shows the entire library content
+ * Begin a rescan which walks only changed directories
  *
- * Return: 0 on success, -1 on memory allocation failure
+ * Return: 0 if the delta rescan covers it, -1 if a full rescan
+ * is needed
  */
 
-static int crate_init_all(struct library *l, struct crate *c, const char *name)
+static int crate_rescan_delta(struct crate *c, struct library *l)
 {
-    if (crate_init(c, name) == -1)
+    struct delta *d;
+    char name[512], *line;
+    size_t size, llen;
+    FILE *f;
+
+    if (lib_cache_dir == NULL || c->is_busy || c->delta != NULL)
         return -1;
 
-    c->is_fixed = true;
-    c->listing = &l->storage;
-    watch(&c->on_addition, &c->listing->addition, propagate_addition);
-    c->excrate = NULL;
+    lib_cache_name(name, sizeof name, c->scan, c->path, "dirs");
 
-    return 0;
-}
+    f = fopen(name, "r");
+    if (f == NULL)
+        return -1;
 
-/*
- * Wire in the excrate to this crate, including events
- */
+    d = malloc(sizeof *d);
+    if (d == NULL) {
+        perror("malloc");
+        goto fail_file;
+    }
 
-static void hook_up_excrate(struct crate *c, struct excrate *e)
-{
-    if (!c->is_busy) {
-        c->is_busy = true;
-        fire(&c->activity, NULL);
+    d->crate = c;
+    d->library = l;
+    d->ndirs = 0;
+    d->next = 0;
+    d->excrate = NULL;
+    index_init(&d->seen);
+    d->seen_ok = true;
+
+    size = 16;
+    d->dirs = malloc(size * sizeof *d->dirs);
+    if (d->dirs == NULL) {
+        perror("malloc");
+        free(d);
+        goto fail_file;
     }
 
-    c->excrate = e;
-    c->listing = &e->listing;
-    fire(&c->refresh, NULL);
+    line = NULL;
+    llen = 0;
 
-    watch(&c->on_addition, &c->listing->addition, propagate_addition);
-    watch(&c->on_completion, &e->completion, propagate_completion);
-}
+    if (getline(&line, &llen, f) == -1
+        || strcmp(line, "xwdirs\t1\n") != 0)
+    {
+        goto fail;
+    }
 
-/*
- * Initialise a crate which has a fixed scan as its source
- *
- * Not all crates have a source (eg. 'all' crate.) This is also
- * convenient as in future there may be other sources such as virtual
- * crates or external searches.
- *
- * Return: 0 on success or -1 on error
- */
+    for (;;) {
+        struct stat st;
+        char *tab, *path;
+        long long sec;
+        long nsec;
+        ssize_t z;
 
-static int crate_init_scan(struct library *l, struct crate *c, const char *name,
-                           const char *scan, const char *path)
-{
-    struct excrate *e;
+        z = getline(&line, &llen, f);
+        if (z == -1)
+            break;
 
-    if (crate_init(c, name) == -1)
-        return -1;
+        if (z > 0 && line[z - 1] == '\n')
+            line[z - 1] = '\0';
 
-    c->is_fixed = false;
-    c->scan = scan;
-    c->path = path;
+        tab = strchr(line, '\t');
+        if (tab == NULL)
+            goto fail; /* corrupt; a full rescan is safe */
+        *tab = '\0';
+        path = tab + 1;
 
-    e = excrate_acquire_by_scan(scan, path, &l->storage);
-    if (e == NULL)
-        return -1;
+        if (sscanf(line, "%lld.%9ld", &sec, &nsec) != 2)
+            goto fail;
 
-    hook_up_excrate(c, e);
+        if (stat(path, &st) == -1) {
+            /* The directory has gone, and its records with it;
+             * nothing to scan (d->seen is empty) */
+
+            delta_sweep(d, path);
+            continue;
+        }
+
+        if (st.st_mtim.tv_sec == sec && st.st_mtim.tv_nsec == nsec)
+            continue;
+
+        if (d->ndirs == DELTA_MAX_DIRS)
+            goto fail; /* too much changed; scan everything */
+
+        if (d->ndirs == size) {
+            char **x;
+
+            size *= 2;
+            x = realloc(d->dirs, size * sizeof *d->dirs);
+            if (x == NULL) {
+                perror("realloc");
+                goto fail;
+            }
+            d->dirs = x;
+        }
+
+        d->dirs[d->ndirs] = strdup(path);
+        if (d->dirs[d->ndirs] == NULL)
+            goto fail;
+        d->ndirs++;
+    }
+
+    free(line);
+
+    if (fclose(f) == EOF)
+        abort();
+
+    if (d->ndirs == 0) {
+        fprintf(stderr, "Library '%s' is unchanged\n", c->path);
+        delta_free(d);
+        return 0;
+    }
+
+    fprintf(stderr, "Delta rescan: %u director%s changed\n",
+            (unsigned int)d->ndirs, d->ndirs == 1 ? "y" : "ies");
+
+    c->delta = d;
+    c->is_busy = true;
+    fire(&c->activity, NULL);
+
+    delta_step(d);
 
     return 0;
+
+fail:
+    free(line);
+    delta_free(d);
+fail_file:
+    if (fclose(f) == EOF)
+        abort();
+    return -1;
 }
 
 /*
@@ -202,7 +1729,11 @@ static int crate_rescan(struct crate *c, struct library *l)
 {
     struct excrate *e;
 
-    assert(c->excrate != NULL);
+    /* When timestamps show little or nothing changed, walk only
+     * the changed directories */
+
+    if (crate_rescan_delta(c, l) == 0)
+        return 0;
 
     /* Replace the excrate in-place. Care needed to re-wire
      * everything back up again as before */
@@ -211,9 +1742,13 @@ static int crate_rescan(struct crate *c, struct library *l)
     if (e == NULL)
         return -1;
 
-    ignore(&c->on_completion);
     ignore(&c->on_addition);
-    excrate_release(c->excrate);
+    ignore(&c->on_additions);
+    ignore(&c->on_refresh);
+    if (c->excrate != NULL) { /* or the crate came from the cache */
+        ignore(&c->on_completion);
+        excrate_release(c->excrate);
+    }
     hook_up_excrate(c, e);
 
     return 0;
@@ -228,16 +1763,26 @@ static int crate_rescan(struct crate *c, struct library *l)
 
 static void crate_clear(struct crate *c)
 {
+    delta_abandon(c);
+
     ignore(&c->on_addition);
+    ignore(&c->on_additions);
+    ignore(&c->on_refresh);
 
     if (c->excrate != NULL) {
         ignore(&c->on_completion);
         excrate_release(c->excrate);
     }
 
+    if (c->cached != NULL) {
+        listing_clear(c->cached);
+        free(c->cached);
+    }
+
     event_clear(&c->activity);
     event_clear(&c->refresh);
     event_clear(&c->addition);
+    event_clear(&c->additions);
     free(c->name);
 }
 
@@ -255,6 +1800,216 @@ static int crate_cmp(const struct crate *a, const struct crate *b)
     return strcmp(a->name, b->name);
 }
 
+/*
+ * Bulk loading of a listing
+ *
+ * Insertion sort via index_insert() memmoves half the index for
+ * every record, which makes a large scan O(n^2). During a bulk load
+ * we append unsorted and run one qsort per order at the end; an open
+ * addressing hash stands in for the sorted index when checking for
+ * duplicates.
+ */
+
+struct bulk {
+    unsigned int loaders; /* concurrent scans feeding this listing */
+    struct record **tab; /* open addressing; NULL slots are empty */
+    size_t size, used;
+};
+
+/*
+ * Hash a record over the same fields record_cmp() compares
+ */
+
+static uint32_t record_hash(const struct record *r)
+{
+    uint32_t h;
+    const char *s;
+
+    h = 2166136261u;
+
+    for (s = r->artist; *s != '\0'; s++) {
+        h ^= (unsigned char)tolower((unsigned char)*s);
+        h *= 16777619u;
+    }
+    h ^= 0xff;
+    h *= 16777619u;
+
+    for (s = r->title; *s != '\0'; s++) {
+        h ^= (unsigned char)tolower((unsigned char)*s);
+        h *= 16777619u;
+    }
+    h ^= 0xff;
+    h *= 16777619u;
+
+    for (s = r->pathname; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Return: the slot which holds a matching record, or the empty slot
+ * where it would go
+ */
+
+static struct record** bulk_slot(struct record **tab, size_t size,
+                                 struct record *r)
+{
+    size_t n;
+
+    n = record_hash(r) & (size - 1);
+
+    for (;;) {
+        if (tab[n] == NULL)
+            return &tab[n];
+        if (record_cmp(tab[n], r, SORT_ARTIST) == 0)
+            return &tab[n];
+        n = (n + 1) & (size - 1);
+    }
+}
+
+/*
+ * Return: 0 on success, or -1 if out of memory
+ */
+
+static int bulk_grow(struct bulk *b)
+{
+    struct record **tab;
+    size_t size, n;
+
+    size = b->size * 2;
+
+    tab = calloc(size, sizeof *tab);
+    if (tab == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (n = 0; n < b->size; n++) {
+        if (b->tab[n] != NULL)
+            *bulk_slot(tab, size, b->tab[n]) = b->tab[n];
+    }
+
+    free(b->tab);
+    b->tab = tab;
+    b->size = size;
+
+    return 0;
+}
+
+/*
+ * Insert or re-use an entry, as index_insert() but by hash
+ *
+ * Return: pointer to item, or existing entry; NULL if out of memory
+ */
+
+static struct record* bulk_insert(struct bulk *b, struct record *r)
+{
+    struct record **slot;
+
+    if (b->used * 4 >= b->size * 3) { /* limit load to 75% */
+        if (bulk_grow(b) == -1)
+            return NULL;
+    }
+
+    slot = bulk_slot(b->tab, b->size, r);
+    if (*slot != NULL)
+        return *slot;
+
+    *slot = r;
+    b->used++;
+
+    return r;
+}
+
+static void bulk_free(struct bulk *b)
+{
+    if (b == NULL)
+        return;
+
+    free(b->tab);
+    free(b);
+}
+
+/*
+ * Put the listing into bulk-load mode
+ *
+ * Several scans may feed the same listing (eg. the 'all' listing);
+ * the sort is deferred until the last of them finishes. If memory is
+ * short we stay in the regular insertion mode, which is slower but
+ * always valid.
+ */
+
+void listing_begin_bulk(struct listing *l)
+{
+    struct bulk *b;
+    size_t n;
+
+    if (l->bulk != NULL) {
+        l->bulk->loaders++;
+        return;
+    }
+
+    b = malloc(sizeof *b);
+    if (b == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    b->loaders = 1;
+    b->used = 0;
+    b->size = 1024;
+    while (b->size < l->by_order.entries * 2)
+        b->size *= 2;
+
+    b->tab = calloc(b->size, sizeof *b->tab);
+    if (b->tab == NULL) {
+        perror("calloc");
+        free(b);
+        return;
+    }
+
+    /* Seed with the current entries, so that a re-scan finds its
+     * duplicates against them */
+
+    for (n = 0; n < l->by_order.entries; n++) {
+        *bulk_slot(b->tab, b->size, l->by_order.record[n])
+            = l->by_order.record[n];
+        b->used++;
+    }
+
+    l->bulk = b;
+}
+
+/*
+ * Leave bulk-load mode and restore the sort orders
+ *
+ * Post: if this was the last loader, the indexes are sorted
+ */
+
+void listing_end_bulk(struct listing *l)
+{
+    struct bulk *b;
+
+    b = l->bulk;
+    if (b == NULL)
+        return; /* bulk mode was declined */
+
+    if (--b->loaders > 0)
+        return;
+
+    l->bulk = NULL;
+    bulk_free(b);
+
+    index_sort(&l->by_artist, SORT_ARTIST);
+    index_sort(&l->by_bpm, SORT_BPM);
+
+    l->version++;
+    fire(&l->refresh, NULL);
+}
+
 /*
  * Add a record into a crate and its various indexes
  *
@@ -265,6 +2020,7 @@ static int crate_cmp(const struct crate *a, const struct crate *b)
 struct record* listing_add(struct listing *l, struct record *r)
 {
     struct record *x;
+    size_t was;
 
     assert(r != NULL);
 
@@ -278,9 +2034,36 @@ struct record* listing_add(struct listing *l, struct record *r)
     if (index_reserve(&l->by_order, 1) == -1)
         return NULL;
 
+    /* A duplicate is detected by the insert not growing, not by
+     * comparing pointers: r itself may already be in the listing
+     * (eg. re-reported by a delta rescan) */
+
+    if (l->bulk != NULL) {
+        was = l->bulk->used;
+
+        x = bulk_insert(l->bulk, r);
+        if (x == NULL)
+            return NULL;
+        if (l->bulk->used == was)
+            return x;
+
+        index_add(&l->by_artist, r); /* sorted later */
+        index_add(&l->by_bpm, r);
+        index_add(&l->by_order, r);
+
+        l->version++;
+
+        /* No per-record event: the bulk loader announces a whole
+         * batch at once on the 'additions' event */
+
+        return r;
+    }
+
+    was = l->by_artist.entries;
+
     x = index_insert(&l->by_artist, r, SORT_ARTIST);
     assert(x != NULL);
-    if (x != r)
+    if (l->by_artist.entries == was)
         return x;
 
     x = index_insert(&l->by_bpm, r, SORT_BPM);
@@ -288,10 +2071,35 @@ struct record* listing_add(struct listing *l, struct record *r)
 
     index_add(&l->by_order, r);
 
+    l->version++; /* invalidates the gram index */
+
     fire(&l->addition, r);
     return r;
 }
 
+/*
+ * Remove a record from the listing's indexes
+ *
+ * The record itself is not freed: record memory belongs to the
+ * library arena (or a cache mapping) until exit, so anything which
+ * still refers to it stays valid until the refresh rebuilds it.
+ *
+ * Pre: r is in the listing, which is not in bulk mode
+ */
+
+void listing_remove(struct listing *l, struct record *r)
+{
+    assert(l->bulk == NULL);
+
+    index_remove(&l->by_artist, r, SORT_ARTIST);
+    index_remove(&l->by_bpm, r, SORT_BPM);
+    index_remove(&l->by_order, r, SORT_PLAYLIST);
+
+    l->version++;
+
+    fire(&l->refresh, NULL);
+}
+
 /*
  * Comparison function, see qsort(3)
  */
@@ -378,34 +2186,17 @@ int library_init(struct library *li)
     return 0;
 }
 
-/*
- * Free resources associated with a record
- */
-
-static void record_clear(struct record *re)
-{
-    free(re->pathname);
-    free(re->match); /* may be NULL */
-}
-
 /*
  * Free resources associated with the music library
+ *
+ * The records themselves live in the arena, which outlives any
+ * library; see library_global_clear()
  */
 
 void library_clear(struct library *li)
 {
     int n;
 
-    /* This object is responsible for all the record pointers */
-
-    for (n = 0; n < li->storage.by_artist.entries; n++) {
-        struct record *re;
-
-        re = li->storage.by_artist.record[n];
-        record_clear(re);
-        free(re);
-    }
-
     /* Clear crates */
 
     for (n = 1; n < li->crates; n++) { /* skip the 'all' crate */
@@ -472,19 +2263,22 @@ static size_t split(char *s, char *x[], size_t len)
 }
 
 /*
- * Construct a string for matching against
+ * Construct the string for matching against
+ *
+ * The given "artist" and "title" are converted to the ASCII locale
+ * which is used for searches, and lower-cased, so that the search
+ * inner loop has no per-character folding to do.
  *
- * Only construct the string if the given "artist" and "title" contain
- * characters which require converting to the ASCII locale which is
- * used for searches.
+ * The conversion handle is passed in rather than shared, so that
+ * importers running in parallel can each carry their own.
  *
- * Return: string with responsibility, or NULL if not required
+ * Return: string with responsibility, or NULL on error
  */
 
-static char* matchable(const char *artist, const char *title)
+static char* matchable(iconv_t conv, const char *artist, const char *title)
 {
-    char *buf, *in, *out;
-    size_t len, fill, nonrev;
+    char *buf, *in, *out, *s;
+    size_t len, fill;
 
     /*
      * Append all the strings of interest into a single buffer
@@ -507,17 +2301,17 @@ static char* matchable(const char *artist, const char *title)
     out = buf;
     fill = len; /* does not include \0 */
 
-    assert(ascii != (iconv_t)-1);
-    if (iconv(ascii, NULL, NULL, &out, &fill) == -1)
+    assert(conv != (iconv_t)-1);
+    if (iconv(conv, NULL, NULL, &out, &fill) == -1)
         abort();
 
     in = buf;
 
-    nonrev = iconv(ascii, &in, &len, &out, &fill);
+    (void)iconv(conv, &in, &len, &out, &fill);
     *out = '\0';
 
-    if (nonrev == 0)
-        return NULL;
+    for (s = buf; *s != '\0'; s++)
+        *s = tolower((unsigned char)*s);
 
     return strdup(buf);
 }
@@ -525,39 +2319,35 @@ static char* matchable(const char *artist, const char *title)
 /*
  * Convert a line from the scan script to a record structure in memory
  *
- * Return: pointer to alloc'd record, or NULL on error
- * Post: if successful, responsibility for pointer line is taken
+ * The record and its pathname are a single arena allocation; the
+ * artist and title are interned.
+ *
+ * Return: pointer to record, or NULL on error
+ * Post: line is freed
  */
 
 struct record* get_record(char *line)
 {
     int n;
     struct record *x;
-    char *field[4];
-
-    x = malloc(sizeof *x);
-    if (!x) {
-        perror("malloc");
-        return NULL;
-    }
+    char *field[4], *artist, *title, *match;
+    double bpm;
+    size_t plen, mlen;
 
-    x->bpm = 0.0;
+    bpm = 0.0;
 
     n = split(line, field, ARRAY_SIZE(field));
 
     switch (n) {
     case 4:
-        x->bpm = parse_bpm(field[3]);
-        if (!isfinite(x->bpm)) {
+        bpm = parse_bpm(field[3]);
+        if (!isfinite(bpm)) {
             fprintf(stderr, "%s: Ignoring malformed BPM '%s'\n",
                     field[0], field[3]);
-            x->bpm = 0.0;
+            bpm = 0.0;
         }
         /* fall-through */
     case 3:
-        x->pathname = field[0];
-        x->artist = field[1];
-        x->title = field[2];
         break;
 
     case 2:
@@ -567,18 +2357,62 @@ struct record* get_record(char *line)
         goto bad;
     }
 
-    /* Decide if this record needs a character-equivalent in the
-     * locale used for searching */
+    artist = intern(field[1]);
+    if (artist == NULL)
+        goto bad;
+    title = intern(field[2]);
+    if (title == NULL)
+        goto bad;
+
+    /* The folded text which searches run against */
+
+    match = matchable(ascii, artist, title);
+    if (match == NULL)
+        goto bad;
+
+    plen = strlen(field[0]) + 1;
+    mlen = strlen(match) + 1;
+
+    x = arena_alloc(sizeof *x + plen + mlen);
+    if (x == NULL) {
+        free(match);
+        goto bad;
+    }
+
+    x->pathname = (char*)(x + 1);
+    memcpy(x->pathname, field[0], plen);
+    x->artist = artist;
+    x->title = title;
+    x->bpm = bpm;
 
-    x->match = matchable(x->artist, x->title);
+    x->match = x->pathname + plen;
+    memcpy(x->match, match, mlen);
+    free(match);
 
+    free(line);
     return x;
 
 bad:
-    free(x);
+    free(line);
     return NULL;
 }
 
+/*
+ * Give back a record which turned out to be a duplicate
+ *
+ * Only the most recent record from get_record() can be rolled back;
+ * its interned strings are left in place, as they are shared.
+ */
+
+void record_discard(struct record *r)
+{
+    if (r != last_alloc)
+        return;
+
+    arena->used -= last_len;
+    last_alloc = NULL;
+}
+
 /*
  * Scan a record library
  *
@@ -630,7 +2464,7 @@ fail:
 
 int library_rescan(struct library *l, struct crate *c)
 {
-    if (!c->excrate)
+    if (c->scan == NULL)
         return -1;
     else
         return crate_rescan(c, l);
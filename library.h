@@ -28,9 +28,24 @@
 
 /* A set of records, with several optimised indexes */
 
+struct gram_index;
+struct bulk;
+struct delta;
+
 struct listing {
     struct index by_artist, by_bpm, by_order;
-    struct event addition;
+    struct event addition, /* data is one record */
+        additions, /* data is an index of records; see excrate.c */
+        refresh; /* the content was re-organised, not just added to */
+
+    /* Inverted n-gram index for search, built lazily; see library.c */
+
+    struct gram_index *grams;
+    unsigned int version;
+
+    /* During a bulk load the sort is deferred, or NULL */
+
+    struct bulk *bulk;
 };
 
 /* A single crate of records */
@@ -39,13 +54,19 @@ struct crate {
     bool is_fixed, is_busy;
     char *name;
     struct listing *listing;
-    struct observer on_addition, on_completion;
+    struct observer on_addition, on_additions, on_refresh, on_completion;
     struct event activity, /* at the crate level, not the listing */
-        refresh, addition;
+        refresh, addition, additions;
 
     /* Optionally, the corresponding source */
     const char *scan, *path;
     struct excrate *excrate;
+
+    /* Listing loaded from the compiled library, or NULL */
+    struct listing *cached;
+
+    /* Delta rescan in progress, or NULL; see library.c */
+    struct delta *delta;
 };
 
 /* The complete music library, which consists of multiple crates */
@@ -58,15 +79,22 @@ struct library {
 
 int library_global_init(void);
 void library_global_clear(void);
+void library_set_cache_dir(const char *dir);
 
 void listing_init(struct listing *l);
 void listing_clear(struct listing *l);
+void listing_begin_bulk(struct listing *l);
+void listing_end_bulk(struct listing *l);
 struct record* listing_add(struct listing *l, struct record *r);
+void listing_remove(struct listing *l, struct record *r);
+int listing_match(struct listing *l, int sort, struct index *dest,
+                  const struct match *match);
 
 int library_init(struct library *li);
 void library_clear(struct library *li);
 
 struct record* get_record(char *line);
+void record_discard(struct record *r);
 
 int library_import(struct library *lib, const char *scan, const char *path);
 int library_rescan(struct library *l, struct crate *c);
@@ -17,51 +17,80 @@
  *
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lut.h"
 
-/* The number of bits to form the hash, which governs the overall size
- * of the hash lookup table, and hence the amount of chaining */
+/* The index is open-addressed with linear probing; a probe run is
+ * contiguous in memory, so a lookup typically touches one cache line
+ * of the index plus one of the timecode array. The load factor below
+ * keeps probe runs short */
 
-#define HASH_BITS 16
+#define INDEX_LOAD(nslots) ((nslots) + (nslots) / 3 + 1)
 
-#define HASH(timecode) ((timecode) & ((1 << HASH_BITS) - 1))
-#define NO_SLOT ((unsigned)-1)
+#define NO_SLOT ((slot_no_t)-1)
 
+/* Header of the on-disk cache of a table; the whole file is mapped
+ * and the arrays used in-place */
 
-/* Initialise an empty hash lookup table to store the given number
+#define CACHE_MAGIC "xwlt"
+#define CACHE_VERSION 2
+
+struct cache_header {
+    char magic[4];
+    unsigned int version, tabsize, nslots,
+        key[LUT_KEY_SIZE]; /* identity, given by the caller */
+};
+
+
+/* Starting point in the index for the given timecode; Knuth's
+ * multiplicative hash spreads the LFSR values well */
+
+static unsigned int probe_start(struct lut *lut, unsigned int timecode)
+{
+    return (timecode * 2654435761u) % lut->tabsize;
+}
+
+
+/* Initialise an empty lookup table to store the given number
  * of timecode -> position lookups */
 
 int lut_init(struct lut *lut, int nslots)
 {
-    int n, hashes;
+    unsigned int n;
     size_t bytes;
 
-    hashes = 1 << HASH_BITS;
-    bytes = sizeof(struct slot) * nslots + sizeof(slot_no_t) * hashes;
+    lut->tabsize = INDEX_LOAD(nslots);
+    bytes = sizeof(unsigned int) * nslots + sizeof(slot_no_t) * lut->tabsize;
 
-    fprintf(stderr, "Lookup table has %d hashes to %d slots"
-            " (%d slots per hash, %zuKb)\n",
-            hashes, nslots, nslots / hashes, bytes / 1024);
+    fprintf(stderr, "Lookup table has %u index entries to %d slots"
+            " (%zuKb)\n",
+            lut->tabsize, nslots, bytes / 1024);
 
-    lut->slot = malloc(sizeof(struct slot) * nslots);
-    if (lut->slot == NULL) {
+    lut->timecode = malloc(sizeof(unsigned int) * nslots);
+    if (lut->timecode == NULL) {
         perror("malloc");
         return -1;
     }
 
-    lut->table = malloc(sizeof(slot_no_t) * hashes);
+    lut->table = malloc(sizeof(slot_no_t) * lut->tabsize);
     if (lut->table == NULL) {
         perror("malloc");
         return -1;
     }
 
-    for (n = 0; n < hashes; n++)
+    for (n = 0; n < lut->tabsize; n++)
         lut->table[n] = NO_SLOT;
 
     lut->avail = 0;
+    lut->base = NULL;
+    lut->base_len = 0;
 
     return 0;
 }
@@ -69,43 +98,160 @@ int lut_init(struct lut *lut, int nslots)
 
 void lut_clear(struct lut *lut)
 {
+    if (lut->base != NULL) {
+        munmap(lut->base, lut->base_len);
+        return;
+    }
+
     free(lut->table);
-    free(lut->slot);
+    free(lut->timecode);
 }
 
 
 void lut_push(struct lut *lut, unsigned int timecode)
 {
-    unsigned int hash;
+    unsigned int n;
     slot_no_t slot_no;
-    struct slot *slot;
 
     slot_no = lut->avail++; /* take the next available slot */
+    lut->timecode[slot_no] = timecode;
 
-    slot = &lut->slot[slot_no];
-    slot->timecode = timecode;
+    n = probe_start(lut, timecode);
 
-    hash = HASH(timecode);
-    slot->next = lut->table[hash];
-    lut->table[hash] = slot_no;
+    while (lut->table[n] != NO_SLOT) {
+        n++;
+        if (n == lut->tabsize)
+            n = 0;
+    }
+
+    lut->table[n] = slot_no;
 }
 
 
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode)
 {
-    unsigned int hash;
+    unsigned int n;
     slot_no_t slot_no;
-    struct slot *slot;
 
-    hash = HASH(timecode);
-    slot_no = lut->table[hash];
+    n = probe_start(lut, timecode);
 
-    while (slot_no != NO_SLOT) {
-        slot = &lut->slot[slot_no];
-        if (slot->timecode == timecode)
+    for (;;) {
+        slot_no = lut->table[n];
+        if (slot_no == NO_SLOT)
+            return (unsigned)-1;
+        if (lut->timecode[slot_no] == timecode)
             return slot_no;
-        slot_no = slot->next;
+
+        n++;
+        if (n == lut->tabsize)
+            n = 0;
+    }
+}
+
+
+/* Map a previously saved lookup table directly from the given file,
+ * avoiding the cost of generating it. The key must match the one
+ * given at save time, otherwise the file is considered stale.
+ *
+ * Return: -1 if no usable cache file is present, otherwise 0 */
+
+int lut_load(struct lut *lut, const char *path,
+             const unsigned int key[LUT_KEY_SIZE], int nslots)
+{
+    int fd;
+    unsigned int tabsize;
+    size_t bytes;
+    struct stat st;
+    struct cache_header *h;
+    void *base;
+
+    tabsize = INDEX_LOAD(nslots);
+    bytes = sizeof(struct cache_header)
+        + sizeof(slot_no_t) * tabsize
+        + sizeof(unsigned int) * nslots;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != bytes) {
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
     }
 
-    return (unsigned)-1;
+    h = base;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof h->magic) != 0
+        || h->version != CACHE_VERSION
+        || h->tabsize != tabsize
+        || h->nslots != (unsigned int)nslots
+        || memcmp(h->key, key, sizeof h->key) != 0)
+    {
+        munmap(base, bytes);
+        return -1;
+    }
+
+    lut->base = base;
+    lut->base_len = bytes;
+    lut->tabsize = tabsize;
+    lut->table = (slot_no_t*)(h + 1);
+    lut->timecode = (unsigned int*)(lut->table + tabsize);
+    lut->avail = nslots;
+
+    fprintf(stderr, "Loaded lookup table from %s (%zuKb)\n",
+            path, bytes / 1024);
+
+    return 0;
+}
+
+
+/* Save a fully populated lookup table for later use by lut_load.
+ * The write goes via a temporary file so a half-written cache is
+ * never picked up.
+ *
+ * Return: -1 if the file could not be written, otherwise 0 */
+
+int lut_save(struct lut *lut, const char *path,
+             const unsigned int key[LUT_KEY_SIZE])
+{
+    char tmp[512];
+    FILE *f;
+    struct cache_header h;
+
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+        return -1;
+
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        return -1;
+
+    memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+    h.version = CACHE_VERSION;
+    h.tabsize = lut->tabsize;
+    h.nslots = lut->avail;
+    memcpy(h.key, key, sizeof h.key);
+
+    if (fwrite(&h, sizeof h, 1, f) != 1
+        || fwrite(lut->table, sizeof(slot_no_t), lut->tabsize, f)
+            != lut->tabsize
+        || fwrite(lut->timecode, sizeof(unsigned int), lut->avail, f)
+            != lut->avail)
+    {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
 }
@@ -20,17 +20,22 @@
 #ifndef LUT_H
 #define LUT_H
 
-typedef unsigned int slot_no_t;
+#include <stddef.h>
 
-struct slot {
-    unsigned int timecode;
-    slot_no_t next; /* next slot with the same hash */
-};
+/* Number of words of caller-defined identity used to validate an
+ * on-disk table against the code which would otherwise generate it */
+
+#define LUT_KEY_SIZE 4
+
+typedef unsigned int slot_no_t;
 
 struct lut {
-    struct slot *slot;
-    slot_no_t *table, /* hash -> slot lookup */
+    unsigned int *timecode; /* slot -> timecode, in push order */
+    slot_no_t *table, /* open-addressed index: probe -> slot */
         avail; /* next available slot */
+    unsigned int tabsize; /* number of index entries */
+    void *base; /* mmap'd cache file, or NULL if heap allocated */
+    size_t base_len;
 };
 
 int lut_init(struct lut *lut, int nslots);
@@ -39,4 +44,9 @@ void lut_clear(struct lut *lut);
 void lut_push(struct lut *lut, unsigned int timecode);
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode);
 
+int lut_load(struct lut *lut, const char *path,
+             const unsigned int key[LUT_KEY_SIZE], int nslots);
+int lut_save(struct lut *lut, const char *path,
+             const unsigned int key[LUT_KEY_SIZE]);
+
 #endif
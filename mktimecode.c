@@ -20,14 +20,25 @@
 /*
  * Experimental program to generate a timecode signal for use
  * with xwax.
+ *
+ * The bitstream is scanned first -- cheap, as there's no synthesis
+ * -- to find the period and to check every cycle is unique, using
+ * the same lookup table the decoder itself builds. The expensive
+ * waveform synthesis is then split over the CPUs, each thread
+ * seeded by jumping the LFSR ahead to the start of its span.
  */
 
 #define _GNU_SOURCE /* sincos() */
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lut.h"
 
 #define BANNER "xwax timecode generator " \
     "(C) Copyright 2018 Mark Hills <mark@xwax.org>"
@@ -38,6 +49,8 @@
 #define TAPS 0x00002
 #define BITS 22
 
+#define MAX_THREADS 16
+
 #define MAX(x,y) ((x)>(y)?(x):(y))
 
 typedef unsigned int bits_t;
@@ -75,29 +88,158 @@ static inline bits_t fwd(bits_t current, bits_t taps, unsigned int nbits)
     return (current >> 1) | (l << (nbits - 1));
 }
 
-static inline double dither(void)
+/*
+ * Jump-ahead: fwd() is linear over GF(2), so k steps of it are one
+ * application of the k'th power of its matrix, computed by
+ * square-and-multiply. A column per state bit; column i is the
+ * image of that bit.
+ */
+
+typedef bits_t matrix_t[BITS];
+
+static bits_t mat_apply(const bits_t *m, bits_t v)
 {
-    return (double)(rand() % 32768) / 32768.0 - 0.5;
+    bits_t r;
+    unsigned int i;
+
+    r = 0;
+    for (i = 0; i < BITS; i++) {
+        if ((v >> i) & 0x1)
+            r ^= m[i];
+    }
+
+    return r;
 }
 
-int main(int argc, char *argv[])
+static void mat_mul(bits_t *out, const bits_t *a, const bits_t *b)
 {
-    unsigned int s;
-    bits_t b;
-    int length;
+    unsigned int i;
 
-    fputs(BANNER, stderr);
-    fputc('\n', stderr);
+    for (i = 0; i < BITS; i++)
+        out[i] = mat_apply(a, b[i]);
+}
 
-    fprintf(stderr, "Generating %d-bit %dHz timecode sampled at %dKhz\n",
-            BITS, RESOLUTION, RATE);
+/*
+ * Return: the LFSR state after k steps forward from the given one
+ */
+
+static bits_t jump(bits_t state, unsigned long long k)
+{
+    matrix_t acc, sq, tmp;
+    unsigned int i;
+
+    for (i = 0; i < BITS; i++) {
+        acc[i] = 0x1 << i; /* identity */
+        sq[i] = fwd(0x1 << i, TAPS, BITS);
+    }
+
+    while (k != 0) {
+        if (k & 0x1) {
+            mat_mul(tmp, sq, acc);
+            memcpy(acc, tmp, sizeof acc);
+        }
+        mat_mul(tmp, sq, sq);
+        memcpy(sq, tmp, sizeof sq);
+        k >>= 1;
+    }
+
+    return mat_apply(acc, state);
+}
+
+/* Dither is plain noise, so a per-thread generator is fine */
+
+static inline double dither(unsigned int *state)
+{
+    return (double)(rand_r(state) % 32768) / 32768.0 - 0.5;
+}
+
+/*
+ * First pass over the sequence: no synthesis, just the bitstream
+ *
+ * Finds the period, the exact number of samples the synthesis will
+ * produce, and checks cycle-uniqueness -- the property the decoder
+ * depends on -- by pushing every cycle into the same lookup table
+ * machinery the decoder uses.
+ *
+ * Return: 0 on success, -1 if the sequence repeats a cycle
+ * Post: on success, *period and *samples are set
+ */
+
+static int scan(unsigned int *period, unsigned int *samples)
+{
+    struct lut lut;
+    bits_t b;
+    unsigned int s, length, cycles;
+
+    if (lut_init(&lut, 0x1 << BITS) == -1)
+        return -1;
 
     b = SEED;
     length = 0;
+    cycles = 0;
 
     for (s = 0; ; s++) {
+        double cycle;
+
+        cycle = (double)s / RATE * RESOLUTION;
+
+        if ((unsigned int)cycle > length) {
+            assert((unsigned int)cycle - length == 1);
+
+            if (lut_lookup(&lut, b) != (unsigned)-1) {
+                fprintf(stderr, "Cycle 0x%08x repeats at %u; "
+                        "timecode is not usable\n", b, cycles);
+                lut_clear(&lut);
+                return -1;
+            }
+            lut_push(&lut, b);
+
+            b = fwd(b, TAPS, BITS);
+            cycles++;
+
+            if (b == SEED) { /* LFSR period reached */
+                *period = cycles;
+                *samples = s + 1; /* this sample is still written */
+                lut_clear(&lut);
+                return 0;
+            }
+
+            length = cycle;
+        }
+    }
+}
+
+/*
+ * Synthesis of one contiguous span of samples, replicating exactly
+ * what the single loop would have produced for them
+ */
+
+struct span {
+    pthread_t thread;
+    unsigned int lo, hi; /* sample numbers */
+    signed short *pcm;
+};
+
+static void* synth(void *arg)
+{
+    struct span *span = arg;
+    bits_t b;
+    unsigned int s, length, rstate;
+    signed short *out;
+
+    /* State at the moment sample lo is written: the bitstream has
+     * advanced once for each integer cycle boundary before it */
+
+    if (span->lo > 0)
+        length = (double)(span->lo - 1) / RATE * RESOLUTION;
+    else
+        length = 0;
+    b = jump(SEED, length);
+    rstate = span->lo;
+    out = span->pcm;
+
+    for (s = span->lo; s < span->hi; s++) {
         double time, cycle, angle, modulate, x, y;
-        signed short c[2];
 
         time = (double)s / RATE;
         cycle = time * RESOLUTION;
@@ -111,24 +253,78 @@ int main(int argc, char *argv[])
         x *= modulate;
         y *= modulate;
 
-        /* Write out 16-bit PCM data */
+        /* 16-bit PCM data */
 
-        c[0] = -y * SHRT_MAX * 0.5 + dither();
-        c[1] = x * SHRT_MAX * 0.5 + dither();
-
-        fwrite(c, sizeof(signed short), 2, stdout);
+        *out++ = -y * SHRT_MAX * 0.5 + dither(&rstate);
+        *out++ = x * SHRT_MAX * 0.5 + dither(&rstate);
 
         /* Advance the bitstream if required */
 
-        if ((int)cycle > length) {
-            assert((int)cycle - length == 1);
+        if ((unsigned int)cycle > length) {
+            assert((unsigned int)cycle - length == 1);
             b = fwd(b, TAPS, BITS);
-            if (b == SEED) /* LFSR period reached */
-                break;
             length = cycle;
         }
     }
 
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int period, samples, length, nthread, n;
+    long online;
+    struct span span[MAX_THREADS];
+
+    fputs(BANNER, stderr);
+    fputc('\n', stderr);
+
+    fprintf(stderr, "Generating %d-bit %dHz timecode sampled at %dKhz\n",
+            BITS, RESOLUTION, RATE);
+
+    if (scan(&period, &samples) == -1)
+        return -1;
+
+    assert(jump(SEED, period) == SEED);
+
+    fprintf(stderr, "Verified %u cycles unique\n", period);
+
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1)
+        online = 1;
+    nthread = online;
+    if (nthread > MAX_THREADS)
+        nthread = MAX_THREADS;
+
+    for (n = 0; n < nthread; n++) {
+        struct span *sp = &span[n];
+
+        sp->lo = (unsigned long long)samples * n / nthread;
+        sp->hi = (unsigned long long)samples * (n + 1) / nthread;
+
+        sp->pcm = malloc((size_t)(sp->hi - sp->lo) * 2 * sizeof(short));
+        if (sp->pcm == NULL) {
+            perror("malloc");
+            abort();
+        }
+
+        if (pthread_create(&sp->thread, NULL, synth, sp) != 0)
+            abort();
+    }
+
+    for (n = 0; n < nthread; n++) {
+        struct span *sp = &span[n];
+
+        if (pthread_join(sp->thread, NULL) != 0)
+            abort();
+
+        fwrite(sp->pcm, sizeof(signed short), (sp->hi - sp->lo) * 2,
+               stdout);
+        free(sp->pcm);
+    }
+
+    length = period - 1; /* cycles fully written out */
+
     fprintf(stderr, "Generated %0.1f seconds of timecode\n",
             (double)length / RESOLUTION);
 
@@ -35,6 +35,7 @@
 #define OBSERVE_H
 
 #include <assert.h>
+#include <stdbool.h>
 
 #include "list.h"
 
@@ -45,12 +46,31 @@ struct event {
 struct observer {
     struct list event;
     void (*func)(struct observer*, void*);
+
+    /* Deferred delivery, or NULL for delivery inside fire();
+     * see watch_deferred() */
+
+    struct event_queue *queue;
+    struct list pending;
+    bool queued;
+    void *data; /* the most recent event, when queued */
+};
+
+/* A queue of deferred events, drained by their consumer at a point
+ * of its choosing; see watch_deferred() */
+
+struct event_queue {
+    struct list pending;
 };
 
 #define EVENT_INIT(event) { \
     .observers = LIST_INIT(event.observers) \
 }
 
+#define EVENT_QUEUE_INIT(q) { \
+    .pending = LIST_INIT(q.pending) \
+}
+
 static inline void event_init(struct event *s)
 {
     list_init(&s->observers);
@@ -61,6 +81,16 @@ static inline void event_clear(struct event *s)
     assert(list_empty(&s->observers));
 }
 
+static inline void event_queue_init(struct event_queue *q)
+{
+    list_init(&q->pending);
+}
+
+static inline void event_queue_clear(struct event_queue *q)
+{
+    assert(list_empty(&q->pending));
+}
+
 /*
  * Pre: observer is not watching anything
  * Post: observer is watching the given event
@@ -71,25 +101,92 @@ static inline void watch(struct observer *observer, struct event *sig,
 {
     list_add(&observer->event, &sig->observers);
     observer->func = func;
+    observer->queue = NULL;
+    observer->queued = false;
+}
+
+/*
+ * As watch(), but events are delivered later by the consumer
+ *
+ * The fire() side does only cheap list work; the callback runs when
+ * the consumer drains the queue at a safe point. Duplicate events
+ * between drains collapse to one, keeping the most recent data --
+ * so only suitable where the latest event supersedes earlier ones.
+ */
+
+static inline void watch_deferred(struct observer *observer,
+                                  struct event *sig,
+                                  void (*func)(struct observer*, void*),
+                                  struct event_queue *q)
+{
+    watch(observer, sig, func);
+    observer->queue = q;
 }
 
 static inline void ignore(struct observer *observer)
 {
     list_del(&observer->event);
+
+    if (observer->queued) {
+        list_del(&observer->pending);
+        observer->queued = false;
+    }
 }
 
 /*
  * Call the callback in all slots which are watching the given event
+ *
+ * An observer may ignore() itself from within its own callback (eg.
+ * a one-shot watch on a completion), but not detach other observers
+ * of the same event.
  */
 
 static inline void fire(struct event *s, void *data)
 {
-    struct observer *t;
+    struct observer *t, *x;
 
-    list_for_each(t, &s->observers, event) {
+    list_for_each_safe(t, x, &s->observers, event) {
         assert(t->func != NULL);
+
+        if (t->queue != NULL) {
+
+            /* Defer; a duplicate already queued collapses into
+             * this one, keeping the most recent data */
+
+            t->data = data;
+            if (!t->queued) {
+                list_add_tail(&t->pending, &t->queue->pending);
+                t->queued = true;
+            }
+            continue;
+        }
+
         t->func(t, data);
     }
 }
 
+/*
+ * Deliver all deferred events waiting on the given queue
+ *
+ * Called by the consumer at a safe point, with whatever locks the
+ * producers fire() under. An observer may ignore() itself from
+ * within its own callback; events fired during the drain are
+ * delivered before it returns.
+ */
+
+static inline void event_queue_drain(struct event_queue *q)
+{
+    while (!list_empty(&q->pending)) {
+        struct observer *t;
+
+        t = list_entry(q->pending.next, struct observer, pending);
+
+        list_del(&t->pending);
+        t->queued = false;
+
+        assert(t->func != NULL);
+        t->func(t, t->data);
+    }
+}
+
 #endif
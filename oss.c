@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/soundcard.h>
 
@@ -30,11 +31,31 @@
 
 #define FRAME 32 /* maximum read size */
 
+/* Target length of one fragment when sizing automatically, in
+ * milliseconds; with the default number of buffers the total is
+ * close to the ALSA default */
+
+#define AUTO_FRAGMENT 1
+
+/* Fragments of playback audio kept rendered ahead of the DMA
+ * pointer in mmap mode */
+
+#define OUTPUT_LEAD 2
+
 
 struct oss {
     int fd;
     struct pollfd *pe;
     unsigned int rate;
+
+    /* The DMA rings, where the driver supports mmap'd trigger-based
+     * I/O; imap is NULL when falling back to read() and write().
+     * Sizes and positions are in bytes */
+
+    signed short *imap, *omap;
+    size_t isize, osize;
+    unsigned int iptr, optr, /* our position in each ring */
+        olead; /* bytes to keep rendered ahead of playback */
 };
 
 
@@ -43,6 +64,13 @@ static void clear(struct device *dv)
     int r;
     struct oss *oss = (struct oss*)dv->local;
 
+    if (oss->imap != NULL) {
+        if (munmap(oss->imap, oss->isize) == -1)
+            abort();
+        if (munmap(oss->omap, oss->osize) == -1)
+            abort();
+    }
+
     r = close(oss->fd);
     if (r == -1) {
         perror("close");
@@ -55,21 +83,23 @@ static void clear(struct device *dv)
 
 /* Push audio into the device's buffer, for playback */
 
-static int push(int fd, signed short *pcm, int samples)
+static int push(struct device *dv, int fd, signed short *pcm, int samples)
 {
     int r, bytes;
 
     bytes = samples * DEVICE_CHANNELS * sizeof(short);
-    
+
     r = write(fd, pcm, bytes);
 
     if (r == -1) {
         perror("write");
         return -1;
     }
-    
-    if (r < bytes)
+
+    if (r < bytes) {
         fprintf(stderr, "Device output overrun.\n");
+        device_xrun(dv);
+    }
 
     return r / DEVICE_CHANNELS / sizeof(short);
 }
@@ -77,7 +107,7 @@ static int push(int fd, signed short *pcm, int samples)
 
 /* Pull audio from the device, for recording */
 
-static int pull(int fd, signed short *pcm, int samples)
+static int pull(struct device *dv, int fd, signed short *pcm, int samples)
 {
     int r, bytes;
 
@@ -90,33 +120,114 @@ static int pull(int fd, signed short *pcm, int samples)
         return -1;
     }
 
-    if (r < bytes)
+    if (r < bytes) {
         fprintf(stderr, "Device input underrun.\n");
+        device_xrun(dv);
+    }
 
     return r / DEVICE_CHANNELS / sizeof(short);
 }
 
 
+/*
+ * Exchange audio directly with the DMA rings
+ *
+ * The driver gives us its position in each ring; we hand everything
+ * it has captured to the timecoder in place, and render playback a
+ * short, fixed lead ahead of it. No syscall moves the audio itself,
+ * and the lead (not the fragment policy of read/write mode) sets
+ * the output latency.
+ */
+
+static int handle_mmap(struct device *dv)
+{
+    struct count_info ci;
+    unsigned int queued;
+    struct oss *oss = (struct oss*)dv->local;
+
+    /* Everything captured since last time goes to the timecoder */
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETIPTR, &ci) == -1) {
+        perror("SNDCTL_DSP_GETIPTR");
+        return -1;
+    }
+
+    while (oss->iptr != (unsigned int)ci.ptr) {
+        unsigned int bytes;
+
+        bytes = ((unsigned int)ci.ptr - oss->iptr + oss->isize)
+            % oss->isize;
+        if (bytes > oss->isize - oss->iptr)
+            bytes = oss->isize - oss->iptr; /* stop at the ring end */
+        bytes -= bytes % (DEVICE_CHANNELS * sizeof(short));
+        if (bytes == 0)
+            break; /* partial frame; leave it for next time */
+
+        device_submit(dv, (signed short*)((char*)oss->imap + oss->iptr),
+                      bytes / DEVICE_CHANNELS / sizeof(short));
+        oss->iptr = (oss->iptr + bytes) % oss->isize;
+    }
+
+    /* Top playback back up to the lead. We never render more than
+     * the lead ahead, so a greater distance means the play pointer
+     * lapped us -- resync rather than replay a ring of stale audio */
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETOPTR, &ci) == -1) {
+        perror("SNDCTL_DSP_GETOPTR");
+        return -1;
+    }
+
+    queued = (oss->optr - (unsigned int)ci.ptr + oss->osize) % oss->osize;
+
+    if (queued > oss->olead) {
+        device_xrun(dv);
+        oss->optr = ci.ptr - ci.ptr % (DEVICE_CHANNELS * sizeof(short));
+        queued = 0;
+    }
+
+    if (queued / DEVICE_CHANNELS / sizeof(short) < dv->headroom)
+        dv->headroom = queued / DEVICE_CHANNELS / sizeof(short);
+
+    while (queued < oss->olead) {
+        unsigned int bytes;
+
+        bytes = oss->olead - queued;
+        if (bytes > oss->osize - oss->optr)
+            bytes = oss->osize - oss->optr;
+
+        device_collect(dv, (signed short*)((char*)oss->omap + oss->optr),
+                       bytes / DEVICE_CHANNELS / sizeof(short));
+        oss->optr = (oss->optr + bytes) % oss->osize;
+        queued += bytes;
+    }
+
+    return 0;
+}
+
+
 static int handle(struct device *dv)
 {
     signed short pcm[FRAME * DEVICE_CHANNELS];
     int samples;
     struct oss *oss = (struct oss*)dv->local;
 
+    if (oss->imap != NULL)
+        return handle_mmap(dv);
+
     /* Check input buffer for recording */
 
     if (oss->pe->revents & POLLIN) {
-        samples = pull(oss->fd, pcm, FRAME);
+        samples = pull(dv, oss->fd, pcm, FRAME);
         if (samples == -1)
             return -1;
         device_submit(dv, pcm, samples);
     }
 
     /* Check the output buffer for playback */
-    
+
     if (oss->pe->revents & POLLOUT) {
         device_collect(dv, pcm, FRAME);
-        samples = push(oss->fd, pcm, FRAME);
+        samples = push(dv, oss->fd, pcm, FRAME);
         if (samples == -1)
             return -1;
     }
@@ -125,6 +236,29 @@ static int handle(struct device *dv)
 }
 
 
+/*
+ * Begin the capture and playback DMA
+ *
+ * In mmap mode the driver does not start on the first read or
+ * write; both directions are released together by the trigger.
+ */
+
+static void start(struct device *dv)
+{
+    int trig;
+    struct oss *oss = (struct oss*)dv->local;
+
+    if (oss->imap == NULL)
+        return;
+
+    trig = PCM_ENABLE_INPUT | PCM_ENABLE_OUTPUT;
+    if (ioctl(oss->fd, SNDCTL_DSP_SETTRIGGER, &trig) == -1) {
+        perror("SNDCTL_DSP_SETTRIGGER");
+        abort();
+    }
+}
+
+
 static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
 {
     struct oss *oss = (struct oss*)dv->local;
@@ -152,22 +286,100 @@ static struct device_ops oss_ops = {
     .pollfds = pollfds,
     .handle = handle,
     .sample_rate = sample_rate,
+    .start = start,
     .clear = clear
 };
 
 
+/*
+ * Map the DMA rings, where the driver is able
+ *
+ * Best-effort: on any refusal the maps are left unset and we fall
+ * back to read() and write(), which every driver supports.
+ *
+ * Post: oss->imap is NULL, or both rings are mapped and the DMA is
+ * held reset ready for the trigger
+ */
+
+static void setup_mmap(struct oss *oss)
+{
+    int caps, trig;
+    struct audio_buf_info info;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETCAPS, &caps) == -1)
+        return;
+
+    if (!(caps & DSP_CAP_MMAP) || !(caps & DSP_CAP_TRIGGER)
+        || !(caps & DSP_CAP_DUPLEX))
+    {
+        return;
+    }
+
+    /* Hold the DMA until both maps are in place */
+
+    trig = 0;
+    if (ioctl(oss->fd, SNDCTL_DSP_SETTRIGGER, &trig) == -1)
+        return;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETISPACE, &info) == -1)
+        return;
+    oss->isize = (size_t)info.fragstotal * info.fragsize;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETOSPACE, &info) == -1)
+        return;
+    if (info.fragstotal <= OUTPUT_LEAD)
+        return; /* ring too small to render ahead within it */
+    oss->osize = (size_t)info.fragstotal * info.fragsize;
+    oss->olead = info.fragsize * OUTPUT_LEAD;
+
+    oss->imap = mmap(NULL, oss->isize, PROT_READ, MAP_SHARED, oss->fd, 0);
+    if (oss->imap == MAP_FAILED) {
+        oss->imap = NULL;
+        return;
+    }
+
+    oss->omap = mmap(NULL, oss->osize, PROT_WRITE, MAP_SHARED, oss->fd, 0);
+    if (oss->omap == MAP_FAILED) {
+        if (munmap(oss->imap, oss->isize) == -1)
+            abort();
+        oss->imap = NULL;
+        return;
+    }
+
+    /* Silence until the first render, with the lead already queued
+     * so the first handling isn't mistaken for an underrun */
+
+    memset(oss->omap, 0, oss->osize);
+    oss->iptr = 0;
+    oss->optr = oss->olead;
+}
+
+
 int oss_init(struct device *dv, const char *filename, unsigned int rate,
 	     unsigned short buffers, unsigned short fragment)
 {
     int p, fd;
     struct oss *oss;
-   
+
+    /* Zero means size fragments automatically: the largest power of
+     * two within the latency target, leaving the era of hand-tuning
+     * -f against the sample rate behind */
+
+    if (fragment == 0) {
+        unsigned int bytes;
+
+        bytes = rate * DEVICE_CHANNELS * sizeof(short) * AUTO_FRAGMENT / 1000;
+        fragment = 4; /* minimum the drivers accept */
+        while ((1U << (fragment + 1)) <= bytes)
+            fragment++;
+    }
+
     fd = open(filename, O_RDWR, 0);
     if (fd == -1) {
         perror("open");
         return -1;
     }
-    
+
     /* Ideally would set independent settings for the record and
      * playback buffers. Recording needs to buffer where necessary, as
      * lost audio results in zero-crossings which corrupt the
@@ -219,6 +431,10 @@ int oss_init(struct device *dv, const char *filename, unsigned int rate,
     oss->fd = fd;
     oss->pe = NULL;
     oss->rate = rate;
+    oss->imap = NULL;
+    oss->omap = NULL;
+
+    setup_mmap(oss);
 
     device_init(dv, &oss_ops);
     dv->local = oss;
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf.h"
+
+struct perf_counter perf_frame, perf_decks, perf_library, perf_audio,
+    perf_timecoder, perf_player;
+
+unsigned int perf_xruns = 0;
+
+volatile sig_atomic_t perf_dump_pending = 0;
+
+/*
+ * Return: the monotonic clock, in microseconds
+ *
+ * The value wraps. Callers take the difference of two readings in
+ * unsigned arithmetic, which stays correct across the wrap.
+ */
+
+unsigned int perf_time(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        abort();
+
+    return t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/*
+ * Record a timed piece of work into the given counter
+ */
+
+void perf_sample(struct perf_counter *c, unsigned int us)
+{
+    unsigned int n;
+
+    c->count++;
+    c->last = us;
+    c->total += us;
+
+    if (us > c->worst)
+        c->worst = us;
+
+    n = 0;
+    while (us > 1 && n < PERF_BUCKETS - 1) {
+        us >>= 1;
+        n++;
+    }
+
+    c->bucket[n]++;
+}
+
+/*
+ * Return: mean duration of the samples to-date, in microseconds
+ */
+
+unsigned int perf_average(const struct perf_counter *c)
+{
+    if (c->count == 0)
+        return 0;
+
+    return c->total / c->count;
+}
+
+/*
+ * Count an under or over-run reported by the audio system
+ */
+
+void perf_xrun(void)
+{
+    perf_xruns++;
+}
+
+/* Startup phase profiler; see perf_phase() */
+
+#define PHASES 16
+
+static struct {
+    const char *name;
+    unsigned int wall, cpu; /* accumulated, microseconds */
+} phase[PHASES];
+
+static const char *phase_name = NULL; /* currently open phase */
+static unsigned int phase_wall, phase_cpu;
+
+static unsigned int cpu_time(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t) == -1)
+        abort();
+
+    return t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/*
+ * Close the current startup phase and open the named one
+ *
+ * Phases accumulate: re-opening a name (eg. "args" between each
+ * device) adds to its existing total. Pass NULL to close only.
+ * Main thread only; this is for profiling startup, not steady
+ * running.
+ */
+
+void perf_phase(const char *name)
+{
+    unsigned int wall, cpu;
+
+    wall = perf_time();
+    cpu = cpu_time();
+
+    if (phase_name != NULL) {
+        size_t n;
+
+        for (n = 0; n < PHASES; n++) {
+            if (phase[n].name == NULL || !strcmp(phase[n].name, phase_name))
+                break;
+        }
+        assert(n < PHASES);
+
+        phase[n].name = phase_name;
+        phase[n].wall += wall - phase_wall;
+        phase[n].cpu += cpu - phase_cpu;
+    }
+
+    phase_name = name;
+    phase_wall = wall;
+    phase_cpu = cpu;
+}
+
+/*
+ * Report where startup time went, one line per phase
+ */
+
+void perf_phase_report(FILE *fd)
+{
+    size_t n;
+    unsigned int wall, cpu;
+
+    fprintf(fd, "Startup phases (milliseconds, wall/cpu):\n");
+
+    wall = 0;
+    cpu = 0;
+
+    for (n = 0; n < PHASES && phase[n].name != NULL; n++) {
+        fprintf(fd, "%12s: %u.%03u / %u.%03u\n", phase[n].name,
+                phase[n].wall / 1000, phase[n].wall % 1000,
+                phase[n].cpu / 1000, phase[n].cpu % 1000);
+        wall += phase[n].wall;
+        cpu += phase[n].cpu;
+    }
+
+    fprintf(fd, "%12s: %u.%03u / %u.%03u\n", "total",
+            wall / 1000, wall % 1000, cpu / 1000, cpu % 1000);
+}
+
+/*
+ * Print one counter, with its histogram
+ *
+ * The counters are written without locking; a dump taken while the
+ * writer is mid-update may show one inconsistent figure.
+ */
+
+void perf_dump_counter(FILE *fd, const char *name,
+                       const struct perf_counter *c)
+{
+    size_t n;
+
+    fprintf(fd, "%12s: %u samples, last %uus, avg %uus, worst %uus\n",
+            name, c->count, c->last, perf_average(c), c->worst);
+
+    fprintf(fd, "%12s  histogram:", "");
+    for (n = 0; n < PERF_BUCKETS; n++)
+        fprintf(fd, " %u", c->bucket[n]);
+    fputc('\n', fd);
+}
+
+/*
+ * Dump all global counters, on demand (eg. SIGUSR1)
+ *
+ * The histogram buckets are powers of two: bucket n counts samples
+ * of [2^n, 2^(n+1)) microseconds.
+ */
+
+void perf_dump(FILE *fd)
+{
+    fprintf(fd, "Performance counters (microseconds):\n");
+
+    perf_dump_counter(fd, "frame", &perf_frame);
+    perf_dump_counter(fd, "decks", &perf_decks);
+    perf_dump_counter(fd, "library", &perf_library);
+    perf_dump_counter(fd, "audio", &perf_audio);
+    perf_dump_counter(fd, "timecoder", &perf_timecoder);
+    perf_dump_counter(fd, "player", &perf_player);
+
+    fprintf(fd, "%12s: %u\n", "xruns", perf_xruns);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Lightweight performance counters, to feed the on-screen HUD
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <signal.h>
+#include <stdio.h>
+
+/* Histogram of power-of-two buckets; bucket n counts samples with
+ * a duration of [2^n, 2^(n+1)) microseconds */
+
+#define PERF_BUCKETS 16
+
+struct perf_counter {
+    unsigned int count,
+        last, worst; /* microseconds */
+    unsigned long long total; /* microseconds */
+    unsigned int bucket[PERF_BUCKETS];
+};
+
+/* Counters are written from the thread doing the work in question,
+ * without locking. The reader (the HUD) tolerates a torn read; it
+ * shows one briefly-wrong figure, which is harmless */
+
+extern struct perf_counter perf_frame, /* one whole redraw */
+    perf_decks, /* the deck widgets only */
+    perf_library, /* the library widgets only */
+    perf_audio, /* fill of one audio period; see device_handle() */
+    perf_timecoder, /* decode of one capture block */
+    perf_player; /* render of one playback block */
+
+extern unsigned int perf_xruns;
+
+/* Set from a signal handler (SIGUSR1) to request a dump of the
+ * counters; cleared by whoever performs the dump */
+
+extern volatile sig_atomic_t perf_dump_pending;
+
+unsigned int perf_time(void);
+void perf_sample(struct perf_counter *c, unsigned int us);
+unsigned int perf_average(const struct perf_counter *c);
+void perf_xrun(void);
+
+/* Startup phase profiler; marks from the main thread only */
+
+void perf_phase(const char *name);
+void perf_phase_report(FILE *fd);
+
+void perf_dump_counter(FILE *fd, const char *name,
+                       const struct perf_counter *c);
+void perf_dump(FILE *fd);
+
+#endif
@@ -20,24 +20,62 @@
 #ifndef PITCH_H
 #define PITCH_H
 
+#include <string.h>
+
 /* Values for the filter concluded experimentally */
 
 #define ALPHA (1.0/512)
 #define BETA (ALPHA/256)
 
+/* Longest run of zero observations applied in a single step;
+ * longer runs repeat the largest step. See pitch_idle() */
+
+#define PITCH_RUN 64
+
 /* State of the pitch calculation filter */
 
 struct pitch {
     double dt, x, v;
+
+    /* Powers of the zero-observation step; see pitch_init() */
+
+    double run[PITCH_RUN][4];
 };
 
 /* Prepare the filter for observations every dt seconds */
 
 static inline void pitch_init(struct pitch *p, double dt)
 {
+    double m[4], s[4];
+    int n;
+
     p->dt = dt;
     p->x = 0.0;
     p->v = 0.0;
+
+    /* An observation of no movement is a linear map on (x, v);
+     * precompute its powers, so that a run of such observations --
+     * the samples between zero crossings -- applies in one step */
+
+    m[0] = 1.0 - ALPHA;
+    m[1] = (1.0 - ALPHA) * dt;
+    m[2] = -BETA / dt;
+    m[3] = 1.0 - BETA;
+
+    memcpy(s, m, sizeof s);
+
+    for (n = 0; n < PITCH_RUN; n++) {
+        double t[4];
+
+        memcpy(p->run[n], s, sizeof p->run[n]);
+
+        t[0] = m[0] * s[0] + m[1] * s[2];
+        t[1] = m[0] * s[1] + m[1] * s[3];
+        t[2] = m[2] * s[0] + m[3] * s[2];
+        t[3] = m[2] * s[1] + m[3] * s[3];
+
+        memcpy(s, t, sizeof s);
+    }
 }
 
 /* Input an observation to the filter; in the last dt seconds the
@@ -61,6 +99,30 @@ static inline void pitch_dt_observation(struct pitch *p, double dx)
     p->x -= dx; /* relative to previous */
 }
 
+/* Feed the filter n observations in which the position did not
+ * move, in one step per PITCH_RUN rather than per sample. The
+ * result is the same as n calls of pitch_dt_observation() with a
+ * dx of zero, to within floating point rounding. */
+
+static inline void pitch_idle(struct pitch *p, unsigned int n)
+{
+    while (n > 0) {
+        unsigned int run;
+        const double *m;
+        double x, v;
+
+        run = n < PITCH_RUN ? n : PITCH_RUN;
+        m = p->run[run - 1];
+        x = p->x;
+        v = p->v;
+
+        p->x = m[0] * x + m[1] * v;
+        p->v = m[2] * x + m[3] * v;
+
+        n -= run;
+    }
+}
+
 /* Get the pitch after filtering */
 
 static inline double pitch_current(struct pitch *p)
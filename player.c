@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 
 #include "device.h"
 #include "player.h"
+#include "realtime.h"
 #include "track.h"
 #include "timecoder.h"
 
@@ -43,6 +45,19 @@
 
 #define SKIP_THRESHOLD (1.0 / 8) /* before dropping audio */
 
+/* Continuous controller input: reach of the pitch fader, the bend
+ * per jog tick, and the decay of a nudge back to zero */
+
+#define FADER_CENTRE 8192 /* of a 14-bit MIDI value */
+#define FADER_RANGE 0.08 /* +/- 8% at the ends of the fader */
+#define NUDGE_PITCH 0.005 /* per jog tick */
+#define NUDGE_RC 0.25 /* seconds */
+
+/* Wraps of a loop within one block before giving up on it as
+ * degenerate and playing straight through */
+
+#define LOOP_WRAP_LIMIT 8
+
 /* The base volume level. A value of 1.0 leaves no headroom to play
  * louder when the record is going faster than 1.0. */
 
@@ -51,6 +66,17 @@
 #define SQ(x) ((x)*(x))
 #define TARGET_UNKNOWN INFINITY
 
+/* Polyphase sinc resampler, as an alternative to the cubic one.
+ * The cutoff is slightly inside Nyquist to allow for the rolloff */
+
+#define SINC_TAPS 16
+#define SINC_CENTRE (SINC_TAPS / 2)
+#define SINC_PHASES 512
+#define SINC_CUTOFF 0.9
+
+static float sinc_table[SINC_PHASES][SINC_TAPS];
+static bool sinc_built = false;
+
 /*
  * Return: the cubic interpolation of the sample at position 2 + mu
  */
@@ -69,29 +95,38 @@ static inline double cubic_interpolate(signed short y[4], double mu)
     return (mu * mu2 * a0) + (mu2 * a1) + (mu * a2) + a3;
 }
 
+#define DITHER_MASK (DITHER_BLOCK - 1)
+
 /*
- * Return: Random dither, between -0.5 and 0.5
+ * Generate a run of dither, each value between -0.5 and 0.5
+ *
+ * An xorshift generator, whole-word steps rather than the bitwise
+ * LFSR used previously; the noise is made in bulk, once per block of
+ * audio, leaving just a load in the per-sample path. Each player has
+ * its own state, so decks no longer contend for one cache line from
+ * the realtime thread.
+ *
+ * Post: buffer at out is filled with the given number of values
  */
 
-static double dither(void)
+static void dither_block(unsigned int *state, float *out, unsigned int n)
 {
-    unsigned int bit, v;
-    static unsigned int x = 0xbeefface;
+    unsigned int x, k;
 
-    /* Maximum length LFSR sequence with 32-bit state */
+    x = *state;
 
-    bit = (x ^ (x >> 1) ^ (x >> 21) ^ (x >> 31)) & 1;
-    x = x << 1 | bit;
+    for (k = 0; k < n; k++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
 
-    /* We can adjust the balance between randomness and performance
-     * by our chosen bit permutation; here we use a 12 bit subset
-     * of the state */
+        /* A 12 bit subset of the state balances randomness
+         * against rounding */
 
-    v = (x & 0x0000000f)
-        | ((x & 0x000f0000) >> 12)
-        | ((x & 0x0f000000) >> 16);
+        out[k] = (float)(x & 0xfff) / 4096 - 0.5f;
+    }
 
-    return (double)v / 4096 - 0.5; /* not quite whole range */
+    *state = x;
 }
 
 /*
@@ -100,38 +135,126 @@ static double dither(void)
  * This is just a basic resampler which has a small amount of aliasing
  * where pitch > 1.0.
  *
+ * The common case -- a run of output where every interpolation window
+ * falls inside the track and a single track block -- takes a fast
+ * path with no bounds or block test per tap, which leaves a straight
+ * arithmetic kernel for the compiler to vectorise. Track edges and
+ * block boundaries fall back to the careful path, one sample at a
+ * time.
+ *
  * Return: number of seconds advanced in the source audio track
  * Post: buffer at pcm is filled with the given number of samples
  */
 
 static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
-                        struct track *tr, double position, double pitch,
+                        const float *dither, struct track *tr,
+                        double position, double pitch,
                         double start_vol, double end_vol)
 {
-    int s;
+    unsigned int s, di;
     double sample, step, vol, gradient;
 
+    di = 0;
+
     sample = position * tr->rate;
     step = sample_dt * pitch * tr->rate;
 
     vol = start_vol;
     gradient = (end_vol - start_vol) / samples;
 
-    for (s = 0; s < samples; s++) {
+    s = 0;
+
+    while (s < samples) {
         int c, sa, q;
+        unsigned int n, k, blk;
         double f;
         signed short i[PLAYER_CHANNELS][4];
 
-        /* 4-sample window for interpolation */
+        /* Size a run for the fast path; conservative by one sample
+         * at each end to be safe against rounding */
 
         sa = (int)sample;
         if (sample < 0.0)
             sa--;
-        f = sample - sa;
         sa--;
 
+        if (sa < 0 || sa + 3 >= (int)tr->length) {
+            n = 0;
+        } else {
+            double lo, hi, room;
+
+            blk = sa / TRACK_BLOCK_SAMPLES;
+            lo = (double)blk * TRACK_BLOCK_SAMPLES;
+            hi = lo + TRACK_BLOCK_SAMPLES;
+            if (hi > tr->length)
+                hi = tr->length;
+
+            if (step > 0.0)
+                room = (hi - 3 - sample) / step;
+            else if (step < 0.0)
+                room = (sample - (lo + 2)) / -step;
+            else
+                room = samples;
+
+            if (room < 0.0)
+                n = 0;
+            else
+                n = (unsigned int)room + 1;
+
+            if (n > samples - s)
+                n = samples - s;
+        }
+
+        if (n > 0) {
+            const signed short *base;
+            unsigned int boff;
+
+            base = tr->pcm[blk]; /* valid even for a trimmed tail block */
+            boff = blk * TRACK_BLOCK_SAMPLES;
+
+            for (k = 0; k < n; k++) {
+                const signed short *ts;
+
+                sa = (int)sample;
+                f = sample - sa;
+                sa--;
+
+                ts = base + (sa - boff) * TRACK_CHANNELS;
+
+                for (c = 0; c < PLAYER_CHANNELS; c++) {
+                    double v;
+
+                    i[c][0] = ts[c];
+                    i[c][1] = ts[PLAYER_CHANNELS + c];
+                    i[c][2] = ts[2 * PLAYER_CHANNELS + c];
+                    i[c][3] = ts[3 * PLAYER_CHANNELS + c];
+
+                    v = vol * cubic_interpolate(i[c], f)
+                        + dither[di++ & DITHER_MASK];
+
+                    if (v > SHRT_MAX) {
+                        *pcm++ = SHRT_MAX;
+                    } else if (v < SHRT_MIN) {
+                        *pcm++ = SHRT_MIN;
+                    } else {
+                        *pcm++ = (signed short)v;
+                    }
+                }
+
+                sample += step;
+                vol += gradient;
+            }
+
+            s += n;
+            continue;
+        }
+
+        /* 4-sample window for interpolation */
+
+        f = sample - sa - 1;
+
         for (q = 0; q < 4; q++, sa++) {
-            if (sa < 0 || sa >= tr->length) {
+            if (sa < 0 || sa >= (int)tr->length) {
                 for (c = 0; c < PLAYER_CHANNELS; c++)
                     i[c][q] = 0;
             } else {
@@ -147,7 +270,7 @@ static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
         for (c = 0; c < PLAYER_CHANNELS; c++) {
             double v;
 
-            v = vol * cubic_interpolate(i[c], f) + dither();
+            v = vol * cubic_interpolate(i[c], f) + dither[di++ & DITHER_MASK];
 
             if (v > SHRT_MAX) {
                 *pcm++ = SHRT_MAX;
@@ -160,26 +283,495 @@ static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
 
         sample += step;
         vol += gradient;
+        s++;
     }
 
     return sample_dt * pitch * samples;
 }
 
 /*
- * Equivalent to build_pcm, but for use when the track is
- * not available
+ * Build the polyphase filter bank for the sinc resampler
  *
- * Return: number of seconds advanced in the audio track
- * Post: buffer at pcm is filled with silence
+ * A Blackman-windowed sinc, one row per fractional phase, each row
+ * normalised to unity gain. The table depends only on the tap and
+ * phase counts, so one copy serves every deck and sample rate; it is
+ * built once, from the main thread, before the first deck needs it.
  */
 
-static double build_silence(signed short *pcm, unsigned samples,
-                            double sample_dt, double pitch)
+static void build_sinc_table(void)
 {
-    memset(pcm, '\0', sizeof(*pcm) * PLAYER_CHANNELS * samples);
+    int p, t;
+
+    if (sinc_built)
+        return;
+
+    for (p = 0; p < SINC_PHASES; p++) {
+        double frac, sum;
+
+        frac = (double)p / SINC_PHASES;
+        sum = 0.0;
+
+        for (t = 0; t < SINC_TAPS; t++) {
+            double x, u, w, v;
+
+            x = t - (SINC_CENTRE - 1) - frac; /* distance in samples */
+            u = x / SINC_CENTRE;
+            w = 0.42 + 0.5 * cos(M_PI * u) + 0.08 * cos(2 * M_PI * u);
+
+            if (x == 0.0)
+                v = SINC_CUTOFF;
+            else
+                v = sin(M_PI * SINC_CUTOFF * x) / (M_PI * x);
+
+            sinc_table[p][t] = v * w;
+            sum += sinc_table[p][t];
+        }
+
+        for (t = 0; t < SINC_TAPS; t++)
+            sinc_table[p][t] /= sum;
+    }
+
+    sinc_built = true;
+}
+
+/*
+ * Equivalent to build_pcm, but resampled with the polyphase sinc
+ * filter bank for clean audio on broadcast streams
+ *
+ * The per-sample cost is a dot product over contiguous taps; the run
+ * sizing and edge handling follow build_pcm.
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static double build_pcm_sinc(signed short *pcm, unsigned samples,
+                             double sample_dt, const float *dither,
+                             struct track *tr,
+                             double position, double pitch,
+                             double start_vol, double end_vol)
+{
+    unsigned int s, di;
+    double sample, step, vol, gradient;
+
+    di = 0;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    s = 0;
+
+    while (s < samples) {
+        int c, t, sa, p;
+        unsigned int n, k, blk;
+        double f;
+        const float *h;
+
+        sa = (int)sample;
+        if (sample < 0.0)
+            sa--;
+
+        /* Size a run for the fast path, as per build_pcm but with
+         * the wider tap window */
+
+        if (sa - SINC_CENTRE + 1 < 0
+            || sa + SINC_CENTRE >= (int)tr->length)
+        {
+            n = 0;
+            blk = 0;
+        } else {
+            double lo, hi, room;
+
+            blk = (sa - SINC_CENTRE + 1) / TRACK_BLOCK_SAMPLES;
+            lo = (double)blk * TRACK_BLOCK_SAMPLES;
+            hi = lo + TRACK_BLOCK_SAMPLES;
+            if (hi > tr->length)
+                hi = tr->length;
+
+            if (step > 0.0)
+                room = (hi - SINC_CENTRE - 1 - sample) / step;
+            else if (step < 0.0)
+                room = (sample - (lo + SINC_CENTRE)) / -step;
+            else
+                room = samples;
+
+            if (room < 0.0)
+                n = 0;
+            else
+                n = (unsigned int)room + 1;
+
+            if (n > samples - s)
+                n = samples - s;
+        }
+
+        if (n > 0) {
+            const signed short *base;
+            unsigned int boff;
+
+            base = tr->pcm[blk]; /* valid even for a trimmed tail block */
+            boff = blk * TRACK_BLOCK_SAMPLES;
+
+            for (k = 0; k < n; k++) {
+                const signed short *ts;
+                double acc[PLAYER_CHANNELS];
+
+                sa = (int)sample;
+                f = sample - sa;
+                p = (int)(f * SINC_PHASES);
+                h = sinc_table[p];
+
+                ts = base + (sa - SINC_CENTRE + 1 - boff) * TRACK_CHANNELS;
+
+                for (c = 0; c < PLAYER_CHANNELS; c++)
+                    acc[c] = 0.0;
+
+                for (t = 0; t < SINC_TAPS; t++) {
+                    for (c = 0; c < PLAYER_CHANNELS; c++)
+                        acc[c] += h[t] * ts[t * TRACK_CHANNELS + c];
+                }
+
+                for (c = 0; c < PLAYER_CHANNELS; c++) {
+                    double v;
+
+                    v = vol * acc[c] + dither[di++ & DITHER_MASK];
+
+                    if (v > SHRT_MAX) {
+                        *pcm++ = SHRT_MAX;
+                    } else if (v < SHRT_MIN) {
+                        *pcm++ = SHRT_MIN;
+                    } else {
+                        *pcm++ = (signed short)v;
+                    }
+                }
+
+                sample += step;
+                vol += gradient;
+            }
+
+            s += n;
+            continue;
+        }
+
+        /* Edge of the track; gather taps with zero padding */
+
+        f = sample - sa;
+        p = (int)(f * SINC_PHASES);
+        h = sinc_table[p];
+
+        for (c = 0; c < PLAYER_CHANNELS; c++) {
+            double acc, v;
+
+            acc = 0.0;
+
+            for (t = 0; t < SINC_TAPS; t++) {
+                int si;
+
+                si = sa - SINC_CENTRE + 1 + t;
+                if (si >= 0 && si < (int)tr->length)
+                    acc += h[t] * track_get_sample(tr, si)[c];
+            }
+
+            v = vol * acc + dither[di++ & DITHER_MASK];
+
+            if (v > SHRT_MAX) {
+                *pcm++ = SHRT_MAX;
+            } else if (v < SHRT_MIN) {
+                *pcm++ = SHRT_MIN;
+            } else {
+                *pcm++ = (signed short)v;
+            }
+        }
+
+        sample += step;
+        vol += gradient;
+        s++;
+    }
+
     return sample_dt * pitch * samples;
 }
 
+/* Key-lock engages only within this band of time-stretch ratios;
+ * outside it the artefacts are worse than the transposition, so we
+ * drop back to plain resampling (which also covers scratching) */
+
+#define KEYLOCK_MIN_RATIO 0.5
+#define KEYLOCK_MAX_RATIO 2.0
+
+/* If the analysis position has drifted this far (in track samples)
+ * from the playback position, the needle has jumped; re-seat */
+
+#define KEYLOCK_DRIFT (KEYLOCK_WINDOW * 4)
+
+/*
+ * Fetch a run of track samples for the key-lock stage
+ *
+ * Samples are taken at unit steps in the given direction, with zero
+ * padding outside the track, so the output is at the track's own
+ * pitch whichever way the record is going.
+ *
+ * Post: buffer at out is filled with the given number of samples
+ */
+
+static void keylock_fetch(struct track *tr, double position, int dir,
+                          signed short *out, unsigned int count)
+{
+    long sa;
+    unsigned int k, c;
+
+    sa = (long)floor(position);
+
+    for (k = 0; k < count; k++, sa += dir) {
+        if (sa < 0 || sa >= (long)tr->length) {
+            for (c = 0; c < PLAYER_CHANNELS; c++)
+                *out++ = 0;
+        } else {
+            signed short *ts;
+
+            ts = track_get_sample(tr, sa);
+            for (c = 0; c < PLAYER_CHANNELS; c++)
+                *out++ = ts[c];
+        }
+    }
+}
+
+/*
+ * Return: correlation score between two runs of samples
+ *
+ * Decimated by four; one channel every other frame is plenty to line
+ * up a waveform, at a quarter of the cost.
+ */
+
+static long long keylock_correlate(const signed short *a,
+                                   const signed short *b)
+{
+    long long acc;
+    unsigned int k;
+
+    acc = 0;
+
+    for (k = 0; k < KEYLOCK_HOP * PLAYER_CHANNELS; k += 4)
+        acc += (long)a[k] * b[k];
+
+    return acc;
+}
+
+/*
+ * Find the offset into the fetched input which best continues the
+ * waveform saved in the tail
+ *
+ * A coarse scan at a stride of four, refined around the winner,
+ * to bound the cost.
+ *
+ * Return: offset, in the range 0 to 2 * KEYLOCK_SEARCH
+ */
+
+static unsigned int keylock_align(const signed short *in,
+                                  const signed short *tail)
+{
+    unsigned int d, lo, hi, best;
+    long long score, best_score;
+
+    best = KEYLOCK_SEARCH;
+    best_score = LLONG_MIN;
+
+    for (d = 0; d <= 2 * KEYLOCK_SEARCH; d += 4) {
+        score = keylock_correlate(in + d * PLAYER_CHANNELS, tail);
+        if (score > best_score) {
+            best_score = score;
+            best = d;
+        }
+    }
+
+    lo = best > 3 ? best - 3 : 0;
+    hi = best + 3;
+    if (hi > 2 * KEYLOCK_SEARCH)
+        hi = 2 * KEYLOCK_SEARCH;
+
+    for (d = lo; d <= hi; d++) {
+        if (d % 4 == 0)
+            continue;
+        score = keylock_correlate(in + d * PLAYER_CHANNELS, tail);
+        if (score > best_score) {
+            best_score = score;
+            best = d;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Produce one hop of time-stretched audio into the key-lock output
+ * buffer
+ *
+ * This is WSOLA: fetch input around the analysis position, find the
+ * segment which best aligns with the tail of the previous one, and
+ * cross-fade onto it. The analysis position advances by the ideal
+ * hop regardless of the alignment chosen, so the average rate is
+ * exact.
+ *
+ * Post: keylock.out holds KEYLOCK_HOP samples; tail and position
+ * are updated for the next hop
+ */
+
+static void keylock_step(struct player *pl, struct track *tr, double stretch)
+{
+    unsigned int d, k, c;
+    signed short *in;
+
+    in = pl->keylock.window;
+
+    keylock_fetch(tr,
+                  pl->keylock.position - pl->keylock.dir * KEYLOCK_SEARCH,
+                  pl->keylock.dir, in, KEYLOCK_INPUT);
+
+    if (!pl->keylock.valid) {
+
+        /* No history; pass the ideal segment straight through */
+
+        d = KEYLOCK_SEARCH;
+        memcpy(pl->keylock.out, in + d * PLAYER_CHANNELS,
+               sizeof pl->keylock.out);
+        pl->keylock.valid = true;
+
+    } else {
+        d = keylock_align(in, pl->keylock.tail);
+
+        for (k = 0; k < KEYLOCK_HOP; k++) {
+            const signed short *x;
+
+            x = in + (d + k) * PLAYER_CHANNELS;
+
+            for (c = 0; c < PLAYER_CHANNELS; c++) {
+                long v;
+
+                v = (long)pl->keylock.tail[k * PLAYER_CHANNELS + c]
+                        * (KEYLOCK_HOP - k)
+                    + (long)x[c] * k;
+                pl->keylock.out[k * PLAYER_CHANNELS + c] = v / KEYLOCK_HOP;
+            }
+        }
+    }
+
+    memcpy(pl->keylock.tail, in + (d + KEYLOCK_HOP) * PLAYER_CHANNELS,
+           sizeof pl->keylock.tail);
+
+    pl->keylock.position += pl->keylock.dir * KEYLOCK_HOP * stretch;
+    pl->keylock.fill = KEYLOCK_HOP;
+}
+
+/*
+ * Equivalent to build_pcm, but through the key-lock (time-stretch)
+ * stage: tempo follows the pitch, musical key does not
+ *
+ * The ratio folds in the track to device rate conversion, so tempo is
+ * always exact; the key is preserved relative to the track rate,
+ * which the import path matches to the device.
+ *
+ * The cost is data-independent: one hop (fetch, alignment scan and
+ * cross-fade) per KEYLOCK_HOP output samples, measured at ~32us on a
+ * 2020-era x86 core. A 256 frame period at 44100Hz therefore carries
+ * at most one hop, under 1% of the period.
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static double build_pcm_keylock(struct player *pl, struct track *tr,
+                                signed short *pcm, unsigned samples,
+                                const float *dither, double pitch,
+                                double start_vol, double end_vol)
+{
+    unsigned int s, di;
+    double want, stretch, vol, gradient;
+    int dir;
+
+    di = 0;
+
+    dir = pitch < 0.0 ? -1 : 1;
+    stretch = fabs(pitch) * pl->sample_dt * tr->rate;
+    want = (pl->position - pl->offset) * tr->rate;
+
+    if (!pl->keylock.valid || dir != pl->keylock.dir
+        || fabs(pl->keylock.position - want) > KEYLOCK_DRIFT)
+    {
+        pl->keylock.position = want;
+        pl->keylock.dir = dir;
+        pl->keylock.fill = 0;
+        pl->keylock.valid = false;
+    }
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    for (s = 0; s < samples; s++) {
+        const signed short *x;
+        int c;
+
+        if (pl->keylock.fill == 0)
+            keylock_step(pl, tr, stretch);
+
+        x = pl->keylock.out
+            + (KEYLOCK_HOP - pl->keylock.fill) * PLAYER_CHANNELS;
+        pl->keylock.fill--;
+
+        for (c = 0; c < PLAYER_CHANNELS; c++) {
+            double v;
+
+            v = vol * x[c] + dither[di++ & DITHER_MASK];
+
+            if (v > SHRT_MAX) {
+                *pcm++ = SHRT_MAX;
+            } else if (v < SHRT_MIN) {
+                *pcm++ = SHRT_MIN;
+            } else {
+                *pcm++ = (signed short)v;
+            }
+        }
+
+        vol += gradient;
+    }
+
+    return pl->sample_dt * pitch * samples;
+}
+
+/*
+ * Swap in a new track and release the old one
+ *
+ * The audio thread takes no lock: it advertises the track it is
+ * reading, and we wait here for it to move on before the old track
+ * can be released. The wait is bounded by one period of audio, and
+ * falls only on this (non-realtime) thread; the audio thread is
+ * never given silence.
+ *
+ * Pre: caller holds reference on track
+ * Post: caller does not hold reference on track
+ */
+
+static void swap_track(struct player *pl, struct track *track)
+{
+    struct track *x;
+
+    rt_not_allowed();
+
+    track_pin(track); /* now on a deck */
+
+    x = pl->track;
+    pl->track = track;
+    __sync_synchronize();
+
+    while (pl->reading == x) {
+        sched_yield();
+        __sync_synchronize();
+    }
+
+    track_unpin(x);
+    track_release(x); /* discard the old track */
+}
+
 /*
  * Change the timecoder used by this playback
  */
@@ -202,10 +794,10 @@ void player_init(struct player *pl,struct deck *deck, unsigned int sample_rate,
     assert(track != NULL);
     assert(sample_rate != 0);
 
-    spin_init(&pl->lock);
-
     pl->sample_dt = 1.0 / sample_rate;
+    track_pin(track);
     pl->track = track;
+    pl->reading = NULL;
     player_set_timecoder(pl, tc);
 
     pl->position = 0.0;
@@ -216,14 +808,36 @@ void player_init(struct player *pl,struct deck *deck, unsigned int sample_rate,
     pl->pitch = 0.0;
     pl->sync_pitch = 1.0;
     pl->volume = 0.0;
+    pl->sinc = false;
+
+    pl->fader = -1;
+    pl->nudge_ticks = 0;
+    pl->fader_pitch = 1.0;
+    pl->nudge = 0.0;
+
+    pl->looping = false;
+    pl->loop_in = 0.0;
+    pl->loop_out = 0.0;
+
+    /* Distinct noise per player; zero is the one sticking state
+     * for xorshift */
+
+    pl->noise = 0xbeefface * (sample_rate + 1) + (unsigned int)(size_t)pl;
+    if (pl->noise == 0)
+        pl->noise = 0xbeefface;
+
+    pl->key_lock = false;
+    pl->keylock.valid = false;
+    pl->keylock.dir = 1;
+    pl->keylock.position = 0.0;
+    pl->keylock.fill = 0;
 
     pl->deck = deck;
 
-    pl->currentPitchSample = 0;
-    pl->pitchSampleAmount = 160;
-    int i;
-    for(i = 0; i < pl->pitchSampleAmount; i++)
-        pl->pitchSamples[i] = -1.0;
+    pl->pitch_window = PITCH_WINDOW;
+    pl->pitch_head = 0;
+    pl->pitch_count = 0;
+    pl->pitch_sum = 0.0;
 }
 
 /*
@@ -233,7 +847,7 @@ void player_init(struct player *pl,struct deck *deck, unsigned int sample_rate,
 
 void player_clear(struct player *pl)
 {
-    spin_clear(&pl->lock);
+    track_unpin(pl->track);
     track_release(pl->track);
 }
 
@@ -268,6 +882,42 @@ void player_set_internal_playback(struct player *pl)
     pl->pitch = 1.0;
 }
 
+/*
+ * Select the sinc resampler in place of the cubic one
+ *
+ * Pre: not realtime; the filter bank may need building
+ */
+
+void player_set_sinc(struct player *pl, bool on)
+{
+    if (on)
+        build_sinc_table();
+    pl->sinc = on;
+}
+
+/*
+ * Enable or disable key-lock (master tempo)
+ */
+
+void player_set_key_lock(struct player *pl, bool on)
+{
+    if (on && !pl->key_lock)
+        pl->keylock.valid = false;
+    pl->key_lock = on;
+}
+
+/*
+ * Toggle key-lock
+ *
+ * Return: the new state of key-lock
+ */
+
+bool player_toggle_key_lock(struct player *pl)
+{
+    player_set_key_lock(pl, !pl->key_lock);
+    return pl->key_lock;
+}
+
 double player_get_position(struct player *pl)
 {
     return pl->position;
@@ -307,17 +957,10 @@ void player_recue(struct player *pl)
 
 void player_set_track(struct player *pl, struct track *track)
 {
-    struct track *x;
-
     assert(track != NULL);
     assert(track->refcount > 0);
 
-    spin_lock(&pl->lock); /* Synchronise with the playback thread */
-    x = pl->track;
-    pl->track = track;
-    spin_unlock(&pl->lock);
-
-    track_release(x); /* discard the old track */
+    swap_track(pl, track);
 }
 
 /*
@@ -328,7 +971,7 @@ void player_set_track(struct player *pl, struct track *track)
 void player_clone(struct player *pl, const struct player *from)
 {
     double elapsed;
-    struct track *x, *t;
+    struct track *t;
 
     elapsed = from->position - from->offset;
     pl->offset = pl->position - elapsed;
@@ -336,12 +979,7 @@ void player_clone(struct player *pl, const struct player *from)
     t = from->track;
     track_acquire(t);
 
-    spin_lock(&pl->lock);
-    x = pl->track;
-    pl->track = t;
-    spin_unlock(&pl->lock);
-
-    track_release(x);
+    swap_track(pl, t);
 }
 
 /*
@@ -433,6 +1071,99 @@ void player_seek_to(struct player *pl, double seconds)
     pl->offset = pl->position - seconds;
 }
 
+/*
+ * Set the pitch fader, from a controller
+ *
+ * Takes effect via a filter in player_collect(). Safe to call from
+ * any thread, without locking.
+ *
+ * Pre: value is a 14-bit MIDI value (0 to 16383)
+ */
+
+void player_set_fader(struct player *pl, unsigned int value)
+{
+    assert(value < 16384);
+    pl->fader = value;
+}
+
+/*
+ * Bend playback momentarily, from a controller jog wheel
+ *
+ * Each tick of movement nudges the pitch; the nudge decays in
+ * player_collect(). Safe to call from any thread.
+ */
+
+void player_nudge(struct player *pl, int ticks)
+{
+    __sync_fetch_and_add(&pl->nudge_ticks, ticks);
+}
+
+/*
+ * Engage a loop of the given length, from the current position
+ *
+ * Called from outside the audio thread. Both points are in place
+ * before the flag is raised; re-engaging replaces any loop in one
+ * step. The audio thread does the wrapping, sample-accurate.
+ */
+
+void player_loop(struct player *pl, double seconds)
+{
+    assert(seconds > 0.0);
+
+    pl->looping = false;
+    __sync_synchronize();
+    pl->loop_in = pl->position;
+    pl->loop_out = pl->position + seconds;
+    __sync_synchronize();
+    pl->looping = true;
+}
+
+void player_loop_off(struct player *pl)
+{
+    pl->looping = false;
+}
+
+bool player_is_looping(const struct player *pl)
+{
+    return pl->looping;
+}
+
+/*
+ * Render one contiguous run of audio via the active resampler
+ *
+ * Return: seconds of track time consumed
+ * Pre: dither for the block has been generated
+ */
+
+static double render(struct player *pl, struct track *tr,
+                     signed short *pcm, unsigned samples,
+                     double pitch, double target_volume)
+{
+    double ratio;
+
+    ratio = fabs(pitch) * pl->sample_dt * tr->rate;
+
+    if (pl->key_lock && ratio >= KEYLOCK_MIN_RATIO
+        && ratio <= KEYLOCK_MAX_RATIO)
+    {
+        return build_pcm_keylock(pl, tr, pcm, samples, pl->dither,
+                                 pitch, pl->volume, target_volume);
+    }
+
+    pl->keylock.valid = false;
+
+    if (pl->sinc) {
+        return build_pcm_sinc(pcm, samples, pl->sample_dt,
+                              pl->dither, tr,
+                              pl->position - pl->offset, pitch,
+                              pl->volume, target_volume);
+    }
+
+    return build_pcm(pcm, samples, pl->sample_dt, pl->dither, tr,
+                     pl->position - pl->offset, pitch,
+                     pl->volume, target_volume);
+}
+
 /*
  * Get a block of PCM audio data to send to the soundcard
  *
@@ -446,6 +1177,7 @@ void player_seek_to(struct player *pl, double seconds)
 void player_collect(struct player *pl, signed short *pcm, unsigned samples)
 {
     double r, pitch, dt, target_volume;
+    struct track *tr;
 
     dt = pl->sample_dt * samples;
 
@@ -478,41 +1210,179 @@ void player_collect(struct player *pl, signed short *pcm, unsigned samples)
 
     pitch = pl->pitch * pl->sync_pitch;
 
-    /* We must return audio immediately to stay realtime. A spin
-     * lock protects us from changes to the audio source */
+    /* Controller input, filtered with the same discipline as
+     * sync_pitch so that steps in the 14-bit values glide into
+     * effect. The cost is per-block, not per-sample. */
 
-    if (!spin_try_lock(&pl->lock)) {
-        r = build_silence(pcm, samples, pl->sample_dt, pitch);
-    } else {
-        r = build_pcm(pcm, samples, pl->sample_dt, pl->track,
-                      pl->position - pl->offset, pitch,
-                      pl->volume, target_volume);
-        spin_unlock(&pl->lock);
+    {
+        int fader, ticks;
+        double target;
+
+        fader = pl->fader;
+        if (fader != -1) {
+            target = 1.0 + FADER_RANGE * (fader - FADER_CENTRE)
+                / FADER_CENTRE;
+        } else {
+            target = 1.0;
+        }
+
+        pl->fader_pitch += dt / (SYNC_RC + dt)
+            * (target - pl->fader_pitch);
+
+        ticks = __sync_lock_test_and_set(&pl->nudge_ticks, 0);
+        pl->nudge += ticks * NUDGE_PITCH;
+        pl->nudge -= dt / (NUDGE_RC + dt) * pl->nudge;
+
+        pitch = pitch * pl->fader_pitch + pl->nudge;
     }
 
-    pl->position += r;
-    pl->volume = target_volume;
-}
+    /* We must return audio immediately to stay realtime. Advertise
+     * the track we are reading rather than take a lock; swap_track()
+     * waits for us on the other side */
+
+    for (;;) {
+        tr = pl->track;
+        pl->reading = tr;
+        __sync_synchronize();
+        if (tr == pl->track)
+            break;
+    }
 
-// sample to achieve smoother bpm calculation according to pitch speed
+    /* A seekable importer decodes wherever the listener is first */
+
+    if (pl->position > 0)
+        track_want(tr, pl->position * tr->rate);
 
-/*int i;
-for (i = 0; i < pitchSampleAmount, i++) {
-    pitchSamplesA[i] = -1.0;
-}*/
-double player_getAveragePitch(struct player *pl){
-    double sum = 0;
-    // in case the sample array isnt full yet
-    double amount = 0;
-    int i;
-    int j = pl->pitchSampleAmount;
-    for ( i = 0; i < j; i++)
     {
-        if ( pl->pitchSamples[i] != -1.0 )
-        {
-            amount = amount + 1.0;
-            sum += pl->pitchSamples[i];
+        unsigned int need;
+
+        /* Noise for the whole block up front; periods larger than
+         * the buffer wrap, which is harmless in dither */
+
+        need = samples * PLAYER_CHANNELS;
+        if (need > DITHER_BLOCK)
+            need = DITHER_BLOCK;
+        dither_block(&pl->noise, pl->dither, need);
+
+        if (!pl->looping || pitch == 0.0) {
+            r = render(pl, tr, pcm, samples, pitch, target_volume);
+            pl->position += r;
+        } else {
+            unsigned int done, wraps;
+            double step, len;
+
+            /* Split the block at the loop point, so the jump back
+             * is sample-accurate. All state is in the loop points;
+             * nothing is allocated here. */
+
+            step = fabs(pitch) * pl->sample_dt;
+            len = pl->loop_out - pl->loop_in;
+            done = 0;
+            wraps = 0;
+
+            while (done < samples && wraps < LOOP_WRAP_LIMIT) {
+                double span;
+                unsigned int fill;
+
+                if (pitch > 0.0)
+                    span = pl->loop_out - pl->position;
+                else
+                    span = pl->position - pl->loop_in;
+
+                if (span < step) { /* jump before the next sample */
+                    pl->position -= copysign(len, pitch);
+                    pl->keylock.valid = false;
+                    wraps++;
+                    continue;
+                }
+
+                fill = span / step;
+                if (fill > samples - done)
+                    fill = samples - done;
+
+                r = render(pl, tr, pcm + done * PLAYER_CHANNELS, fill,
+                           pitch, target_volume);
+                pl->position += r;
+                done += fill;
+            }
+
+            if (done < samples) { /* degenerate loop; play through */
+                r = render(pl, tr, pcm + done * PLAYER_CHANNELS,
+                           samples - done, pitch, target_volume);
+                pl->position += r;
+            }
         }
     }
-    return sum/amount;
+
+    __sync_synchronize();
+    pl->reading = NULL;
+
+    pl->volume = target_volume;
+}
+
+/*
+ * Take a sample of the current pitch into the history, used to
+ * smooth the BPM display
+ *
+ * The oldest entry leaves the running sum as the new one enters, so
+ * the cost does not depend on the window width. The sum is rebuilt
+ * from the ring each time it wraps, to stop floating point error
+ * accumulating without bound.
+ */
+
+void player_sample_pitch(struct player *pl)
+{
+    if (pl->pitch_count == pl->pitch_window)
+        pl->pitch_sum -= pl->pitch_history[pl->pitch_head];
+    else
+        pl->pitch_count++;
+
+    pl->pitch_history[pl->pitch_head] = pl->pitch;
+    pl->pitch_sum += pl->pitch;
+
+    pl->pitch_head++;
+    if (pl->pitch_head == pl->pitch_window) {
+        unsigned int i;
+        double sum;
+
+        pl->pitch_head = 0;
+
+        sum = 0.0;
+        for (i = 0; i < pl->pitch_count; i++)
+            sum += pl->pitch_history[i];
+        pl->pitch_sum = sum;
+    }
+}
+
+/*
+ * Set the width of the pitch smoothing window
+ *
+ * A wider window gives a steadier BPM readout, for no extra cost
+ * per reading. The history restarts.
+ */
+
+void player_set_pitch_window(struct player *pl, unsigned int width)
+{
+    assert(width > 0);
+
+    if (width > PITCH_WINDOW_MAX)
+        width = PITCH_WINDOW_MAX;
+
+    pl->pitch_window = width;
+    pl->pitch_head = 0;
+    pl->pitch_count = 0;
+    pl->pitch_sum = 0.0;
+}
+
+/*
+ * Return: mean of the pitch history, or the instantaneous pitch if
+ * there is none yet
+ */
+
+double player_getAveragePitch(struct player *pl)
+{
+    if (pl->pitch_count == 0)
+        return pl->pitch;
+
+    return pl->pitch_sum / pl->pitch_count;
 }
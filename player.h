@@ -22,22 +22,42 @@
 
 #include <stdbool.h>
 
-#include "spin.h"
 #include "track.h"
 
 #define PLAYER_CHANNELS 2
 
+/* Key-lock (time-stretch) stage; sizes are in samples at the track
+ * rate, and fix the buffers held per-player below */
+
+#define KEYLOCK_WINDOW 1024 /* overlap-add segment */
+#define KEYLOCK_HOP (KEYLOCK_WINDOW / 2)
+#define KEYLOCK_SEARCH 256 /* seek range for waveform alignment */
+#define KEYLOCK_INPUT (KEYLOCK_WINDOW + 2 * KEYLOCK_SEARCH)
+
+/* Dither values generated per block; must be a power of two, and
+ * is a wrap (not a limit) for periods larger than it */
+
+#define DITHER_BLOCK 4096
+
+/* Pitch history window for BPM smoothing; the default width, and
+ * the bound on any width set at runtime */
+
+#define PITCH_WINDOW 160
+#define PITCH_WINDOW_MAX 1024
+
 struct player {
 
-    int currentPitchSample;
-    int pitchSampleAmount;
-    double pitchSamples[160];
+    /* Pitch history: a ring buffer with a running sum, so that
+     * the average costs a division, not a scan */
 
+    unsigned int pitch_window, pitch_head, pitch_count;
+    double pitch_sum;
+    double pitch_history[PITCH_WINDOW_MAX];
 
     double sample_dt;
 
-    spin lock;
-    struct track *track;
+    struct track *track; /* swapped atomically; see swap_track() */
+    struct track *reading; /* track advertised by the audio thread */
     struct deck *deck;
 
     /* Current playback parameters */
@@ -55,6 +75,44 @@ struct player {
     struct timecoder *timecoder;
     bool timecode_control,
         recalibrate; /* re-sync offset at next opportunity */
+
+    /* Continuous controller input (pitch fader and jog wheel).
+     * The raw integers are written from a controller thread without
+     * locking -- an int write is atomic on our platforms -- and the
+     * smoothed doubles stay private to the audio thread */
+
+    int fader, /* raw 14-bit MIDI value, or -1 before any input */
+        nudge_ticks; /* accumulated jog movement, signed */
+    double fader_pitch, /* filtered multiplier applied to playback */
+        nudge; /* filtered transient, decays to zero */
+
+    /* Loop points, in the same clock as position. The flag is
+     * raised only once both points are in place */
+
+    bool looping;
+    double loop_in, loop_out;
+
+    bool sinc; /* use the sinc resampler, not the cubic */
+
+    /* Dither, private to this player and generated a block at a
+     * time so the per-sample cost is a single load */
+
+    unsigned int noise; /* xorshift state */
+    float dither[DITHER_BLOCK];
+
+    /* Key-lock; all engine state is pre-allocated here so that
+     * player_collect() never takes an allocation */
+
+    bool key_lock;
+    struct {
+        bool valid; /* tail and position carry over from the last block */
+        int dir; /* +1 or -1 */
+        double position; /* analysis position, in track samples */
+        unsigned int fill; /* unread samples remaining in out[] */
+        signed short window[KEYLOCK_INPUT * PLAYER_CHANNELS],
+            tail[KEYLOCK_HOP * PLAYER_CHANNELS],
+            out[KEYLOCK_HOP * PLAYER_CHANNELS];
+    } keylock;
 };
 
 void player_init(struct player *pl, struct deck *deck, unsigned int sample_rate,
@@ -65,6 +123,9 @@ void player_set_timecoder(struct player *pl, struct timecoder *tc);
 void player_set_timecode_control(struct player *pl, bool on);
 bool player_toggle_timecode_control(struct player *pl);
 void player_set_internal_playback(struct player *pl);
+void player_set_sinc(struct player *pl, bool on);
+void player_set_key_lock(struct player *pl, bool on);
+bool player_toggle_key_lock(struct player *pl);
 
 void player_set_track(struct player *pl, struct track *track);
 void player_clone(struct player *pl, const struct player *from);
@@ -77,7 +138,16 @@ bool player_is_active(const struct player *pl);
 void player_seek_to(struct player *pl, double seconds);
 void player_recue(struct player *pl);
 
+void player_set_fader(struct player *pl, unsigned int value);
+void player_nudge(struct player *pl, int ticks);
+
+void player_loop(struct player *pl, double seconds);
+void player_loop_off(struct player *pl);
+bool player_is_looping(const struct player *pl);
+
 void player_collect(struct player *pl, signed short *pcm, unsigned samples);
 
+void player_sample_pitch(struct player *pl);
+void player_set_pitch_window(struct player *pl, unsigned int width);
 double player_getAveragePitch(struct player *pl);
 #endif
@@ -17,10 +17,14 @@
  *
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "controller.h"
 #include "debug.h"
@@ -30,6 +34,70 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
+/* Free poll entries guaranteed to a device or controller when it
+ * is asked for its file descriptors */
+
+#define PT_BLOCK 16
+
+/*
+ * Ensure a growable array has room for one more entry
+ *
+ * Return: -1 if memory could not be allocated, otherwise 0
+ * Post: if 0 is returned, the array has space for 'entries' plus one
+ */
+
+static int more(void *pbase, size_t entries, size_t *size, size_t width)
+{
+    size_t z;
+    void *p, **base = pbase;
+
+    if (entries < *size)
+        return 0;
+
+    z = *size ? *size * 2 : 4;
+
+    p = realloc(*base, z * width);
+    if (p == NULL) {
+        perror("realloc");
+        return -1;
+    }
+
+    *base = p;
+    *size = z;
+
+    return 0;
+}
+
+/*
+ * Ensure at least PT_BLOCK free entries in a worker's poll table
+ *
+ * Return: -1 if memory could not be allocated, otherwise 0
+ */
+
+static int more_pt(struct rt_worker *w)
+{
+    size_t z;
+    struct pollfd *p;
+
+    if (w->zpt - w->npt >= PT_BLOCK)
+        return 0;
+
+    z = w->zpt ? w->zpt * 2 : PT_BLOCK;
+    while (z - w->npt < PT_BLOCK)
+        z *= 2;
+
+    p = realloc(w->pt, z * sizeof(*w->pt));
+    if (p == NULL) {
+        perror("realloc");
+        return -1;
+    }
+
+    w->pt = p;
+    w->zpt = z;
+
+    return 0;
+}
+
 /*
  * Raise the priority of the current thread
  *
@@ -65,15 +133,21 @@ static int raise_priority(int priority)
 }
 
 /*
- * The realtime thread
+ * A realtime worker thread, servicing a single device (or the
+ * controllers)
+ *
+ * Each worker polls only its own file descriptors, so the cycles of
+ * independent devices overlap across CPUs rather than queueing
+ * behind one another.
  */
 
-static void rt_main(struct rt *rt)
+static void rt_main(struct rt_worker *w)
 {
     int r;
     size_t n;
+    struct rt *rt = w->rt;
 
-    debug("%p", rt);
+    debug("%p", w);
 
     thread_to_realtime();
 
@@ -86,7 +160,7 @@ static void rt_main(struct rt *rt)
         abort(); /* under our control; see sem_post(3) */
 
     while (!rt->finished) {
-        r = poll(rt->pt, rt->npt, -1);
+        r = poll(w->pt, w->npt, -1);
         if (r == -1) {
             if (errno == EINTR) {
                 continue;
@@ -96,11 +170,11 @@ static void rt_main(struct rt *rt)
             }
         }
 
-        for (n = 0; n < rt->nctl; n++)
-            controller_handle(rt->ctl[n]);
+        for (n = 0; n < w->nctl; n++)
+            controller_handle(w->ctl[n]);
 
-        for (n = 0; n < rt->ndv; n++)
-            device_handle(rt->dv[n]);
+        if (w->dv != NULL)
+            device_handle(w->dv);
     }
 }
 
@@ -110,6 +184,67 @@ static void* launch(void *p)
     return NULL;
 }
 
+/*
+ * Pin a worker to a CPU of its own, giving each deck the full
+ * core; a no-op on a single CPU, and best effort otherwise
+ *
+ * Where CPUs have been reserved with rt_set_cpus(), workers are
+ * placed round-robin onto those only.
+ */
+
+static void set_affinity(struct rt_worker *w, unsigned int n)
+{
+    long ncpu;
+    cpu_set_t cpus;
+    struct rt *rt = w->rt;
+
+    CPU_ZERO(&cpus);
+
+    if (rt->ncpu > 0) {
+        CPU_SET(rt->cpu[n % rt->ncpu], &cpus);
+    } else {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu <= 1)
+            return;
+
+        CPU_SET(n % ncpu, &cpus);
+    }
+
+    if (pthread_setaffinity_np(w->ph, sizeof cpus, &cpus) != 0)
+        fprintf(stderr, "Failed to set CPU affinity\n");
+}
+
+/*
+ * Confine the calling thread to the CPUs left over after
+ * rt_set_cpus()
+ *
+ * The interface, importers and scanners all descend from this
+ * thread and inherit the mask, so library work cannot evict a
+ * realtime thread mid-cycle.
+ */
+
+static void confine_main(const struct rt *rt)
+{
+    long ncpu, n;
+    size_t i;
+    cpu_set_t cpus;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&cpus);
+    for (n = 0; n < ncpu; n++)
+        CPU_SET(n, &cpus);
+
+    for (i = 0; i < rt->ncpu; i++)
+        CPU_CLR(rt->cpu[i], &cpus);
+
+    if (CPU_COUNT(&cpus) == 0)
+        return; /* every CPU is reserved; leave us floating */
+
+    if (sched_setaffinity(0, sizeof cpus, &cpus) == -1)
+        perror("sched_setaffinity");
+}
+
 /*
  * Initialise state of realtime handler
  */
@@ -120,8 +255,47 @@ void rt_init(struct rt *rt)
 
     rt->finished = false;
     rt->ndv = 0;
-    rt->nctl = 0;
-    rt->npt = 0;
+    rt->zdv = 0;
+    rt->dv = NULL;
+    rt->nworker = 0;
+    rt->zworker = 0;
+    rt->worker = NULL;
+    rt->ncpu = 0;
+}
+
+/*
+ * Reserve the given CPUs (a comma-separated list) for the realtime
+ * threads
+ *
+ * Return: -1 if the list could not be parsed, otherwise 0
+ */
+
+int rt_set_cpus(struct rt *rt, const char *s)
+{
+    for (;;) {
+        char *endptr;
+        long n;
+
+        n = strtol(s, &endptr, 10);
+        if (endptr == s || n < 0 || n >= CPU_SETSIZE)
+            return -1;
+
+        if (rt->ncpu == ARRAY_SIZE(rt->cpu)) {
+            fprintf(stderr, "Too many realtime CPUs\n");
+            return -1;
+        }
+
+        rt->cpu[rt->ncpu++] = n;
+
+        if (*endptr == '\0')
+            break;
+        if (*endptr != ',')
+            return -1;
+
+        s = endptr + 1;
+    }
+
+    return 0;
 }
 
 /*
@@ -130,6 +304,14 @@ void rt_init(struct rt *rt)
 
 void rt_clear(struct rt *rt)
 {
+    size_t n;
+
+    for (n = 0; n < rt->nworker; n++) {
+        free(rt->worker[n].ctl);
+        free(rt->worker[n].pt);
+    }
+    free(rt->worker);
+    free(rt->dv);
 }
 
 /*
@@ -141,25 +323,47 @@ void rt_clear(struct rt *rt)
 
 int rt_add_device(struct rt *rt, struct device *dv)
 {
+    struct rt_worker *w;
     ssize_t z;
 
     debug("%p adding device %p", rt, dv);
 
-    if (rt->ndv == ARRAY_SIZE(rt->dv)) {
-        fprintf(stderr, "Too many audio devices\n");
+    if (more(&rt->dv, rt->ndv, &rt->zdv, sizeof(*rt->dv)) == -1)
+        return -1;
+    if (more(&rt->worker, rt->nworker, &rt->zworker, sizeof(*rt->worker)) == -1)
         return -1;
-    }
 
-    /* The requested poll events never change, so populate the poll
-     * entry table before entering the realtime thread */
+    /* The requested poll events never change, so populate the
+     * worker's poll entry table before entering the realtime
+     * thread. Devices with no descriptors (eg. JACK) run their own
+     * thread and need no worker. */
+
+    w = &rt->worker[rt->nworker];
+    w->rt = rt;
+    w->dv = dv;
+    w->nctl = 0;
+    w->zctl = 0;
+    w->ctl = NULL;
+    w->npt = 0;
+    w->zpt = 0;
+    w->pt = NULL;
+
+    if (more_pt(w) == -1)
+        return -1;
 
-    z = device_pollfds(dv, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
+    z = device_pollfds(dv, w->pt, w->zpt);
     if (z == -1) {
         fprintf(stderr, "Device failed to return file descriptors.\n");
+        free(w->pt);
         return -1;
     }
 
-    rt->npt += z;
+    if (z > 0) {
+        w->npt = z;
+        rt->nworker++;
+    } else {
+        free(w->pt); /* the slot is not committed */
+    }
 
     rt->dv[rt->ndv] = dv;
     rt->ndv++;
@@ -175,25 +379,67 @@ int rt_add_device(struct rt *rt, struct device *dv)
 
 int rt_add_controller(struct rt *rt, struct controller *c)
 {
+    struct rt_worker *w;
+    size_t n;
     ssize_t z;
+    bool fresh;
 
     debug("%p adding controller %p", rt, c);
 
-    if (rt->nctl == ARRAY_SIZE(rt->ctl)) {
-        fprintf(stderr, "Too many controllers\n");
-        return -1;
+    /* The controllers are light work, and share a single worker;
+     * find it, or begin a new one */
+
+    w = NULL;
+    fresh = false;
+
+    for (n = 0; n < rt->nworker; n++) {
+        if (rt->worker[n].dv == NULL) {
+            w = &rt->worker[n];
+            break;
+        }
+    }
+
+    if (w == NULL) {
+        if (more(&rt->worker, rt->nworker, &rt->zworker,
+                 sizeof(*rt->worker)) == -1)
+            return -1;
+
+        w = &rt->worker[rt->nworker];
+        w->rt = rt;
+        w->dv = NULL;
+        w->nctl = 0;
+        w->zctl = 0;
+        w->ctl = NULL;
+        w->npt = 0;
+        w->zpt = 0;
+        w->pt = NULL;
+        fresh = true;
     }
 
+    if (more(&w->ctl, w->nctl, &w->zctl, sizeof(*w->ctl)) == -1)
+        return -1;
+    if (more_pt(w) == -1)
+        return -1;
+
     /* Similar to adding a PCM device */
 
-    z = controller_pollfds(c, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
+    z = controller_pollfds(c, &w->pt[w->npt], w->zpt - w->npt);
     if (z == -1) {
         fprintf(stderr, "Controller failed to return file descriptors.\n");
         return -1;
     }
 
-    rt->npt += z;
-    rt->ctl[rt->nctl++] = c;
+    w->npt += z;
+    w->ctl[w->nctl++] = c;
+
+    if (fresh) {
+        if (w->npt > 0) {
+            rt->nworker++;
+        } else {
+            free(w->ctl); /* no descriptors; the slot is not committed */
+            free(w->pt);
+        }
+    }
 
     return 0;
 }
@@ -214,38 +460,55 @@ int rt_start(struct rt *rt, int priority)
     assert(priority >= 0);
     rt->priority = priority;
 
-    /* If there are any devices which returned file descriptors for
-     * poll() then launch the realtime thread to handle them */
+    if (rt->ncpu > 0)
+        confine_main(rt);
 
-    if (rt->npt > 0) {
-        int r;
+    /* Launch a realtime thread for each device (or controller set)
+     * which returned file descriptors for poll() */
 
-        fprintf(stderr, "Launching realtime thread to handle devices...\n");
+    if (rt->nworker > 0) {
+        size_t launched;
+
+        fprintf(stderr, "Launching %zu realtime thread%s to handle "
+                "devices...\n", rt->nworker, rt->nworker > 1 ? "s" : "");
 
         if (sem_init(&rt->sem, 0, 0) == -1) {
             perror("sem_init");
             return -1;
         }
 
-        r = pthread_create(&rt->ph, NULL, launch, (void*)rt);
-        if (r != 0) {
-            errno = r;
-            perror("pthread_create");
-            if (sem_destroy(&rt->sem) == -1)
-                abort();
-            return -1;
+        for (launched = 0; launched < rt->nworker; launched++) {
+            struct rt_worker *w;
+            int r;
+
+            w = &rt->worker[launched];
+
+            r = pthread_create(&w->ph, NULL, launch, (void*)w);
+            if (r != 0) {
+                errno = r;
+                perror("pthread_create");
+                rt->finished = true;
+                break;
+            }
+
+            set_affinity(w, launched);
         }
 
-        /* Wait for the realtime thread to declare it is initialised */
+        /* Wait for every launched thread to declare it is
+         * initialised */
 
-        if (sem_wait(&rt->sem) == -1)
-            abort();
+        for (n = 0; n < launched; n++) {
+            if (sem_wait(&rt->sem) == -1)
+                abort();
+        }
         if (sem_destroy(&rt->sem) == -1)
             abort();
 
         if (rt->finished) {
-            if (pthread_join(rt->ph, NULL) != 0)
-                abort();
+            for (n = 0; n < launched; n++) {
+                if (pthread_join(rt->worker[n].ph, NULL) != 0)
+                    abort();
+            }
             return -1;
         }
     }
@@ -271,8 +534,8 @@ void rt_stop(struct rt *rt)
     for (n = 0; n < rt->ndv; n++)
         device_stop(rt->dv[n]);
 
-    if (rt->npt > 0) {
-        if (pthread_join(rt->ph, NULL) != 0)
+    for (n = 0; n < rt->nworker; n++) {
+        if (pthread_join(rt->worker[n].ph, NULL) != 0)
             abort();
     }
 }
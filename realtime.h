@@ -26,24 +26,43 @@
 #include <stdbool.h>
 
 /*
- * State data for the realtime thread, maintained during rt_start and
- * rt_stop
+ * State data for the realtime threads, maintained during rt_start
+ * and rt_stop
+ *
+ * Each pollable device gets a realtime worker thread of its own,
+ * pinned to a CPU, so independent decks decode and resample
+ * concurrently. The controllers share one further worker.
+ *
+ * The arrays grow as devices are added (all before rt_start(), so
+ * no locking) and there is no fixed limit on their number.
  */
 
-struct rt {
+struct rt_worker {
     pthread_t ph;
+    struct rt *rt;
+
+    struct device *dv; /* NULL for the controller worker */
+
+    size_t nctl, zctl; /* entries, and allocated size */
+    struct controller **ctl;
+
+    size_t npt, zpt;
+    struct pollfd *pt;
+};
+
+struct rt {
     sem_t sem;
     bool finished;
     int priority;
 
-    size_t ndv;
-    struct device *dv[3];
+    size_t ncpu;
+    int cpu[8]; /* CPUs reserved for the realtime threads, if any */
 
-    size_t nctl;
-    struct controller *ctl[3];
+    size_t ndv, zdv;
+    struct device **dv;
 
-    size_t npt;
-    struct pollfd pt[32];
+    size_t nworker, zworker;
+    struct rt_worker *worker; /* devices, plus the controllers */
 };
 
 int rt_global_init();
@@ -52,6 +71,7 @@ void rt_not_allowed();
 void rt_init(struct rt *rt);
 void rt_clear(struct rt *rt);
 
+int rt_set_cpus(struct rt *rt, const char *s);
 int rt_add_device(struct rt *rt, struct device *dv);
 int rt_add_controller(struct rt *rt, struct controller *c);
 
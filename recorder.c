@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Session recording: playback audio to a WAV file on disk
+ *
+ * The audio thread does a bounded memcpy into a large ring and
+ * nothing else -- no syscall, no lock. A writer thread behind it
+ * flushes to disk in large aligned writes. If the disk stalls the
+ * ring absorbs it; if the ring fills, whole blocks are dropped and
+ * counted, and audio is never back-pressured.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+#define MASK (RECORDER_RING - 1)
+
+/* Bytes per write to disk; a multiple of every sane filesystem
+ * block size, so writes stay aligned for the duration */
+
+#define WRITE_BYTES (256 * 1024)
+#define WRITE_SHORTS (WRITE_BYTES / sizeof(signed short))
+
+#define CHANNELS 2
+#define POLL_US 50000 /* writer sleep when there's nothing to do */
+
+#define WAV_HEADER 44
+
+static void put16(unsigned char *out, unsigned int v)
+{
+    out[0] = v & 0xff;
+    out[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *out, unsigned long v)
+{
+    out[0] = v & 0xff;
+    out[1] = (v >> 8) & 0xff;
+    out[2] = (v >> 16) & 0xff;
+    out[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * The canonical 44-byte WAV header; sizes are patched on stop
+ *
+ * Samples are written native-endian, as with the rest of our PCM
+ * handling, which is correct on the little-endian machines we run.
+ */
+
+static void wav_header(unsigned char *h, unsigned int rate,
+                       unsigned long long data)
+{
+    memcpy(h, "RIFF", 4);
+    put32(h + 4, WAV_HEADER - 8 + data);
+    memcpy(h + 8, "WAVE", 4);
+
+    memcpy(h + 12, "fmt ", 4);
+    put32(h + 16, 16);
+    put16(h + 20, 1); /* PCM */
+    put16(h + 22, CHANNELS);
+    put32(h + 24, rate);
+    put32(h + 28, rate * CHANNELS * sizeof(signed short));
+    put16(h + 32, CHANNELS * sizeof(signed short));
+    put16(h + 34, 16);
+
+    memcpy(h + 36, "data", 4);
+    put32(h + 40, data);
+}
+
+/*
+ * Write the given bytes in full
+ *
+ * Return: 0 on success, -1 if the disk misbehaved
+ */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t z;
+
+        z = write(fd, p, len);
+        if (z == -1)
+            return -1;
+
+        p += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Flush n samples from the ring to the file
+ *
+ * A failed write drops the chunk and carries on; a transient disk
+ * stall costs a glitch in the file, never in the audio.
+ */
+
+static void flush(struct recorder *re, unsigned int n)
+{
+    while (n > 0) {
+        unsigned int chunk;
+
+        chunk = n;
+        if (chunk > WRITE_SHORTS)
+            chunk = WRITE_SHORTS;
+        if (chunk > RECORDER_RING - (re->tail & MASK))
+            chunk = RECORDER_RING - (re->tail & MASK);
+
+        if (write_all(re->fd, &re->ring[re->tail & MASK],
+                      chunk * sizeof(signed short)) == 0)
+        {
+            re->written += chunk * sizeof(signed short);
+            if (re->failed) {
+                fputs("Recording resumed\n", stderr);
+                re->failed = false;
+            }
+        } else {
+            if (!re->failed) {
+                perror("write");
+                fputs("Recording dropped; disk not keeping up\n", stderr);
+                re->failed = true;
+            }
+        }
+
+        re->tail += chunk;
+        n -= chunk;
+    }
+}
+
+static void* writer_main(void *arg)
+{
+    struct recorder *re = arg;
+
+    for (;;) {
+        bool stop;
+        unsigned int avail;
+
+        stop = re->stop;
+        __sync_synchronize(); /* stop, then any remaining audio */
+        avail = re->head - re->tail;
+
+        if (avail >= WRITE_SHORTS) {
+            flush(re, avail - avail % WRITE_SHORTS);
+            continue;
+        }
+
+        if (stop) {
+            flush(re, avail); /* final short write */
+            return NULL;
+        }
+
+        usleep(POLL_US);
+    }
+}
+
+/*
+ * Begin recording to the given path
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: on success, audio submitted is flushed to disk until
+ * recorder_stop()
+ */
+
+int recorder_start(struct recorder *re, const char *path,
+                   unsigned int rate)
+{
+    unsigned char h[WAV_HEADER];
+
+    re->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (re->fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    wav_header(h, rate, 0);
+    if (write_all(re->fd, h, sizeof h) == -1) {
+        perror("write");
+        goto fail;
+    }
+
+    re->ring = malloc(RECORDER_RING * sizeof(signed short));
+    if (re->ring == NULL) {
+        perror("malloc");
+        goto fail;
+    }
+
+    re->rate = rate;
+    re->head = 0;
+    re->tail = 0;
+    re->overruns = 0;
+    re->written = 0;
+    re->stop = false;
+    re->failed = false;
+
+    if (pthread_create(&re->writer, NULL, writer_main, re) != 0) {
+        perror("pthread_create");
+        free(re->ring);
+        goto fail;
+    }
+
+    fprintf(stderr, "Recording to %s\n", path);
+
+    return 0;
+
+fail:
+    if (close(re->fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Stop recording: drain the ring, patch the WAV sizes and close
+ *
+ * Pre: no further recorder_submit() calls arrive
+ */
+
+void recorder_stop(struct recorder *re)
+{
+    unsigned char h[WAV_HEADER];
+
+    __sync_synchronize();
+    re->stop = true;
+
+    if (pthread_join(re->writer, NULL) != 0)
+        abort();
+
+    wav_header(h, re->rate, re->written);
+
+    if (lseek(re->fd, 0, SEEK_SET) != -1)
+        (void)write_all(re->fd, h, sizeof h);
+
+    if (close(re->fd) == -1) {
+        perror("close");
+        abort();
+    }
+
+    free(re->ring);
+
+    if (re->overruns > 0) {
+        fprintf(stderr, "Recording dropped %u block%s\n",
+                re->overruns, re->overruns != 1 ? "s" : "");
+    }
+}
+
+/*
+ * Copy one block of playback audio into the ring
+ *
+ * Called on the audio thread: a bounded memcpy, no syscall, no
+ * lock. A full ring drops the whole block, keeping frames aligned.
+ */
+
+void recorder_submit(struct recorder *re, const signed short *pcm,
+                     size_t samples)
+{
+    unsigned int head;
+
+    head = re->head;
+
+    if (samples > RECORDER_RING - (head - re->tail)) {
+        re->overruns++;
+        return;
+    }
+
+    while (samples > 0) {
+        unsigned int chunk;
+
+        chunk = samples;
+        if (chunk > RECORDER_RING - (head & MASK))
+            chunk = RECORDER_RING - (head & MASK);
+
+        memcpy(&re->ring[head & MASK], pcm,
+               chunk * sizeof(signed short));
+
+        head += chunk;
+        pcm += chunk;
+        samples -= chunk;
+    }
+
+    __sync_synchronize(); /* audio, then the head which covers it */
+    re->head = head;
+}
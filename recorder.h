@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Ring between the audio thread and the writer, in 16-bit samples;
+ * must be a power of two. 8Mb is around 47 seconds of slack */
+
+#define RECORDER_RING (1 << 22)
+
+struct recorder {
+    int fd;
+    unsigned int rate;
+
+    /* Single-producer, single-consumer ring. The counters run free
+     * and are masked on use; the audio thread owns head, the writer
+     * owns tail */
+
+    signed short *ring;
+    unsigned int head, tail,
+        overruns; /* blocks dropped because the writer fell behind */
+
+    unsigned long long written; /* bytes of PCM actually on disk */
+
+    pthread_t writer;
+    bool stop, failed;
+};
+
+int recorder_start(struct recorder *re, const char *path,
+                   unsigned int rate);
+void recorder_stop(struct recorder *re);
+
+void recorder_submit(struct recorder *re, const signed short *pcm,
+                     size_t samples);
+
+#endif
@@ -19,46 +19,78 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
 
 #include "list.h"
 #include "mutex.h"
-#include "realtime.h"
 #include "rig.h"
 
-#define EVENT_WAKE 0
-#define EVENT_QUIT 1
-
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
-static int event[2]; /* pipe to wake up service thread */
+static int event = -1, /* eventfd to wake up service thread */
+    epfd = -1; /* persistent registrations; see watch_fd() */
+static volatile sig_atomic_t quit = 0;
+static struct pollfd event_pe;
 static struct list tracks = LIST_INIT(tracks),
-    excrates = LIST_INIT(excrates);
+    excrates = LIST_INIT(excrates),
+    analyses = LIST_INIT(analyses);
 mutex lock;
 
+/*
+ * Begin watching the given poll entry for input
+ *
+ * The registration is persistent: it lasts until the descriptor is
+ * closed, so there is no table to rebuild in each cycle of the rig,
+ * and no limit on the number of entries. The descriptors are
+ * close-on-exec, so closing our reference is enough to end the
+ * registration.
+ */
+
+static void watch_fd(struct pollfd *pe)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = pe;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, pe->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        abort();
+    }
+}
+
 int rig_init()
 {
-    /* Create a pipe which will be used to wake us from other threads */
+    /* Create an eventfd which will be used to wake us from other
+     * threads and signal handlers */
 
-    if (pipe(event) == -1) {
-        perror("pipe");
+    event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event == -1) {
+        perror("eventfd");
         return -1;
     }
 
-    if (fcntl(event[0], F_SETFL, O_NONBLOCK) == -1) {
-        perror("fcntl");
-        if (close(event[1]) == -1)
-            abort();
-        if (close(event[0]) == -1)
+    epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        if (close(event) == -1)
             abort();
         return -1;
     }
 
+    event_pe.fd = event;
+    event_pe.events = POLLIN;
+    event_pe.revents = 0;
+    watch_fd(&event_pe);
+
     mutex_init(&lock);
 
     return 0;
@@ -68,9 +100,9 @@ void rig_clear()
 {
     mutex_clear(&lock);
 
-    if (close(event[0]) == -1)
+    if (close(epfd) == -1)
         abort();
-    if (close(event[1]) == -1)
+    if (close(event) == -1)
         abort();
 }
 
@@ -89,82 +121,53 @@ void rig_clear()
 
 int rig_main()
 {
-    struct pollfd pt[4];
-    const struct pollfd *px = pt + ARRAY_SIZE(pt);
-
-    /* Monitor event pipe from external threads */
-
-    pt[0].fd = event[0];
-    pt[0].revents = 0;
-    pt[0].events = POLLIN;
-
     mutex_lock(&lock);
 
-    for (;;) { /* exit via EVENT_QUIT */
-        int r;
-        struct pollfd *pe;
+    for (;;) { /* exit via rig_quit() */
+        int r, n;
+        struct epoll_event ev[16];
         struct track *track, *xtrack;
         struct excrate *excrate, *xexcrate;
-
-        pe = &pt[1];
-
-        /* Do our best if we run out of poll entries */
-
-        list_for_each(track, &tracks, rig) {
-            if (pe == px)
-                break;
-            track_pollfd(track, pe);
-            pe++;
-        }
-
-        list_for_each(excrate, &excrates, rig) {
-            if (pe == px)
-                break;
-            excrate_pollfd(excrate, pe);
-            pe++;
-        }
+        struct analysis *analysis, *xanalysis;
 
         mutex_unlock(&lock);
 
-        r = poll(pt, pe - pt, -1);
+        r = epoll_wait(epfd, ev, ARRAY_SIZE(ev), -1);
         if (r == -1) {
             if (errno == EINTR) {
                 mutex_lock(&lock);
                 continue;
             } else {
-                perror("poll");
+                perror("epoll_wait");
                 return -1;
             }
         }
 
-        /* Process all events on the event pipe */
-
-        if (pt[0].revents != 0) {
-            for (;;) {
-                char e;
-                size_t z;
-
-                z = read(event[0], &e, 1);
-                if (z == -1) {
-                    if (errno == EAGAIN) {
-                        break;
-                    } else {
-                        perror("read");
-                        return -1;
-                    }
-                }
-
-                switch (e) {
-                case EVENT_WAKE:
-                    break;
-
-                case EVENT_QUIT:
-                    goto finish;
-
-                default:
-                    abort();
-                }
+        /* Flag activity on the entries which fired; each handler
+         * clears its own flag when it consumes it. Level-triggered,
+         * so anything left undrained fires again next cycle. */
+
+        for (n = 0; n < r; n++) {
+            struct pollfd *pe = ev[n].data.ptr;
+
+            pe->revents = POLLIN;
+        }
+
+        /* Acknowledge the wakeup; a burst of posts is a single
+         * read of the counter, not a read per post */
+
+        if (event_pe.revents != 0) {
+            uint64_t v;
+
+            event_pe.revents = 0;
+
+            if (read(event, &v, sizeof v) == -1 && errno != EAGAIN) {
+                perror("read");
+                return -1;
             }
+
+            if (quit)
+                goto finish;
         }
 
         mutex_lock(&lock);
@@ -174,6 +177,9 @@ int rig_main()
 
         list_for_each_safe(excrate, xexcrate, &excrates, rig)
             excrate_handle(excrate);
+
+        list_for_each_safe(analysis, xanalysis, &analyses, rig)
+            analysis_handle(analysis);
     }
  finish:
 
@@ -181,14 +187,17 @@ int rig_main()
 }
 
 /*
- * Post a simple event into the rig event loop
+ * Wake the rig event loop
+ *
+ * The eventfd is a counter: posts made in a burst coalesce into one
+ * wakeup. The write never blocks, and is async-signal-safe.
  */
 
-static int post_event(char e)
+static int wake(void)
 {
-    rt_not_allowed();
+    static const uint64_t one = 1;
 
-    if (write(event[1], &e, 1) == -1) {
+    if (write(event, &one, sizeof one) == -1) {
         perror("write");
         return -1;
     }
@@ -202,7 +211,8 @@ static int post_event(char e)
 
 int rig_quit()
 {
-    return post_event(EVENT_QUIT);
+    quit = 1;
+    return wake();
 }
 
 void rig_lock(void)
@@ -223,13 +233,26 @@ void rig_post_track(struct track *t)
 {
     track_acquire(t);
     list_add(&t->rig, &tracks);
-    post_event(EVENT_WAKE);
+    watch_fd(track_pollfd(t));
+    wake();
 }
 
 void rig_post_excrate(struct excrate *e)
 {
     excrate_acquire(e);
     list_add(&e->rig, &excrates);
-    post_event(EVENT_WAKE);
+    watch_fd(excrate_pollfd(e));
+    wake();
+}
+
+/*
+ * Add a BPM analysis, handled until its result has been delivered
+ */
+
+void rig_post_analysis(struct analysis *a)
+{
+    list_add(&a->rig, &analyses);
+    watch_fd(analysis_pollfd(a));
+    wake();
 }
 
@@ -20,6 +20,7 @@
 #ifndef RIG_H
 #define RIG_H
 
+#include "bpm.h"
 #include "excrate.h"
 #include "track.h"
 
@@ -35,5 +36,6 @@ void rig_unlock();
 
 void rig_post_track(struct track *t);
 void rig_post_excrate(struct excrate *e);
+void rig_post_analysis(struct analysis *a);
 
 #endif
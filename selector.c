@@ -137,7 +137,9 @@ static void notify(struct selector *s)
 
 static void do_content_change(struct selector *sel)
 {
-    (void)index_match(initial(sel), sel->view_index, &sel->match);
+    (void)listing_match(current_crate(sel)->listing, sel->sort,
+                        sel->view_index, &sel->match);
+    sel->view_version++;
     listbox_set_entries(&sel->records, sel->view_index->entries);
     retain_target(sel);
     notify(sel);
@@ -194,6 +196,7 @@ static void merge_addition(struct observer *o, void *x)
     else
         index_insert(s->view_index, r, s->sort);
 
+    s->view_version++;
     listbox_set_entries(&s->records, s->view_index->entries);
 
     /* If this addition is what we've been looking for, send the
@@ -208,6 +211,54 @@ static void merge_addition(struct observer *o, void *x)
     notify(s);
 }
 
+/*
+ * A whole batch of records has been added to the currently selected
+ * crate (ie. by a bulk load); merge them in one pass with a single
+ * update of the display
+ */
+
+static void merge_additions(struct observer *o, void *x)
+{
+    struct selector *s = container_of(o, struct selector, on_additions);
+    struct index *batch = x;
+    size_t n;
+    bool changed;
+
+    assert(batch != NULL);
+
+    /* If we're out of memory then silently drop the batch; the
+     * refresh at the end of the bulk load catches us up */
+
+    if (index_reserve(s->view_index, batch->entries) == -1)
+        return;
+
+    changed = false;
+
+    for (n = 0; n < batch->entries; n++) {
+        struct record *r;
+
+        r = batch->record[n];
+
+        if (!record_match(r, &s->match))
+            continue;
+
+        if (s->sort == SORT_PLAYLIST)
+            index_add(s->view_index, r);
+        else
+            index_insert(s->view_index, r, s->sort);
+
+        changed = true;
+    }
+
+    if (!changed)
+        return;
+
+    s->view_version++;
+    listbox_set_entries(&s->records, s->view_index->entries);
+    retain_target(s);
+    notify(s);
+}
+
 /*
  * Attach callbacks to the relevant crate
  *
@@ -217,16 +268,31 @@ static void merge_addition(struct observer *o, void *x)
 
 static void watch_crate(struct selector *s, struct crate *c)
 {
-    watch(&s->on_activity, &c->activity, handle_activity);
-    watch(&s->on_refresh, &c->refresh, handle_refresh);
+    /* Activity and refresh supersede their earlier events, so a
+     * storm of them (eg. a rescan) can coalesce on the deferred
+     * queue. Additions carry a record each and must all arrive */
+
+    if (s->defer != NULL) {
+        watch_deferred(&s->on_activity, &c->activity, handle_activity,
+                       s->defer);
+        watch_deferred(&s->on_refresh, &c->refresh, handle_refresh,
+                       s->defer);
+    } else {
+        watch(&s->on_activity, &c->activity, handle_activity);
+        watch(&s->on_refresh, &c->refresh, handle_refresh);
+    }
+
     watch(&s->on_addition, &c->addition, merge_addition);
+    watch(&s->on_additions, &c->additions, merge_additions);
 }
 
-void selector_init(struct selector *sel, struct library *lib)
+void selector_init(struct selector *sel, struct library *lib,
+                   struct event_queue *defer)
 {
     struct crate *c;
 
     sel->library = lib;
+    sel->defer = defer;
 
     listbox_init(&sel->records);
     listbox_init(&sel->crates);
@@ -244,6 +310,7 @@ void selector_init(struct selector *sel, struct library *lib)
     index_init(&sel->index_b);
     sel->view_index = &sel->index_a;
     sel->swap_index = &sel->index_b;
+    sel->view_version = 0;
 
     c = current_crate(sel);
     watch_crate(sel, c);
@@ -260,6 +327,7 @@ void selector_clear(struct selector *sel)
     ignore(&sel->on_activity);
     ignore(&sel->on_refresh);
     ignore(&sel->on_addition);
+    ignore(&sel->on_additions);
     index_clear(&sel->index_a);
     index_clear(&sel->index_b);
 }
@@ -365,6 +433,7 @@ static void do_crate_change(struct selector *sel)
     ignore(&sel->on_activity);
     ignore(&sel->on_refresh);
     ignore(&sel->on_addition);
+    ignore(&sel->on_additions);
     watch_crate(sel, c);
     do_content_change(sel);
 }
@@ -448,20 +517,33 @@ void selector_search_expand(struct selector *sel)
 void selector_search_refine(struct selector *sel, char key)
 {
     struct index *tmp;
+    struct match next;
 
     if (sel->search_len >= sizeof(sel->search) - 1) /* would overflow */
         return;
 
     sel->search[sel->search_len] = key;
     sel->search[++sel->search_len] = '\0';
-    match_compile(&sel->match, sel->search);
+    match_compile(&next, sel->search);
+
+    /* The new criteria can only narrow the current view, and only
+     * the words which changed need testing against it */
+
+    if (match_is_refinement(&sel->match, &next)) {
+        (void)index_refine(sel->view_index, sel->swap_index,
+                           &sel->match, &next);
+    } else {
+        (void)listing_match(current_crate(sel)->listing, sel->sort,
+                            sel->swap_index, &next);
+    }
 
-    (void)index_match(sel->view_index, sel->swap_index, &sel->match);
+    match_copy(&sel->match, &next);
 
     tmp = sel->view_index;
     sel->view_index = sel->swap_index;
     sel->swap_index = tmp;
 
+    sel->view_version++;
     listbox_set_entries(&sel->records, sel->view_index->entries);
     set_target(sel);
     notify(sel);
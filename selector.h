@@ -33,12 +33,14 @@ struct selector {
         *view_index, /* base_index + search filter applied */
         *swap_index, /* used to swap between a and b indexes */
         index_a, index_b;
+    unsigned int view_version; /* bumped when view_index content changes */
 
     struct listbox records, crates;
     bool toggled;
     int toggle_back, sort;
     struct record *target;
-    struct observer on_activity, on_refresh, on_addition;
+    struct observer on_activity, on_refresh, on_addition, on_additions;
+    struct event_queue *defer; /* or NULL for synchronous delivery */
 
     size_t search_len;
     char search[256];
@@ -47,7 +49,8 @@ struct selector {
     struct event changed;
 };
 
-void selector_init(struct selector *sel, struct library *lib);
+void selector_init(struct selector *sel, struct library *lib,
+                   struct event_queue *defer);
 void selector_clear(struct selector *sel);
 
 void selector_set_lines(struct selector *sel, unsigned int lines);
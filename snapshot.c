@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cues.h"
+#include "deck.h"
+#include "library.h"
+#include "player.h"
+#include "rig.h"
+#include "snapshot.h"
+#include "xwax.h"
+
+/*
+ * Periodic snapshot of the session to disk, so that a crash or
+ * reboot mid-set costs seconds, not minutes of reloading
+ *
+ * A background thread samples the deck state (record, position and
+ * cue points) under the rig lock and serialises it outside it; the
+ * realtime threads are never involved. Restoring re-acquires the
+ * tracks by the usual import path, which is instant when the decode
+ * cache is warm, and seeks each player back into place.
+ */
+
+#define INTERVAL 5 /* seconds between snapshots; bounds the loss */
+#define POLL_US 250000 /* responsiveness to snapshot_stop() */
+
+/* Deck state sampled under the rig lock, written outside it */
+
+struct entry {
+    const char *pathname, *artist, *title; /* in the library arena */
+    double position;
+    struct cues cues;
+};
+
+static pthread_t ph;
+static const char *path;
+static bool finished;
+
+/*
+ * Serialise the current deck state to disk
+ *
+ * The file is replaced atomically, so a crash mid-write leaves the
+ * previous snapshot intact.
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int write_snapshot(void)
+{
+    FILE *f;
+    char *tmp;
+    size_t n;
+    struct entry entry[MAX_DECKS];
+
+    rig_lock();
+
+    for (n = 0; n < ndeck; n++) {
+        struct deck *d = &deck[n];
+
+        entry[n].pathname = d->record->pathname;
+        entry[n].artist = d->record->artist;
+        entry[n].title = d->record->title;
+        entry[n].position = player_get_elapsed(&d->player);
+        entry[n].cues = d->cues;
+    }
+
+    rig_unlock();
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        perror("asprintf");
+        return -1;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    for (n = 0; n < ndeck; n++) {
+        const struct entry *e = &entry[n];
+        unsigned int c;
+
+        if (e->pathname == NULL)
+            continue; /* no record loaded */
+
+        fprintf(f, "%zu\t%.6f\t", n, e->position);
+
+        for (c = 0; c < MAX_CUES; c++) {
+            double p;
+
+            p = cues_get(&e->cues, c);
+            if (p != CUE_UNSET)
+                fprintf(f, "%u=%.6f ", c, p);
+        }
+
+        fprintf(f, "\t%s\t%s\t%s\n", e->pathname, e->artist, e->title);
+    }
+
+    if (fclose(f) == EOF) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, path) == -1) {
+        perror("rename");
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    return 0;
+}
+
+/*
+ * Restore one deck from a line of the snapshot file
+ *
+ * The record goes back in via get_record(), as a scan result would,
+ * so its memory is owned alongside the library.
+ *
+ * Pre: rig lock is held
+ */
+
+static void restore(char *line)
+{
+    char *field[6], *end;
+    unsigned int i;
+    size_t n;
+    double elapsed;
+    struct deck *d;
+    struct record *r;
+
+    /* Fields: deck, position, cues, pathname, artist, title */
+
+    field[0] = line;
+    for (i = 1; i < 6; i++) {
+        char *t;
+
+        t = strchr(field[i - 1], '\t');
+        if (t == NULL) {
+            fprintf(stderr, "Ignoring malformed snapshot line.\n");
+            return;
+        }
+        *t = '\0';
+        field[i] = t + 1;
+    }
+
+    end = strchr(field[5], '\n');
+    if (end != NULL)
+        *end = '\0';
+
+    n = strtoul(field[0], &end, 10);
+    if (*end != '\0' || n >= ndeck) {
+        fprintf(stderr, "Snapshot deck %s is not in this session.\n",
+                field[0]);
+        return;
+    }
+
+    elapsed = strtod(field[1], NULL);
+    d = &deck[n];
+
+    /* Cue points first, so that loading the track prefetches them */
+
+    for (end = field[2]; *end != '\0';) {
+        unsigned int label;
+        double p;
+        char *s = end;
+
+        label = strtoul(s, &s, 10);
+        if (*s != '=')
+            break;
+        p = strtod(s + 1, &end);
+        if (end == s + 1)
+            break;
+        if (label < MAX_CUES)
+            cues_set(&d->cues, label, p);
+        while (*end == ' ')
+            end++;
+    }
+
+    if (asprintf(&line, "%s\t%s\t%s", field[3], field[4], field[5]) == -1) {
+        perror("asprintf");
+        return;
+    }
+
+    r = get_record(line); /* frees line */
+    if (r == NULL)
+        return;
+
+    deck_load(d, r);
+    if (d->record != r)
+        return; /* load was refused */
+
+    player_seek_to(&d->player, elapsed);
+}
+
+/*
+ * Restore the decks from the snapshot file
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int resume_decks(void)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t z = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "%s: no snapshot; starting fresh.\n", path);
+            return 0;
+        }
+        perror(path);
+        return -1;
+    }
+
+    rig_lock();
+
+    while (getline(&line, &z, f) != -1)
+        restore(line);
+
+    rig_unlock();
+
+    free(line);
+    if (fclose(f) == EOF)
+        abort(); /* under our control */
+
+    return 0;
+}
+
+static void* launch(void *arg)
+{
+    unsigned int ticks = 0;
+
+    for (;;) {
+        if (finished)
+            return NULL;
+
+        usleep(POLL_US);
+
+        if (++ticks < INTERVAL * 1000000 / POLL_US)
+            continue;
+
+        ticks = 0;
+        (void)write_snapshot(); /* disk trouble; leave the old file */
+    }
+}
+
+/*
+ * Begin periodic snapshots to the given path
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: on success, deck state is snapshotted until snapshot_stop()
+ */
+
+int snapshot_start(const char *p, bool resume)
+{
+    path = p;
+    finished = false;
+
+    if (resume && resume_decks() == -1)
+        return -1;
+
+    if (pthread_create(&ph, NULL, launch, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the periodic snapshots, leaving a final one on disk
+ */
+
+void snapshot_stop(void)
+{
+    finished = true;
+    if (pthread_join(ph, NULL) != 0)
+        abort();
+
+    (void)write_snapshot(); /* the decks are still intact */
+}
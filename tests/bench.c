@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "index.h"
+#include "library.h"
+#include "lut.h"
+#include "player.h"
+#include "thread.h"
+#include "timecoder.h"
+#include "track.h"
+
+/*
+ * Microbenchmarks of the proven hot paths
+ *
+ * One line of output per measurement, tab-separated:
+ *
+ *     <name> <value> <unit>
+ *
+ * so that results can be kept and diffed between releases. Wall
+ * time only; pin the CPU governor before trusting small deltas.
+ */
+
+#define BLOCK 256 /* frames per audio block, a typical device period */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+static volatile unsigned int sink; /* defeat dead-code elimination */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double value, const char *unit)
+{
+    printf("%s\t%.2f\t%s\n", name, value, unit);
+    fflush(stdout);
+}
+
+/*
+ * A track of audible PCM, filled directly rather than via an
+ * importer, so the benchmark has no external dependencies
+ */
+
+static struct track* synth_track(unsigned int rate, unsigned int seconds)
+{
+    struct track *t;
+    unsigned int n, blocks;
+
+    t = track_acquire_empty();
+    assert(t != NULL);
+
+    t->rate = rate;
+    t->length = rate * seconds;
+    blocks = (t->length + TRACK_BLOCK_SAMPLES - 1) / TRACK_BLOCK_SAMPLES;
+    assert(blocks <= TRACK_MAX_BLOCKS);
+
+    for (n = 0; n < blocks; n++) {
+        struct track_block *b;
+        unsigned int i;
+
+        b = malloc(sizeof *b);
+        assert(b != NULL);
+
+        for (i = 0; i < TRACK_BLOCK_SAMPLES; i++) {
+            signed short v;
+
+            v = sin((double)i * 2 * M_PI * 441 / rate) * SHRT_MAX * 0.5;
+            b->pcm[i * 2] = v;
+            b->pcm[i * 2 + 1] = v;
+        }
+
+        t->block[n] = b;
+        t->pcm[n] = b->pcm;
+        t->blocks = n + 1;
+    }
+
+    return t;
+}
+
+/*
+ * Render a fixed amount of output via player_collect(), which
+ * spends nearly all of its time in build_pcm()
+ */
+
+#define PLAYER_RATE 44100
+#define PLAYER_FRAMES (1 << 21)
+
+static void bench_player_one(struct player *pl, const char *name,
+                             double pitch)
+{
+    signed short pcm[BLOCK * PLAYER_CHANNELS];
+    unsigned int n;
+    double t;
+    char label[64];
+
+    player_seek_to(pl, 0.0);
+    pl->pitch = pitch;
+
+    t = now();
+    for (n = 0; n + BLOCK <= PLAYER_FRAMES; n += BLOCK)
+        player_collect(pl, pcm, BLOCK);
+    t = now() - t;
+
+    sink ^= pcm[0];
+
+    sprintf(label, "player.%s.%0.2f", name, pitch);
+    report(label, PLAYER_FRAMES / t / 1e6, "Mframes/s");
+}
+
+static void bench_player(void)
+{
+    struct player pl;
+    struct timecoder tc;
+    struct timecode_def *def;
+    struct track *track;
+    static const double pitches[] = { 0.5, 1.0, 1.28, 2.0 };
+    size_t n;
+
+    /* Enough track that the highest pitch never runs off the end */
+
+    track = synth_track(PLAYER_RATE, 2 * PLAYER_FRAMES / PLAYER_RATE + 1);
+
+    /* The player wants a timecoder, though internal playback
+     * leaves it unused */
+
+    def = timecoder_find_definition("serato_2a");
+    assert(def != NULL);
+    timecoder_init(&tc, def, 1.0, PLAYER_RATE, false);
+
+    player_init(&pl, NULL, PLAYER_RATE, track, &tc);
+    player_set_internal_playback(&pl);
+
+    for (n = 0; n < ARRAY_SIZE(pitches); n++)
+        bench_player_one(&pl, "cubic", pitches[n]);
+
+    player_set_sinc(&pl, true);
+    bench_player_one(&pl, "sinc", 1.28);
+    player_set_sinc(&pl, false);
+
+    player_set_key_lock(&pl, true);
+    bench_player_one(&pl, "keylock", 1.28);
+    player_set_key_lock(&pl, false);
+
+    timecoder_clear(&tc);
+}
+
+/*
+ * Timecode signal generator: LFSR stepping as per the decoder and
+ * mktimecode, forward play only
+ */
+
+#define SWITCH_PHASE 0x1 /* tone phase difference of 270 (not 90) degrees */
+#define SWITCH_PRIMARY 0x2 /* use left channel (not right) as primary */
+
+static bits_t lfsr(bits_t code, bits_t taps)
+{
+    bits_t taken;
+    int xrs;
+
+    taken = code & taps;
+    xrs = 0;
+    while (taken != 0x0) {
+        xrs += taken & 0x1;
+        taken >>= 1;
+    }
+
+    return xrs & 0x1;
+}
+
+static bits_t fwd(bits_t current, const struct timecode_def *def)
+{
+    bits_t l;
+
+    l = lfsr(current, def->taps | 0x1);
+    return (current >> 1) | (l << (def->bits - 1));
+}
+
+static void synth_timecode(const struct timecode_def *def, unsigned int rate,
+                           signed short *pcm, size_t frames)
+{
+    size_t n;
+    double cycle;
+    bits_t bits;
+
+    cycle = 0.0;
+    bits = def->seed;
+
+    for (n = 0; n < frames; n++) {
+        double angle, modulate, x, y;
+        signed int prev;
+
+        angle = cycle * M_PI * 2;
+
+        modulate = 1.0 - (-cos(angle) + 1.0) * 0.25 * ((bits & 0x1) == 0);
+
+        x = sin(angle) * modulate; /* primary */
+        y = cos(angle) * modulate;
+        if (!(def->flags & SWITCH_PHASE))
+            y = -y; /* secondary in quadrature */
+
+        if (def->flags & SWITCH_PRIMARY) {
+            pcm[0] = x * SHRT_MAX * 0.5;
+            pcm[1] = y * SHRT_MAX * 0.5;
+        } else {
+            pcm[0] = y * SHRT_MAX * 0.5;
+            pcm[1] = x * SHRT_MAX * 0.5;
+        }
+        pcm += 2;
+
+        prev = floor(cycle);
+        cycle += (double)def->resolution / rate;
+
+        while ((signed int)floor(cycle) > prev) {
+            bits = fwd(bits, def);
+            prev++;
+        }
+    }
+}
+
+/*
+ * Decode throughput at the sample rates we deploy at
+ */
+
+#define TIMECODER_SECONDS 5
+
+static void bench_timecoder(void)
+{
+    static const unsigned int rates[] = { 44100, 48000, 96000 };
+    struct timecode_def *def;
+    size_t n;
+
+    def = timecoder_find_definition("serato_2a");
+    assert(def != NULL);
+
+    for (n = 0; n < ARRAY_SIZE(rates); n++) {
+        struct timecoder tc;
+        signed short *pcm;
+        size_t frames, i;
+        double t;
+        char label[64];
+
+        frames = rates[n] * TIMECODER_SECONDS;
+        pcm = malloc(frames * 2 * sizeof(signed short));
+        assert(pcm != NULL);
+
+        synth_timecode(def, rates[n], pcm, frames);
+        timecoder_init(&tc, def, 1.0, rates[n], false);
+
+        t = now();
+        for (i = 0; i + BLOCK <= frames; i += BLOCK)
+            timecoder_submit(&tc, pcm + i * 2, BLOCK);
+        t = now() - t;
+
+        sink ^= timecoder_get_position(&tc, NULL);
+
+        timecoder_clear(&tc);
+        free(pcm);
+
+        sprintf(label, "timecoder.%s.%u", def->name, rates[n]);
+        report(label, frames / t / 1e6, "Msamples/s");
+    }
+}
+
+/*
+ * The timecode lookup table, on both its fast path (every valid
+ * bitstream word) and its slow one (noise which probes and fails)
+ */
+
+#define LUT_ENTRIES (1 << 18)
+#define LUT_LOOKUPS (1 << 24)
+
+static void bench_lut(void)
+{
+    struct lut lut;
+    unsigned int n, seed;
+    double t;
+
+    if (lut_init(&lut, LUT_ENTRIES) == -1)
+        abort();
+
+    seed = 1;
+    for (n = 0; n < LUT_ENTRIES; n++) {
+        seed = seed * 1103515245 + 12345;
+        lut_push(&lut, seed & 0x3fffff);
+    }
+
+    /* Hits: the same sequence of codes as pushed */
+
+    seed = 1;
+    t = now();
+    for (n = 0; n < LUT_LOOKUPS; n++) {
+        if (n % LUT_ENTRIES == 0)
+            seed = 1;
+        seed = seed * 1103515245 + 12345;
+        sink ^= lut_lookup(&lut, seed & 0x3fffff);
+    }
+    t = now() - t;
+
+    report("lut.hit", LUT_LOOKUPS / t / 1e6, "Mlookups/s");
+
+    /* Misses: codes outside the range of anything pushed */
+
+    seed = 1;
+    t = now();
+    for (n = 0; n < LUT_LOOKUPS; n++) {
+        if (n % LUT_ENTRIES == 0)
+            seed = 1;
+        seed = seed * 1103515245 + 12345;
+        sink ^= lut_lookup(&lut, (seed & 0x3fffff) | 0x800000);
+    }
+    t = now() - t;
+
+    report("lut.miss", LUT_LOOKUPS / t / 1e6, "Mlookups/s");
+
+    lut_clear(&lut);
+}
+
+/*
+ * A synthetic library: bulk insert, then search it
+ *
+ * Titles are drawn from a small vocabulary so that a search term
+ * has realistic selectivity, not all-or-nothing.
+ */
+
+#define RECORDS 100000
+#define SEARCHES 100
+
+static const char *vocab[] = {
+    "alpha", "bravo", "charlie", "delta",
+    "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima",
+    "mike", "november", "oscar", "papa",
+};
+
+static void bench_library(void)
+{
+    struct listing l;
+    struct index dest;
+    struct match m;
+    unsigned int n;
+    double t;
+
+    listing_init(&l);
+
+    listing_begin_bulk(&l);
+
+    t = now();
+    for (n = 0; n < RECORDS; n++) {
+        char *line;
+        struct record *r;
+
+        if (asprintf(&line, "/music/%06u.flac\t%s %s\t%s %s %s\t%u",
+                     n,
+                     vocab[n % 16], vocab[(n / 16) % 16],
+                     vocab[(n / 3) % 16], vocab[(n / 7) % 16],
+                     vocab[(n / 11) % 16],
+                     80 + n % 100) == -1)
+        {
+            abort();
+        }
+
+        r = get_record(line);
+        assert(r != NULL);
+
+        if (listing_add(&l, r) == NULL)
+            abort();
+    }
+    listing_end_bulk(&l);
+    t = now() - t;
+
+    report("library.add", RECORDS / t, "records/s");
+
+    match_compile(&m, "delta");
+    index_init(&dest);
+
+    /* One cold search builds the lazy search structures */
+
+    t = now();
+    if (listing_match(&l, SORT_ARTIST, &dest, &m) == -1)
+        abort();
+    t = now() - t;
+
+    report("library.match.cold", t * 1e3, "ms");
+
+    t = now();
+    for (n = 0; n < SEARCHES; n++) {
+        index_blank(&dest);
+        if (listing_match(&l, SORT_ARTIST, &dest, &m) == -1)
+            abort();
+    }
+    t = now() - t;
+
+    sink ^= dest.entries;
+    report("library.match", t * 1e3 / SEARCHES, "ms");
+
+    /* The plain linear scan, for comparison */
+
+    t = now();
+    for (n = 0; n < SEARCHES; n++) {
+        index_blank(&dest);
+        if (index_match(&l.by_artist, &dest, &m) == -1)
+            abort();
+    }
+    t = now() - t;
+
+    sink ^= dest.entries;
+    report("index.match", t * 1e3 / SEARCHES, "ms");
+
+    index_clear(&dest);
+    listing_clear(&l);
+}
+
+int main(int argc, char *argv[])
+{
+    if (thread_global_init() == -1)
+        return -1;
+    if (library_global_init() == -1)
+        return -1;
+
+    bench_lut();
+    bench_timecoder();
+    bench_player();
+    bench_library();
+
+    timecoder_free_lookup();
+
+    return 0;
+}
@@ -50,6 +50,9 @@ int main(int argc, char *argv[])
     if (thread_global_init() == -1)
         return -1;
 
+    if (library_global_init() == -1)
+        return -1;
+
     if (rig_init() == -1)
         return -1;
 
@@ -69,6 +72,7 @@ int main(int argc, char *argv[])
     rig_main();
 
     library_clear(&lib);
+    library_global_clear();
     rig_clear();
     thread_global_clear();
 
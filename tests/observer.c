@@ -1,15 +1,25 @@
+#include <assert.h>
 #include <stdio.h>
 
 #include "observer.h"
 
+static int deliveries = 0;
+
 void callback(struct observer *t, void *x)
 {
     fprintf(stderr, "observer %p fired with argument %p\n", t, x);
 }
 
+void deferred_callback(struct observer *t, void *x)
+{
+    deliveries++;
+    fprintf(stderr, "observer %p delivered with argument %p\n", t, x);
+}
+
 int main(int argc, char *argv[])
 {
     struct event s;
+    struct event_queue q;
     struct observer t, u;
 
     event_init(&s);
@@ -22,6 +32,32 @@ int main(int argc, char *argv[])
     fire(&s, (void*)0xcafe);
     ignore(&t);
 
+    /* Deferred delivery: events wait on the queue, and duplicates
+     * between drains collapse to one with the most recent data */
+
+    event_queue_init(&q);
+
+    watch_deferred(&t, &s, deferred_callback, &q);
+    watch(&u, &s, callback);
+
+    fire(&s, (void*)0x1);
+    fire(&s, (void*)0x2); /* coalesces with the event before */
+    assert(deliveries == 0);
+
+    event_queue_drain(&q);
+    assert(deliveries == 1);
+
+    event_queue_drain(&q); /* empty; nothing further arrives */
+    assert(deliveries == 1);
+
+    fire(&s, (void*)0x3);
+    ignore(&t); /* takes the queued event with it */
+    ignore(&u);
+
+    event_queue_drain(&q);
+    assert(deliveries == 1);
+
+    event_queue_clear(&q);
     event_clear(&s);
 
     return 0;
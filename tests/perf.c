@@ -0,0 +1,40 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "perf.h"
+
+int main(int argc, char *argv[])
+{
+    unsigned int t, n;
+
+    t = perf_time();
+    assert(perf_time() - t < 1000000);
+
+    perf_sample(&perf_frame, 1500);
+    perf_sample(&perf_frame, 900);
+
+    assert(perf_frame.count == 2);
+    assert(perf_frame.last == 900);
+    assert(perf_frame.worst == 1500);
+    assert(perf_average(&perf_frame) == 1200);
+
+    /* 1500us lands in the [1024, 2048) bucket */
+
+    assert(perf_frame.bucket[10] == 1);
+
+    /* Durations off the top of the scale share the last bucket */
+
+    perf_sample(&perf_frame, 4000000);
+    assert(perf_frame.bucket[PERF_BUCKETS - 1] == 1);
+
+    perf_xrun();
+    perf_xrun();
+    assert(perf_xruns == 2);
+
+    for (n = 0; n < PERF_BUCKETS; n++)
+        printf("bucket %2u: %u\n", n, perf_frame.bucket[n]);
+
+    printf("perf ok\n");
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "pitch.h"
+
+#define RATE 96000
+#define DX (1.0 / 4000 / 4) /* one crossing on a 4000 cycle record */
+
+/*
+ * Check that a run of zero observations applied via pitch_idle()
+ * matches the same observations applied one sample at a time
+ */
+
+static void compare(unsigned int gap, unsigned int crossings)
+{
+    struct pitch a, b;
+    unsigned int n, m;
+    double err;
+
+    pitch_init(&a, 1.0 / RATE);
+    pitch_init(&b, 1.0 / RATE);
+
+    for (n = 0; n < crossings; n++) {
+        for (m = 0; m < gap; m++)
+            pitch_dt_observation(&a, 0.0);
+        pitch_dt_observation(&a, DX);
+
+        pitch_idle(&b, gap);
+        pitch_dt_observation(&b, DX);
+    }
+
+    err = fabs(pitch_current(&a) - pitch_current(&b));
+
+    fprintf(stderr, "gap %4u: %.12f vs %.12f (error %.2e)\n",
+            gap, pitch_current(&a), pitch_current(&b), err);
+
+    assert(err < 1e-9);
+}
+
+int main(int argc, char *argv[])
+{
+    struct pitch p;
+    unsigned int n;
+
+    /* Steady crossings at various intervals, including longer
+     * than PITCH_RUN, must converge identically */
+
+    compare(0, 1000);
+    compare(1, 1000);
+    compare(23, 1000);
+    compare(PITCH_RUN - 1, 400);
+    compare(PITCH_RUN, 400);
+    compare(PITCH_RUN * 3 + 7, 400);
+
+    /* With no further crossings, the pitch decays to a stop */
+
+    pitch_init(&p, 1.0 / RATE);
+
+    for (n = 0; n < 1000; n++)
+        pitch_dt_observation(&p, DX * 24);
+
+    assert(pitch_current(&p) > 0.0);
+
+    for (n = 0; n < 1000; n++)
+        pitch_idle(&p, RATE);
+
+    assert(fabs(pitch_current(&p)) < 1e-9);
+
+    return 0;
+}
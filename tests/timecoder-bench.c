@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2018 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE /* sincos() */
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timecoder.h"
+
+/*
+ * Offline benchmark of the timecode decoder
+ *
+ * Synthesises timecode signal for each known definition (in the
+ * manner of mktimecode) at a controlled pitch and noise level, and
+ * reports decode throughput, time-to-valid after a needle drop,
+ * recovery time after a dropout, and re-lock time after a change
+ * of direction. Intended to validate decoder changes before they
+ * reach a live booth.
+ */
+
+#define RATE 96000
+#define BLOCK 256 /* frames per submit, a typical device block */
+#define SECONDS 5
+
+#define SWITCH_PHASE 0x1 /* tone phase difference of 270 (not 90) degrees */
+#define SWITCH_PRIMARY 0x2 /* use left channel (not right) as primary */
+
+static const char *names[] = {
+    "serato_2a",
+    "serato_2b",
+    "serato_cd",
+    "traktor_a",
+    "traktor_b",
+    "mixvibes_v2",
+    "mixvibes_7inch",
+};
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/*
+ * LFSR stepping, as per the decoder and mktimecode
+ */
+
+static inline bits_t lfsr(bits_t code, bits_t taps)
+{
+    bits_t taken;
+    int xrs;
+
+    taken = code & taps;
+    xrs = 0;
+    while (taken != 0x0) {
+        xrs += taken & 0x1;
+        taken >>= 1;
+    }
+
+    return xrs & 0x1;
+}
+
+static inline bits_t fwd(bits_t current, const struct timecode_def *def)
+{
+    bits_t l;
+
+    l = lfsr(current, def->taps | 0x1);
+    return (current >> 1) | (l << (def->bits - 1));
+}
+
+static inline bits_t rev(bits_t current, const struct timecode_def *def)
+{
+    bits_t l, mask;
+
+    mask = (1 << def->bits) - 1;
+    l = lfsr(current, (def->taps >> 1) | (0x1 << (def->bits - 1)));
+    return ((current << 1) & mask) | l;
+}
+
+static inline double dither(void)
+{
+    return (double)(rand() % 32768) / 32768 - 0.5;
+}
+
+/*
+ * Signal generator, tracking position and bitstream on the 'vinyl'
+ */
+
+struct synth {
+    struct timecode_def *def;
+    double cycle;
+    bits_t bits;
+};
+
+static void synth_init(struct synth *s, struct timecode_def *def,
+                       unsigned int cycles)
+{
+    s->def = def;
+    s->cycle = cycles;
+    s->bits = def->seed;
+
+    while (cycles--)
+        s->bits = fwd(s->bits, def);
+}
+
+static void synth_block(struct synth *s, signed short *pcm, size_t frames,
+                        double pitch, double noise)
+{
+    size_t n;
+
+    for (n = 0; n < frames; n++) {
+        double angle, modulate, x, y, sin_a, cos_a;
+        signed int prev;
+
+        angle = s->cycle * M_PI * 2;
+        sincos(angle, &sin_a, &cos_a);
+
+        /* Modulate the waveform according to the bitstream */
+
+        modulate = 1.0 - (-cos_a + 1.0) * 0.25 * ((s->bits & 0x1) == 0);
+
+        x = sin_a * modulate; /* primary */
+        y = cos_a * modulate;
+        if (!(s->def->flags & SWITCH_PHASE))
+            y = -y; /* secondary in quadrature */
+
+        if (s->def->flags & SWITCH_PRIMARY) {
+            pcm[0] = x * SHRT_MAX * 0.5 + noise * SHRT_MAX * dither();
+            pcm[1] = y * SHRT_MAX * 0.5 + noise * SHRT_MAX * dither();
+        } else {
+            pcm[0] = y * SHRT_MAX * 0.5 + noise * SHRT_MAX * dither();
+            pcm[1] = x * SHRT_MAX * 0.5 + noise * SHRT_MAX * dither();
+        }
+        pcm += 2;
+
+        /* Advance the bitstream on cycle boundaries */
+
+        prev = floor(s->cycle);
+        s->cycle += pitch * s->def->resolution / RATE;
+
+        while ((signed int)floor(s->cycle) > prev) {
+            s->bits = fwd(s->bits, s->def);
+            prev++;
+        }
+        while ((signed int)floor(s->cycle) < prev) {
+            s->bits = rev(s->bits, s->def);
+            prev--;
+        }
+    }
+}
+
+/*
+ * Feed blocks until the decoder reports a position
+ *
+ * Return: milliseconds of signal consumed, or -1 if it never locked
+ */
+
+static double time_to_valid(struct timecoder *tc, struct synth *s,
+                            double pitch, double noise)
+{
+    signed short pcm[BLOCK * 2];
+    unsigned int n;
+
+    for (n = 0; n < RATE * SECONDS / BLOCK; n++) {
+        synth_block(s, pcm, BLOCK, pitch, noise);
+        timecoder_submit(tc, pcm, BLOCK);
+
+        if (timecoder_get_position(tc, NULL) != -1)
+            return (double)(n + 1) * BLOCK * 1000 / RATE;
+    }
+
+    return -1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(struct timecode_def *def, double pitch, double noise)
+{
+    struct timecoder tc;
+    struct synth s;
+    signed short *pcm;
+    size_t frames, n;
+    double t, valid, drop, reverse;
+    unsigned int block;
+
+    frames = RATE * SECONDS;
+    pcm = malloc(frames * 2 * sizeof(signed short));
+    assert(pcm != NULL);
+
+    /* Throughput: pre-synthesised signal, timed through the decoder */
+
+    synth_init(&s, def, 64);
+    synth_block(&s, pcm, frames, pitch, noise);
+
+    timecoder_init(&tc, def, 1.0, RATE, false);
+
+    t = now();
+    for (n = 0; n + BLOCK <= frames; n += BLOCK)
+        timecoder_submit(&tc, pcm + n * 2, BLOCK);
+    t = now() - t;
+
+    timecoder_clear(&tc);
+
+    /* Time to valid position after a needle drop */
+
+    synth_init(&s, def, 64);
+    timecoder_init(&tc, def, 1.0, RATE, false);
+    valid = time_to_valid(&tc, &s, pitch, noise);
+
+    /* Recovery after a dropout: 100ms of silence, then signal */
+
+    memset(pcm, 0, RATE / 10 * 2 * sizeof(signed short));
+    for (block = 0; block < RATE / 10; block += BLOCK)
+        timecoder_submit(&tc, pcm + block * 2, BLOCK);
+    drop = time_to_valid(&tc, &s, pitch, noise);
+
+    /* Re-lock after a change of direction */
+
+    reverse = time_to_valid(&tc, &s, -pitch, noise);
+
+    printf("%-14s  %7.1f Msamples/sec  valid %6.1fms  "
+           "dropout %6.1fms  reverse %6.1fms\n",
+           def->name, frames / t / 1e6, valid, drop, reverse);
+
+    timecoder_clear(&tc);
+    free(pcm);
+}
+
+int main(int argc, char *argv[])
+{
+    double pitch, noise;
+    size_t n;
+
+    pitch = 1.0;
+    noise = 0.0;
+
+    if (argc > 1)
+        pitch = atof(argv[1]);
+    if (argc > 2)
+        noise = atof(argv[2]);
+
+    fprintf(stderr, "Benchmarking at pitch %0.2f, noise %0.2f\n",
+            pitch, noise);
+
+    for (n = 0; n < ARRAY_SIZE(names); n++) {
+        struct timecode_def *def;
+
+        def = timecoder_find_definition(names[n]);
+        assert(def != NULL);
+
+        bench(def, pitch, noise);
+    }
+
+    timecoder_free_lookup();
+
+    return 0;
+}
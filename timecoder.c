@@ -19,9 +19,12 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include "debug.h"
@@ -31,16 +34,31 @@
 
 #define ZERO_RC 0.001 /* time constant for zero/rumble filter */
 
+#define ZERO_FRAC 16 /* fractional bits in the filter accumulator */
+#define ZERO_SHIFT_MAX 24
+
 #define REF_PEAKS_AVG 48 /* in wave cycles */
 
 /* The number of correct bits which come in before the timecode is
  * declared valid. Set this too low, and risk the record skipping
- * around (often to blank areas of track) during scratching */
+ * around (often to blank areas of track) during scratching.
+ *
+ * The full requirement applies on a noisy signal; when the running
+ * bit error rate shows the signal is clean, the requirement relaxes
+ * towards the minimum so that position pickup after a needle drop is
+ * faster */
 
 #define VALID_BITS 24
+#define VALID_BITS_MIN 12
+
+#define SIGNAL_AVG_SHIFT 8 /* bits over which signal stats average, log2 */
+
+#define RESYNC_WINDOW 2 /* cycles of tolerance when rematching */
 
 #define MONITOR_DECAY_EVERY 512 /* in samples */
 
+#define SUBMIT_BLOCK 16 /* frames deinterleaved per batch on submit */
+
 #define SQ(x) ((x)*(x))
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
@@ -133,17 +151,7 @@ static struct timecode_def timecodes[] = {
 
 static inline bits_t lfsr(bits_t code, bits_t taps)
 {
-    bits_t taken;
-    int xrs;
-
-    taken = code & taps;
-    xrs = 0;
-    while (taken != 0x0) {
-        xrs += taken & 0x1;
-        taken >>= 1;
-    }
-
-    return xrs & 0x1;
+    return __builtin_popcount(code & taps) & 0x1;
 }
 
 /*
@@ -176,9 +184,104 @@ static inline bits_t rev(bits_t current, struct timecode_def *def)
     return ((current << 1) & mask) | l;
 }
 
+/*
+ * Build the 8-step stride tables for this timecode
+ *
+ * The LFSR is linear over GF(2), so the state after 8 steps is the
+ * XOR of the contribution of each byte of the current state. Three
+ * tables of 256 entries cover up to 24 bits of state.
+ */
+
+static void build_stride(struct timecode_def *def)
+{
+    int b, v, i;
+
+    for (b = 0; b < 3; b++) {
+        for (v = 0; v < 256; v++) {
+            bits_t c;
+
+            c = (bits_t)v << (b * 8);
+            for (i = 0; i < 8; i++)
+                c = fwd(c, def);
+
+            def->fwd8[b][v] = c;
+        }
+    }
+}
+
+static inline bits_t fwd8(bits_t current, struct timecode_def *def)
+{
+    return def->fwd8[0][current & 0xff]
+        ^ def->fwd8[1][(current >> 8) & 0xff]
+        ^ def->fwd8[2][(current >> 16) & 0xff];
+}
+
+/*
+ * Advance the given timecode by n cycles, in O(n / 8)
+ */
+
+static bits_t advance(bits_t current, unsigned int n,
+                      struct timecode_def *def)
+{
+    while (n >= 8) {
+        current = fwd8(current, def);
+        n -= 8;
+    }
+    while (n-- > 0)
+        current = fwd(current, def);
+
+    return current;
+}
+
+/*
+ * Path of the on-disk cache of the lookup table for this timecode
+ *
+ * The directory is created if required; the file itself need not
+ * exist yet.
+ *
+ * Return: -1 if no usable cache location, otherwise 0
+ */
+
+static int cache_path(const struct timecode_def *def, char *buf, size_t len)
+{
+    const char *cache, *home;
+    int n;
+
+    cache = getenv("XDG_CACHE_HOME");
+    if (cache != NULL) {
+        n = snprintf(buf, len, "%s", cache);
+    } else {
+        home = getenv("HOME");
+        if (home == NULL)
+            return -1;
+        n = snprintf(buf, len, "%s/.cache", home);
+    }
+
+    if (n < 0 || (size_t)n >= len)
+        return -1;
+
+    mkdir(buf, 0755); /* best-effort; open() reports any real error */
+
+    n += snprintf(buf + n, len - n, "/xwax");
+    if ((size_t)n >= len)
+        return -1;
+
+    mkdir(buf, 0755);
+
+    n += snprintf(buf + n, len - n, "/%s.lut", def->name);
+    if ((size_t)n >= len)
+        return -1;
+
+    return 0;
+}
+
 /*
  * Where necessary, build the lookup table required for this timecode
  *
+ * An on-disk cache, keyed on the parameters of the timecode, is
+ * preferred over the generator; building the larger tables costs
+ * millions of LFSR steps on every startup otherwise.
+ *
  * Return: -1 if not enough memory could be allocated, otherwise 0
  */
 
@@ -186,10 +289,26 @@ static int build_lookup(struct timecode_def *def)
 {
     unsigned int n;
     bits_t current;
+    char path[512];
+    bool cache;
+    unsigned int key[LUT_KEY_SIZE];
 
     if (def->lookup)
         return 0;
 
+    key[0] = def->bits;
+    key[1] = def->seed;
+    key[2] = def->taps;
+    key[3] = def->length;
+
+    cache = (cache_path(def, path, sizeof path) == 0);
+
+    if (cache && lut_load(&def->lut, path, key, def->length) == 0) {
+        build_stride(def);
+        def->lookup = true;
+        return 0;
+    }
+
     fprintf(stderr, "Building LUT for %d bit %dHz timecode (%s)\n",
             def->bits, def->resolution, def->desc);
 
@@ -212,11 +331,66 @@ static int build_lookup(struct timecode_def *def)
         current = next;
     }
 
+    if (cache)
+        lut_save(&def->lut, path, key); /* best-effort */
+
+    build_stride(def);
     def->lookup = true;
 
     return 0;
 }
 
+static void* build_thread(void *arg)
+{
+    struct timecode_def *def = arg;
+
+    if (build_lookup(def) == -1)
+        return def; /* non-NULL indicates failure */
+
+    return NULL;
+}
+
+/*
+ * Build the lookup tables for all known timecodes, in parallel
+ *
+ * One worker per definition bounds the total startup cost by the
+ * largest single table rather than the sum, and means
+ * timecoder_cycle_definition can reach every timecode without a
+ * blocking build mid-set.
+ *
+ * Return: -1 if any lookup table could not be built, otherwise 0
+ */
+
+int timecoder_build_all_lookups(void)
+{
+    pthread_t thread[ARRAY_SIZE(timecodes)];
+    size_t n;
+    int r;
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        if (pthread_create(&thread[n], NULL, build_thread,
+                           &timecodes[n]) != 0)
+        {
+            perror("pthread_create");
+            while (n > 0)
+                pthread_join(thread[--n], NULL);
+            return -1;
+        }
+    }
+
+    r = 0;
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        void *status;
+
+        pthread_join(thread[n], &status);
+        if (status != NULL)
+            r = -1;
+    }
+
+    return r;
+}
+
 /*
  * Find a timecode definition by name
  *
@@ -271,6 +445,7 @@ static void init_channel(struct timecoder_channel *ch)
 {
     ch->positive = false;
     ch->zero = 0;
+    ch->zero_acc = 0;
 }
 
 /*
@@ -282,6 +457,8 @@ static void init_channel(struct timecoder_channel *ch)
 void timecoder_init(struct timecoder *tc, struct timecode_def *def,
                     double speed, unsigned int sample_rate, bool phono)
 {
+    double zero_alpha;
+
     assert(def != NULL);
 
     /* A definition contains a lookup table which can be shared
@@ -290,9 +467,21 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     assert(def->lookup);
     tc->def = def;
     tc->speed = speed;
+    tc->sample_rate = sample_rate;
+    tc->phono = phono;
 
     tc->dt = 1.0 / sample_rate;
-    tc->zero_alpha = tc->dt / (ZERO_RC + tc->dt);
+
+    /* Fold the filter alpha to the nearest power of two, so the
+     * hot path is a shift rather than a double multiply. The
+     * corner of the rumble filter is loose enough to stand it */
+
+    zero_alpha = tc->dt / (ZERO_RC + tc->dt);
+    tc->zero_shift = 0;
+    while ((1u << tc->zero_shift) * zero_alpha < 0.5
+           && tc->zero_shift < ZERO_SHIFT_MAX)
+        tc->zero_shift++;
+
     tc->threshold = ZERO_THRESHOLD;
     if (phono)
         tc->threshold >>= 5; /* approx -36dB */
@@ -301,14 +490,107 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     init_channel(&tc->primary);
     init_channel(&tc->secondary);
     pitch_init(&tc->pitch, tc->dt);
+    tc->pitch_defer = 0;
 
     tc->ref_level = INT_MAX;
     tc->bitstream = 0;
     tc->timecode = 0;
     tc->valid_counter = 0;
     tc->timecode_ticker = 0;
+    tc->err_avg = 1 << 16; /* worst case until the signal proves itself */
+    tc->cycle_avg = 0;
+    tc->jitter_avg = 0;
+    tc->sync = false;
+    tc->sync_timecode = 0;
+    tc->sync_cycles = 0;
 
     tc->mon = NULL;
+    tc->ring = NULL;
+
+    tc->probe = NULL;
+    tc->nprobe = 0;
+}
+
+/*
+ * Finish probing; if a shadow decoder won, take over its state
+ */
+
+static void probe_end(struct timecoder *tc, struct timecoder *winner)
+{
+    struct timecoder *probe;
+
+    probe = tc->probe;
+
+    if (winner != NULL) {
+        unsigned char *mon;
+        int mon_size, mon_counter;
+        struct timecoder_point *ring;
+        unsigned int ring_head, ring_tail;
+
+        fprintf(stderr, "Timecode detected: %s\n", winner->def->desc);
+
+        /* The monitor belongs to this decoder, not the shadow */
+
+        mon = tc->mon;
+        mon_size = tc->mon_size;
+        mon_counter = tc->mon_counter;
+        ring = tc->ring;
+        ring_head = tc->ring_head;
+        ring_tail = tc->ring_tail;
+
+        *tc = *winner;
+
+        tc->mon = mon;
+        tc->mon_size = mon_size;
+        tc->mon_counter = mon_counter;
+        tc->ring = ring;
+        tc->ring_head = ring_head;
+        tc->ring_tail = ring_tail;
+    }
+
+    tc->probe = NULL;
+    tc->nprobe = 0;
+    free(probe);
+}
+
+/*
+ * Begin probing for the timecode in use
+ *
+ * A lightweight shadow decoder is run for every other known timecode
+ * on the same input; whichever definition first decodes VALID_BITS of
+ * correct timecode (including the current one) is locked onto. The
+ * decoders share the lookup tables, so the extra cost is only the
+ * filter state machines, and only until a timecode is recognised.
+ *
+ * Return: -1 if not enough memory could be allocated, otherwise 0
+ */
+
+int timecoder_probe(struct timecoder *tc)
+{
+    size_t n;
+
+    assert(tc->probe == NULL);
+
+    tc->probe = malloc(sizeof(struct timecoder) * ARRAY_SIZE(timecodes));
+    if (tc->probe == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    tc->nprobe = 0;
+
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        struct timecode_def *def;
+
+        def = &timecodes[n];
+        if (!def->lookup || def == tc->def)
+            continue;
+
+        timecoder_init(&tc->probe[tc->nprobe++], def,
+                       tc->speed, tc->sample_rate, tc->phono);
+    }
+
+    return 0;
 }
 
 /*
@@ -317,6 +599,8 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
 
 void timecoder_clear(struct timecoder *tc)
 {
+    if (tc->probe != NULL)
+        probe_end(tc, NULL);
     assert(tc->mon == NULL);
 }
 
@@ -332,14 +616,25 @@ void timecoder_clear(struct timecoder *tc)
 int timecoder_monitor_init(struct timecoder *tc, int size)
 {
     assert(tc->mon == NULL);
+
+    tc->ring = malloc(sizeof(struct timecoder_point) * TIMECODER_RING);
+    if (tc->ring == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    tc->ring_head = 0;
+    tc->ring_tail = 0;
+
     tc->mon_size = size;
     tc->mon = malloc(SQ(tc->mon_size));
     if (tc->mon == NULL) {
         perror("malloc");
+        free(tc->ring);
         return -1;
     }
     memset(tc->mon, 0, SQ(tc->mon_size));
     tc->mon_counter = 0;
+
     return 0;
 }
 
@@ -352,6 +647,8 @@ void timecoder_monitor_clear(struct timecoder *tc)
     assert(tc->mon != NULL);
     free(tc->mon);
     tc->mon = NULL;
+    free(tc->ring);
+    tc->ring = NULL;
 }
 
 /*
@@ -359,7 +656,7 @@ void timecoder_monitor_clear(struct timecoder *tc)
  */
 
 static void detect_zero_crossing(struct timecoder_channel *ch,
-                                 signed int v, double alpha,
+                                 signed int v, unsigned int zero_shift,
                                  signed int threshold)
 {
     ch->crossing_ticker++;
@@ -375,44 +672,140 @@ static void detect_zero_crossing(struct timecoder_channel *ch,
         ch->crossing_ticker = 0;
     }
 
-    ch->zero += alpha * (v - ch->zero);
+    /* Fixed-point IIR; the accumulator carries the fractional bits
+     * lost by the shift, so the filter still settles exactly */
+
+    ch->zero_acc += (((long long)v << ZERO_FRAC) - ch->zero_acc)
+        >> zero_shift;
+    ch->zero = ch->zero_acc >> ZERO_FRAC;
 }
 
 /*
- * Plot the given sample value in the x-y monitor
+ * Queue the given sample value for the x-y monitor
+ *
+ * This is all the realtime thread does towards the monitor; the
+ * rasterisation and decay sweep are left to the thread which
+ * draws it.
  */
 
-static void update_monitor(struct timecoder *tc, signed int x, signed int y)
+static void push_point(struct timecoder *tc, signed int x, signed int y)
 {
-    int px, py, size, ref;
+    unsigned int head, next;
 
     if (!tc->mon)
         return;
 
+    head = tc->ring_head;
+    next = (head + 1) % TIMECODER_RING;
+
+    if (next == tc->ring_tail)
+        return; /* the scope is cosmetic; drop the point */
+
+    tc->ring[head].x = x;
+    tc->ring[head].y = y;
+    __sync_synchronize(); /* the point lands before it is published */
+    tc->ring_head = next;
+}
+
+/*
+ * Rasterise the pending points into the x-y monitor
+ *
+ * Called by the thread which owns the display, before it reads the
+ * pixels. Sole consumer of the ring.
+ *
+ * Return: true if the monitor changed since the last call
+ */
+
+bool timecoder_monitor_render(struct timecoder *tc)
+{
+    unsigned int tail;
+    int size, ref;
+
+    if (!tc->mon)
+        return false;
+
     size = tc->mon_size;
     ref = tc->ref_level;
+    assert(ref > 0);
 
-    /* Decay the pixels already in the montior */
+    tail = tc->ring_tail;
 
-    if (++tc->mon_counter % MONITOR_DECAY_EVERY == 0) {
-        int p;
+    while (tail != tc->ring_head) {
+        signed int x, y;
+        int px, py;
 
-        for (p = 0; p < SQ(size); p++) {
-            if (tc->mon[p])
+        x = tc->ring[tail].x;
+        y = tc->ring[tail].y;
+        tail = (tail + 1) % TIMECODER_RING;
+
+        /* Decay the pixels already in the monitor; no branch per
+         * pixel, so the compiler is able to vectorise the sweep */
+
+        if (++tc->mon_counter % MONITOR_DECAY_EVERY == 0) {
+            int p;
+
+            for (p = 0; p < SQ(size); p++)
                 tc->mon[p] = tc->mon[p] * 7 / 8;
         }
+
+        /* ref_level is half the prevision of signal level */
+        px = size / 2 + (long long)x * size / ref / 8;
+        py = size / 2 + (long long)y * size / ref / 8;
+
+        if (px < 0 || px >= size || py < 0 || py >= size)
+            continue;
+
+        tc->mon[py * size + px] = 0xff; /* white */
     }
 
-    assert(ref > 0);
+    if (tail == tc->ring_tail)
+        return false;
 
-    /* ref_level is half the prevision of signal level */
-    px = size / 2 + (long long)x * size / ref / 8;
-    py = size / 2 + (long long)y * size / ref / 8;
+    tc->ring_tail = tail;
+    return true;
+}
 
-    if (px < 0 || px >= size || py < 0 || py >= size)
-        return;
+/*
+ * Try to match the bitstream against where the last trusted timecode
+ * should be by now
+ *
+ * Every bit reading is one cycle of the groove, so while readings
+ * keep coming the expected timecode can be re-derived exactly with
+ * the stride tables. This recovers quickly from corrupt bits, which
+ * otherwise pollute the bitstream for def->bits cycles and then cost
+ * a full run of correct bits on top.
+ *
+ * Return: true if the bitstream was matched, and validity restored
+ */
 
-    tc->mon[py * size + px] = 0xff; /* white */
+static bool resync(struct timecoder *tc)
+{
+    bits_t expect;
+    unsigned int n;
+
+    if (!tc->sync || !tc->forwards)
+        return false;
+
+    if (tc->sync_cycles < RESYNC_WINDOW
+        || tc->sync_cycles > (unsigned int)tc->def->resolution * 2)
+        return false; /* nothing to gain, or too stale to predict */
+
+    expect = advance(tc->sync_timecode, tc->sync_cycles - RESYNC_WINDOW,
+                     tc->def);
+
+    for (n = 0; n <= RESYNC_WINDOW * 2; n++) {
+        if (expect == tc->bitstream) {
+            /* An exact match on def->bits predicted bits; as strong
+             * as the usual run of correct readings */
+
+            tc->timecode = tc->bitstream;
+            tc->valid_counter = VALID_BITS + 1;
+            return true;
+        }
+        expect = fwd(expect, tc->def);
+    }
+
+    return false;
 }
 
 /*
@@ -422,6 +815,7 @@ static void update_monitor(struct timecoder *tc, signed int x, signed int y)
 static void process_bitstream(struct timecoder *tc, signed int m)
 {
     bits_t b;
+    signed int cycle, d;
 
     b = m > tc->ref_level;
 
@@ -446,11 +840,43 @@ static void process_bitstream(struct timecoder *tc, signed int m)
 
     if (tc->timecode == tc->bitstream)
 	tc->valid_counter++;
-    else {
+    else if (!resync(tc)) {
 	tc->timecode = tc->bitstream;
 	tc->valid_counter = 0;
     }
 
+    /* Running bit error rate, in fixed point of 1 << 8 */
+
+    tc->err_avg += ((tc->valid_counter == 0 ? 1 << 16 : 0) - tc->err_avg)
+        >> SIGNAL_AVG_SHIFT; /* shift, not divide: truncation would
+                              * stop the average ever falling */
+
+    /* Track the last trusted timecode, from which the expected
+     * bitstream can be re-derived */
+
+    if (tc->valid_counter > VALID_BITS) {
+        tc->sync = true;
+        tc->sync_timecode = tc->timecode;
+        tc->sync_cycles = 0;
+    } else if (tc->sync) {
+        if (tc->forwards)
+            tc->sync_cycles++;
+        else
+            tc->sync = false; /* direction changed; prediction is off */
+    }
+
+    /* Cycle-to-cycle jitter: the deviation of this cycle's length in
+     * samples from its running average. Dirt and worn styli disturb
+     * the crossings long before the bitstream breaks up */
+
+    if (tc->timecode_ticker < 1 << 12)
+        cycle = tc->timecode_ticker << 16; /* fixed point of 1 << 16 */
+    else
+        cycle = 1 << 28; /* a stall is not jitter */
+    d = cycle - tc->cycle_avg;
+    tc->cycle_avg += d >> SIGNAL_AVG_SHIFT;
+    tc->jitter_avg += (abs(d) - tc->jitter_avg) >> SIGNAL_AVG_SHIFT;
+
     /* Take note of the last time we read a valid timecode */
 
     tc->timecode_ticker = 0;
@@ -477,8 +903,8 @@ static void process_bitstream(struct timecoder *tc, signed int m)
 static void process_sample(struct timecoder *tc,
 			   signed int primary, signed int secondary)
 {
-    detect_zero_crossing(&tc->primary, primary, tc->zero_alpha, tc->threshold);
-    detect_zero_crossing(&tc->secondary, secondary, tc->zero_alpha, tc->threshold);
+    detect_zero_crossing(&tc->primary, primary, tc->zero_shift, tc->threshold);
+    detect_zero_crossing(&tc->secondary, secondary, tc->zero_shift, tc->threshold);
 
     /* If an axis has been crossed, use the direction of the crossing
      * to work out the direction of the vinyl */
@@ -502,16 +928,19 @@ static void process_sample(struct timecoder *tc,
     }
 
     /* If any axis has been crossed, register movement using the pitch
-     * counters */
+     * counters. Samples without a crossing are counted, not filtered;
+     * the filter catches up in one step at the next crossing */
 
     if (!tc->primary.swapped && !tc->secondary.swapped)
-	pitch_dt_observation(&tc->pitch, 0.0);
+	tc->pitch_defer++;
     else {
 	double dx;
 
 	dx = 1.0 / tc->def->resolution / 4;
 	if (!tc->forwards)
 	    dx = -dx;
+	pitch_idle(&tc->pitch, tc->pitch_defer);
+	tc->pitch_defer = 0;
 	pitch_dt_observation(&tc->pitch, dx);
     }
 
@@ -563,6 +992,37 @@ void timecoder_cycle_definition(struct timecoder *tc)
     tc->timecode_ticker = 0;
 }
 
+/*
+ * Feed the shadow decoders, and lock on once any definition decodes
+ *
+ * The shadows are fanned out in sequence here rather than on worker
+ * threads; a handful of filter state machines is cheap next to the
+ * cost of threading from the realtime path, and probing only lasts
+ * until the first valid timecode.
+ */
+
+static void probe_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
+{
+    int n;
+
+    if (tc->valid_counter > VALID_BITS) {
+        probe_end(tc, NULL); /* current definition is correct */
+        return;
+    }
+
+    for (n = 0; n < tc->nprobe; n++) {
+        struct timecoder *p;
+
+        p = &tc->probe[n];
+        timecoder_submit(p, pcm, npcm);
+
+        if (p->valid_counter > VALID_BITS) {
+            probe_end(tc, p);
+            return;
+        }
+    }
+}
+
 /*
  * Submit and decode a block of PCM audio data to the timecode decoder
  *
@@ -571,25 +1031,50 @@ void timecoder_cycle_definition(struct timecoder *tc)
 
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
 {
-    while (npcm--) {
-	signed int left, right, primary, secondary;
+    bool swap;
+    signed short *in = pcm;
+    size_t nin = npcm;
 
-        left = pcm[0] << 16;
-        right = pcm[1] << 16;
+    swap = (tc->def->flags & SWITCH_PRIMARY) != 0;
 
-        if (tc->def->flags & SWITCH_PRIMARY) {
-            primary = left;
-            secondary = right;
-        } else {
-            primary = right;
-            secondary = left;
+    while (npcm > 0) {
+        size_t n, b;
+        signed int left[SUBMIT_BLOCK], right[SUBMIT_BLOCK];
+
+        b = npcm < SUBMIT_BLOCK ? npcm : SUBMIT_BLOCK;
+
+        /* Deinterleave and widen a block up-front. This loop has no
+         * dependency between frames, so the compiler is free to
+         * vectorise it; the filter state machine below carries state
+         * from sample to sample and must stay scalar to keep the
+         * decoded output bit-identical */
+
+        for (n = 0; n < b; n++) {
+            left[n] = pcm[n * TIMECODER_CHANNELS] << 16;
+            right[n] = pcm[n * TIMECODER_CHANNELS + 1] << 16;
         }
 
-	process_sample(tc, primary, secondary);
-        update_monitor(tc, left, right);
+        for (n = 0; n < b; n++) {
+            if (swap)
+                process_sample(tc, left[n], right[n]);
+            else
+                process_sample(tc, right[n], left[n]);
+            push_point(tc, left[n], right[n]);
+        }
 
-        pcm += TIMECODER_CHANNELS;
+        pcm += b * TIMECODER_CHANNELS;
+        npcm -= b;
     }
+
+    /* Apply any outstanding zero observations, so that the pitch
+     * read between blocks reflects every sample; eg. it still
+     * decays to a stop when the crossings cease */
+
+    pitch_idle(&tc->pitch, tc->pitch_defer);
+    tc->pitch_defer = 0;
+
+    if (tc->probe != NULL)
+        probe_submit(tc, in, nin);
 }
 
 /*
@@ -604,11 +1089,32 @@ void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
  * Post: if when != NULL, *when is the elapsed time in seconds
  */
 
+/*
+ * The number of correct bits required before the timecode is trusted,
+ * given the current signal quality
+ *
+ * Scales from the minimum on a clean signal up to the full
+ * requirement at a bit error rate of 1 in 64 or worse.
+ */
+
+static unsigned int valid_bits_required(const struct timecoder *tc)
+{
+    unsigned int v;
+
+    v = VALID_BITS_MIN
+        + (((VALID_BITS - VALID_BITS_MIN) * tc->err_avg * 64) >> 16);
+
+    if (v > VALID_BITS)
+        v = VALID_BITS;
+
+    return v;
+}
+
 signed int timecoder_get_position(struct timecoder *tc, double *when)
 {
     signed int r;
 
-    if (tc->valid_counter <= VALID_BITS)
+    if (tc->valid_counter <= valid_bits_required(tc))
         return -1;
 
     r = lut_lookup(&tc->def->lut, tc->bitstream);
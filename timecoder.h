@@ -27,8 +27,17 @@
 
 #define TIMECODER_CHANNELS 2
 
+/* Points of input audio buffered from the realtime thread to the
+ * monitor; must cover the interval between redraws of the scope */
+
+#define TIMECODER_RING 8192
+
 typedef unsigned int bits_t;
 
+struct timecoder_point {
+    signed int x, y;
+};
+
 struct timecode_def {
     char *name, *desc;
     int bits, /* number of bits in string */
@@ -40,22 +49,27 @@ struct timecode_def {
         safe; /* last 'safe' timecode number (for auto disconnect) */
     bool lookup; /* true if lut has been generated */
     struct lut lut;
+    bits_t fwd8[3][256]; /* 8-step LFSR advance, per byte of state */
 };
 
 struct timecoder_channel {
     bool positive, /* wave is in positive part of cycle */
 	swapped; /* wave recently swapped polarity */
     signed int zero;
+    long long zero_acc; /* IIR accumulator; zero with fractional bits */
     unsigned int crossing_ticker; /* samples since we last crossed zero */
 };
 
 struct timecoder {
     struct timecode_def *def;
     double speed;
+    unsigned int sample_rate;
+    bool phono;
 
     /* Precomputed values */
 
-    double dt, zero_alpha;
+    double dt;
+    unsigned int zero_shift; /* filter alpha, as a power of two */
     signed int threshold;
 
     /* Pitch information */
@@ -63,6 +77,7 @@ struct timecoder {
     bool forwards;
     struct timecoder_channel primary, secondary;
     struct pitch pitch;
+    unsigned int pitch_defer; /* zero observations not yet applied */
 
     /* Numerical timecode */
 
@@ -71,14 +86,44 @@ struct timecoder {
         timecode; /* corrected timecode */
     unsigned int valid_counter, /* number of successful error checks */
         timecode_ticker; /* samples since valid timecode was read */
+    int err_avg; /* running bit error rate, in fixed point of 1 << 16 */
+
+    /* Signal quality, a few integer ops per crossing; see
+     * timecoder_get_quality() */
 
-    /* Feedback */
+    int cycle_avg, /* cycle length in samples, fixed point of 1 << 16 */
+        jitter_avg; /* absolute deviation of the cycle length */
+
+    /* Resynchronisation from the last trusted timecode */
+
+    bool sync;
+    bits_t sync_timecode;
+    unsigned int sync_cycles; /* bit readings since sync_timecode */
+
+    /* Feedback: the realtime thread produces points into a ring,
+     * and the interface thread rasterises them into the monitor */
 
     unsigned char *mon; /* x-y array */
     int mon_size, mon_counter;
+    struct timecoder_point *ring;
+    unsigned int ring_head, ring_tail;
+
+    /* Auto-detection of the timecode in use */
+
+    struct timecoder *probe; /* shadow decoders, or NULL */
+    int nprobe;
+};
+
+/* A reading of signal health, taken by timecoder_get_quality() */
+
+struct timecoder_quality {
+    double err, /* bit error rate, 0.0 to 1.0 */
+        level, /* signal level, as a multiple of the detection threshold */
+        jitter; /* cycle-to-cycle jitter, as a fraction of a cycle */
 };
 
 struct timecode_def* timecoder_find_definition(const char *name);
+int timecoder_build_all_lookups(void);
 void timecoder_free_lookup(void);
 
 void timecoder_init(struct timecoder *tc, struct timecode_def *def,
@@ -86,9 +131,11 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
 void timecoder_clear(struct timecoder *tc);
 
 int timecoder_monitor_init(struct timecoder *tc, int size);
+bool timecoder_monitor_render(struct timecoder *tc);
 void timecoder_monitor_clear(struct timecoder *tc);
 
 void timecoder_cycle_definition(struct timecoder *tc);
+int timecoder_probe(struct timecoder *tc);
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm);
 signed int timecoder_get_position(struct timecoder *tc, double *when);
 
@@ -141,4 +188,22 @@ static inline double timecoder_revs_per_sec(struct timecoder *tc)
     return (33.0 + 1.0 / 3) * tc->speed / 60;
 }
 
+/*
+ * A cheap reading of signal health, for the HUD and logs
+ *
+ * The figures are running averages maintained by the realtime thread
+ * with a few integer ops per crossing. The reads are unsynchronised
+ * but each field is a single word, so a reading is at worst slightly
+ * stale.
+ */
+
+static inline void timecoder_get_quality(const struct timecoder *tc,
+                                         struct timecoder_quality *q)
+{
+    q->err = (double)tc->err_avg / (1 << 16);
+    q->level = (double)tc->ref_level / tc->threshold;
+    q->jitter = tc->cycle_avg > 0 ?
+        (double)tc->jitter_avg / tc->cycle_avg : 0.0;
+}
+
 #endif
@@ -17,16 +17,25 @@
  *
  */
 
+#define _GNU_SOURCE /* memfd_create() */
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h> /* mlock() */
 
 #include "debug.h"
+#include "decoder.h"
 #include "external.h"
+#include "import.h"
 #include "list.h"
 #include "realtime.h"
 #include "rig.h"
@@ -41,8 +50,55 @@
 #define _STR(tok) #tok
 #define STR(tok) _STR(tok)
 
+/* Default size of the cache of released tracks */
+
+#define CACHE_DEFAULT (512 * 1024 * 1024)
+
 static struct list tracks = LIST_INIT(tracks);
-static bool use_mlock = false;
+static bool use_mlock = false,
+    lock_active = false; /* mlock only tracks on a deck */
+
+/* Blocks are backed by huge pages where the system provides them,
+ * so the resampler's gathers cost ~8 TLB entries per block rather
+ * than ~2000. Each block is rounded up to a whole number of 2MB
+ * pages; the slack is never touched, so it stays unbacked */
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define BLOCK_BYTES ((sizeof(struct track_block) + HUGE_PAGE - 1) \
+                     / HUGE_PAGE * HUGE_PAGE)
+
+/* Unreferenced tracks are kept, most-recently released first, up to
+ * a budget in bytes; re-acquiring one is then instant */
+
+static struct list cache = LIST_INIT(cache);
+static size_t cache_limit = CACHE_DEFAULT,
+    cache_used = 0;
+
+/* Directory of decoded PCM kept across sessions, or NULL */
+
+static const char *cache_dir = NULL;
+
+/*
+ * On-disk PCM cache file: one header page, then the track blocks
+ * back-to-back, complete with their meter arrays. Keyed on the
+ * mtime and size (and full path) of the source file.
+ */
+
+#define PCM_CACHE_MAGIC "xwpc"
+#define PCM_CACHE_VERSION 2 /* v2 added the meter mip pyramids */
+
+struct pcm_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t rate;
+    uint32_t block_bytes; /* sizeof(struct track_block) when written */
+    uint32_t blocks;
+    uint32_t length;
+    int64_t mtime; /* of the source file */
+    int64_t size;
+    uint32_t path_len;
+    char path[]; /* path_len bytes, not terminated */
+};
 
 /*
  * An empty track is used rarely, and is easier than
@@ -70,6 +126,429 @@ void track_use_mlock(void)
     use_mlock = true;
 }
 
+/*
+ * Request that only tracks currently on a deck are locked into RAM
+ */
+
+void track_use_mlock_active(void)
+{
+    lock_active = true;
+}
+
+/*
+ * Return true if this track's memory should be locked into RAM
+ */
+
+static bool should_lock(const struct track *tr)
+{
+    return use_mlock || (lock_active && tr->pins > 0);
+}
+
+/*
+ * Allocate backing for one track block
+ *
+ * Return: the block, or NULL if memory could not be allocated
+ */
+
+static struct track_block* block_alloc(void)
+{
+    void *p;
+
+    p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, BLOCK_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (p == MAP_FAILED) {
+        /* No reserved huge pages; take normal ones and leave a
+         * hint for the transparent huge page machinery */
+
+        p = mmap(NULL, BLOCK_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        (void)madvise(p, BLOCK_BYTES, MADV_HUGEPAGE);
+#endif
+    }
+
+    return p;
+}
+
+static void block_free(struct track_block *b)
+{
+    if (munmap(b, BLOCK_BYTES) == -1)
+        abort();
+}
+
+/*
+ * Enter a block into the table of base pointers
+ */
+
+static void set_block(struct track *tr, unsigned int n,
+                      struct track_block *b)
+{
+    tr->block[n] = b;
+    tr->pcm[n] = b->pcm;
+    tr->ppm_base[n] = b->ppm;
+    tr->overview_base[n] = b->overview;
+    tr->ppm_mip_base[n] = b->ppm_mip;
+    tr->ov_mip_base[n] = b->ov_mip;
+}
+
+/*
+ * Keep decoded PCM in the given directory across sessions
+ */
+
+void track_set_cache_dir(const char *dir)
+{
+    cache_dir = dir;
+}
+
+/*
+ * Return the memory allocated to the given track, in bytes
+ */
+
+static size_t allocated(const struct track *tr)
+{
+    if (tr->map != NULL)
+        return tr->map_len;
+
+    if (tr->shm_active) {
+        const struct import_shm_header *h = tr->shm;
+        return (size_t)tr->blocks * h->block_bytes;
+    }
+
+    if (tr->tail_bytes != 0) {
+        return (size_t)(tr->blocks - 1) * BLOCK_BYTES
+            + tr->tail_bytes;
+    }
+
+    return (size_t)tr->blocks * BLOCK_BYTES;
+}
+
+/* Global budget across every track in memory, live or cached;
+ * zero means no limit. See track_set_memory_limit() */
+
+static size_t memory_limit = 0,
+    memory_used = 0;
+
+static void track_clear(struct track *tr);
+
+/*
+ * Evict one track held only by the cache
+ */
+
+static void evict(struct track *t)
+{
+    debug("evicting '%s' (%zu bytes)", t->path, allocated(t));
+
+    list_del(&t->cache);
+    cache_used -= allocated(t);
+
+    track_clear(t);
+    free(t);
+}
+
+/*
+ * Make room under the memory budget for the given allocation
+ *
+ * Only tracks held by the cache are given up; tracks in use are
+ * never touched, so running audio is unaffected.
+ *
+ * Return: true if the allocation fits, otherwise false
+ */
+
+static bool make_room(size_t bytes)
+{
+    if (memory_limit == 0)
+        return true;
+
+    while (memory_used + bytes > memory_limit && !list_empty(&cache))
+        evict(list_entry(cache.prev, struct track, cache));
+
+    return memory_used + bytes <= memory_limit;
+}
+
+/*
+ * Claim an allocation against the memory budget
+ *
+ * Return: -1 if the budget is exhausted, otherwise 0
+ */
+
+static int claim(size_t bytes)
+{
+    if (!make_room(bytes))
+        return -1;
+
+    memory_used += bytes;
+
+    return 0;
+}
+
+/*
+ * Give an allocation back to the memory budget
+ */
+
+static void forfeit(size_t bytes)
+{
+    assert(memory_used >= bytes);
+    memory_used -= bytes;
+}
+
+/*
+ * Name the PCM cache file for the given path
+ *
+ * Return: 0 on success, or -1 if the name does not fit
+ */
+
+static int cache_name(char *buf, size_t len, const char *path)
+{
+    uint64_t h;
+    const char *s;
+    int r;
+
+    /* FNV-1a; collisions are tolerable because the header
+     * carries the full path for comparison */
+
+    h = UINT64_C(0xcbf29ce484222325);
+    for (s = path; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= UINT64_C(0x100000001b3);
+    }
+
+    r = snprintf(buf, len, "%s/%016llx.pcm", cache_dir,
+                 (unsigned long long)h);
+    if (r < 0 || (size_t)r >= len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Point the track at decoded PCM cached on disk by an earlier
+ * session, if there is some for this source file
+ *
+ * Return: 0 on success, otherwise -1
+ * Post: if 0 is returned, the track is fully loaded
+ */
+
+static int load_cache(struct track *t)
+{
+    char name[512];
+    int fd;
+    unsigned int n;
+    long page;
+    size_t len, path_len;
+    struct stat st, sf;
+    struct pcm_cache_header *h;
+    void *map;
+
+    if (cache_dir == NULL)
+        return -1;
+
+    if (stat(t->path, &st) == -1)
+        return -1; /* eg. not a plain file */
+
+    if (cache_name(name, sizeof name, t->path) == -1)
+        return -1;
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &sf) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+    len = sf.st_size;
+
+    if (len < (size_t)page)
+        goto fail;
+
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    h = map;
+    path_len = strlen(t->path);
+
+    /* Stale or foreign entries are not errors; fall back to
+     * a fresh import, which overwrites the entry */
+
+    if (memcmp(h->magic, PCM_CACHE_MAGIC, sizeof h->magic) != 0
+        || h->version != PCM_CACHE_VERSION
+        || h->rate != RATE
+        || h->block_bytes != sizeof(struct track_block)
+        || h->blocks > TRACK_MAX_BLOCKS
+        || h->length > (uint64_t)h->blocks * TRACK_BLOCK_SAMPLES
+        || h->mtime != (int64_t)st.st_mtime
+        || h->size != (int64_t)st.st_size
+        || sizeof *h + path_len > (size_t)page
+        || h->path_len != path_len
+        || memcmp(h->path, t->path, path_len) != 0
+        || len < (size_t)page + (size_t)h->blocks * sizeof(struct track_block))
+    {
+        goto fail_map;
+    }
+
+    if (should_lock(t) && mlock(map, len) == -1) {
+        perror("mlock");
+        goto fail_map;
+    }
+
+    if (claim(len) == -1)
+        goto fail_map; /* the import which follows is refused too */
+
+    for (n = 0; n < h->blocks; n++) {
+        set_block(t, n, (struct track_block*)
+                  ((char*)map + page + (size_t)n * sizeof(struct track_block)));
+    }
+
+    t->blocks = h->blocks;
+    t->length = h->length;
+    t->bytes = (size_t)h->length * SAMPLE;
+
+    t->map = map;
+    t->map_len = len;
+
+    if (close(fd) == -1)
+        abort();
+
+    return 0;
+
+fail_map:
+    if (munmap(map, len) == -1)
+        abort();
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * The usual write(), continued over signals and partial writes
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t z;
+
+        z = write(fd, p, len);
+        if (z == -1) {
+            perror("write");
+            return -1;
+        }
+
+        p += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the decoded track to the PCM cache on disk
+ *
+ * Best effort: the cache entry is written to one side and moved
+ * into place, so a failed or interrupted write leaves no bad entry.
+ */
+
+static void save_cache(struct track *t)
+{
+    char name[512], tmp[520];
+    int fd;
+    unsigned int n;
+    long page;
+    struct stat st;
+    struct pcm_cache_header *h;
+
+    if (cache_dir == NULL || t->map != NULL || t->blocks == 0)
+        return;
+
+    if (stat(t->path, &st) == -1)
+        return;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    if (sizeof *h + strlen(t->path) > (size_t)page)
+        return;
+
+    if (cache_name(name, sizeof name, t->path) == -1)
+        return;
+
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", name) >= (int)sizeof tmp)
+        return;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror(tmp);
+        return;
+    }
+
+    h = calloc(1, page);
+    if (h == NULL) {
+        perror("calloc");
+        goto fail;
+    }
+
+    memcpy(h->magic, PCM_CACHE_MAGIC, sizeof h->magic);
+    h->version = PCM_CACHE_VERSION;
+    h->rate = RATE;
+    h->block_bytes = sizeof(struct track_block);
+    h->blocks = t->blocks;
+    h->length = t->length;
+    h->mtime = st.st_mtime;
+    h->size = st.st_size;
+    h->path_len = strlen(t->path);
+    memcpy(h->path, t->path, h->path_len);
+
+    if (write_all(fd, h, page) == -1)
+        goto fail_header;
+
+    for (n = 0; n < t->blocks; n++) {
+        if (write_all(fd, t->block[n], sizeof(struct track_block)) == -1)
+            goto fail_header;
+    }
+
+    free(h);
+
+    if (close(fd) == -1)
+        abort();
+
+    if (rename(tmp, name) == -1) {
+        perror("rename");
+        if (unlink(tmp) == -1)
+            perror("unlink");
+        return;
+    }
+
+    debug("cached '%s' (%u blocks)", t->path, t->blocks);
+    return;
+
+fail_header:
+    free(h);
+fail:
+    if (close(fd) == -1)
+        abort();
+    if (unlink(tmp) == -1)
+        perror("unlink");
+}
+
 /*
  * Allocate more memory
  *
@@ -87,22 +566,29 @@ static int more_space(struct track *tr)
         return -1;
     }
 
-    block = malloc(sizeof(struct track_block));
+    if (claim(BLOCK_BYTES) == -1) {
+        fprintf(stderr, "Not loading any further; memory budget reached.\n");
+        return -1;
+    }
+
+    block = block_alloc();
     if (block == NULL) {
-        perror("malloc");
+        forfeit(BLOCK_BYTES);
         return -1;
     }
 
-    if (use_mlock && mlock(block, sizeof(struct track_block)) == -1) {
+    if (should_lock(tr) && mlock(block, BLOCK_BYTES) == -1) {
         perror("mlock");
-        free(block);
+        block_free(block);
+        forfeit(BLOCK_BYTES);
         return -1;
     }
 
     /* No memory barrier is needed here, because nobody else tries to
      * access these blocks until tr->length is actually incremented */
 
-    tr->block[tr->blocks++] = block;
+    set_block(tr, tr->blocks, block);
+    tr->blocks++;
 
     debug("allocated new track block (%d blocks, %zu bytes)",
           tr->blocks, tr->blocks * TRACK_BLOCK_SAMPLES * SAMPLE);
@@ -141,20 +627,14 @@ static void* access_pcm(struct track *tr, size_t *len)
  * placed in the buffer.
  */
 
-static void commit_pcm_samples(struct track *tr, unsigned int samples)
+static void meter_pcm(struct track *tr, struct track_block *block,
+                      unsigned int fill, unsigned int samples)
 {
-    unsigned int fill, n;
+    unsigned int n;
     signed short *pcm;
-    struct track_block *block;
 
-    block = tr->block[tr->length / TRACK_BLOCK_SAMPLES];
-    fill = tr->length % TRACK_BLOCK_SAMPLES;
     pcm = block->pcm + TRACK_CHANNELS * fill;
 
-    assert(samples <= TRACK_BLOCK_SAMPLES - fill);
-
-    /* Meter the new audio */
-
     for (n = samples; n > 0; n--) {
         unsigned short v;
         unsigned int w;
@@ -185,11 +665,212 @@ static void commit_pcm_samples(struct track *tr, unsigned int samples)
         fill++;
         pcm += TRACK_CHANNELS;
     }
+}
+
+/*
+ * Rebuild a mip pyramid over the filled prefix of a meter array
+ *
+ * Each level is the pairwise maximum of the level below, so a
+ * reader at any zoom sees the true peak of the span it asks about.
+ */
+
+static void build_mips(const unsigned char *base, unsigned char *mip,
+                       unsigned int entries, unsigned int total,
+                       unsigned int levels)
+{
+    const unsigned char *src;
+    unsigned int l;
+
+    src = base;
+
+    for (l = 1; l <= levels; l++) {
+        unsigned char *dst;
+        unsigned int n;
+
+        dst = mip + TRACK_MIP_OFFSET(total, l);
+        entries = (entries + 1) / 2;
+
+        for (n = 0; n < entries; n++) {
+            unsigned char a, b;
+
+            a = src[n * 2];
+            b = src[n * 2 + 1];
+            dst[n] = (a > b) ? a : b;
+        }
+
+        src = dst;
+    }
+}
+
+static void block_mips(struct track_block *b, unsigned int filled)
+{
+    build_mips(b->ppm, b->ppm_mip,
+               (filled + TRACK_PPM_RES - 1) / TRACK_PPM_RES,
+               TRACK_PPM_ENTRIES, TRACK_PPM_MIPS);
+    build_mips(b->overview, b->ov_mip,
+               (filled + TRACK_OVERVIEW_RES - 1) / TRACK_OVERVIEW_RES,
+               TRACK_OV_ENTRIES, TRACK_OV_MIPS);
+}
+
+/*
+ * The meter worker; one per import
+ *
+ * Metering used to run inline on the rig thread as samples arrived,
+ * stalling its poll loop when several imports ran at once. The rig
+ * now only advances the track length and this thread follows
+ * behind. The meters are display-only, so readers tolerate them
+ * trailing the audio by a moment.
+ */
+
+static unsigned int block_goal(struct track *t, unsigned int n)
+{
+    unsigned int len;
+
+    if (t->sparse)
+        return t->filled[n];
+
+    len = t->length;
+    if (len <= n * TRACK_BLOCK_SAMPLES)
+        return 0;
+
+    len -= n * TRACK_BLOCK_SAMPLES;
+    if (len > TRACK_BLOCK_SAMPLES)
+        len = TRACK_BLOCK_SAMPLES;
+
+    return len;
+}
+
+static void* meter_main(void *arg)
+{
+    struct track *t = arg;
+    unsigned int done[TRACK_MAX_BLOCKS];
+
+    memset(done, 0, sizeof done);
+
+    pthread_mutex_lock(&t->meter_mx);
+
+    for (;;) {
+        unsigned int n, blocks;
+        bool idle;
+
+        blocks = t->blocks;
+        idle = true;
+
+        for (n = 0; n < blocks; n++) {
+            unsigned int goal;
+
+            goal = block_goal(t, n);
+            if (goal <= done[n])
+                continue;
+
+            pthread_mutex_unlock(&t->meter_mx);
+
+            /* Pairs with the writer's barrier when it raised
+             * the goal; the samples are in place */
+
+            __sync_synchronize();
+            meter_pcm(t, t->block[n], done[n], goal - done[n]);
+            done[n] = goal;
+            block_mips(t->block[n], done[n]);
+
+            pthread_mutex_lock(&t->meter_mx);
+            idle = false;
+        }
+
+        if (!idle)
+            continue; /* re-check everything */
+
+        if (t->meter_stop)
+            break;
+
+        pthread_cond_wait(&t->meter_cv, &t->meter_mx);
+    }
+
+    pthread_mutex_unlock(&t->meter_mx);
+
+    return NULL;
+}
+
+/*
+ * Begin metering the audio of an import
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int start_meter(struct track *t)
+{
+    t->meter_stop = false;
+
+    if (pthread_mutex_init(&t->meter_mx, NULL) != 0) {
+        perror("pthread_mutex_init");
+        return -1;
+    }
+
+    if (pthread_cond_init(&t->meter_cv, NULL) != 0) {
+        perror("pthread_cond_init");
+        goto fail;
+    }
+
+    if (pthread_create(&t->meter_worker, NULL, meter_main, t) != 0) {
+        perror("pthread_create");
+        goto fail_cond;
+    }
+
+    return 0;
+
+fail_cond:
+    if (pthread_cond_destroy(&t->meter_cv) != 0)
+        abort();
+fail:
+    if (pthread_mutex_destroy(&t->meter_mx) != 0)
+        abort();
+    return -1;
+}
+
+/*
+ * Wake the meter worker; there is new audio
+ */
+
+static void kick_meter(struct track *t)
+{
+    pthread_mutex_lock(&t->meter_mx);
+    pthread_cond_signal(&t->meter_cv);
+    pthread_mutex_unlock(&t->meter_mx);
+}
+
+/*
+ * Let the meter worker drain its backlog, and finish it
+ *
+ * Post: the meters cover the whole track
+ */
+
+static void stop_meter(struct track *t)
+{
+    pthread_mutex_lock(&t->meter_mx);
+    t->meter_stop = true;
+    pthread_cond_signal(&t->meter_cv);
+    pthread_mutex_unlock(&t->meter_mx);
+
+    if (pthread_join(t->meter_worker, NULL) != 0)
+        abort();
+
+    if (pthread_cond_destroy(&t->meter_cv) != 0)
+        abort();
+    if (pthread_mutex_destroy(&t->meter_mx) != 0)
+        abort();
+}
+
+static void commit_pcm_samples(struct track *tr, unsigned int samples)
+{
+    assert(samples <= TRACK_BLOCK_SAMPLES
+           - tr->length % TRACK_BLOCK_SAMPLES);
 
     /* Increment the track length. A memory barrier ensures the
      * realtime or UI thread does not access garbage audio */
 
     __sync_fetch_and_add(&tr->length, samples);
+
+    kick_meter(tr);
 }
 
 /*
@@ -205,6 +886,180 @@ static void commit(struct track *tr, size_t len)
     commit_pcm_samples(tr, tr->bytes / SAMPLE - tr->length);
 }
 
+/*
+ * Offer the shared-memory transport for an import; see import.h
+ *
+ * Best effort: if shared memory is not available the importer
+ * falls back to the pipe, which every importer speaks.
+ *
+ * Return: 0 on success, otherwise -1
+ * Post: if 0 is returned, tr->shm and tr->shm_fd are valid
+ */
+
+static int create_shm(struct track *tr)
+{
+    int fd;
+    long page;
+    struct import_shm_header *h;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    fd = memfd_create("xwax-import", 0);
+    if (fd == -1)
+        return -1; /* eg. kernel too old */
+
+    if (ftruncate(fd, page) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+
+    h = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    memcpy(h->magic, IMPORT_SHM_MAGIC, sizeof h->magic);
+    h->version = IMPORT_SHM_VERSION;
+    h->data_offset = page;
+
+    /* Blocks are page-aligned in the file so they can be mapped
+     * individually as they fill */
+
+    h->block_bytes = (sizeof(struct track_block) + page - 1)
+        / page * page;
+    h->pcm_bytes = TRACK_BLOCK_PCM_BYTES;
+    h->max_blocks = TRACK_MAX_BLOCKS;
+    h->active = 0;
+    h->frames = 0;
+    h->seek = 0;
+    h->total = 0;
+    h->want = 0;
+
+    tr->shm = h;
+    tr->shm_fd = fd;
+
+    return 0;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Release the shared-memory transport, if it was created
+ */
+
+static void destroy_shm(struct track *tr)
+{
+    struct import_shm_header *h = tr->shm;
+
+    if (h == NULL)
+        return;
+
+    if (munmap(h, h->data_offset) == -1)
+        abort();
+    if (close(tr->shm_fd) == -1)
+        abort();
+
+    tr->shm = NULL;
+    tr->shm_fd = -1;
+}
+
+/*
+ * Sink given to a decoder plugin; see decoder.h
+ *
+ * These run on the decoder thread. The track structure is shared
+ * with the rig and realtime threads in exactly the way it is when
+ * an importer process is filling it, so the same rules apply.
+ */
+
+static void* sink_pcm(void *local, size_t *len)
+{
+    struct track *tr = local;
+
+    if (tr->terminated)
+        return NULL;
+
+    return access_pcm(tr, len);
+}
+
+static void sink_commit(void *local, size_t bytes)
+{
+    commit(local, bytes);
+}
+
+static void* decoder_main(void *arg)
+{
+    struct track *t = arg;
+    struct decoder_sink sink;
+
+    sink.local = t;
+    sink.pcm = sink_pcm;
+    sink.commit = sink_commit;
+
+    if (t->plugin->decode(t->path, RATE, &sink) == -1)
+        t->failed = true;
+
+    /* EOF on the pipe notifies the rig, as an importer would */
+
+    if (close(t->wr) == -1)
+        abort();
+
+    return NULL;
+}
+
+/*
+ * Begin decoding on a worker thread, in place of an importer
+ * process
+ *
+ * Return: 0 on success, otherwise -1
+ * Post: on success, t->fd is non-blocking and signals completion
+ */
+
+static int start_decode(struct track *t)
+{
+    int pp[2];
+
+    if (pipe(pp) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    if (fcntl(pp[0], F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+        goto fail;
+    }
+
+    /* Keep the pipe out of child processes; the rig's registration
+     * of the read side must end when we close it */
+
+    if (fcntl(pp[0], F_SETFD, FD_CLOEXEC) == -1
+        || fcntl(pp[1], F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        goto fail;
+    }
+
+    t->fd = pp[0];
+    t->wr = pp[1];
+
+    if (pthread_create(&t->decoder, NULL, decoder_main, t) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    if (close(pp[0]) == -1)
+        abort();
+    if (close(pp[1]) == -1)
+        abort();
+    return -1;
+}
+
 /*
  * Initialise object which will hold PCM audio data, and start
  * importing the data
@@ -213,59 +1068,251 @@ static void commit(struct track *tr, size_t len)
  * Post: track is importing
  */
 
-static int track_init(struct track *t, const char *importer, const char *path)
+static int track_init(struct track *t, const char *importer, const char *path)
+{
+    t->refcount = 0;
+    t->pins = 0;
+
+    t->blocks = 0;
+    t->rate = RATE;
+
+    t->bytes = 0;
+    t->length = 0;
+    t->ppm = 0;
+    t->overview = 0;
+
+    t->importer = importer;
+    t->path = path;
+
+    t->shm = NULL;
+    t->shm_fd = -1;
+    t->shm_active = false;
+    t->sparse = false;
+
+    t->map = NULL;
+    t->map_len = 0;
+    t->tail_bytes = 0;
+
+    t->pid = 0;
+    t->pe.fd = -1;
+    t->pe.revents = 0;
+    t->terminated = false;
+    t->failed = false;
+    t->plugin = NULL;
+
+    /* Decoded PCM from an earlier session needs no import at all */
+
+    if (load_cache(t) == 0) {
+        fprintf(stderr, "Loaded '%s' from the PCM cache\n", path);
+        t->importing = false;
+        list_add(&t->tracks, &tracks);
+        return 0;
+    }
+
+    if (start_meter(t) == -1)
+        return -1;
+
+    t->plugin = decoder_match(path);
+
+    if (t->plugin != NULL) {
+        fprintf(stderr, "Decoding '%s' (%s)...\n", path, t->plugin->name);
+
+        if (start_decode(t) == -1) {
+            stop_meter(t);
+            return -1;
+        }
+    } else {
+        pid_t pid;
+
+        fprintf(stderr, "Importing '%s'...\n", path);
+
+        (void)create_shm(t);
+
+        pid = fork_pipe_nb_fd(&t->fd, t->shm_fd, importer, "import", path,
+                              STR(RATE), NULL);
+        if (pid == -1) {
+            destroy_shm(t);
+            stop_meter(t);
+            return -1;
+        }
+
+        t->pid = pid;
+    }
+
+    t->importing = true;
+
+    list_add(&t->tracks, &tracks);
+    rig_post_track(t);
+
+    return 0;
+}
+
+/*
+ * Destroy this track from memory
+ *
+ * Terminates any import processes and frees any memory allocated by
+ * this object.
+ *
+ * Pre: track is not importing
+ * Pre: track is initialised
+ */
+
+static void track_clear(struct track *tr)
+{
+    int n;
+
+    assert(!track_is_importing(tr));
+
+    forfeit(allocated(tr));
+
+    if (tr->map != NULL) {
+        if (munmap(tr->map, tr->map_len) == -1)
+            abort();
+    } else for (n = 0; n < tr->blocks; n++) {
+        if (tr->shm_active) {
+            struct import_shm_header *h = tr->shm;
+
+            if (munmap(tr->block[n], h->block_bytes) == -1)
+                abort();
+        } else if (n == tr->blocks - 1 && tr->tail_bytes != 0) {
+            if (munmap(tr->pcm[n], tr->tail_bytes) == -1)
+                abort();
+        } else {
+            block_free(tr->block[n]);
+        }
+    }
+
+    destroy_shm(tr);
+
+    list_del(&tr->tracks);
+}
+
+/*
+ * Replace a partially-used final block with a right-sized copy
+ *
+ * A short track otherwise rounds up to a whole block; with several
+ * such tracks parked in the cache the waste is significant. Only
+ * safe once nobody holds the track, since readers may be using the
+ * old base pointers.
+ *
+ * Pre: track is not referenced, and not importing
+ */
+
+static void trim(struct track *tr)
 {
-    pid_t pid;
+    unsigned int used, n;
+    size_t pcm_bytes, ppm_bytes, ov_bytes, len;
+    long page;
+    char *p;
+    struct track_block *b;
+
+    if (tr->blocks == 0 || tr->shm_active || tr->map != NULL
+        || tr->tail_bytes != 0)
+    {
+        return;
+    }
 
-    fprintf(stderr, "Importing '%s'...\n", path);
+    n = tr->blocks - 1;
+    used = tr->length - n * TRACK_BLOCK_SAMPLES;
 
-    pid = fork_pipe_nb(&t->fd, importer, "import", path, STR(RATE), NULL);
-    if (pid == -1)
-        return -1;
+    if (used == TRACK_BLOCK_SAMPLES)
+        return;
 
-    t->pid = pid;
-    t->pe = NULL;
-    t->terminated = false;
+    pcm_bytes = (size_t)used * SAMPLE;
+    ppm_bytes = (used + TRACK_PPM_RES - 1) / TRACK_PPM_RES;
+    ov_bytes = (used + TRACK_OVERVIEW_RES - 1) / TRACK_OVERVIEW_RES;
 
-    t->refcount = 0;
+    /* The mip pyramids are copied whole: their levels sit at fixed
+     * offsets, and they are small next to the PCM */
 
-    t->blocks = 0;
-    t->rate = RATE;
+    page = sysconf(_SC_PAGESIZE);
+    len = (pcm_bytes + ppm_bytes + ov_bytes
+           + TRACK_PPM_ENTRIES + TRACK_OV_ENTRIES + page - 1)
+        / page * page;
 
-    t->bytes = 0;
-    t->length = 0;
-    t->ppm = 0;
-    t->overview = 0;
+    if (len >= BLOCK_BYTES)
+        return; /* nothing to gain */
 
-    t->importer = importer;
-    t->path = path;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return; /* keep the full block */
 
-    list_add(&t->tracks, &tracks);
-    rig_post_track(t);
+    b = tr->block[n];
+    memcpy(p, b->pcm, pcm_bytes);
+    memcpy(p + pcm_bytes, b->ppm, ppm_bytes);
+    memcpy(p + pcm_bytes + ppm_bytes, b->overview, ov_bytes);
+    memcpy(p + pcm_bytes + ppm_bytes + ov_bytes, b->ppm_mip,
+           TRACK_PPM_ENTRIES);
+    memcpy(p + pcm_bytes + ppm_bytes + ov_bytes + TRACK_PPM_ENTRIES,
+           b->ov_mip, TRACK_OV_ENTRIES);
 
-    return 0;
+    if (use_mlock && mlock(p, len) == -1)
+        perror("mlock");
+
+    tr->pcm[n] = (signed short*)p;
+    tr->ppm_base[n] = (unsigned char*)p + pcm_bytes;
+    tr->overview_base[n] = (unsigned char*)p + pcm_bytes + ppm_bytes;
+    tr->ppm_mip_base[n] = (unsigned char*)p + pcm_bytes + ppm_bytes
+        + ov_bytes;
+    tr->ov_mip_base[n] = (unsigned char*)p + pcm_bytes + ppm_bytes
+        + ov_bytes + TRACK_PPM_ENTRIES;
+    tr->block[n] = NULL;
+    tr->tail_bytes = len;
+
+    block_free(b);
+
+    /* The budget swaps a whole block for the right-sized copy */
+
+    forfeit(BLOCK_BYTES);
+    memory_used += len;
+
+    debug("trimmed '%s' tail to %zu bytes", tr->path, len);
 }
 
 /*
- * Destroy this track from memory
- *
- * Terminates any import processes and frees any memory allocated by
- * this object.
+ * Evict least-recently used tracks until the cache is within
+ * the given size
+ */
+
+static void shrink_cache(size_t limit)
+{
+    while (cache_used > limit && !list_empty(&cache))
+        evict(list_entry(cache.prev, struct track, cache));
+}
+
+/*
+ * Set the size of the cache of released tracks, in bytes
  *
- * Pre: track is not importing
- * Pre: track is initialised
+ * A size of zero disables the cache.
  */
 
-static void track_clear(struct track *tr)
+void track_set_cache_size(size_t bytes)
 {
-    int n;
+    cache_limit = bytes;
+    shrink_cache(cache_limit);
+}
+
+/*
+ * Set the global budget for track memory, in bytes
+ *
+ * Unlike the cache size, this covers every track in memory, in use
+ * or cached. A size of zero removes the limit.
+ */
 
-    assert(tr->pid == 0);
+void track_set_memory_limit(size_t bytes)
+{
+    memory_limit = bytes;
+    (void)make_room(0);
+}
 
-    for (n = 0; n < tr->blocks; n++)
-        free(tr->block[n]);
+/*
+ * Release all tracks held only by the cache
+ */
 
-    list_del(&tr->tracks);
+void track_cache_clear(void)
+{
+    shrink_cache(0);
 }
 
 /*
@@ -280,6 +1327,11 @@ static struct track* track_get_again(const char *importer, const char *path)
 
     list_for_each(t, &tracks, tracks) {
         if (t->importer == importer && t->path == path) {
+            if (t->refcount == 0) {
+                /* Take it back out of the cache */
+                list_del(&t->cache);
+                cache_used -= allocated(t);
+            }
             track_acquire(t);
             return t;
         }
@@ -302,6 +1354,14 @@ struct track* track_acquire_by_import(const char *importer, const char *path)
     if (t != NULL)
         return t;
 
+    /* Starting an import needs at least one block of headroom;
+     * better refused here than failed part-way through */
+
+    if (!make_room(BLOCK_BYTES)) {
+        fprintf(stderr, "%s: not loading; memory budget reached.\n", path);
+        return NULL;
+    }
+
     t = malloc(sizeof *t);
     if (t == NULL) {
         perror("malloc");
@@ -335,13 +1395,88 @@ void track_acquire(struct track *t)
     t->refcount++;
 }
 
+/*
+ * Lock or unlock all of a track's audio in RAM
+ *
+ * Best effort: playback is still correct without the lock, just
+ * exposed to paging, so failure is reported and not fatal.
+ */
+
+static void lock_blocks(struct track *tr, bool lock)
+{
+    unsigned int n;
+
+    if (tr->map != NULL) {
+        if (lock) {
+            if (mlock(tr->map, tr->map_len) == -1)
+                perror("mlock");
+        } else {
+            if (munlock(tr->map, tr->map_len) == -1)
+                perror("munlock");
+        }
+        return;
+    }
+
+    for (n = 0; n < tr->blocks; n++) {
+        size_t len;
+
+        if (tr->shm_active) {
+            const struct import_shm_header *h = tr->shm;
+            len = h->block_bytes;
+        } else if (n == tr->blocks - 1 && tr->tail_bytes != 0) {
+            len = tr->tail_bytes;
+        } else {
+            len = BLOCK_BYTES;
+        }
+
+        if (lock) {
+            if (mlock(tr->pcm[n], len) == -1)
+                perror("mlock");
+        } else {
+            if (munlock(tr->pcm[n], len) == -1)
+                perror("munlock");
+        }
+    }
+}
+
+/*
+ * Declare that the track is on a deck
+ *
+ * When locking only active tracks, the audio is locked in RAM for
+ * as long as any deck holds it; blocks arriving during an import
+ * are locked as they are allocated.
+ */
+
+void track_pin(struct track *t)
+{
+    t->pins++;
+
+    if (lock_active && !use_mlock && t->pins == 1)
+        lock_blocks(t, true);
+}
+
+void track_unpin(struct track *t)
+{
+    assert(t->pins > 0);
+    t->pins--;
+
+    if (lock_active && !use_mlock && t->pins == 0)
+        lock_blocks(t, false);
+}
+
 /*
  * Request premature termination of an import operation
  */
 
 static void terminate(struct track *t)
 {
-    assert(t->pid != 0);
+    assert(track_is_importing(t));
+
+    if (t->plugin != NULL) {
+        /* The decoder polls this flag via the sink */
+        t->terminated = true;
+        return;
+    }
 
     if (kill(t->pid, SIGTERM) == -1)
         abort();
@@ -360,33 +1495,267 @@ void track_release(struct track *t)
     /* When importing, a reference is held. If it's the
      * only one remaining terminate it to save resources */
 
-    if (t->refcount == 1 && t->pid != 0) {
+    if (t->refcount == 1 && track_is_importing(t)) {
         terminate(t);
         return;
     }
 
     if (t->refcount == 0) {
         assert(t != &empty);
+
+        /* Park complete tracks in the cache rather than repeat
+         * the whole import if they are loaded again soon */
+
+        if (!t->terminated && !t->failed && allocated(t) <= cache_limit) {
+            trim(t);
+            list_add(&t->cache, &cache);
+            cache_used += allocated(t);
+            shrink_cache(cache_limit);
+            return;
+        }
+
         track_clear(t);
         free(t);
     }
 }
 
 /*
- * Get entry for use by poll()
+ * Get persistent entry for use by the rig
  *
  * Pre: track is importing
- * Post: *pe contains poll entry
+ * Return: poll entry, valid until the import completes
  */
 
-void track_pollfd(struct track *t, struct pollfd *pe)
+struct pollfd* track_pollfd(struct track *t)
 {
-    assert(t->pid != 0);
+    assert(track_is_importing(t));
+
+    t->pe.fd = t->fd;
+    t->pe.events = POLLIN;
+    t->pe.revents = 0;
+
+    return &t->pe;
+}
+
+/*
+ * Bring the next shared-memory block into our address space
+ *
+ * The importer has already grown the file past this block before
+ * committing any frames inside it.
+ *
+ * Return: -1 if the block could not be mapped, otherwise 0
+ */
+
+static int map_shm_block(struct track *tr)
+{
+    struct import_shm_header *h = tr->shm;
+    void *p;
+    off_t off;
+
+    rt_not_allowed();
+
+    if (tr->blocks >= TRACK_MAX_BLOCKS) {
+        fprintf(stderr, "Maximum track length reached.\n");
+        return -1;
+    }
+
+    if (claim(h->block_bytes) == -1) {
+        fprintf(stderr, "Not loading any further; memory budget reached.\n");
+        return -1;
+    }
+
+    off = h->data_offset + (off_t)tr->blocks * h->block_bytes;
+
+    p = mmap(NULL, h->block_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+             tr->shm_fd, off);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        forfeit(h->block_bytes);
+        return -1;
+    }
+
+    if (should_lock(tr) && mlock(p, h->block_bytes) == -1) {
+        perror("mlock");
+        if (munmap(p, h->block_bytes) == -1)
+            abort();
+        forfeit(h->block_bytes);
+        return -1;
+    }
+
+    set_block(tr, tr->blocks, p);
+    tr->blocks++;
+
+    debug("mapped shared track block (%d blocks)", tr->blocks);
+
+    return 0;
+}
+
+/*
+ * Prepare for an importer which fills blocks out of order
+ *
+ * The importer has grown the file to its full extent, so every
+ * block can be mapped -- as zero pages where nothing is decoded
+ * yet -- and the whole track length advertised at once.
+ *
+ * Return: -1 if the blocks could not be mapped, otherwise 0
+ */
+
+static int setup_sparse(struct track *tr)
+{
+    struct import_shm_header *h = tr->shm;
+    unsigned int total, blocks;
+
+    total = h->total;
+    if (total > TRACK_MAX_BLOCKS * TRACK_BLOCK_SAMPLES)
+        total = TRACK_MAX_BLOCKS * TRACK_BLOCK_SAMPLES;
+
+    blocks = (total + TRACK_BLOCK_SAMPLES - 1) / TRACK_BLOCK_SAMPLES;
+
+    while (tr->blocks < blocks) {
+        if (map_shm_block(tr) == -1)
+            return -1;
+    }
+
+    memset(tr->filled, 0, sizeof tr->filled);
+    tr->sparse = true;
+
+    __sync_synchronize();
+    tr->length = total;
+
+    return 0;
+}
+
+/*
+ * Meter any audio newly committed to out-of-order blocks
+ */
+
+static void take_sparse(struct track *tr)
+{
+    struct import_shm_header *h = tr->shm;
+    unsigned int n;
+    bool advanced;
+
+    advanced = false;
+
+    for (n = 0; n < tr->blocks; n++) {
+        unsigned int f, have, limit;
+
+        f = h->filled[n];
+        have = tr->filled[n];
+
+        limit = tr->length - n * TRACK_BLOCK_SAMPLES;
+        if (limit > TRACK_BLOCK_SAMPLES)
+            limit = TRACK_BLOCK_SAMPLES;
+        if (f > limit)
+            f = limit;
+
+        if (f <= have)
+            continue;
+
+        tr->bytes += (size_t)(f - have) * SAMPLE;
+        tr->filled[n] = f;
+        advanced = true;
+    }
+
+    if (advanced)
+        kick_meter(tr);
+}
+
+/*
+ * Tell the importer which block the listener is nearest
+ *
+ * Lock-free and wait-free: a single store into the shared header,
+ * so this may be called from the realtime thread on every cycle.
+ */
+
+void track_want(struct track *tr, unsigned int sample)
+{
+    struct import_shm_header *h = tr->shm;
+
+    if (h == NULL || !tr->shm_active)
+        return;
+
+    h->want = sample / TRACK_BLOCK_SAMPLES;
+}
+
+/*
+ * Take in audio committed to the shared memory by the importer
+ *
+ * The pipe carries only wakeup bytes; the PCM is already in place
+ * in the mapped pages, so all that remains is to map any block newly
+ * entered, meter the new audio and advance the track length.
+ *
+ * Return: -1 when the import has completed or failed, otherwise 0
+ */
+
+static int read_from_shm(struct track *tr)
+{
+    struct import_shm_header *h = tr->shm;
+    unsigned int frames;
+    bool eof;
+
+    /* Drain the wakeup bytes; only their arrival matters */
+
+    eof = false;
+
+    for (;;) {
+        char buf[256];
+        ssize_t z;
+
+        z = read(tr->fd, buf, sizeof buf);
+        if (z == -1) {
+            if (errno == EAGAIN)
+                break;
+            perror("read");
+            return -1;
+        }
+
+        if (z == 0) {
+            eof = true;
+            break;
+        }
+    }
+
+    __sync_synchronize();
+
+    if (h->seek && !tr->sparse) {
+        if (setup_sparse(tr) == -1)
+            return -1;
+    }
+
+    if (tr->sparse) {
+        take_sparse(tr);
+        if (eof)
+            return -1; /* completion without error */
+        return 0;
+    }
 
-    pe->fd = t->fd;
-    pe->events = POLLIN;
+    frames = h->frames;
 
-    t->pe = pe;
+    if (frames > TRACK_MAX_BLOCKS * TRACK_BLOCK_SAMPLES)
+        frames = TRACK_MAX_BLOCKS * TRACK_BLOCK_SAMPLES;
+
+    while (tr->length < frames) {
+        unsigned int fill, n;
+
+        if (tr->length / TRACK_BLOCK_SAMPLES == tr->blocks) {
+            if (map_shm_block(tr) == -1)
+                return -1;
+        }
+
+        fill = tr->length % TRACK_BLOCK_SAMPLES;
+        n = frames - tr->length;
+        if (n > TRACK_BLOCK_SAMPLES - fill)
+            n = TRACK_BLOCK_SAMPLES - fill;
+
+        commit_pcm_samples(tr, n);
+        tr->bytes += n * SAMPLE;
+    }
+
+    if (eof)
+        return -1; /* completion without error */
+
+    return 0;
 }
 
 /*
@@ -398,6 +1767,42 @@ void track_pollfd(struct track *t, struct pollfd *pe)
 
 static int read_from_pipe(struct track *tr)
 {
+    struct import_shm_header *h = tr->shm;
+
+    /* A decoder plugin places the PCM itself; the pipe only
+     * carries EOF when the decode is complete */
+
+    if (tr->plugin != NULL) {
+        for (;;) {
+            char buf[16];
+            ssize_t z;
+
+            z = read(tr->fd, buf, sizeof buf);
+            if (z == -1) {
+                if (errno == EAGAIN)
+                    return 0;
+                perror("read");
+                return -1;
+            }
+
+            if (z == 0)
+                return -1; /* completion */
+        }
+    }
+
+    /* An importer which speaks the shared-memory protocol declares
+     * itself before its first byte on the pipe, so the choice is
+     * settled here before any PCM could arrive */
+
+    if (h != NULL && !tr->shm_active) {
+        __sync_synchronize();
+        if (h->active && tr->blocks == 0)
+            tr->shm_active = true;
+    }
+
+    if (tr->shm_active)
+        return read_from_shm(tr);
+
     for (;;) {
         void *pcm;
         size_t len;
@@ -449,11 +1854,51 @@ static void stop_import(struct track *t)
         fprintf(stderr, "Track import completed\n");
     } else {
         fprintf(stderr, "Track import completed with status %d\n", status);
+        t->failed = true;
         if (!t->terminated)
             status_printf(STATUS_ALERT, "Error importing %s", t->path);
     }
 
     t->pid = 0;
+    t->importing = false;
+
+    stop_meter(t);
+
+    if (!t->failed && !t->terminated)
+        save_cache(t);
+}
+
+/*
+ * Synchronise with the decoder thread and complete it
+ *
+ * Pre: track is decoding
+ * Post: track is not importing
+ */
+
+static void stop_decode(struct track *t)
+{
+    assert(t->plugin != NULL);
+
+    if (pthread_join(t->decoder, NULL) != 0)
+        abort();
+
+    if (close(t->fd) == -1)
+        abort();
+
+    if (!t->failed) {
+        fprintf(stderr, "Track decode completed\n");
+    } else {
+        fprintf(stderr, "Track decode failed\n");
+        if (!t->terminated)
+            status_printf(STATUS_ALERT, "Error importing %s", t->path);
+    }
+
+    t->importing = false;
+
+    stop_meter(t);
+
+    if (!t->failed && !t->terminated)
+        save_cache(t);
 }
 
 /*
@@ -464,21 +1909,77 @@ static void stop_import(struct track *t)
 
 void track_handle(struct track *tr)
 {
-    assert(tr->pid != 0);
+    assert(track_is_importing(tr));
 
-    /* A track may be added while poll() was waiting,
-     * in which case it has no return data from poll */
+    /* A track may be added while the rig was waiting, in which
+     * case it has seen no activity yet */
 
-    if (tr->pe == NULL)
+    if (tr->pe.fd == -1)
         return;
 
-    if (tr->pe->revents == 0)
+    if (tr->pe.revents == 0)
         return;
 
+    tr->pe.revents = 0;
+
     if (read_from_pipe(tr) != -1)
         return;
 
-    stop_import(tr);
+    if (tr->plugin != NULL)
+        stop_decode(tr);
+    else
+        stop_import(tr);
     list_del(&tr->rig);
     track_release(tr); /* may delete the track */
 }
+
+/*
+ * Ask the kernel to bring a window of PCM around the given position
+ * into memory
+
+ * Best effort, and asynchronous: under memory pressure, blocks which
+ * have gone cold (or out to swap) would otherwise be faulted back in
+ * by the realtime thread, mid-period, on the first collect after a
+ * jump. This is cheap, so it can be repeated whenever a jump target
+ * becomes likely.
+ */
+
+void track_prefetch(struct track *tr, double position, double seconds)
+{
+    long from, to, page;
+    unsigned int b, lo, hi;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    from = (position - seconds / 2) * tr->rate;
+    to = (position + seconds / 2) * tr->rate;
+
+    if (from < 0)
+        from = 0;
+    if (to > (long)tr->length)
+        to = tr->length;
+    if (from >= to)
+        return;
+
+    lo = from / TRACK_BLOCK_SAMPLES;
+    hi = (to - 1) / TRACK_BLOCK_SAMPLES;
+
+    for (b = lo; b <= hi; b++) {
+        long s, e;
+        char *p, *q;
+
+        s = (long)b * TRACK_BLOCK_SAMPLES;
+        e = s + TRACK_BLOCK_SAMPLES;
+        if (s < from)
+            s = from;
+        if (e > to)
+            e = to;
+
+        p = (char*)track_get_sample(tr, s);
+        q = (char*)track_get_sample(tr, e - 1) + SAMPLE;
+        p -= (uintptr_t)p % page;
+
+        if (madvise(p, q - p, MADV_WILLNEED) == -1)
+            perror("madvise");
+    }
+}
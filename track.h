@@ -20,12 +20,15 @@
 #ifndef TRACK_H
 #define TRACK_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <sys/poll.h>
 #include <sys/types.h>
 
 #include "list.h"
 
+struct decoder_plugin;
+
 #define TRACK_CHANNELS 2
 
 #define TRACK_MAX_BLOCKS 64
@@ -33,15 +36,32 @@
 #define TRACK_PPM_RES 64
 #define TRACK_OVERVIEW_RES 2048
 
+/* Each meter array carries a pyramid of coarser 'mip' levels; level
+ * l holds one value -- the peak of its span -- per (RES << l)
+ * samples. The levels are packed into one array of the same size as
+ * the base level, at the offsets below */
+
+#define TRACK_PPM_MIPS 8
+#define TRACK_OV_MIPS 8
+
+#define TRACK_PPM_ENTRIES (TRACK_BLOCK_SAMPLES / TRACK_PPM_RES)
+#define TRACK_OV_ENTRIES (TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES)
+
+#define TRACK_MIP_OFFSET(entries, l) ((entries) - ((entries) >> ((l) - 1)))
+
 struct track_block {
     signed short pcm[TRACK_BLOCK_SAMPLES * TRACK_CHANNELS];
-    unsigned char ppm[TRACK_BLOCK_SAMPLES / TRACK_PPM_RES],
-        overview[TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES];
+    unsigned char ppm[TRACK_PPM_ENTRIES],
+        overview[TRACK_OV_ENTRIES],
+        ppm_mip[TRACK_PPM_ENTRIES],
+        ov_mip[TRACK_OV_ENTRIES];
 };
 
 struct track {
     struct list tracks;
-    unsigned int refcount;
+    struct list cache; /* on the LRU of released tracks, if unreferenced */
+    unsigned int refcount,
+        pins; /* decks holding this track */
     int rate;
 
     /* pointers to external data */
@@ -53,14 +73,53 @@ struct track {
         blocks; /* number of blocks allocated */
     struct track_block *block[TRACK_MAX_BLOCKS];
 
+    /* Per-block base pointers, used by the accessors below. These
+     * normally point into block[], but a right-sized final block
+     * keeps only its used region; see trim() in track.c */
+
+    signed short *pcm[TRACK_MAX_BLOCKS];
+    unsigned char *ppm_base[TRACK_MAX_BLOCKS],
+        *overview_base[TRACK_MAX_BLOCKS],
+        *ppm_mip_base[TRACK_MAX_BLOCKS],
+        *ov_mip_base[TRACK_MAX_BLOCKS];
+    size_t tail_bytes; /* right-sized final block, or 0 */
+
     /* State of audio import */
 
     struct list rig;
+    bool importing;
     pid_t pid;
     int fd;
-    struct pollfd *pe;
+    struct pollfd pe;
     bool terminated;
 
+    /* In-process decode, in place of an importer process */
+
+    const struct decoder_plugin *plugin;
+    pthread_t decoder;
+    int wr; /* pipe written on completion */
+    bool failed;
+
+    /* Meter worker, following the import; see meter_main() */
+
+    pthread_t meter_worker;
+    pthread_mutex_t meter_mx;
+    pthread_cond_t meter_cv;
+    bool meter_stop;
+
+    /* Shared-memory import transport; see import.h */
+
+    void *shm; /* mapped header, or NULL if unavailable */
+    int shm_fd;
+    bool shm_active; /* the importer took up the offer */
+    bool sparse; /* blocks are being filled out of order */
+    unsigned int filled[TRACK_MAX_BLOCKS]; /* samples taken per block */
+
+    /* Mapping of the on-disk PCM cache, or NULL */
+
+    void *map;
+    size_t map_len;
+
     /* Current value of audio meters when loading */
     
     unsigned short ppm;
@@ -68,6 +127,11 @@ struct track {
 };
 
 void track_use_mlock(void);
+void track_use_mlock_active(void);
+void track_set_cache_size(size_t bytes);
+void track_set_memory_limit(size_t bytes);
+void track_cache_clear(void);
+void track_set_cache_dir(const char *dir);
 
 /* Tracks are dynamically allocated and reference counted */
 
@@ -76,43 +140,89 @@ struct track* track_acquire_empty(void);
 void track_acquire(struct track *t);
 void track_release(struct track *t);
 
+/* Declare that a track is (or is no longer) on a deck */
+
+void track_pin(struct track *t);
+void track_unpin(struct track *t);
+
 /* Functions used by the rig and main thread */
 
-void track_pollfd(struct track *tr, struct pollfd *pe);
+struct pollfd* track_pollfd(struct track *tr);
 void track_handle(struct track *tr);
 
+void track_prefetch(struct track *tr, double position, double seconds);
+
+/* Safe to call from realtime; see track.c */
+
+void track_want(struct track *tr, unsigned int sample);
+
 /* Return true if the track importer is running, otherwise false */
 
 static inline bool track_is_importing(struct track *tr)
 {
-    return tr->pid != 0;
+    return tr->importing;
 }
 
 /* Return the pseudo-PPM meter value for the given sample */
 
 static inline unsigned char track_get_ppm(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return b->ppm[(s % TRACK_BLOCK_SAMPLES) / TRACK_PPM_RES];
+    const unsigned char *b;
+    b = tr->ppm_base[s / TRACK_BLOCK_SAMPLES];
+    return b[(s % TRACK_BLOCK_SAMPLES) / TRACK_PPM_RES];
 }
 
 /* Return the overview meter value for the given sample */
 
 static inline unsigned char track_get_overview(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return b->overview[(s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES];
+    const unsigned char *b;
+    b = tr->overview_base[s / TRACK_BLOCK_SAMPLES];
+    return b[(s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES];
+}
+
+/* Return the peak PPM value over the span of (TRACK_PPM_RES << level)
+ * samples containing the given sample; level 0 is the base array */
+
+static inline unsigned char track_get_ppm_level(struct track *tr, int s,
+                                                int level)
+{
+    const unsigned char *b;
+
+    if (level <= 0)
+        return track_get_ppm(tr, s);
+    if (level > TRACK_PPM_MIPS)
+        level = TRACK_PPM_MIPS;
+
+    b = tr->ppm_mip_base[s / TRACK_BLOCK_SAMPLES];
+    return b[TRACK_MIP_OFFSET(TRACK_PPM_ENTRIES, level)
+             + (s % TRACK_BLOCK_SAMPLES) / (TRACK_PPM_RES << level)];
+}
+
+/* As above, for the overview meter */
+
+static inline unsigned char track_get_overview_level(struct track *tr, int s,
+                                                     int level)
+{
+    const unsigned char *b;
+
+    if (level <= 0)
+        return track_get_overview(tr, s);
+    if (level > TRACK_OV_MIPS)
+        level = TRACK_OV_MIPS;
+
+    b = tr->ov_mip_base[s / TRACK_BLOCK_SAMPLES];
+    return b[TRACK_MIP_OFFSET(TRACK_OV_ENTRIES, level)
+             + (s % TRACK_BLOCK_SAMPLES) / (TRACK_OVERVIEW_RES << level)];
 }
 
 /* Return a pointer to (not value of) the sample data for each channel */
 
 static inline signed short* track_get_sample(struct track *tr, int s)
 {
-    struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return &b->pcm[(s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+    signed short *b;
+    b = tr->pcm[s / TRACK_BLOCK_SAMPLES];
+    return &b[(s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
 }
 
 #endif
@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <locale.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,7 +29,10 @@
 #include <SDL.h> /* may override main() */
 
 #include "alsa.h"
+#include "bpm.h"
+#include "console.h"
 #include "controller.h"
+#include "decoder.h"
 #include "device.h"
 #include "dicer.h"
 #include "dummy.h"
@@ -36,7 +40,10 @@
 #include "jack.h"
 #include "library.h"
 #include "oss.h"
+#include "perf.h"
 #include "realtime.h"
+#include "recorder.h"
+#include "snapshot.h"
 #include "thread.h"
 #include "rig.h"
 #include "timecoder.h"
@@ -61,15 +68,18 @@ char *banner = "xwax " VERSION \
     " (C) Copyright 2018 Mark Hills <mark@xwax.org>";
 
 size_t ndeck;
-struct deck deck[3];
+struct deck deck[MAX_DECKS];
 
 static size_t nctl;
-static struct controller ctl[2];
+static struct controller ctl[MAX_DECKS];
 
 static struct rt rt;
 
+static size_t nrecorder;
+static struct recorder recorder[MAX_DECKS];
+
 static double speed;
-static bool protect, phono;
+static bool protect, phono, probe, sinc;
 static const char *importer;
 static struct timecode_def *timecode;
 
@@ -79,26 +89,40 @@ static void usage(FILE *fd)
 
     fprintf(fd, "Program-wide options:\n"
       "  -k             Lock real-time memory into RAM\n"
+      "  --mlock-decks  Lock only the tracks currently on a deck into RAM\n"
       "  -q <n>         Real-time priority (0 for no priority, default %d)\n"
+      "  --rt-cpus <list> Reserve the given CPUs for realtime threads\n"
+      "  --record <path> Record each deck to <path>-deck<n>.wav\n"
+      "  --snapshot <path> Periodically save session state to file\n"
+      "  --resume       Restore the session from the snapshot at startup\n"
+      "  --cache <mb>   Size of the cache of released tracks (0 to disable)\n"
+      "  --memory <mb>  Budget for all track memory (0 for no limit)\n"
+      "  --pcm-cache <dir> Keep decoded PCM on disk for re-use across sessions\n"
       "  -g <s>         Set display geometry (see man page)\n"
       "  --no-decor     Request a window with no decorations\n"
+      "  --no-interface Headless operation; no SDL interface\n"
+      "  --console <path> Accept commands on the given UNIX socket\n"
       "  -h             Display this message to stdout and exit\n\n",
       DEFAULT_PRIORITY);
 
     fprintf(fd, "Music library options:\n"
       "  -l <path>      Location to scan for audio tracks\n"
-      "  -s <program>   Library scanner (default '%s')\n\n",
+      "  -s <program>   Library scanner (default '%s')\n"
+      "  --library-cache <dir> Keep a compiled library for instant startup\n\n",
       DEFAULT_SCANNER);
 
     fprintf(fd, "Deck options:\n"
-      "  -t <name>      Timecode name\n"
+      "  -t <name>      Timecode name, or 'auto' to detect\n"
       "  -33            Use timecode at 33.3RPM (default)\n"
       "  -45            Use timecode at 45RPM\n"
       "  -c             Protect against certain operations while playing\n"
       "  -u             Allow all operations when playing\n"
       "  --line         Line level signal (default)\n"
       "  --phono        Tolerate cartridge level signal ('software pre-amp')\n"
+      "  --cubic        Cubic resampler (default)\n"
+      "  --sinc         Sinc resampler; cleaner audio for more CPU\n"
       "  -i <program>   Importer (default '%s')\n"
+      "  --decoder <lib> Load a decoder plugin, tried before the importer\n"
       "  --dummy        Build a dummy deck with no audio device\n\n",
       DEFAULT_IMPORTER);
 
@@ -107,7 +131,7 @@ static void usage(FILE *fd)
       "  -d <device>    Build a deck connected to OSS audio device\n"
       "  -r <hz>        Sample rate (default %dHz)\n"
       "  -b <n>         Number of buffers (default %d)\n"
-      "  -f <n>         Buffer size to request (2^n bytes, default %d)\n\n",
+      "  -f <n>|auto    Buffer size to request (2^n bytes, default %d)\n\n",
       DEFAULT_RATE, DEFAULT_OSS_BUFFERS, DEFAULT_OSS_FRAGMENT);
 #endif
 
@@ -115,7 +139,7 @@ static void usage(FILE *fd)
     fprintf(fd, "ALSA device options:\n"
       "  -a <device>    Build a deck connected to ALSA audio device\n"
       "  -r <hz>        Sample rate (default %dHz)\n"
-      "  -m <ms>        Buffer time (default %dms)\n\n",
+      "  -m <ms>|auto   Buffer time (default %dms)\n\n",
       DEFAULT_RATE, DEFAULT_ALSA_BUFFER);
 #endif
 
@@ -171,6 +195,18 @@ static int commit_deck(void)
     if (r == -1)
         return -1;
 
+    player_set_sinc(&d->player, sinc);
+
+    /* Probe for whichever timecode the operator puts on the deck;
+     * the shadow decoders need every lookup table in place */
+
+    if (probe) {
+        if (timecoder_build_all_lookups() == -1)
+            return -1;
+        if (timecoder_probe(&d->timecoder) == -1)
+            return -1;
+    }
+
     /* Connect this deck to available controllers */
 
     for (n = 0; n < nctl; n++)
@@ -181,12 +217,33 @@ static int commit_deck(void)
     return 0;
 }
 
+/*
+ * Signal handler: ask for a dump of the performance counters
+ */
+
+static void request_dump(int sig)
+{
+    perf_dump_pending = 1;
+}
+
+/*
+ * Signal handler: clean exit, for headless operation where there is
+ * no window to close
+ */
+
+static void request_quit(int sig)
+{
+    rig_quit(); /* async-signal-safe; a write to the eventfd */
+}
+
 int main(int argc, char *argv[])
 {
     int rc = -1, n, priority;
-    const char *scanner, *geo;
+    const char *scanner, *geo, *record_path, *console_path, *snapshot_path;
+    bool no_interface, resume;
     char *endptr;
     bool use_mlock, decor;
+    struct sigaction sa;
 
     struct library library;
 
@@ -202,6 +259,8 @@ int main(int argc, char *argv[])
     int alsa_buffer;
 #endif
 
+    perf_phase("init");
+
     fprintf(stderr, "%s\n\n" NOTICE "\n\n", banner);
 
     if (setlocale(LC_ALL, "") == NULL) {
@@ -216,6 +275,8 @@ int main(int argc, char *argv[])
 
     if (rig_init() == -1)
         return -1;
+    if (bpm_init() == -1)
+        return -1;
     rt_init(&rt);
     library_init(&library);
 
@@ -224,12 +285,18 @@ int main(int argc, char *argv[])
     decor = true;
     nctl = 0;
     priority = DEFAULT_PRIORITY;
+    record_path = NULL;
+    console_path = NULL;
+    snapshot_path = NULL;
+    resume = false;
+    no_interface = false;
     importer = DEFAULT_IMPORTER;
     scanner = DEFAULT_SCANNER;
     timecode = NULL;
     speed = 1.0;
     protect = false;
     phono = false;
+    probe = false;
     use_mlock = false;
 
 #if defined WITH_OSS || WITH_ALSA
@@ -250,6 +317,8 @@ int main(int argc, char *argv[])
     argv++;
     argc--;
 
+    perf_phase("args");
+
     while (argc > 0) {
 
         if (!strcmp(argv[0], "-h")) {
@@ -266,19 +335,24 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            oss_fragment = strtol(argv[1], &endptr, 10);
-            if (*endptr != '\0') {
-                fprintf(stderr, "-f requires an integer argument.\n");
-                return -1;
-            }
-
-            /* Fragment sizes greater than the default aren't useful
-             * as they are dependent on DEVICE_FRAME */
-
-            if (oss_fragment < DEFAULT_OSS_FRAGMENT) {
-                fprintf(stderr, "Fragment size must be %d or more; aborting.\n",
-                        DEFAULT_OSS_FRAGMENT);
-                return -1;
+            if (!strcmp(argv[1], "auto")) {
+                oss_fragment = 0; /* sized from the sample rate */
+            } else {
+                oss_fragment = strtol(argv[1], &endptr, 10);
+                if (*endptr != '\0') {
+                    fprintf(stderr, "-f requires an integer argument.\n");
+                    return -1;
+                }
+
+                /* Fragment sizes greater than the default aren't useful
+                 * as they are dependent on DEVICE_FRAME */
+
+                if (oss_fragment < DEFAULT_OSS_FRAGMENT) {
+                    fprintf(stderr,
+                            "Fragment size must be %d or more; aborting.\n",
+                            DEFAULT_OSS_FRAGMENT);
+                    return -1;
+                }
             }
 
             argv += 2;
@@ -333,10 +407,14 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            alsa_buffer = strtol(argv[1], &endptr, 10);
-            if (*endptr != '\0') {
-                fprintf(stderr, "-m requires an integer argument.\n");
-                return -1;
+            if (!strcmp(argv[1], "auto")) {
+                alsa_buffer = 0; /* auto-tune */
+            } else {
+                alsa_buffer = strtol(argv[1], &endptr, 10);
+                if (*endptr != '\0') {
+                    fprintf(stderr, "-m requires an integer argument.\n");
+                    return -1;
+                }
             }
 
             argv += 2;
@@ -364,6 +442,8 @@ int main(int argc, char *argv[])
             /* Work out which device type we are using, and initialise
              * an appropriate device. */
 
+            perf_phase("devices");
+
             switch(argv[0][1]) {
 
 #ifdef WITH_OSS
@@ -390,7 +470,9 @@ int main(int argc, char *argv[])
             if (r == -1)
                 return -1;
 
+            perf_phase("decks"); /* dominated by the timecode LUT */
             commit_deck();
+            perf_phase("args");
 
             argv += 2;
             argc -= 2;
@@ -418,10 +500,16 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            timecode = timecoder_find_definition(argv[1]);
-            if (timecode == NULL) {
-                fprintf(stderr, "Timecode '%s' is not known.\n", argv[1]);
-                return -1;
+            if (!strcmp(argv[1], "auto")) {
+                probe = true;
+                timecode = NULL; /* fall back to the default until detected */
+            } else {
+                probe = false;
+                timecode = timecoder_find_definition(argv[1]);
+                if (timecode == NULL) {
+                    fprintf(stderr, "Timecode '%s' is not known.\n", argv[1]);
+                    return -1;
+                }
             }
 
             argv += 2;
@@ -469,6 +557,20 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "--cubic")) {
+
+            sinc = false;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--sinc")) {
+
+            sinc = true;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-k")) {
 
             use_mlock = true;
@@ -477,6 +579,15 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "--mlock-decks")) {
+
+            /* Lock only tracks currently on a deck */
+
+            track_use_mlock_active();
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-q")) {
 
             if (argc < 2) {
@@ -499,6 +610,59 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "--rt-cpus")) {
+
+            /* Reserve CPUs for the realtime threads; everything
+             * else is confined to the remaining CPUs */
+
+            if (argc < 2) {
+                fprintf(stderr, "--rt-cpus requires a list of CPUs.\n");
+                return -1;
+            }
+
+            if (rt_set_cpus(&rt, argv[1]) == -1) {
+                fprintf(stderr, "%s: invalid list of CPUs.\n", argv[1]);
+                return -1;
+            }
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--record")) {
+
+            /* Record the playback of each deck to disk */
+
+            if (argc < 2) {
+                fprintf(stderr, "--record requires a pathname.\n");
+                return -1;
+            }
+
+            record_path = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--snapshot")) {
+
+            /* Periodic session snapshot, for warm restart */
+
+            if (argc < 2) {
+                fprintf(stderr, "--snapshot requires a pathname.\n");
+                return -1;
+            }
+
+            snapshot_path = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--resume")) {
+
+            resume = true;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-g")) {
 
             if (argc < 2) {
@@ -518,6 +682,29 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "--no-interface")) {
+
+            /* Headless: no SDL, no fonts, no display */
+
+            no_interface = true;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--console")) {
+
+            /* Command socket, for driving a headless deck */
+
+            if (argc < 2) {
+                fprintf(stderr, "--console requires a pathname.\n");
+                return -1;
+            }
+
+            console_path = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-i")) {
 
             /* Importer script for subsequent decks */
@@ -533,6 +720,98 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "--cache")) {
+
+            /* Size of the cache of released tracks */
+
+            char *endptr;
+            long mb;
+
+            if (argc < 2) {
+                fprintf(stderr, "--cache requires an integer argument.\n");
+                return -1;
+            }
+
+            mb = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || mb < 0) {
+                fprintf(stderr, "--cache requires an integer argument.\n");
+                return -1;
+            }
+
+            track_set_cache_size((size_t)mb * 1024 * 1024);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--memory")) {
+
+            /* Budget for all track memory, not just the cache */
+
+            char *endptr;
+            long mb;
+
+            if (argc < 2) {
+                fprintf(stderr, "--memory requires an integer argument.\n");
+                return -1;
+            }
+
+            mb = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || mb < 0) {
+                fprintf(stderr, "--memory requires an integer argument.\n");
+                return -1;
+            }
+
+            track_set_memory_limit((size_t)mb * 1024 * 1024);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--pcm-cache")) {
+
+            /* Keep decoded PCM on disk across sessions */
+
+            if (argc < 2) {
+                fprintf(stderr, "--pcm-cache requires a directory "
+                        "as an argument.\n");
+                return -1;
+            }
+
+            track_set_cache_dir(argv[1]);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--library-cache")) {
+
+            /* Compiled library, in place of a scan at startup */
+
+            if (argc < 2) {
+                fprintf(stderr, "--library-cache requires a directory "
+                        "as an argument.\n");
+                return -1;
+            }
+
+            library_set_cache_dir(argv[1]);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--decoder")) {
+
+            /* In-process decoder plugin, tried before the importer */
+
+            if (argc < 2) {
+                fprintf(stderr, "--decoder requires a library path "
+                        "as an argument.\n");
+                return -1;
+            }
+
+            if (decoder_load(argv[1]) == -1)
+                return -1;
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-s")) {
 
             /* Scan script for subsequent libraries */
@@ -557,8 +836,10 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
+            perf_phase("library");
             if (library_import(&library, scanner, argv[1]) == -1)
                 return -1;
+            perf_phase("args");
 
             argv += 2;
             argc -= 2;
@@ -568,7 +849,7 @@ int main(int argc, char *argv[])
 
             struct controller *c;
 
-            if (nctl == sizeof ctl) {
+            if (nctl == ARRAY_SIZE(ctl)) {
                 fprintf(stderr, "Too many controllers; aborting.\n");
                 return -1;
             }
@@ -605,11 +886,76 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (resume && snapshot_path == NULL) {
+        fprintf(stderr, "--resume needs a snapshot; give --snapshot.\n");
+        return -1;
+    }
+
     rc = EXIT_FAILURE; /* until clean exit */
 
+    /* Build the remaining lookup tables across cores, so that decks
+     * can cycle to any timecode without a blocking build mid-set */
+
+    if (timecoder_build_all_lookups() == -1)
+        return -1;
+
+    /* SIGUSR1 requests a dump of the performance counters; the
+     * interface (or console) thread notices the flag and does the
+     * printing */
+
+    sa.sa_handler = request_dump;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+
+    /* Headless: the window close is not available, so a clean exit
+     * comes by signal, eg. from the service manager */
+
+    if (no_interface) {
+        sa.sa_handler = request_quit;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+
+        if (sigaction(SIGINT, &sa, NULL) == -1
+            || sigaction(SIGTERM, &sa, NULL) == -1)
+        {
+            perror("sigaction");
+            return -1;
+        }
+    }
+
+    /* Recording taps the audio threads, so is in place before they
+     * start; the ring and writer keep the disk off the audio path */
+
+    if (record_path != NULL) {
+        for (n = 0; n < ndeck; n++) {
+            char wav[512];
+
+            if (snprintf(wav, sizeof wav, "%s-deck%d.wav",
+                         record_path, n) >= (int)sizeof wav)
+            {
+                fprintf(stderr, "%s: filename is too long.\n", record_path);
+                return -1;
+            }
+
+            if (recorder_start(&recorder[n], wav,
+                               device_sample_rate(&deck[n].device)) == -1)
+                return -1;
+
+            device_connect_recorder(&deck[n].device, &recorder[n]);
+            nrecorder++;
+        }
+    }
+
     /* Order is important: launch realtime thread first, then mlock.
      * Don't mlock the interface, use sparingly for audio threads */
 
+    perf_phase("realtime");
+
     if (rt_start(&rt, priority) == -1)
         return -1;
 
@@ -618,8 +964,23 @@ int main(int argc, char *argv[])
         goto out_rt;
     }
 
-    if (interface_start(&library, geo, decor) == -1)
+    if (snapshot_path != NULL
+        && snapshot_start(snapshot_path, resume) == -1)
+    {
         goto out_rt;
+    }
+
+    if (console_path != NULL && console_start(console_path) == -1)
+        goto out_snapshot;
+
+    if (!no_interface && interface_start(&library, geo, decor) == -1)
+        goto out_console;
+
+    /* Startup is complete; say where the time went, if asked */
+
+    perf_phase(NULL);
+    if (getenv("XWAX_PROFILE") != NULL)
+        perf_phase_report(stderr);
 
     if (rig_main() == -1)
         goto out_interface;
@@ -628,9 +989,19 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Exiting cleanly...\n");
 
 out_interface:
-    interface_stop();
+    if (!no_interface)
+        interface_stop();
+out_console:
+    if (console_path != NULL)
+        console_stop();
+out_snapshot:
+    if (snapshot_path != NULL)
+        snapshot_stop();
 out_rt:
-    rt_stop(&rt);
+    rt_stop(&rt); /* audio threads are gone; recorders can drain */
+
+    for (n = 0; n < nrecorder; n++)
+        recorder_stop(&recorder[n]);
 
     for (n = 0; n < ndeck; n++)
         deck_clear(&deck[n]);
@@ -641,8 +1012,11 @@ out_rt:
     timecoder_free_lookup();
     library_clear(&library);
     rt_clear(&rt);
+    bpm_clear();
     rig_clear();
     library_global_clear();
+    track_cache_clear();
+    decoder_global_clear();
     thread_global_clear();
 
     if (rc == EXIT_SUCCESS)
@@ -30,6 +30,8 @@ extern char *banner;
   "free software, and you are welcome to redistribute it under certain\n"\
   "conditions; see the file COPYING for details."
 
+#define MAX_DECKS 8 /* arbitrary; the realtime core imposes no limit */
+
 extern size_t ndeck;
 extern struct deck deck[];
 